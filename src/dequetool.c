@@ -40,6 +40,8 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * <li>-i --inject : Inject data onto the bottom of a memory mapped double ended queue</li>
  * <li>-e --extract : Extract data from the top a memory mapped double ended queue</li>
  * <li>-b --binary : For inject/extract operations use binary transfer mode
+ * <li>-E --export : Export the whole deque (items, positions and geometry) to a file in bulk</li>
+ * <li>-I --import : Create the deque from a file written by -E</li>
  * <li>-h --help : command line help</li>
  * <li>-d --directory : Data directory -- overrides env var MMDQ_DIR_PATH (default /var/ulppk/data)</li>
  * <li>-q --queue : Name of the double ended queue (filename w/o extension)</li>
@@ -82,6 +84,12 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * Zap this deque ... resets it to the empty state
  *
  * dequetool -z -q mydeque -d /var/ulppk2/memfiles
+ *
+ * Export and import move a whole deque in bulk, without popping or pushing items: the
+ * deque file is copied by the kernel (see mmdq_export). To copy mydeque to otherdeque:
+ *
+ * dequetool -E -q mydeque -d /var/ulppk2/memfiles -f mydeque.dump
+ * dequetool -I -q otherdeque -d /var/ulppk2/memfiles -f mydeque.dump
  */
 #include <stdio.h>
 #include <stddef.h>
@@ -91,6 +99,8 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <appenv.h>
 #include <diagnostics.h>
@@ -117,6 +127,10 @@ static void register_args(int argc, char* argv[]) {
 		"Print command help", NULL, NULL);
 	cmdarg_register_option("b", "binary", CA_SWITCH,
 			"inject/extract operations binary transfer mode", NULL, NULL);
+	cmdarg_register_option("E", "export", CA_SWITCH,
+		"Export the whole deque to a file in bulk", NULL, NULL);
+	cmdarg_register_option("I", "import", CA_SWITCH,
+		"Create the deque from a file written by export", NULL, NULL);
 		
 	// Common options
 	cmdarg_register_option("d", "directory", CA_DEFAULT_ARG,
@@ -145,7 +159,8 @@ static void fetch_values(char* quename, char* filepath, int* nitemsp, int* items
 		APP_ERR(stderr, "q option is always required");
 	}
 	strcpy(quename, qname);
-	if ((cmdarg_fetch_switch(NULL, "i")) || (cmdarg_fetch_switch(NULL, "e"))) {
+	if ((cmdarg_fetch_switch(NULL, "i")) || (cmdarg_fetch_switch(NULL, "e")) ||
+		(cmdarg_fetch_switch(NULL, "E")) || (cmdarg_fetch_switch(NULL, "I"))) {
 		fpath = cmdarg_fetch_string(NULL, "f");
 		if (NULL == fpath) {
 			// This is actually OK. It just means stdout (e) or stdin (i)
@@ -437,11 +452,78 @@ static int process_switch_e() {
 	return 0; 			// no action taken ... keep looping
 }
 
+static int process_switch_E() {
+	char deque_name[MAX_DEQUE_NAME_LEN];
+	char filepath[PATH_MAX];
+	int nitems;
+	int itemsize;
+	MMA_HANDLE* mmahp;
+	int fd;
+
+	if (cmdarg_fetch_switch(NULL, "E")) {
+		fetch_values(deque_name, filepath, &nitems, &itemsize);
+		mmahp = mmdq_open(deque_name);
+		if (NULL == mmahp) {
+			mma_strerror(ebuff, sizeof(ebuff));
+			APP_ERR(stderr, ebuff);
+		}
+		if (strcmp(filepath, "stdio") == 0) {
+			fd = STDOUT_FILENO;
+		} else {
+			fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+		}
+		if (fd < 0) {
+			APP_ERR(stderr, "Unable to open output file %s\n%s\n", filepath, strerror(errno));
+		}
+		if (mmdq_export(mmahp, fd)) {
+			mma_strerror(ebuff, sizeof(ebuff));
+			APP_ERR(stderr, ebuff);
+		}
+		close(fd);
+		fprintf(stderr, "dequetool export complete: deque %s\n", deque_name);
+		return 1;		// action taken ... stop processing arguments
+	}
+	return 0; 			// no action taken ... keep looping
+}
+
+static int process_switch_I() {
+	char deque_name[MAX_DEQUE_NAME_LEN];
+	char filepath[PATH_MAX];
+	int nitems;
+	int itemsize;
+	MMA_HANDLE* mmahp;
+	DQSTATS dq_stats;
+	int fd;
+
+	if (cmdarg_fetch_switch(NULL, "I")) {
+		fetch_values(deque_name, filepath, &nitems, &itemsize);
+		if (strcmp(filepath, "stdio") == 0) {
+			fd = STDIN_FILENO;
+		} else {
+			fd = open(filepath, O_RDONLY);
+		}
+		if (fd < 0) {
+			APP_ERR(stderr, "Input File %s not found!\n", filepath);
+		}
+		mmahp = mmdq_import(deque_name, fd);
+		if (NULL == mmahp) {
+			mma_strerror(ebuff, sizeof(ebuff));
+			APP_ERR(stderr, ebuff);
+		}
+		close(fd);
+		mmdq_stats(mmahp, &dq_stats);
+		fprintf(stderr, "dequetool import complete: deque %s holds %d items\n", deque_name,
+			dq_stats.dquse);
+		return 1;		// action taken ... stop processing arguments
+	}
+	return 0; 			// no action taken ... keep looping
+}
+
 int main(int argc, char* argv[]) {
 
 	// Switches are listed in order of processing precedence.
 
-	static int switches[] = {'h', 'd', 'c', 'r', 'z', 'i', 'e', '\0'};
+	static int switches[] = {'h', 'd', 'c', 'r', 'z', 'i', 'e', 'E', 'I', '\0'};
 	static int (*process_func[])() = { 
 		process_switch_help, 
 		process_switch_d,
@@ -450,6 +532,8 @@ int main(int argc, char* argv[]) {
 		process_switch_z,
 		process_switch_i,
 		process_switch_e,
+		process_switch_E,
+		process_switch_I,
 		NULL
 	};
 	int status = 0;
@@ -43,9 +43,17 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * <li>-l --datalength : Length of user available data of buffer in bytes (create only) </li>
  * <li>-i --poolid : Numeric pool identifier. An integer (default is 1)
  * <li>-C --capacity ; Required number of buffers in pool (create only)</li>
+ * <li>-L --lockfree : Keep free buffers on a lock free stack (create only)</li>
+ * <li>-a --align : User data alignment in bytes, a power of two up to the page size (create only)</li>
  * <li>-r --report : Report buffer pool stats</li>
  * <li>-D --display ; Display buffer pool deque contents (buffer indices) </li>
+ * <li>-A --audit : Set audit mode (maintain out of pool deque) 1 = on, 0 = off</li>
  * <li>-z --zap : Reset buffer pool to initialized state</li>
+ * <li>-R --reclaim : Return buffers held by dead processes to the pool</li>
+ * <li>-S --slab : Report slab group (mmslab.c) stats, -p names the group</li>
+ * <li>-E --export : Export the pool (control and contents files) to a file in bulk</li>
+ * <li>-I --import : Create pool -p from a file written by -E</li>
+ * <li>-f --file : Export/import file path (default stdout/stdin)</li>
  * </ul>
  *
  * Environment Variables:
@@ -74,15 +82,23 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  *
  * mmbuffpool -c -p pool4k -l 4096 -C 64 -d /home/ulppkuser
  *
+ * To copy pool4k, buffer contents included, to a new pool named pool4k-copy:
+ *
+ * mmbuffpool -E -p pool4k -f pool4k.dump
+ * mmbuffpool -I -p pool4k-copy -f pool4k.dump
+ *
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <cmdargs.h>
 #include <mmpool.h>
+#include <mmslab.h>
 #include <appenv.h>
 #include <pathinfo.h>
 
@@ -95,8 +111,15 @@ static int process_switch_create();
 static int process_switch_report();
 static int process_switch_display();
 static int process_switch_zap();
+static int process_switch_reclaim();
+static int process_switch_audit();
+static int process_switch_slab();
+static int process_switch_export();
+static int process_switch_import();
 static int report_pool(BPOOL_HANDLE* bphp);
+static int report_slab(MMSLAB_HANDLE* slabp);
 static int display_pool(BPOOL_HANDLE* bphp);
+static void display_out_buffer(BPOOL_HANDLE* bphp, BPOOL_INDEX bpx);
 static void rptline(char* fmtp, ...);
 
 static char err_buff[2048];
@@ -155,6 +178,21 @@ int main(int argc, char* argv[]) {
 	if (0 == status) {
 		status = process_switch_zap();
 	}
+	if (0 == status) {
+		status = process_switch_reclaim();
+	}
+	if (0 == status) {
+		status = process_switch_audit();
+	}
+	if (0 == status) {
+		status = process_switch_slab();
+	}
+	if (0 == status) {
+		status = process_switch_export();
+	}
+	if (0 == status) {
+		status = process_switch_import();
+	}
 	if (status > 0) {
 		status = 0;
 	}
@@ -189,6 +227,10 @@ static void register_args(int argc, char* argv[]) {
 		"Requested pool capacity", "20", "c");
 	cmdarg_register_option("i", "poolid", CA_DEFAULT_ARG,
 		"Pool ID number", "1", "c");
+	cmdarg_register_option("L", "lockfree", CA_SWITCH,
+		"Keep free buffers on a lock free stack", NULL, "c");
+	cmdarg_register_option("a", "align", CA_DEFAULT_ARG,
+		"User data alignment in bytes (0 = default)", "0", "c");
 		
 	// Report function
 	
@@ -202,6 +244,26 @@ static void register_args(int argc, char* argv[]) {
 	// Zap function
 	cmdarg_register_option("z", "zap", CA_SWITCH, 
 		"Reset pool to initial state", NULL, "c");
+
+	// Reclaim function
+	cmdarg_register_option("R", "reclaim", CA_SWITCH,
+		"Return buffers held by dead processes to the pool", NULL, NULL);
+
+	// Audit mode
+	cmdarg_register_option("A", "audit", CA_OPTIONAL_ARG,
+		"Set audit mode (maintain out of pool deque) 1 = on, 0 = off", NULL, NULL);
+
+	// Slab group report
+	cmdarg_register_option("S", "slab", CA_SWITCH,
+		"Report slab group stats (-p names the group)", NULL, NULL);
+
+	// Bulk export and import
+	cmdarg_register_option("E", "export", CA_SWITCH,
+		"Export the pool to a file in bulk", NULL, NULL);
+	cmdarg_register_option("I", "import", CA_SWITCH,
+		"Create the pool from a file written by export", NULL, NULL);
+	cmdarg_register_option("f", "file", CA_DEFAULT_ARG,
+		"Export/import file path (default stdout/stdin)", "", NULL);
  		
 }
 
@@ -268,6 +330,7 @@ static int process_switch_create() {
 	long data_size;
 	long req_capacity;
 	unsigned short pool_id = 0;
+	unsigned int flags = 0;
 	CMD_ARG* optp;
 	BPOOL_HANDLE* bphp;
 	
@@ -278,7 +341,11 @@ static int process_switch_create() {
 		req_capacity = cmdarg_fetch_long(optp, "C");
 		pool_id = (unsigned short)cmdarg_fetch_int(optp, "i");
 		pool_name = cmdarg_fetch_string(NULL, "p");
-		bphp = mmpool_define_pool(pool_name, pool_id, data_size, req_capacity);
+		if (cmdarg_fetch_switch(optp, "L")) {
+			flags |= BPOOL_FLAG_LOCKFREE;
+		}
+		bphp = mmpool_define_pool_aligned(pool_name, pool_id, data_size, req_capacity, flags,
+			(unsigned int)cmdarg_fetch_int(optp, "a"));
 		if (bphp != NULL) {
 			report_pool(bphp);
 		} else {
@@ -328,6 +395,172 @@ static int process_switch_display() {
 }
 
 static int process_switch_zap() {
+	int status = 0;
+	char* pool_name;
+	BPOOL_HANDLE* bphp;
+
+	if (cmdarg_fetch_switch(NULL, "z")) {
+		status = 1;
+		pool_name = cmdarg_fetch_string(NULL, "p");
+		bphp = mmpool_open(pool_name);
+		if (bphp != NULL) {
+			rptline("Returned %d buffers to the pool", mmpool_zap_pool(bphp));
+			report_pool(bphp);
+		} else {
+			status = -1;
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+	}
+	return status;
+}
+
+static int process_switch_reclaim() {
+	int status = 0;
+	char* pool_name;
+	BPOOL_HANDLE* bphp;
+
+	if (cmdarg_fetch_switch(NULL, "R")) {
+		status = 1;
+		pool_name = cmdarg_fetch_string(NULL, "p");
+		bphp = mmpool_open(pool_name);
+		if (bphp != NULL) {
+			rptline("Reclaimed %d buffers from dead processes", mmpool_reclaim(bphp));
+			report_pool(bphp);
+		} else {
+			status = -1;
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+	}
+	return status;
+}
+
+static int process_switch_audit() {
+	int status = 0;
+	char* pool_name;
+	BPOOL_HANDLE* bphp;
+
+	if (cmdarg_fetch_switch(NULL, "A")) {
+		status = 1;
+		pool_name = cmdarg_fetch_string(NULL, "p");
+		bphp = mmpool_open(pool_name);
+		if (bphp != NULL) {
+			mmpool_set_audit(bphp, cmdarg_fetch_int(NULL, "A"));
+			report_pool(bphp);
+		} else {
+			status = -1;
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+	}
+	return status;
+}
+
+static int process_switch_slab() {
+	int status = 0;
+	char* group_name;
+	MMSLAB_HANDLE* slabp;
+
+	if (cmdarg_fetch_switch(NULL, "S")) {
+		status = 1;
+		group_name = cmdarg_fetch_string(NULL, "p");
+		slabp = mmslab_open(group_name);
+		if (slabp != NULL) {
+			report_slab(slabp);
+			mmslab_close(slabp);
+		} else {
+			status = -1;
+			app_error("Unable to open slab group");
+		}
+	}
+	return status;
+}
+
+static int process_switch_export() {
+	int status = 0;
+	char* pool_name;
+	char* file_path;
+	BPOOL_HANDLE* bphp;
+	int fd;
+
+	if (cmdarg_fetch_switch(NULL, "E")) {
+		status = 1;
+		pool_name = cmdarg_fetch_string(NULL, "p");
+		file_path = cmdarg_fetch_string(NULL, "f");
+		bphp = mmpool_open(pool_name);
+		if (NULL == bphp) {
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+		if ((NULL == file_path) || (strlen(file_path) == 0)) {
+			fd = STDOUT_FILENO;
+		} else {
+			fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+			if (fd < 0) {
+				app_error("Unable to open export file");
+			}
+		}
+		if (mmpool_export(bphp, fd)) {
+			status = -1;
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+		close(fd);
+	}
+	return status;
+}
+
+static int process_switch_import() {
+	int status = 0;
+	char* pool_name;
+	char* file_path;
+	BPOOL_HANDLE* bphp;
+	int fd;
+
+	if (cmdarg_fetch_switch(NULL, "I")) {
+		status = 1;
+		pool_name = cmdarg_fetch_string(NULL, "p");
+		file_path = cmdarg_fetch_string(NULL, "f");
+		if ((NULL == file_path) || (strlen(file_path) == 0)) {
+			fd = STDIN_FILENO;
+		} else {
+			fd = open(file_path, O_RDONLY);
+			if (fd < 0) {
+				app_error("Unable to open import file");
+			}
+		}
+		bphp = mmpool_import(pool_name, fd);
+		close(fd);
+		if (bphp != NULL) {
+			report_pool(bphp);
+		} else {
+			status = -1;
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+	}
+	return status;
+}
+
+static int report_slab(MMSLAB_HANDLE* slabp) {
+	MMSLAB_STATS stats;
+	BPMF_STATS* bpstatsp;
+	int i;
+
+	mmslab_getstats(slabp, &stats);
+	rptline("=========== SLAB GROUP REPORT =================");
+	rptline("");
+	rptline("Name: %s Classes: %d", slabp->recp->name, stats.nclasses);
+	for (i = 0; i < stats.nclasses; i++) {
+		bpstatsp = mmpool_getstats(slabp->pools[i]);
+		rptline("Class %d: Pool: %s Size: %ld Capacity: %d In: %d Cached: %d Out: %d",
+			i, slabp->recp->classes[i].pool_name, bpstatsp->max_data_size,
+			bpstatsp->capacity, bpstatsp->remaining, bpstatsp->cached,
+			bpstatsp->capacity - bpstatsp->remaining - bpstatsp->cached);
+	}
+	rptline("Buffers: Capacity: %lu In: %lu Cached: %lu Out: %lu",
+		stats.capacity, stats.remaining, stats.cached,
+		stats.capacity - stats.remaining - stats.cached);
+	rptline("Data bytes: Total: %lu Out: %lu Pct: %g",
+		(unsigned long)stats.data_bytes, (unsigned long)stats.data_bytes_out,
+		(100.0 * stats.data_bytes_out) / stats.data_bytes);
+	rptline("Fallbacks to a larger class: %lu Failed allocations: %lu",
+		stats.fallbacks, stats.failures);
 	return 0;
 }
 
@@ -340,17 +573,26 @@ static int report_pool(BPOOL_HANDLE* bphp) {
 		bphp->bpmf_recp->stats.capacity,
 		bphp->bpmf_recp->stats.rqst_capacity
 	);
+	// The free buffers are those on the in pool deque (or lock free
+	// stack) and those not yet formatted
 	rptline("In the pool: In: %d Capacity: %d Pct: %g",
-		bphp->bpmf_recp->dq_inpool.dquse,
-		bphp->bpmf_recp->dq_inpool.dqslots,
-		(100.0 * bphp->bpmf_recp->dq_inpool.dquse)/ bphp->bpmf_recp->dq_inpool.dqslots
+		bphp->bpmf_recp->stats.remaining,
+		bphp->bpmf_recp->stats.capacity,
+		(100.0 * bphp->bpmf_recp->stats.remaining)/ bphp->bpmf_recp->stats.capacity
 	);
-	rptline("Out of pool: In: %d Capacity: %d Pct: %g",
-		bphp->bpmf_recp->dq_outpool.dquse,
-		bphp->bpmf_recp->dq_outpool.dqslots,
-		(100.0 * bphp->bpmf_recp->dq_outpool.dquse)/ bphp->bpmf_recp->dq_outpool.dqslots
+	rptline("Cached in process magazines: %d", bphp->bpmf_recp->stats.cached);
+	rptline("Out of pool: Out: %d Capacity: %d Pct: %g",
+		bphp->bpmf_recp->stats.capacity - bphp->bpmf_recp->stats.remaining - bphp->bpmf_recp->stats.cached,
+		bphp->bpmf_recp->stats.capacity,
+		(100.0 * (bphp->bpmf_recp->stats.capacity - bphp->bpmf_recp->stats.remaining - bphp->bpmf_recp->stats.cached))/ bphp->bpmf_recp->stats.capacity
 	);
+	rptline("Audit mode: %s", bphp->bpmf_recp->audit ? "on" : "off");
+	rptline("Lock free: %s", (bphp->bpmf_recp->flags & BPOOL_FLAG_LOCKFREE) ? "yes" : "no");
 	rptline("Max Data Size: %ld", bphp->bpmf_recp->stats.max_data_size);
+	rptline("Alignment: %u Stride: %ld", bphp->bpmf_recp->stats.alignment,
+		bphp->bpmf_recp->stats.stride);
+	rptline("Formatted: %u Generation: %u", bphp->bpmf_recp->hwm,
+		bphp->bpmf_recp->generation);
 	return 0;
 }
 
@@ -362,12 +604,41 @@ static void rptline(char* fmtp, ...) {
 	fprintf(stdout,"\n");
 }
 
+static void display_out_buffer(BPOOL_HANDLE* bphp, BPOOL_INDEX bpx) {
+	BPCF_BUFFER_REF* buff_refp;
+
+	buff_refp = mmpool_buffx2refp(bphp, bpx);
+	if (buff_refp->owner_pid) {
+		rptline("Out: BPX: %ld Owner: %d Lease: %lds Refs: %u", bpx, (int)buff_refp->owner_pid,
+			(long)(time(NULL) - buff_refp->lease), buff_refp->refcount);
+	} else {
+		rptline("Out: BPX: %ld Owner: none Refs: %u", bpx, buff_refp->refcount);
+	}
+}
+
 static int display_pool(BPOOL_HANDLE* bphp) {
 	DQHEADER* dqp;
 	DQHEADER tempdq;
 	int buffcount = 0;
 	BPOOL_INDEX bpx = 0;
 	
+	if (bphp->bpmf_recp->flags & BPOOL_FLAG_LOCKFREE) {
+		// Walking the lock free stack would race with other processes, so
+		// list the free buffers from their state bytes instead.
+		for (bpx = 0; bpx < bphp->bpmf_recp->stats.capacity; bpx++) {
+			switch (mmpool_buff_state(bphp, bpx)) {
+			case BPOOL_BUFF_IN:
+				buffcount++;
+				rptline("Rec: %d BPX: %ld", buffcount, bpx);
+				break;
+			case BPOOL_BUFF_OUT:
+				display_out_buffer(bphp, bpx);
+				break;
+			}
+		}
+		return buffcount;
+	}
+
 	// TODO: lock
 	dqp = &bphp->bpmf_recp->dq_inpool;
 
@@ -379,6 +650,12 @@ static int display_pool(BPOOL_HANDLE* bphp) {
 		dq_abd(&tempdq, &bpx);			// push onto the temporary deque
 		rptline("Rec: %d BPX: %ld", buffcount, bpx);
 	}
+	// Buffers above the high-water mark are free but not yet formatted
+	if (bphp->bpmf_recp->hwm < bphp->bpmf_recp->stats.capacity) {
+		buffcount += bphp->bpmf_recp->stats.capacity - bphp->bpmf_recp->hwm;
+		rptline("Unformatted: BPX: %u to %u", bphp->bpmf_recp->hwm,
+			bphp->bpmf_recp->stats.capacity - 1);
+	}
 	if (buffcount != bphp->bpmf_recp->stats.remaining) {
 		rptline("WARNING: Header balance problem! Buffcount = %d stats.remaining = %d",
 			buffcount, bphp->bpmf_recp->stats.remaining);
@@ -387,6 +664,12 @@ static int display_pool(BPOOL_HANDLE* bphp) {
 	for (bpx = 0; (!dq_rtd(&tempdq, &bpx)); ) {
 		dq_abd(dqp, &bpx);
 	}
+	// List the allocated buffers
+	for (bpx = 0; bpx < bphp->bpmf_recp->stats.capacity; bpx++) {
+		if (BPOOL_BUFF_OUT == mmpool_buff_state(bphp, bpx)) {
+			display_out_buffer(bphp, bpx);
+		}
+	}
 	// TODO: Unlock
 	return buffcount;
 }
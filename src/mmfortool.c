@@ -0,0 +1,259 @@
+
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file mmfortool.c
+ *
+ * @brief File of records (mmfor.c) maintenance utility.
+ *
+ * mmfortool reports on files of records and moves them between hosts or
+ * directories in bulk. Export writes the header and every record to a dump
+ * file, letting the kernel copy the file pages (see mmfor_export); import
+ * creates a new file of records from the dump, reading it straight into the
+ * mapping. Linear lists (linearlist.c) are files of records and are moved
+ * the same way.
+ *
+ * Command line options.
+ *
+ * <ul>
+ * <li>-p --path : Full path of the file of records (required)</li>
+ * <li>-r --report : Report record size, record count, capacity, flags and generation</li>
+ * <li>-E --export : Export the file of records to the -f file in bulk</li>
+ * <li>-I --import : Create the -p file of records from the -f file written by -E</li>
+ * <li>-f --file : Export/import file path (default stdout/stdin)</li>
+ * <li>-h --help : Show help</li>
+ * </ul>
+ *
+ * Examples:
+ *
+ * To copy /var/ulppk/data/orders.for to /backup/orders.for:
+ *
+ * mmfortool -E -p /var/ulppk/data/orders.for -f orders.dump
+ * mmfortool -I -p /backup/orders.for -f orders.dump
+ *
+ * or, through a pipe:
+ *
+ * mmfortool -E -p /var/ulppk/data/orders.for | ssh otherhost mmfortool -I -p /backup/orders.for
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <cmdargs.h>
+#include <mmfor.h>
+
+// Function prototypes
+static void app_error(char* err_msg);
+static void register_args(int argc, char* argv[]);
+static int process_switch_help();
+static int process_switch_report();
+static int process_switch_export();
+static int process_switch_import();
+static int report_for(MMFOR_HANDLE* mmforhp);
+static void rptline(char* fmtp, ...);
+
+static char err_buff[2048];
+
+
+int main(int argc, char* argv[]) {
+	int status;
+
+	register_args(argc, argv);
+
+	status = cmdarg_parse(argc, argv);
+	if (status) {
+		cmdarg_show_help(NULL);
+		exit(1);
+	}
+
+	// Handler routines
+	// return > 0 if successful, 0 if they took no action, and < 0
+	// if they encountered an error.
+	status = process_switch_help();
+	if (0 == status) {
+		status = process_switch_report();
+	}
+	if (0 == status) {
+		status = process_switch_export();
+	}
+	if (0 == status) {
+		status = process_switch_import();
+	}
+	if (status > 0) {
+		status = 0;
+	}
+	return status;
+}
+
+
+// Register command line arguments with the cmdargs library.
+
+static void register_args(int argc, char* argv[]) {
+	cmdarg_init(argc, argv);
+
+	// File of records path parameter
+	cmdarg_register_option("p", "path", CA_REQUIRED_ARG,
+		"Full path of the file of records", NULL, NULL);
+
+	cmdarg_register_option("h", "help", CA_SWITCH,
+		"Show help", NULL, NULL);
+
+	// Report function
+	cmdarg_register_option("r", "report", CA_SWITCH,
+		"Report file of records stats", NULL, NULL);
+
+	// Bulk export and import
+	cmdarg_register_option("E", "export", CA_SWITCH,
+		"Export the file of records to a file in bulk", NULL, NULL);
+	cmdarg_register_option("I", "import", CA_SWITCH,
+		"Create the file of records from a file written by export", NULL, NULL);
+	cmdarg_register_option("f", "file", CA_DEFAULT_ARG,
+		"Export/import file path (default stdout/stdin)", "", NULL);
+}
+
+static void app_error(char* errmsg) {
+	if ((errmsg != NULL) && (strlen(errmsg) != 0)) {
+		fprintf(stderr, "Application Error: Diagnostic message follows:\n %s \n", errmsg);
+	} else {
+		fprintf(stderr,"Application Error -- No diagnostic message available\n");
+	}
+	exit(1);
+}
+
+static int process_switch_help() {
+
+	if (cmdarg_fetch_switch(NULL, "h")) {
+		cmdarg_show_help(NULL);
+		exit(0);
+	}
+	return 0;
+}
+
+static int process_switch_report() {
+	int status = 0;
+	MMFOR_HANDLE* mmforhp;
+
+	if (cmdarg_fetch_switch(NULL, "r")) {
+		status = 1;
+		mmforhp = mmfor_open(cmdarg_fetch_string(NULL, "p"), MMA_READ, MMF_SHARED);
+		if (mmforhp != NULL) {
+			report_for(mmforhp);
+			mmfor_close(mmforhp);
+		} else {
+			status = -1;
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+	}
+	return status;
+}
+
+static int process_switch_export() {
+	int status = 0;
+	char* file_path;
+	MMFOR_HANDLE* mmforhp;
+	int fd;
+
+	if (cmdarg_fetch_switch(NULL, "E")) {
+		status = 1;
+		file_path = cmdarg_fetch_string(NULL, "f");
+		mmforhp = mmfor_open(cmdarg_fetch_string(NULL, "p"), MMA_READ, MMF_SHARED);
+		if (NULL == mmforhp) {
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+		if ((NULL == file_path) || (strlen(file_path) == 0)) {
+			fd = STDOUT_FILENO;
+		} else {
+			fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+			if (fd < 0) {
+				app_error("Unable to open export file");
+			}
+		}
+		if (mmfor_export(mmforhp, fd)) {
+			status = -1;
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+		close(fd);
+		mmfor_close(mmforhp);
+	}
+	return status;
+}
+
+static int process_switch_import() {
+	int status = 0;
+	char* file_path;
+	MMFOR_HANDLE* mmforhp;
+	int fd;
+
+	if (cmdarg_fetch_switch(NULL, "I")) {
+		status = 1;
+		file_path = cmdarg_fetch_string(NULL, "f");
+		if ((NULL == file_path) || (strlen(file_path) == 0)) {
+			fd = STDIN_FILENO;
+		} else {
+			fd = open(file_path, O_RDONLY);
+			if (fd < 0) {
+				app_error("Unable to open import file");
+			}
+		}
+		mmforhp = mmfor_import(cmdarg_fetch_string(NULL, "p"), MMA_READ_WRITE, MMF_SHARED,
+			0660, fd);
+		close(fd);
+		if (mmforhp != NULL) {
+			report_for(mmforhp);
+			mmfor_close(mmforhp);
+		} else {
+			status = -1;
+			app_error(mma_strerror(err_buff, sizeof(err_buff)));
+		}
+	}
+	return status;
+}
+
+static int report_for(MMFOR_HANDLE* mmforhp) {
+	rptline("=========== FILE OF RECORDS REPORT =================");
+	rptline("");
+	rptline("Path: %s", cmdarg_fetch_string(NULL, "p"));
+	rptline("Record size: %lu Records: %lu Capacity: %lu",
+		(unsigned long)mmfor_record_size(mmforhp), (unsigned long)mmfor_record_count(mmforhp),
+		(unsigned long)mmfor_capacity(mmforhp));
+	rptline("Flags: 0x%04x%s Generation: %u", mmforhp->flags,
+		(mmforhp->flags & MMFOR_FLAG_SEQLOCK) ? " (seqlock)" : "", mmforhp->generation);
+	return 0;
+}
+
+static void rptline(char* fmtp, ...) {
+	va_list ap;
+
+	va_start(ap, fmtp);
+	vfprintf(stdout, fmtp, ap);
+	va_end(ap);
+	fprintf(stdout, "\n");
+}
@@ -0,0 +1,590 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file msgbench.c
+ *
+ * @brief Latency and throughput benchmark for message deques.
+ *
+ * msgbench forks N producer and M consumer processes around a single
+ * message deque (msgdeque.c) and measures one way latency and aggregate
+ * throughput. Each message carries the CLOCK_MONOTONIC time at which it
+ * was sent. Consumers record the delivery latency in a log-linear
+ * (HDR style) histogram with roughly 1% precision kept in shared memory;
+ * the parent merges them and reports p50/p99/p99.9/max.
+ *
+ * Both fixed item deques (msgdeque_send_wait / msgdeque_rec_batch) and
+ * byte stream deques (msgdeque_send_byte_stream / msgdeque_rec_byte_stream)
+ * are exercised. The run is repeated for every combination of item size
+ * and batch size given on the command line. Producers send one message
+ * per call, as there is no batched send. Fixed item consumers receive
+ * up to the batch size per call. Byte stream deques have no batched
+ * receive either, so stream runs are made once per item size, with a
+ * batch size of 1. Each run deletes its deque when it is done.
+ *
+ * Results are printed as text, JSON or CSV so they can be archived and
+ * compared from one release to the next.
+ *
+ * Command line options.
+ *
+ * <ul>
+ * <li>-p --producers : Number of producer processes (default 1)</li>
+ * <li>-c --consumers : Number of consumer processes (default 1)</li>
+ * <li>-n --messages : Messages sent by each producer (default 10000)</li>
+ * <li>-s --sizes : Comma separated item sizes in bytes (default 16,64,256)</li>
+ * <li>-b --batches : Comma separated receive batch sizes, fixed mode (default 1,16)</li>
+ * <li>-m --mode : fixed, stream or both (default both)</li>
+ * <li>-q --depth : Deque capacity in messages (default 1024)</li>
+ * <li>-f --format : text, json or csv (default text)</li>
+ * <li>-d --directory : Deque data directory (default /tmp/msgbench)</li>
+ * <li>-h --help : command line help</li>
+ * </ul>
+ *
+ * Example: 4 producers, 2 consumers, CSV output
+ *
+ * msgbench -p 4 -c 2 -n 50000 -s 32,1024 -b 1,8,64 -f csv > msgbench.csv
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <appenv.h>
+#include <cmdargs.h>
+#include <diagnostics.h>
+#include <msgdeque.h>
+
+#define BENCH_DEQUE_NAME "msgbench"
+#define MAX_SWEEP 32
+
+/*
+ * Histogram geometry. Values below HIST_SUB are counted exactly. Above
+ * that each power of two is split into HIST_SUB/2 linear sub-buckets.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_HALF)
+
+typedef unsigned long long NSECS;
+
+typedef enum _bench_mode {
+	BENCH_FIXED = 1,
+	BENCH_STREAM = 2
+} BENCH_MODE;
+
+/**
+ * Header written at the front of every message.
+ */
+typedef struct _bench_msg {
+	NSECS sent;					///< send time, 0 marks a stop message
+	unsigned int producer;		///< producer number
+	unsigned int seq;			///< sequence number within the producer
+} BENCH_MSG;
+
+/**
+ * Per consumer results. Lives in shared memory.
+ */
+typedef struct _bench_hist {
+	unsigned long long counts[HIST_BUCKETS];
+	unsigned long long total;	///< messages received
+	NSECS min;					///< smallest latency
+	NSECS max;					///< largest latency
+	NSECS sum;					///< sum of latencies
+	NSECS first_sent;			///< earliest send time seen
+	NSECS last_rec;				///< latest receive time
+} BENCH_HIST;
+
+typedef struct _bench_run {
+	BENCH_MODE mode;
+	int producers;
+	int consumers;
+	int messages;
+	int size;
+	int batch;
+	int depth;
+} BENCH_RUN;
+
+static NSECS now_nsecs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((NSECS)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int hist_index(NSECS v) {
+	int msb;
+	int shift;
+
+	if (v < HIST_SUB) {
+		return (int)v;
+	}
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - (HIST_SUB_BITS - 1);
+	return HIST_SUB + (shift - 1) * HIST_HALF + (int)((v >> shift) - HIST_HALF);
+}
+
+/*
+ * Highest value that falls into bucket idx.
+ */
+static NSECS hist_value(int idx) {
+	int shift;
+	NSECS mant;
+
+	if (idx < HIST_SUB) {
+		return (NSECS)idx;
+	}
+	shift = (idx - HIST_SUB) / HIST_HALF + 1;
+	mant = (NSECS)((idx - HIST_SUB) % HIST_HALF + HIST_HALF);
+	return ((mant + 1) << shift) - 1;
+}
+
+static void hist_record(BENCH_HIST* histp, NSECS sent, NSECS rec) {
+	NSECS lat;
+
+	lat = (rec > sent) ? rec - sent : 0;
+	histp->counts[hist_index(lat)]++;
+	if ((0 == histp->total) || (lat < histp->min)) {
+		histp->min = lat;
+	}
+	if (lat > histp->max) {
+		histp->max = lat;
+	}
+	if ((0 == histp->first_sent) || (sent < histp->first_sent)) {
+		histp->first_sent = sent;
+	}
+	histp->last_rec = rec;
+	histp->sum += lat;
+	histp->total++;
+}
+
+static void hist_merge(BENCH_HIST* dstp, BENCH_HIST* srcp) {
+	int i;
+
+	if (0 == srcp->total) {
+		return;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dstp->counts[i] += srcp->counts[i];
+	}
+	if ((0 == dstp->total) || (srcp->min < dstp->min)) {
+		dstp->min = srcp->min;
+	}
+	if (srcp->max > dstp->max) {
+		dstp->max = srcp->max;
+	}
+	if ((0 == dstp->first_sent) || (srcp->first_sent < dstp->first_sent)) {
+		dstp->first_sent = srcp->first_sent;
+	}
+	if (srcp->last_rec > dstp->last_rec) {
+		dstp->last_rec = srcp->last_rec;
+	}
+	dstp->sum += srcp->sum;
+	dstp->total += srcp->total;
+}
+
+static NSECS hist_percentile(BENCH_HIST* histp, double pct) {
+	unsigned long long target;
+	unsigned long long seen = 0;
+	int i;
+
+	if (0 == histp->total) {
+		return 0;
+	}
+	target = (unsigned long long)((pct / 100.0) * histp->total + 0.5);
+	if (target < 1) {
+		target = 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += histp->counts[i];
+		if (seen >= target) {
+			return (hist_value(i) < histp->max) ? hist_value(i) : histp->max;
+		}
+	}
+	return histp->max;
+}
+
+static void send_msg(MSGCELL* msgcellp, BENCH_MODE mode, void* msgp, int size) {
+	if (BENCH_FIXED == mode) {
+		if (msgdeque_send_wait(msgcellp, msgp, NULL)) {
+			APP_ERR(stderr, "msgdeque_send_wait fails: %s", strerror(msgcellp->errcode));
+		}
+	} else {
+		while (msgdeque_send_byte_stream(msgcellp, msgp, size)) {
+			sched_yield();
+		}
+	}
+}
+
+static void producer(BENCH_RUN* runp, int id) {
+	MSGCELL* msgcellp;
+	BENCH_MSG* msgp;
+	int seq;
+
+	msgcellp = msgdeque_attach(BENCH_DEQUE_NAME);
+	if (NULL == msgcellp) {
+		APP_ERR(stderr, "Producer %d unable to attach to %s", id, BENCH_DEQUE_NAME);
+	}
+	msgp = (BENCH_MSG*)calloc(1, runp->size);
+	memset(msgp, 'P', runp->size);
+	msgp->producer = id;
+	for (seq = 0; seq < runp->messages; seq++) {
+		msgp->seq = seq;
+		msgp->sent = now_nsecs();
+		send_msg(msgcellp, runp->mode, msgp, runp->size);
+	}
+	free(msgp);
+	msgdeque_close(msgcellp);
+}
+
+/*
+ * Consume until a stop message arrives. A batched receive may pick up
+ * stop messages meant for other consumers; those are put back.
+ */
+static void consumer(BENCH_RUN* runp, BENCH_HIST* histp) {
+	MSGCELL* msgcellp;
+	BENCH_MSG* msgp;
+	unsigned char* recs;
+	size_t reclen;
+	NSECS rec;
+	int stops = 0;
+	int nrecs;
+	int i;
+
+	msgcellp = msgdeque_attach(BENCH_DEQUE_NAME);
+	if (NULL == msgcellp) {
+		APP_ERR(stderr, "Consumer unable to attach to %s", BENCH_DEQUE_NAME);
+	}
+	recs = (unsigned char*)calloc(runp->batch, runp->size);
+	while (0 == stops) {
+		if (BENCH_FIXED == runp->mode) {
+			nrecs = msgdeque_rec_batch(msgcellp, recs, runp->batch, NULL);
+			if (0 == nrecs) {
+				APP_ERR(stderr, "msgdeque_rec_batch fails: %s", strerror(msgcellp->errcode));
+			}
+			rec = now_nsecs();
+			for (i = 0; i < nrecs; i++) {
+				msgp = (BENCH_MSG*)(recs + i * runp->size);
+				if (0 == msgp->sent) {
+					stops++;
+				} else {
+					hist_record(histp, msgp->sent, rec);
+				}
+			}
+			for (i = 1; i < stops; i++) {
+				memset(recs, 0, sizeof(BENCH_MSG));
+				send_msg(msgcellp, runp->mode, recs, runp->size);
+			}
+		} else {
+			msgp = (BENCH_MSG*)msgdeque_rec_byte_stream(msgcellp, &reclen);
+			if (NULL == msgp) {
+				APP_ERR(stderr, "msgdeque_rec_byte_stream fails: %s", strerror(msgcellp->errcode));
+			}
+			rec = now_nsecs();
+			if (0 == msgp->sent) {
+				stops++;
+			} else {
+				hist_record(histp, msgp->sent, rec);
+			}
+			free(msgp);
+		}
+	}
+	free(recs);
+	msgdeque_close(msgcellp);
+}
+
+static pid_t spawn(BENCH_RUN* runp, int id, BENCH_HIST* histp) {
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		APP_ERR(stderr, "fork fails: %s", strerror(errno));
+	}
+	if (0 == pid) {
+		if (NULL == histp) {
+			producer(runp, id);
+		} else {
+			consumer(runp, histp);
+		}
+		_exit(0);
+	}
+	return pid;
+}
+
+static void run_bench(BENCH_RUN* runp, BENCH_HIST* resultp) {
+	MSGCELL* msgcellp;
+	BENCH_HIST* histsp;
+	BENCH_MSG* stopp;
+	pid_t* pids;
+	size_t histlen;
+	int nitems;
+	int i;
+
+	if (BENCH_FIXED == runp->mode) {
+		msgcellp = msgdeque_create(BENCH_DEQUE_NAME, 0660, runp->size, runp->depth);
+	} else {
+		nitems = runp->depth * (runp->size + 4);
+		if (nitems > 65535 - 4) {
+			nitems = 65535 - 4;
+		}
+		if (nitems < runp->size + 4) {
+			APP_ERR(stderr, "Item size %d too large for a byte stream deque", runp->size);
+		}
+		msgcellp = msgdeque_create_byte_stream(BENCH_DEQUE_NAME, 0660, nitems);
+	}
+	if (NULL == msgcellp) {
+		APP_ERR(stderr, "Unable to create message deque %s", BENCH_DEQUE_NAME);
+	}
+	msgdeque_reset(msgcellp);
+
+	histlen = runp->consumers * sizeof(BENCH_HIST);
+	histsp = (BENCH_HIST*)mmap(NULL, histlen, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == histsp) {
+		APP_ERR(stderr, "Unable to map histograms: %s", strerror(errno));
+	}
+	pids = (pid_t*)calloc(runp->producers + runp->consumers, sizeof(pid_t));
+	for (i = 0; i < runp->consumers; i++) {
+		pids[i] = spawn(runp, i, &histsp[i]);
+	}
+	for (i = 0; i < runp->producers; i++) {
+		pids[runp->consumers + i] = spawn(runp, i, NULL);
+	}
+	for (i = 0; i < runp->producers; i++) {
+		waitpid(pids[runp->consumers + i], NULL, 0);
+	}
+	// One stop message per consumer
+	stopp = (BENCH_MSG*)calloc(1, runp->size);
+	for (i = 0; i < runp->consumers; i++) {
+		send_msg(msgcellp, runp->mode, stopp, runp->size);
+	}
+	for (i = 0; i < runp->consumers; i++) {
+		waitpid(pids[i], NULL, 0);
+	}
+
+	memset(resultp, 0, sizeof(BENCH_HIST));
+	for (i = 0; i < runp->consumers; i++) {
+		hist_merge(resultp, &histsp[i]);
+	}
+	free(stopp);
+	free(pids);
+	munmap(histsp, histlen);
+	if (msgdeque_delete(msgcellp)) {
+		APP_ERR(stderr, "Unable to delete message deque %s: %s", BENCH_DEQUE_NAME,
+			strerror(msgcellp->errcode));
+	}
+}
+
+static const char* mode_name(BENCH_MODE mode) {
+	return (BENCH_FIXED == mode) ? "fixed" : "stream";
+}
+
+static void report(const char* format, BENCH_RUN* runp, BENCH_HIST* histp, int first) {
+	double secs;
+	double rate;
+	double mbps;
+	double mean;
+
+	secs = (histp->last_rec - histp->first_sent) / 1e9;
+	rate = (secs > 0) ? histp->total / secs : 0;
+	mbps = rate * runp->size / 1e6;
+	mean = histp->total ? (histp->sum / (double)histp->total) : 0;
+	if (!strcmp(format, "csv")) {
+		if (first) {
+			fprintf(stdout, "mode,producers,consumers,size,batch,messages,"
+				"min_ns,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,msgs_per_sec,mb_per_sec\n");
+		}
+		fprintf(stdout, "%s,%d,%d,%d,%d,%llu,%llu,%.0f,%llu,%llu,%llu,%llu,%.0f,%.2f\n",
+			mode_name(runp->mode), runp->producers, runp->consumers, runp->size, runp->batch,
+			histp->total, histp->min, mean,
+			hist_percentile(histp, 50.0), hist_percentile(histp, 99.0),
+			hist_percentile(histp, 99.9), histp->max, rate, mbps);
+	} else if (!strcmp(format, "json")) {
+		fprintf(stdout, "%s  {\"mode\": \"%s\", \"producers\": %d, \"consumers\": %d, "
+			"\"size\": %d, \"batch\": %d, \"messages\": %llu, "
+			"\"latency_ns\": {\"min\": %llu, \"mean\": %.0f, \"p50\": %llu, \"p99\": %llu, "
+			"\"p99_9\": %llu, \"max\": %llu}, "
+			"\"msgs_per_sec\": %.0f, \"mb_per_sec\": %.2f}",
+			first ? "" : ",\n",
+			mode_name(runp->mode), runp->producers, runp->consumers, runp->size, runp->batch,
+			histp->total, histp->min, mean,
+			hist_percentile(histp, 50.0), hist_percentile(histp, 99.0),
+			hist_percentile(histp, 99.9), histp->max, rate, mbps);
+	} else {
+		fprintf(stdout, "%-6s size: %5d batch: %4d msgs: %8llu p50: %8.2f us p99: %8.2f us "
+			"p99.9: %8.2f us max: %8.2f us rate: %9.0f msgs/s %8.2f MB/s\n",
+			mode_name(runp->mode), runp->size, runp->batch, histp->total,
+			hist_percentile(histp, 50.0) / 1000.0, hist_percentile(histp, 99.0) / 1000.0,
+			hist_percentile(histp, 99.9) / 1000.0, histp->max / 1000.0, rate, mbps);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Parse a comma separated list of positive integers.
+ */
+static int parse_list(const char* optname, char* str, int* vals) {
+	char* copy;
+	char* tok;
+	char* savep;
+	int n = 0;
+
+	copy = strdup(str);
+	for (tok = strtok_r(copy, ",", &savep); tok != NULL; tok = strtok_r(NULL, ",", &savep)) {
+		if (n >= MAX_SWEEP) {
+			APP_ERR(stderr, "Too many values for -%s (max %d)", optname, MAX_SWEEP);
+		}
+		vals[n] = atoi(tok);
+		if (vals[n] <= 0) {
+			APP_ERR(stderr, "Invalid value %s for -%s", tok, optname);
+		}
+		n++;
+	}
+	free(copy);
+	return n;
+}
+
+static void register_args(int argc, char* argv[]) {
+	cmdarg_init(argc, argv);
+	cmdarg_register_option("p", "producers", CA_DEFAULT_ARG,
+		"Number of producer processes", "1", NULL);
+	cmdarg_register_option("c", "consumers", CA_DEFAULT_ARG,
+		"Number of consumer processes", "1", NULL);
+	cmdarg_register_option("n", "messages", CA_DEFAULT_ARG,
+		"Messages sent by each producer", "10000", NULL);
+	cmdarg_register_option("s", "sizes", CA_DEFAULT_ARG,
+		"Comma separated item sizes in bytes", "16,64,256", NULL);
+	cmdarg_register_option("b", "batches", CA_DEFAULT_ARG,
+		"Comma separated receive batch sizes (fixed mode)", "1,16", NULL);
+	cmdarg_register_option("m", "mode", CA_DEFAULT_ARG,
+		"Deque mode: fixed, stream or both", "both", NULL);
+	cmdarg_register_option("q", "depth", CA_DEFAULT_ARG,
+		"Deque capacity in messages", "1024", NULL);
+	cmdarg_register_option("f", "format", CA_DEFAULT_ARG,
+		"Output format: text, json or csv", "text", NULL);
+	cmdarg_register_option("d", "directory", CA_DEFAULT_ARG,
+		"Deque data directory", "/tmp/msgbench", NULL);
+	cmdarg_register_option("h", "help", CA_SWITCH,
+		"Print command help", NULL, NULL);
+}
+
+int main(int argc, char* argv[]) {
+	BENCH_RUN run;
+	BENCH_HIST* resultp;
+	int sizes[MAX_SWEEP];
+	int batches[MAX_SWEEP];
+	int modes[2];
+	int nsizes;
+	int nbatches;
+	int nmodes = 0;
+	int first = 1;
+	int im;
+	int is;
+	int ib;
+	char* modestr;
+	char* format;
+	char* dirpath;
+
+	register_args(argc, argv);
+	if (cmdarg_parse(argc, argv)) {
+		cmdarg_show_help(NULL);
+		exit(1);
+	}
+	if (cmdarg_fetch_switch(NULL, "h")) {
+		cmdarg_show_help(NULL);
+		exit(0);
+	}
+	memset(&run, 0, sizeof(run));
+	run.producers = cmdarg_fetch_int(NULL, "p");
+	run.consumers = cmdarg_fetch_int(NULL, "c");
+	run.messages = cmdarg_fetch_int(NULL, "n");
+	run.depth = cmdarg_fetch_int(NULL, "q");
+	if ((run.producers <= 0) || (run.consumers <= 0) || (run.messages <= 0)
+			|| (run.depth <= 0) || (run.depth > 65535)) {
+		APP_ERR(stderr, "-p, -c, -n must be positive and -q between 1 and 65535");
+	}
+	nsizes = parse_list("s", cmdarg_fetch_string(NULL, "s"), sizes);
+	nbatches = parse_list("b", cmdarg_fetch_string(NULL, "b"), batches);
+	for (is = 0; is < nsizes; is++) {
+		if ((sizes[is] < (int)sizeof(BENCH_MSG)) || (sizes[is] > 65535)) {
+			APP_ERR(stderr, "Item sizes must be between %d and 65535", (int)sizeof(BENCH_MSG));
+		}
+	}
+	modestr = cmdarg_fetch_string(NULL, "m");
+	if (!strcmp(modestr, "fixed") || !strcmp(modestr, "both")) {
+		modes[nmodes++] = BENCH_FIXED;
+	}
+	if (!strcmp(modestr, "stream") || !strcmp(modestr, "both")) {
+		modes[nmodes++] = BENCH_STREAM;
+	}
+	if (0 == nmodes) {
+		APP_ERR(stderr, "Unknown mode %s", modestr);
+	}
+	format = cmdarg_fetch_string(NULL, "f");
+	if (strcmp(format, "text") && strcmp(format, "json") && strcmp(format, "csv")) {
+		APP_ERR(stderr, "Unknown format %s", format);
+	}
+	dirpath = cmdarg_fetch_string(NULL, "d");
+	mkdir(dirpath, 0775);
+	appenv_set_env_var(MMDQ_DIR_PATH, dirpath);
+
+	if (!strcmp(format, "json")) {
+		fprintf(stdout, "[\n");
+	} else if (!strcmp(format, "text")) {
+		fprintf(stdout, "msgbench: %d producers, %d consumers, %d messages per producer\n",
+			run.producers, run.consumers, run.messages);
+	}
+	resultp = (BENCH_HIST*)calloc(1, sizeof(BENCH_HIST));
+	for (im = 0; im < nmodes; im++) {
+		for (is = 0; is < nsizes; is++) {
+			for (ib = 0; ib < nbatches; ib++) {
+				if ((BENCH_STREAM == modes[im]) && (ib > 0)) {
+					break;		// no batched byte stream receive
+				}
+				run.mode = modes[im];
+				run.size = sizes[is];
+				run.batch = (BENCH_STREAM == modes[im]) ? 1 : batches[ib];
+				run_bench(&run, resultp);
+				report(format, &run, resultp, first);
+				first = 0;
+			}
+		}
+	}
+	if (!strcmp(format, "json")) {
+		fprintf(stdout, "\n]\n");
+	}
+	free(resultp);
+	return 0;
+}
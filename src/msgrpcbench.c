@@ -0,0 +1,319 @@
+
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file msgrpcbench.c
+ *
+ * @brief Request/reply latency benchmark: msgrpc versus local TCP.
+ *
+ * msgrpcbench forks an echo server and times round trips from a client,
+ * first over msgrpc (msgrpc.c) and then over a loopback TCP connection
+ * using socketio.c. Per-call latency percentiles and throughput are
+ * reported for each transport.
+ *
+ * Command line options.
+ *
+ * <ul>
+ * <li>-n --calls : Number of calls to time (default 10000)</li>
+ * <li>-s --size : Request/reply payload size in bytes (default 64)</li>
+ * <li>-w --window : Max outstanding (pipelined) requests (default 1)</li>
+ * <li>-d --directory : Deque data directory (default /tmp/msgrpcbench)</li>
+ * <li>-P --port : Loopback TCP port (default 15099)</li>
+ * <li>-h --help : command line help</li>
+ * </ul>
+ *
+ * Example: time 100000 256 byte calls with 8 requests in flight
+ *
+ * msgrpcbench -n 100000 -s 256 -w 8
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <appenv.h>
+#include <cmdargs.h>
+#include <diagnostics.h>
+#include <msgrpc.h>
+#include <socketio.h>
+
+#define BENCH_SERVER_NAME "rpcbench"
+
+typedef unsigned long long NSECS;
+
+static NSECS now_nsecs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((NSECS)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int cmp_nsecs(const void* a, const void* b) {
+	NSECS x = *(NSECS*)a;
+	NSECS y = *(NSECS*)b;
+
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static void report(const char* label, NSECS* latp, int ncalls, NSECS elapsed) {
+	NSECS total = 0;
+	int i;
+
+	qsort(latp, ncalls, sizeof(NSECS), cmp_nsecs);
+	for (i = 0; i < ncalls; i++) {
+		total += latp[i];
+	}
+	fprintf(stdout, "%-8s calls: %d mean: %.2f us p50: %.2f us p99: %.2f us max: %.2f us rate: %.0f calls/s\n",
+		label, ncalls,
+		(total / (double)ncalls) / 1000.0,
+		latp[ncalls / 2] / 1000.0,
+		latp[(ncalls * 99) / 100] / 1000.0,
+		latp[ncalls - 1] / 1000.0,
+		ncalls / (elapsed / 1e9));
+}
+
+/*
+ * Echo handler for the msgrpc server. A zero length request asks
+ * the server to stop.
+ */
+static int echo_handler(void* ctxp, void* reqp, size_t reqlen, void* replyp, size_t* replylenp) {
+	if (0 == reqlen) {
+		*(int*)ctxp = 1;
+	}
+	memcpy(replyp, reqp, reqlen);
+	*replylenp = reqlen;
+	return 0;
+}
+
+static void bench_msgrpc(int ncalls, int size, int window, NSECS* latp) {
+	MSGRPC_SERVER* serverp;
+	MSGRPC_CLIENT* clientp;
+	unsigned int* corr_ids;
+	NSECS* t0s;
+	char* reqp;
+	char* replyp;
+	size_t replylen;
+	NSECS start;
+	int submitted = 0;
+	int completed = 0;
+	int stop = 0;
+	pid_t pid;
+
+	serverp = msgrpc_server_create(BENCH_SERVER_NAME, 0660, size, 2 * window + 16, 32);
+	if (NULL == serverp) {
+		APP_ERR(stderr, "Unable to create msgrpc server %s", BENCH_SERVER_NAME);
+	}
+	fflush(stdout);
+	pid = fork();
+	if (0 == pid) {
+		while (!stop) {
+			if (msgrpc_server_dispatch(serverp, echo_handler, &stop, NULL) < 0) {
+				APP_ERR(stderr, "msgrpc_server_dispatch fails: %s", strerror(serverp->errcode));
+			}
+		}
+		msgrpc_server_close(serverp);
+		_exit(0);
+	}
+	clientp = msgrpc_client_open(BENCH_SERVER_NAME, window);
+	if (NULL == clientp) {
+		APP_ERR(stderr, "Unable to open msgrpc client");
+	}
+	corr_ids = (unsigned int*)calloc(window, sizeof(unsigned int));
+	t0s = (NSECS*)calloc(window, sizeof(NSECS));
+	reqp = (char*)calloc(1, size);
+	replyp = (char*)calloc(1, size);
+	memset(reqp, 'R', size);
+
+	start = now_nsecs();
+	while (completed < ncalls) {
+		while ((submitted < ncalls) && (submitted - completed < window)) {
+			t0s[submitted % window] = now_nsecs();
+			corr_ids[submitted % window] = msgrpc_submit(clientp, reqp, size, NULL);
+			if (0 == corr_ids[submitted % window]) {
+				APP_ERR(stderr, "msgrpc_submit fails: %s", strerror(clientp->errcode));
+			}
+			submitted++;
+		}
+		replylen = size;
+		if (msgrpc_wait(clientp, corr_ids[completed % window], replyp, &replylen, NULL) != 0) {
+			APP_ERR(stderr, "msgrpc_wait fails: %s", strerror(clientp->errcode));
+		}
+		latp[completed] = now_nsecs() - t0s[completed % window];
+		completed++;
+	}
+	report("msgrpc", latp, ncalls, now_nsecs() - start);
+
+	msgrpc_call(clientp, reqp, 0, NULL, NULL, NULL);
+	waitpid(pid, NULL, 0);
+	msgrpc_client_close(clientp);
+	msgrpc_server_close(serverp);
+	free(corr_ids);
+	free(t0s);
+	free(reqp);
+	free(replyp);
+}
+
+static int listen_loopback(int port) {
+	struct sockaddr_in addr;
+	int fd;
+	int on = 1;
+
+	fd = socket(PF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 1)) {
+		APP_ERR(stderr, "Unable to listen on loopback port %d: %s", port, strerror(errno));
+	}
+	return fd;
+}
+
+static void bench_tcp(int ncalls, int size, int window, int port, NSECS* latp) {
+	NSECS* t0s;
+	char* buffp;
+	NSECS start;
+	int submitted = 0;
+	int completed = 0;
+	int listenfd;
+	int fd;
+	int on = 1;
+	int tries;
+	pid_t pid;
+
+	listenfd = listen_loopback(port);
+	buffp = (char*)calloc(1, size);
+	fflush(stdout);
+	pid = fork();
+	if (0 == pid) {
+		fd = accept(listenfd, NULL, NULL);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		while (sio_readn(fd, buffp, size) == size) {
+			sio_writen(fd, buffp, size);
+		}
+		close(fd);
+		_exit(0);
+	}
+	close(listenfd);
+	for (tries = 0, fd = -1; (fd < 0) && (tries < 100); tries++) {
+		fd = sio_connect("127.0.0.1", port);
+		if (fd < 0) {
+			usleep(10000);
+		}
+	}
+	if (fd < 0) {
+		APP_ERR(stderr, "Unable to connect to loopback port %d", port);
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	t0s = (NSECS*)calloc(window, sizeof(NSECS));
+	memset(buffp, 'R', size);
+
+	start = now_nsecs();
+	while (completed < ncalls) {
+		while ((submitted < ncalls) && (submitted - completed < window)) {
+			t0s[submitted % window] = now_nsecs();
+			if (sio_writen(fd, buffp, size) != size) {
+				APP_ERR(stderr, "TCP write fails: %s", strerror(errno));
+			}
+			submitted++;
+		}
+		if (sio_readn(fd, buffp, size) != size) {
+			APP_ERR(stderr, "TCP read fails: %s", strerror(errno));
+		}
+		latp[completed] = now_nsecs() - t0s[completed % window];
+		completed++;
+	}
+	report("tcp", latp, ncalls, now_nsecs() - start);
+
+	close(fd);
+	waitpid(pid, NULL, 0);
+	free(t0s);
+	free(buffp);
+}
+
+static void register_args(int argc, char* argv[]) {
+	cmdarg_init(argc, argv);
+	cmdarg_register_option("n", "calls", CA_DEFAULT_ARG,
+		"Number of calls to time", "10000", NULL);
+	cmdarg_register_option("s", "size", CA_DEFAULT_ARG,
+		"Request/reply payload size in bytes", "64", NULL);
+	cmdarg_register_option("w", "window", CA_DEFAULT_ARG,
+		"Max outstanding (pipelined) requests", "1", NULL);
+	cmdarg_register_option("d", "directory", CA_DEFAULT_ARG,
+		"Deque data directory", "/tmp/msgrpcbench", NULL);
+	cmdarg_register_option("P", "port", CA_DEFAULT_ARG,
+		"Loopback TCP port", "15099", NULL);
+	cmdarg_register_option("h", "help", CA_SWITCH,
+		"Print command help", NULL, NULL);
+}
+
+int main(int argc, char* argv[]) {
+	NSECS* latp;
+	char* dirpath;
+	int ncalls;
+	int size;
+	int window;
+	int port;
+
+	register_args(argc, argv);
+	if (cmdarg_parse(argc, argv)) {
+		cmdarg_show_help(NULL);
+		exit(1);
+	}
+	if (cmdarg_fetch_switch(NULL, "h")) {
+		cmdarg_show_help(NULL);
+		exit(0);
+	}
+	ncalls = cmdarg_fetch_int(NULL, "n");
+	size = cmdarg_fetch_int(NULL, "s");
+	window = cmdarg_fetch_int(NULL, "w");
+	port = cmdarg_fetch_int(NULL, "P");
+	dirpath = cmdarg_fetch_string(NULL, "d");
+	if ((ncalls <= 0) || (size <= 0) || (window <= 0)) {
+		APP_ERR(stderr, "-n, -s and -w must be positive");
+	}
+	mkdir(dirpath, 0775);
+	appenv_set_env_var(MMDQ_DIR_PATH, dirpath);
+
+	fprintf(stdout, "msgrpcbench: payload %d bytes, window %d\n", size, window);
+	latp = (NSECS*)calloc(ncalls, sizeof(NSECS));
+	bench_msgrpc(ncalls, size, window, latp);
+	bench_tcp(ncalls, size, window, port, latp);
+	free(latp);
+	return 0;
+}
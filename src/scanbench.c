@@ -0,0 +1,261 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+
+/**
+ * @file scanbench.c
+ *
+ * @brief Throughput benchmark for parallel scans of files of records.
+ *
+ * scanbench fills a memory mapped file of records (mmfor.c) and then
+ * sums every word of every record with mmfor_parallel_reduce, once for
+ * each thread count given on the command line. The best of several
+ * passes is reported as GB/s of records scanned, which shows how far
+ * a scan scales with threads before memory bandwidth runs out. The
+ * file is in the page cache after it is filled, so the figures are for
+ * memory, not the disk.
+ *
+ * Command line options.
+ *
+ * <ul>
+ * <li>-m --megabytes : Size of the file of records (default 256)</li>
+ * <li>-r --record : Record size in bytes, a multiple of 8 (default 64)</li>
+ * <li>-t --threads : Comma separated thread counts (default 1,2,4,8)</li>
+ * <li>-n --passes : Passes per thread count, best reported (default 3)</li>
+ * <li>-a --advise : madvise(MADV_SEQUENTIAL) the file before scanning</li>
+ * <li>-f --format : text or csv (default text)</li>
+ * <li>-d --directory : Directory for the file of records (default /tmp)</li>
+ * <li>-h --help : command line help</li>
+ * </ul>
+ *
+ * Example: 1 GB file, 1 to 16 threads, CSV output
+ *
+ * scanbench -m 1024 -t 1,2,4,8,16 -f csv > scanbench.csv
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <cmdargs.h>
+#include <diagnostics.h>
+#include <mmfor.h>
+
+#define SCAN_FILE_NAME "scanbench.for"
+#define MAX_SWEEP 32
+
+typedef unsigned long long NSECS;
+
+/**
+ * Per thread accumulator.
+ */
+typedef struct _scan_acc {
+	unsigned long sum;			///< sum of record words
+	unsigned long records;		///< records visited
+} SCAN_ACC;
+
+static NSECS now_nsecs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((NSECS)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Add up the words of a record. ctx points to the number of words.
+ */
+static int scan_map(void* ctx, size_t x, void* rec, void* acc) {
+	unsigned long* wp = (unsigned long*)rec;
+	unsigned long sum = 0;
+	size_t nwords = *(size_t*)ctx;
+	size_t i;
+
+	(void)x;
+	for (i = 0; i < nwords; i++) {
+		sum += wp[i];
+	}
+	((SCAN_ACC*)acc)->sum += sum;
+	((SCAN_ACC*)acc)->records++;
+	return 0;
+}
+
+static void scan_reduce(void* ctx, void* result, void* acc) {
+	(void)ctx;
+	((SCAN_ACC*)result)->sum += ((SCAN_ACC*)acc)->sum;
+	((SCAN_ACC*)result)->records += ((SCAN_ACC*)acc)->records;
+}
+
+/*
+ * Parse a comma separated list of positive integers.
+ */
+static int parse_list(const char* optname, char* str, int* vals) {
+	char* copy;
+	char* tok;
+	char* savep;
+	int n = 0;
+
+	copy = strdup(str);
+	for (tok = strtok_r(copy, ",", &savep); tok != NULL; tok = strtok_r(NULL, ",", &savep)) {
+		if (n >= MAX_SWEEP) {
+			APP_ERR(stderr, "Too many values for -%s (max %d)", optname, MAX_SWEEP);
+		}
+		vals[n] = atoi(tok);
+		if (vals[n] <= 0) {
+			APP_ERR(stderr, "Invalid value %s for -%s", tok, optname);
+		}
+		n++;
+	}
+	free(copy);
+	return n;
+}
+
+static void register_args(int argc, char* argv[]) {
+	cmdarg_init(argc, argv);
+	cmdarg_register_option("m", "megabytes", CA_DEFAULT_ARG,
+		"Size of the file of records in MB", "256", NULL);
+	cmdarg_register_option("r", "record", CA_DEFAULT_ARG,
+		"Record size in bytes (multiple of 8)", "64", NULL);
+	cmdarg_register_option("t", "threads", CA_DEFAULT_ARG,
+		"Comma separated thread counts", "1,2,4,8", NULL);
+	cmdarg_register_option("n", "passes", CA_DEFAULT_ARG,
+		"Passes per thread count", "3", NULL);
+	cmdarg_register_option("a", "advise", CA_SWITCH,
+		"Advise sequential access before scanning", NULL, NULL);
+	cmdarg_register_option("f", "format", CA_DEFAULT_ARG,
+		"Output format: text or csv", "text", NULL);
+	cmdarg_register_option("d", "directory", CA_DEFAULT_ARG,
+		"Directory for the file of records", "/tmp", NULL);
+	cmdarg_register_option("h", "help", CA_SWITCH,
+		"Print command help", NULL, NULL);
+}
+
+int main(int argc, char* argv[]) {
+	char fpath[512];
+	int threads[MAX_SWEEP];
+	MMFOR_HANDLE* mmfhp;
+	SCAN_ACC acc;
+	unsigned long* wp;
+	unsigned long expect = 0;
+	long megabytes;
+	long rec_size;
+	size_t nwords;
+	size_t nrecs;
+	size_t x;
+	size_t i;
+	char* format;
+	NSECS start;
+	NSECS best;
+	NSECS elapsed;
+	double gbps;
+	int nthreads;
+	int passes;
+	int it;
+	int pass;
+
+	register_args(argc, argv);
+	if (cmdarg_parse(argc, argv)) {
+		cmdarg_show_help(NULL);
+		exit(1);
+	}
+	if (cmdarg_fetch_switch(NULL, "h")) {
+		cmdarg_show_help(NULL);
+		exit(0);
+	}
+	megabytes = cmdarg_fetch_int(NULL, "m");
+	rec_size = cmdarg_fetch_int(NULL, "r");
+	passes = cmdarg_fetch_int(NULL, "n");
+	if ((megabytes <= 0) || (rec_size <= 0) || (rec_size % (long)sizeof(unsigned long)) || (passes <= 0)) {
+		APP_ERR(stderr, "-m and -n must be positive and -r a positive multiple of %d",
+			(int)sizeof(unsigned long));
+	}
+	nthreads = parse_list("t", cmdarg_fetch_string(NULL, "t"), threads);
+	format = cmdarg_fetch_string(NULL, "f");
+	if (strcmp(format, "text") && strcmp(format, "csv")) {
+		APP_ERR(stderr, "Unknown format %s", format);
+	}
+	snprintf(fpath, sizeof(fpath), "%s/%s", cmdarg_fetch_string(NULL, "d"), SCAN_FILE_NAME);
+
+	nwords = rec_size / sizeof(unsigned long);
+	nrecs = (size_t)megabytes * 1024 * 1024 / rec_size;
+	unlink(fpath);
+	mmfhp = mmfor_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, rec_size, nrecs);
+	if (NULL == mmfhp) {
+		APP_ERR(stderr, "Unable to create %s", fpath);
+	}
+	for (x = 0; x < nrecs; x++) {
+		wp = (unsigned long*)mmfor_x2p(mmfhp, x);
+		for (i = 0; i < nwords; i++) {
+			wp[i] = x + i;
+			expect += x + i;
+		}
+	}
+	if (cmdarg_fetch_switch(NULL, "a") && mmfor_advise(mmfhp, MADV_SEQUENTIAL)) {
+		APP_ERR(stderr, "madvise failed");
+	}
+
+	if (!strcmp(format, "csv")) {
+		fprintf(stdout, "threads,records,record_size,megabytes,seconds,gbps\n");
+	} else {
+		fprintf(stdout, "scanbench: %lu records of %lu bytes (%lu MB)\n",
+			(unsigned long)nrecs, (unsigned long)rec_size, (unsigned long)megabytes);
+	}
+	for (it = 0; it < nthreads; it++) {
+		best = 0;
+		for (pass = 0; pass < passes; pass++) {
+			memset(&acc, 0, sizeof(acc));
+			start = now_nsecs();
+			if (mmfor_parallel_reduce(mmfhp, threads[it], scan_map, scan_reduce,
+				&nwords, &acc, sizeof(acc))) {
+				APP_ERR(stderr, "Scan with %d threads failed", threads[it]);
+			}
+			elapsed = now_nsecs() - start;
+			if ((acc.records != nrecs) || (acc.sum != expect)) {
+				APP_ERR(stderr, "Scan with %d threads found %lu records summing to %lu, expected %lu",
+					threads[it], acc.records, acc.sum, expect);
+			}
+			if ((0 == best) || (elapsed < best)) {
+				best = elapsed;
+			}
+		}
+		gbps = (double)(nrecs * rec_size) / (double)(best ? best : 1);
+		if (!strcmp(format, "csv")) {
+			fprintf(stdout, "%d,%lu,%lu,%lu,%.6f,%.3f\n", threads[it], (unsigned long)nrecs,
+				(unsigned long)rec_size, (unsigned long)megabytes, best / 1e9, gbps);
+		} else {
+			fprintf(stdout, "threads: %3d time: %10.6f s rate: %8.3f GB/s\n",
+				threads[it], best / 1e9, gbps);
+		}
+		fflush(stdout);
+	}
+	mmfor_close(mmfhp);
+	unlink(fpath);
+	return 0;
+}
@@ -26,15 +26,33 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 
 #include <dqacc.h>
 #include <cmdargs.h>
 #include <mmfor.h>
 #include <mmpool.h>
+#include <mmslab.h>
+#include <mmdeque.h>
+#include <linearlist.h>
+#include <mmbtree.h>
+#include <mmcol.h>
+#include <msgdeque.h>
+#include <msgrpc.h>
+#include <appenv.h>
 
 FILE* flog;
 
@@ -109,10 +127,11 @@ static int report_pool(BPOOL_HANDLE* bphp) {
 		bphp->bpmf_recp->dq_inpool.dqslots,
 		(100.0 * bphp->bpmf_recp->dq_inpool.dquse)/ bphp->bpmf_recp->dq_inpool.dqslots
 	);
-	rptline("Out of pool: In: %d Capacity: %d Pct: %g",
-		bphp->bpmf_recp->dq_outpool.dquse,
-		bphp->bpmf_recp->dq_outpool.dqslots,
-		(100.0 * bphp->bpmf_recp->dq_outpool.dquse)/ bphp->bpmf_recp->dq_outpool.dqslots
+	rptline("Cached in process magazines: %d", bphp->bpmf_recp->stats.cached);
+	rptline("Out of pool: Out: %d Capacity: %d Pct: %g",
+		bphp->bpmf_recp->stats.capacity - bphp->bpmf_recp->stats.remaining - bphp->bpmf_recp->stats.cached,
+		bphp->bpmf_recp->stats.capacity,
+		(100.0 * (bphp->bpmf_recp->stats.capacity - bphp->bpmf_recp->stats.remaining - bphp->bpmf_recp->stats.cached))/ bphp->bpmf_recp->stats.capacity
 	);
 	return 0;
 }
@@ -318,13 +337,2525 @@ static int process_switch_testc() {
 			} else {
 				fprintf(flog, "Record: %d : %s\n", i, pdata);
 			}
-			mmpool_putbuff(bphp, buff_refp);
+			if (mmpool_putbuff(bphp, buff_refp)) {
+				fprintf(stdout, "ERROR: mmpool_putbuff fails for buffer index %ld\n", i);
+				exit(1);
+			}
 		}
 		fprintf(stdout, "All buffers should now be deallocated!\n");
 		report_pool(bphp);
+		if (statsp->remaining != statsp->capacity) {
+			fprintf(stdout, "ERROR: %d buffers remaining, expected %d\n",
+				statsp->remaining, statsp->capacity);
+			exit(1);
+		}
+		// Returning a buffer twice must be detected
+		if (!mmpool_putbuff(bphp, mmpool_buffx2refp(bphp, 0))) {
+			fprintf(stdout, "ERROR: double mmpool_putbuff not detected\n");
+			exit(1);
+		}
 	}
 	return status;
 }
+/*
+ * Remove the files of a pool left by an earlier run.
+ */
+static void discard_pool(char* strdir, char* pool_name) {
+	char fpath[1024];
+
+	snprintf(fpath, sizeof(fpath), "%s/%s", strdir, mmpool_bpmf_filename(pool_name));
+	unlink(fpath);
+	snprintf(fpath, sizeof(fpath), "%s/%s", strdir, mmpool_bpcf_filename(pool_name));
+	unlink(fpath);
+}
+
+/*
+ * Define a pool, discarding any pool of the same name left by an
+ * earlier run.
+ */
+static BPOOL_HANDLE* fresh_pool(char* strdir, char* pool_name, unsigned short bp_id,
+	size_t max_data_size, unsigned short capacity, unsigned int flags) {
+	discard_pool(strdir, pool_name);
+	return mmpool_define_pool_flags(pool_name, bp_id, max_data_size, capacity, flags);
+}
+
+/*
+ * Stress worker: get a buffer, stamp it with our pid and the cycle
+ * number, check nobody else was handed it meanwhile, and put it back.
+ * Returns the number of errors seen.
+ */
+static int stress_worker(char* pool_name, long cycles) {
+	BPOOL_HANDLE* bphp;
+	BPCF_BUFFER_REF* buff_refp;
+	long* datap;
+	long pid;
+	long i;
+	int errors = 0;
+
+	bphp = mmpool_open(pool_name);
+	if (NULL == bphp) {
+		return 1;
+	}
+	pid = (long)getpid();
+	for (i = 0; i < cycles; ) {
+		buff_refp = mmpool_getbuff(bphp);
+		if (NULL == buff_refp) {
+			continue;			// pool momentarily empty
+		}
+		datap = (long*)mmpool_buffer_data(buff_refp);
+		datap[0] = pid;
+		datap[1] = i;
+		if ((datap[0] != pid) || (datap[1] != i)) {
+			errors++;			// buffer handed to two processes
+		}
+		if (mmpool_putbuff(bphp, buff_refp)) {
+			errors++;
+		}
+		i++;
+	}
+	mmpool_close(bphp);
+	return errors;
+}
+
+/*
+ * Run nprocs stress workers against a pool. Returns allocations per
+ * second over all workers, or a negative value on error.
+ */
+static double stress_run(char* pool_name, int nprocs, long cycles) {
+	struct timespec t0;
+	struct timespec t1;
+	pid_t pid;
+	int wstatus;
+	int i;
+	int failed = 0;
+	double secs;
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nprocs; i++) {
+		pid = fork();
+		if (0 == pid) {
+			exit(stress_worker(pool_name, cycles) ? 1 : 0);
+		} else if (pid < 0) {
+			failed = 1;
+		}
+	}
+	while (wait(&wstatus) > 0) {
+		if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+			failed = 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (failed) {
+		return -1.0;
+	}
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	return (nprocs * cycles) / secs;
+}
+
+/*
+ * Test t: multi process stress of mmpool_getbuff/mmpool_putbuff. A pool
+ * using the BPMF file lock and a lock free pool are hammered by 1, 2,
+ * 4 ... -P processes and allocations per second are reported for each.
+ */
+static int process_switch_testt() {
+	static char* modes[] = {"lock", "lockfree"};
+	static unsigned int mode_flags[] = {0, BPOOL_FLAG_LOCKFREE};
+	char pool_names[2][MMPOOL_MAX_POOL_NAME];
+	char* strdir;
+	char* pool_name;
+	CMD_ARG* optp;
+	BPOOL_HANDLE* bphp;
+	int max_procs;
+	long cycles;
+	int nprocs;
+	int m;
+	double rate[2];
+
+	if (!cmdarg_fetch_switch(NULL, "t")) {
+		return 0;
+	}
+	optp = cmdarg_fetch(NULL, "t");
+	max_procs = cmdarg_fetch_int(optp, "P");
+	cycles = cmdarg_fetch_long(optp, "N");
+	strdir = cmdarg_fetch_string(NULL, "d");
+	setenv(MMPOOL_ENV_DATA_DIR, strdir, 1);
+	pool_name = cmdarg_fetch_string(NULL, "p");
+
+	// Start from fresh pools each run
+	for (m = 0; m < 2; m++) {
+		snprintf(pool_names[m], MMPOOL_MAX_POOL_NAME, "%s-%s", pool_name, modes[m]);
+		bphp = fresh_pool(strdir, pool_names[m], m + 2, 2 * sizeof(long), 64, mode_flags[m]);
+		if (NULL == bphp) {
+			fprintf(stdout, "TEST-T Fails: unable to create pool %s\n", pool_names[m]);
+			exit(1);
+		}
+		mmpool_close(bphp);
+	}
+
+	fprintf(stdout, "TEST-T -- %ld get/put cycles per process\n", cycles);
+	fprintf(stdout, "%6s %16s %16s\n", "Procs", "Lock allocs/s", "Lockfree allocs/s");
+	for (nprocs = 1; nprocs <= max_procs; nprocs *= 2) {
+		for (m = 0; m < 2; m++) {
+			rate[m] = stress_run(pool_names[m], nprocs, cycles);
+			if (rate[m] < 0) {
+				fprintf(stdout, "TEST-T Fails: %s pool with %d processes\n", modes[m], nprocs);
+				exit(1);
+			}
+			// Every buffer must be back in the pool
+			bphp = mmpool_open(pool_names[m]);
+			if (mmpool_getstats(bphp)->remaining != mmpool_getstats(bphp)->capacity) {
+				fprintf(stdout, "TEST-T Fails: %s pool has %d of %d buffers remaining\n",
+					modes[m], mmpool_getstats(bphp)->remaining, mmpool_getstats(bphp)->capacity);
+				exit(1);
+			}
+			mmpool_close(bphp);
+		}
+		fprintf(stdout, "%6d %16.0f %16.0f\n", nprocs, rate[0], rate[1]);
+	}
+	return 0;
+}
+
+/*
+ * Test s: slab group allocation. Classes 16, 32, 64 and 128 bytes of
+ * 4 buffers each. Checks best fit, fallback to a larger class,
+ * exhaustion, oversize requests, freeing and the group stats.
+ */
+static int process_switch_tests() {
+	char* group_name;
+	MMSLAB_HANDLE* slabp;
+	MMSLAB_STATS stats;
+	BPCF_BUFFER_REF* buffs[16];
+	BPCF_BUFFER_REF* buffp;
+	int nbuffs = 0;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "s")) {
+		return 0;
+	}
+	setenv(MMPOOL_ENV_DATA_DIR, cmdarg_fetch_string(NULL, "d"), 1);
+	group_name = cmdarg_fetch_string(NULL, "p");
+	fprintf(stdout, "TEST-S -- Slab group allocation.\n");
+	slabp = mmslab_define_group(group_name, 16, 100, 4, 0);
+	if ((NULL == slabp) || (slabp->recp->nclasses != 4)) {
+		fprintf(stdout, "TEST-S Fails: unable to define slab group %s\n", group_name);
+		exit(1);
+	}
+	// Five small allocations: four from class 0, then one falls back to class 1
+	for (i = 0; i < 5; i++) {
+		buffp = mmslab_alloc(slabp, 10);
+		if ((NULL == buffp) || (buffp->bp_id != ((i < 4) ? 0 : 1))) {
+			fprintf(stdout, "ERROR: small allocation %d from wrong class\n", i);
+			exit(1);
+		}
+		buffs[nbuffs++] = buffp;
+	}
+	// Exhaust the largest class
+	for (i = 0; i < 4; i++) {
+		buffp = mmslab_alloc(slabp, 100);
+		if ((NULL == buffp) || (buffp->bp_id != 3)) {
+			fprintf(stdout, "ERROR: large allocation %d from wrong class\n", i);
+			exit(1);
+		}
+		memset(mmpool_buffer_data(buffp), 'L', 100);
+		buffs[nbuffs++] = buffp;
+	}
+	errno = 0;
+	if ((mmslab_alloc(slabp, 100) != NULL) || (errno != ENOMEM)) {
+		fprintf(stdout, "ERROR: allocation from exhausted classes not refused\n");
+		exit(1);
+	}
+	errno = 0;
+	if ((mmslab_alloc(slabp, 129) != NULL) || (errno != EINVAL)) {
+		fprintf(stdout, "ERROR: oversize allocation not refused\n");
+		exit(1);
+	}
+	mmslab_getstats(slabp, &stats);
+	if ((stats.capacity - stats.remaining != nbuffs) || (stats.fallbacks != 1) ||
+		(stats.failures != 1) || (stats.data_bytes_out != 4 * 16 + 32 + 4 * 128)) {
+		fprintf(stdout, "ERROR: unexpected slab stats out %lu fallbacks %lu failures %lu bytes out %lu\n",
+			stats.capacity - stats.remaining, stats.fallbacks, stats.failures,
+			(unsigned long)stats.data_bytes_out);
+		exit(1);
+	}
+	for (i = 0; i < nbuffs; i++) {
+		if (mmslab_free(slabp, buffs[i])) {
+			fprintf(stdout, "ERROR: mmslab_free fails for buffer %d\n", i);
+			exit(1);
+		}
+	}
+	if (!mmslab_free(slabp, buffs[0])) {
+		fprintf(stdout, "ERROR: double mmslab_free not detected\n");
+		exit(1);
+	}
+	mmslab_getstats(slabp, &stats);
+	if (stats.remaining != stats.capacity) {
+		fprintf(stdout, "ERROR: %lu of %lu slab buffers remaining\n", stats.remaining, stats.capacity);
+		exit(1);
+	}
+	mmslab_close(slabp);
+	fprintf(stdout, "TEST-S -- Passed.\n");
+	return 0;
+}
+
+#define TF_CONSUMERS 3
+/*
+ * Test f: fan one buffer out to several consumer processes by
+ * reference count. Each consumer checks the payload and drops its
+ * reference; the last one must return the buffer to the pool. Run
+ * against a locked and a lock free pool.
+ */
+static int process_switch_testf() {
+	static unsigned int mode_flags[] = {0, BPOOL_FLAG_LOCKFREE};
+	char pool_name[MMPOOL_MAX_POOL_NAME];
+	char* strdir;
+	BPOOL_HANDLE* bphp;
+	BPCF_BUFFER_REF* buff_refp;
+	BPOOL_INDEX bpx;
+	pid_t pid;
+	int wstatus;
+	int m;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "f")) {
+		return 0;
+	}
+	strdir = cmdarg_fetch_string(NULL, "d");
+	setenv(MMPOOL_ENV_DATA_DIR, strdir, 1);
+	fprintf(stdout, "TEST-F -- Buffer fan out by reference count.\n");
+	for (m = 0; m < 2; m++) {
+		snprintf(pool_name, sizeof(pool_name), "%s-%d", cmdarg_fetch_string(NULL, "p"), m);
+		bphp = fresh_pool(strdir, pool_name, 1, 64, 4, mode_flags[m]);
+		if (NULL == bphp) {
+			fprintf(stdout, "TEST-F Fails: unable to create pool %s\n", pool_name);
+			exit(1);
+		}
+		buff_refp = mmpool_getbuff(bphp);
+		bpx = buff_refp->bpindex;
+		strcpy(mmpool_buffer_data(buff_refp), "fan out");
+		fflush(stdout);
+		for (i = 0; i < TF_CONSUMERS; i++) {
+			if (mmpool_buff_ref(buff_refp) != i + 2) {
+				fprintf(stdout, "ERROR: unexpected reference count\n");
+				exit(1);
+			}
+			pid = fork();
+			if (0 == pid) {
+				// Consumer: use our own pool handle, as a separate process would
+				BPOOL_HANDLE* cbphp = mmpool_open(pool_name);
+				BPCF_BUFFER_REF* crefp = mmpool_buffx2refp(cbphp, bpx);
+
+				usleep(1000 * (TF_CONSUMERS - i));
+				if (strcmp(mmpool_buffer_data(crefp), "fan out")) {
+					exit(1);
+				}
+				exit((mmpool_buff_unref(cbphp, crefp) < 0) ? 1 : 0);
+			}
+		}
+		// Producer drops its own reference ... consumers still hold theirs
+		if ((mmpool_buff_unref(bphp, buff_refp) <= 0) ||
+			(BPOOL_BUFF_OUT != mmpool_buff_state(bphp, bpx))) {
+			fprintf(stdout, "ERROR: buffer returned while consumers hold references\n");
+			exit(1);
+		}
+		while (wait(&wstatus) > 0) {
+			if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+				fprintf(stdout, "ERROR: fan out consumer failed\n");
+				exit(1);
+			}
+		}
+		if ((BPOOL_BUFF_IN != mmpool_buff_state(bphp, bpx)) ||
+			(mmpool_getstats(bphp)->remaining != mmpool_getstats(bphp)->capacity)) {
+			fprintf(stdout, "ERROR: last unref did not return the buffer to pool %s\n", pool_name);
+			exit(1);
+		}
+		// References to a free buffer can neither be added nor dropped
+		if ((mmpool_buff_ref(buff_refp) != 0) || (mmpool_buff_unref(bphp, buff_refp) != -1)) {
+			fprintf(stdout, "ERROR: reference to free buffer not refused\n");
+			exit(1);
+		}
+		mmpool_close(bphp);
+	}
+	fprintf(stdout, "TEST-F -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test r: reclaim buffers leaked by a dead process. A child takes
+ * buffers (directly and through a magazine, or from a lock free pool),
+ * gives one up (owner 0, as when sent by reference) and dies without
+ * returning them. mmpool_reclaim must take back the owned buffers and
+ * leave the parent's and the unowned buffer alone.
+ */
+static int process_switch_testr() {
+	static unsigned int mode_flags[] = {0, BPOOL_FLAG_LOCKFREE};
+	char pool_name[MMPOOL_MAX_POOL_NAME];
+	char* strdir;
+	BPOOL_HANDLE* bphp;
+	BPCF_BUFFER_REF* mine;
+	BPCF_BUFFER_REF* unowned;
+	BPOOL_INDEX bpx;
+	int expect;
+	int reclaimed;
+	int wstatus;
+	int m;
+
+	if (!cmdarg_fetch_switch(NULL, "r")) {
+		return 0;
+	}
+	strdir = cmdarg_fetch_string(NULL, "d");
+	setenv(MMPOOL_ENV_DATA_DIR, strdir, 1);
+	fprintf(stdout, "TEST-R -- Reclaim of buffers held by dead processes.\n");
+	for (m = 0; m < 2; m++) {
+		snprintf(pool_name, sizeof(pool_name), "%s-%d", cmdarg_fetch_string(NULL, "p"), m);
+		bphp = fresh_pool(strdir, pool_name, 1, 64, 16, mode_flags[m]);
+		if (NULL == bphp) {
+			fprintf(stdout, "TEST-R Fails: unable to create pool %s\n", pool_name);
+			exit(1);
+		}
+		mine = mmpool_getbuff(bphp);
+		fflush(stdout);
+		if (0 == fork()) {
+			BPOOL_HANDLE* cbphp = mmpool_open(pool_name);
+			int i;
+
+			for (i = 0; i < 3; i++) {
+				mmpool_getbuff(cbphp);
+			}
+			mmpool_buff_set_owner(mmpool_getbuff(cbphp), 0);
+			if (!mmpool_magazine_enable(cbphp, 2)) {
+				mmpool_getbuff(cbphp);		// one out, one left cached
+			}
+			_exit(0);						// die without returning anything
+		}
+		wait(&wstatus);
+		// Three direct buffers, plus one out and one cached by the magazine
+		expect = (mode_flags[m] & BPOOL_FLAG_LOCKFREE) ? 3 : 5;
+		reclaimed = mmpool_reclaim(bphp);
+		if (reclaimed != expect) {
+			fprintf(stdout, "ERROR: pool %s reclaimed %d buffers, expected %d\n",
+				pool_name, reclaimed, expect);
+			exit(1);
+		}
+		if (BPOOL_BUFF_OUT != mmpool_buff_state(bphp, mine->bpindex)) {
+			fprintf(stdout, "ERROR: pool %s reclaimed a live process's buffer\n", pool_name);
+			exit(1);
+		}
+		// The unowned buffer is still out ... return it and ours
+		unowned = NULL;
+		for (bpx = 0; bpx < mmpool_getstats(bphp)->capacity; bpx++) {
+			if ((bpx != mine->bpindex) && (BPOOL_BUFF_OUT == mmpool_buff_state(bphp, bpx))) {
+				unowned = mmpool_buffx2refp(bphp, bpx);
+			}
+		}
+		if ((NULL == unowned) || (unowned->owner_pid != 0) || mmpool_putbuff(bphp, unowned) ||
+			mmpool_putbuff(bphp, mine)) {
+			fprintf(stdout, "ERROR: pool %s lost track of the unowned buffer\n", pool_name);
+			exit(1);
+		}
+		if ((mmpool_getstats(bphp)->remaining != mmpool_getstats(bphp)->capacity) ||
+			mmpool_getstats(bphp)->cached) {
+			fprintf(stdout, "ERROR: pool %s unbalanced after reclaim\n", pool_name);
+			exit(1);
+		}
+		mmpool_close(bphp);
+	}
+	fprintf(stdout, "TEST-R -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test g: aligned pools. For each alignment, every buffer's user data
+ * must be aligned, writable to its full size without touching its
+ * neighbours, and the pool must reopen with the same geometry. Invalid
+ * alignments must be refused.
+ */
+static int process_switch_testg() {
+	static unsigned int alignments[] = {16, 64, 4096, 0};
+	char pool_name[MMPOOL_MAX_POOL_NAME];
+	char* strdir;
+	BPOOL_HANDLE* bphp;
+	BPCF_BUFFER_REF* buffs[5];
+	unsigned char* datap;
+	size_t data_size = 100;
+	int a;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "g")) {
+		return 0;
+	}
+	strdir = cmdarg_fetch_string(NULL, "d");
+	setenv(MMPOOL_ENV_DATA_DIR, strdir, 1);
+	fprintf(stdout, "TEST-G -- Aligned buffer pools.\n");
+	for (a = 0; alignments[a]; a++) {
+		snprintf(pool_name, sizeof(pool_name), "%s-%u", cmdarg_fetch_string(NULL, "p"), alignments[a]);
+		discard_pool(strdir, pool_name);
+		bphp = mmpool_define_pool_aligned(pool_name, 1, data_size, 5, 0, alignments[a]);
+		if ((NULL == bphp) || (mmpool_getstats(bphp)->alignment != alignments[a])) {
+			fprintf(stdout, "TEST-G Fails: unable to create pool %s\n", pool_name);
+			exit(1);
+		}
+		for (i = 0; i < 5; i++) {
+			buffs[i] = mmpool_getbuff(bphp);
+			datap = mmpool_buffer_data(buffs[i]);
+			if (((size_t)datap % alignments[a]) || (mmpool_buffer_data2refp(datap) != buffs[i])) {
+				fprintf(stdout, "ERROR: pool %s buffer %d data %p not aligned\n",
+					pool_name, i, datap);
+				exit(1);
+			}
+			memset(datap, 0xEE, data_size);
+		}
+		for (i = 0; i < 5; i++) {
+			if ((buffs[i]->sync_word[0] != (char)0xA4) || (buffs[i]->bpindex != i) ||
+				mmpool_putbuff(bphp, buffs[i])) {
+				fprintf(stdout, "ERROR: pool %s buffer %d header overwritten\n", pool_name, i);
+				exit(1);
+			}
+		}
+		mmpool_close(bphp);
+		bphp = mmpool_open(pool_name);
+		if ((NULL == bphp) || ((size_t)mmpool_buffer_data(mmpool_buffx2refp(bphp, 4)) % alignments[a])) {
+			fprintf(stdout, "ERROR: pool %s does not reopen aligned\n", pool_name);
+			exit(1);
+		}
+		mmpool_close(bphp);
+	}
+	snprintf(pool_name, sizeof(pool_name), "%s-bad", cmdarg_fetch_string(NULL, "p"));
+	if ((mmpool_define_pool_aligned(pool_name, 1, data_size, 5, 0, 24) != NULL) ||
+		(mmpool_define_pool_aligned(pool_name, 1, data_size, 5, 0, 2 * sysconf(_SC_PAGESIZE)) != NULL)) {
+		fprintf(stdout, "ERROR: invalid alignment accepted\n");
+		exit(1);
+	}
+	fprintf(stdout, "TEST-G -- Passed.\n");
+	return 0;
+}
+
+#define TK_LEN 250
+/*
+ * Test k: buffer chains. A 250 byte message in 100 byte buffers takes a
+ * chain of three. The chain is filled and written with writev through
+ * its iovec description, read back and compared. A chain the pool
+ * cannot supply must take nothing. Run against a locked and a lock
+ * free pool.
+ */
+static int process_switch_testk() {
+	static unsigned int mode_flags[] = {0, BPOOL_FLAG_LOCKFREE};
+	char pool_name[MMPOOL_MAX_POOL_NAME];
+	char fpath[1024];
+	char msg[TK_LEN];
+	char readback[TK_LEN];
+	struct iovec iov[4];
+	char* strdir;
+	BPOOL_HANDLE* bphp;
+	BPCF_BUFFER_REF* headp;
+	size_t off;
+	int niov;
+	int fd;
+	int m;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "k")) {
+		return 0;
+	}
+	strdir = cmdarg_fetch_string(NULL, "d");
+	setenv(MMPOOL_ENV_DATA_DIR, strdir, 1);
+	fprintf(stdout, "TEST-K -- Buffer chains.\n");
+	for (i = 0; i < TK_LEN; i++) {
+		msg[i] = 'a' + i % 26;
+	}
+	for (m = 0; m < 2; m++) {
+		snprintf(pool_name, sizeof(pool_name), "%s-%d", cmdarg_fetch_string(NULL, "p"), m);
+		bphp = fresh_pool(strdir, pool_name, 1, 100, 8, mode_flags[m]);
+		headp = (bphp != NULL) ? mmpool_getchain(bphp, TK_LEN) : NULL;
+		if (NULL == headp) {
+			fprintf(stdout, "TEST-K Fails: unable to get a chain from pool %s\n", pool_name);
+			exit(1);
+		}
+		niov = mmpool_chain_iov(bphp, headp, iov, 4);
+		if ((niov != 3) || (iov[0].iov_len != 100) || (iov[2].iov_len != TK_LEN - 200) ||
+			(mmpool_getstats(bphp)->remaining != 5)) {
+			fprintf(stdout, "ERROR: pool %s chain of %d buffers, expected 3\n", pool_name, niov);
+			exit(1);
+		}
+		// Fill the chain in place and write it out without flattening
+		for (i = 0, off = 0; i < niov; off += iov[i].iov_len, i++) {
+			memcpy(iov[i].iov_base, msg + off, iov[i].iov_len);
+		}
+		snprintf(fpath, sizeof(fpath), "%s/%s.out", strdir, pool_name);
+		fd = open(fpath, O_CREAT | O_TRUNC | O_RDWR, 0660);
+		if ((fd < 0) || (writev(fd, iov, niov) != TK_LEN) ||
+			(pread(fd, readback, TK_LEN, 0) != TK_LEN) || memcmp(msg, readback, TK_LEN)) {
+			fprintf(stdout, "ERROR: pool %s chain did not write back intact\n", pool_name);
+			exit(1);
+		}
+		close(fd);
+		unlink(fpath);
+		// Six buffers are not available: nothing may be taken
+		if ((mmpool_getchain(bphp, 600) != NULL) || (mmpool_getstats(bphp)->remaining != 5)) {
+			fprintf(stdout, "ERROR: pool %s short chain request not all or nothing\n", pool_name);
+			exit(1);
+		}
+		if (mmpool_putchain(bphp, headp) || (mmpool_getstats(bphp)->remaining != 8)) {
+			fprintf(stdout, "ERROR: pool %s chain not returned\n", pool_name);
+			exit(1);
+		}
+		if (!mmpool_putchain(bphp, headp)) {
+			fprintf(stdout, "ERROR: pool %s double chain return not detected\n", pool_name);
+			exit(1);
+		}
+		mmpool_close(bphp);
+	}
+	fprintf(stdout, "TEST-K -- Passed.\n");
+	return 0;
+}
+
+#define TZ_CAPACITY 16
+/*
+ * Test z: lazy formatting. A new pool has formatted no buffers; each
+ * header is written as its buffer is first taken, and returned buffers
+ * are used again before fresh ones. A zap resets the high-water mark
+ * and bumps the generation, which the next headers written carry. Run
+ * against a locked and a lock free pool.
+ */
+static int process_switch_testz() {
+	static unsigned int mode_flags[] = {0, BPOOL_FLAG_LOCKFREE};
+	char pool_name[MMPOOL_MAX_POOL_NAME];
+	BPCF_BUFFER_REF* refs[TZ_CAPACITY];
+	char* strdir;
+	BPOOL_HANDLE* bphp;
+	int m;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "z")) {
+		return 0;
+	}
+	strdir = cmdarg_fetch_string(NULL, "d");
+	setenv(MMPOOL_ENV_DATA_DIR, strdir, 1);
+	fprintf(stdout, "TEST-Z -- Lazy pool formatting and reset.\n");
+	for (m = 0; m < 2; m++) {
+		snprintf(pool_name, sizeof(pool_name), "%s-%d", cmdarg_fetch_string(NULL, "p"), m);
+		bphp = fresh_pool(strdir, pool_name, 3, 65536, TZ_CAPACITY, mode_flags[m]);
+		if ((NULL == bphp) || (bphp->bpmf_recp->hwm != 0) || (bphp->bpmf_recp->generation != 1)) {
+			fprintf(stdout, "TEST-Z Fails: pool %s not defined unformatted\n", pool_name);
+			exit(1);
+		}
+		for (i = 0; i < 3; i++) {
+			refs[i] = mmpool_getbuff(bphp);
+			if ((NULL == refs[i]) || (refs[i]->bpindex != i) || (refs[i]->bp_id != 3) ||
+				((unsigned char)refs[i]->sync_word[0] != 0xA4) || (refs[i]->generation != 1)) {
+				fprintf(stdout, "ERROR: pool %s buffer %d header not formatted\n", pool_name, i);
+				exit(1);
+			}
+		}
+		// A returned buffer is taken again before a fresh one
+		mmpool_putbuff(bphp, refs[1]);
+		refs[1] = mmpool_getbuff(bphp);
+		if ((NULL == refs[1]) || (refs[1]->bpindex != 1) || (bphp->bpmf_recp->hwm != 3)) {
+			fprintf(stdout, "ERROR: pool %s returned buffer not reused\n", pool_name);
+			exit(1);
+		}
+		if ((mmpool_zap_pool(bphp) != 3) || (bphp->bpmf_recp->hwm != 0) ||
+			(bphp->bpmf_recp->generation != 2) ||
+			(mmpool_getstats(bphp)->remaining != TZ_CAPACITY)) {
+			fprintf(stdout, "ERROR: pool %s zap did not reset the pool\n", pool_name);
+			exit(1);
+		}
+		// The whole pool is available again, in the new generation
+		for (i = 0; i < TZ_CAPACITY; i++) {
+			refs[i] = mmpool_getbuff(bphp);
+			if ((NULL == refs[i]) || (refs[i]->bpindex != i) || (refs[i]->generation != 2)) {
+				fprintf(stdout, "ERROR: pool %s buffer %d not reformatted after zap\n", pool_name, i);
+				exit(1);
+			}
+		}
+		if (mmpool_getbuff(bphp) != NULL) {
+			fprintf(stdout, "ERROR: pool %s handed out more than its capacity\n", pool_name);
+			exit(1);
+		}
+		for (i = 0; i < TZ_CAPACITY; i++) {
+			mmpool_putbuff(bphp, refs[i]);
+		}
+		if (mmpool_getstats(bphp)->remaining != TZ_CAPACITY) {
+			fprintf(stdout, "ERROR: pool %s buffers not returned\n", pool_name);
+			exit(1);
+		}
+		mmpool_close(bphp);
+	}
+	fprintf(stdout, "TEST-Z -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Check the items of a deque, popping from the top
+ */
+static void expect_deque(MMA_HANDLE* mmdqhp, long* expected, int count) {
+	long item;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (mmdq_rtd(mmdqhp, &item) || (item != expected[i])) {
+			fprintf(stdout, "ERROR: deque item %d is %ld, expected %ld\n", i, item, expected[i]);
+			exit(1);
+		}
+	}
+	if (!mmdq_isempty(mmdqhp)) {
+		fprintf(stdout, "ERROR: deque holds more than %d items\n", count);
+		exit(1);
+	}
+}
+
+/*
+ * Test m: moves between memory mapped deques. Moves are all or nothing,
+ * keep the order of the items, and a journal left by a mover that died
+ * is finished by mmdq_move_recover. Large moves go through the journal
+ * in batches.
+ */
+static int process_switch_testm() {
+	static long expected[] = {5, 1, 2, 3, 6, 7, 4};
+	char name[MAX_DEQUE_NAME_LEN];
+	MMA_HANDLE* srchp;
+	MMA_HANDLE* dsthp;
+	MMDQ_JOURNAL* journalp;
+	DQSTATS stats;
+	struct stat sb;
+	long item;
+	long big;
+
+	if (!cmdarg_fetch_switch(NULL, "m")) {
+		return 0;
+	}
+	appenv_set_env_var(MMDQ_DIR_PATH, cmdarg_fetch_string(NULL, "d"));
+	fprintf(stdout, "TEST-M -- Moves between memory mapped deques.\n");
+	snprintf(name, sizeof(name), "%s-src", cmdarg_fetch_string(NULL, "p"));
+	srchp = mmdq_create(name, sizeof(long), 8);
+	snprintf(name, sizeof(name), "%s-dst", cmdarg_fetch_string(NULL, "p"));
+	dsthp = mmdq_create(name, sizeof(long), 8);
+	if ((NULL == srchp) || (NULL == dsthp) || (NULL == (journalp = mmdq_journal(dsthp)))) {
+		fprintf(stdout, "TEST-M Fails: unable to create deques\n");
+		exit(1);
+	}
+	for (item = 1; item <= 5; item++) {
+		mmdq_abd(srchp, &item);
+	}
+	// 1 2 3 from the top of the source to the bottom of the destination
+	if (mmdq_move(srchp, MMDQ_TOP, dsthp, MMDQ_BOTTOM, 3) ||
+		(mmdq_stats(srchp, &stats)->dquse != 2) || (mmdq_stats(dsthp, &stats)->dquse != 3)) {
+		fprintf(stdout, "ERROR: move of 3 items failed\n");
+		exit(1);
+	}
+	if (!mmdq_move(srchp, MMDQ_TOP, dsthp, MMDQ_BOTTOM, 3) ||
+		(mmdq_stats(srchp, &stats)->dquse != 2) || (mmdq_stats(dsthp, &stats)->dquse != 3)) {
+		fprintf(stdout, "ERROR: move of more items than the source holds not refused\n");
+		exit(1);
+	}
+	// A mover died after journaling 6 7 for the bottom of the destination
+	((long*)(journalp + 1))[0] = 6;
+	((long*)(journalp + 1))[1] = 7;
+	journalp->dst_end = MMDQ_BOTTOM;
+	journalp->count = 2;
+	journalp->pushed = 0;
+	journalp->state = MMDQ_JOURNAL_MOVING;
+	if ((mmdq_move_recover(dsthp) != 2) || (journalp->state != MMDQ_JOURNAL_IDLE)) {
+		fprintf(stdout, "ERROR: journaled move not recovered\n");
+		exit(1);
+	}
+	// 5 then 4 from the bottom of the source to the top of the destination
+	if (mmdq_move(srchp, MMDQ_BOTTOM, dsthp, MMDQ_TOP, 2) || !mmdq_isempty(srchp)) {
+		fprintf(stdout, "ERROR: move from the bottom failed\n");
+		exit(1);
+	}
+	for (item = 8; item <= 9; item++) {
+		mmdq_abd(srchp, &item);
+	}
+	if (!mmdq_move(srchp, MMDQ_TOP, dsthp, MMDQ_TOP, 2) || (mmdq_stats(srchp, &stats)->dquse != 2)) {
+		fprintf(stdout, "ERROR: move into a deque without room not refused\n");
+		exit(1);
+	}
+	// Rotate the destination: its top item goes to the bottom
+	if (mmdq_move(dsthp, MMDQ_TOP, dsthp, MMDQ_BOTTOM, 1)) {
+		fprintf(stdout, "ERROR: rotate failed\n");
+		exit(1);
+	}
+	expect_deque(dsthp, expected, sizeof(expected) / sizeof(expected[0]));
+	unlink(mmdq_dequepath_from_handle(srchp));
+	unlink(mmdq_dequepath_from_handle(dsthp));
+	mmdq_close(srchp);
+	mmdq_close(dsthp);
+
+	// A move larger than the journal goes through it in batches
+	snprintf(name, sizeof(name), "%s-bsrc", cmdarg_fetch_string(NULL, "p"));
+	srchp = mmdq_create(name, sizeof(long), 4 * MMDQ_MOVE_BATCH);
+	snprintf(name, sizeof(name), "%s-bdst", cmdarg_fetch_string(NULL, "p"));
+	dsthp = mmdq_create(name, sizeof(long), 4 * MMDQ_MOVE_BATCH);
+	if ((NULL == srchp) || (NULL == dsthp)) {
+		fprintf(stdout, "TEST-M Fails: unable to create deques\n");
+		exit(1);
+	}
+	if (stat(mmdq_dequepath_from_handle(dsthp), &sb) ||
+		(sb.st_size >= (off_t)(sizeof(DQHEADER) + 2 * sizeof(long) * 4 * MMDQ_MOVE_BATCH))) {
+		fprintf(stdout, "ERROR: move journal sized for the whole deque\n");
+		exit(1);
+	}
+	for (item = 0; item < 3 * MMDQ_MOVE_BATCH + 5; item++) {
+		mmdq_abd(srchp, &item);
+	}
+	if (mmdq_move(srchp, MMDQ_TOP, dsthp, MMDQ_BOTTOM, 3 * MMDQ_MOVE_BATCH + 5) || !mmdq_isempty(srchp)) {
+		fprintf(stdout, "ERROR: move of several batches failed\n");
+		exit(1);
+	}
+	for (item = 0; item < 3 * MMDQ_MOVE_BATCH + 5; item++) {
+		if (mmdq_rtd(dsthp, &big) || (big != item)) {
+			fprintf(stdout, "ERROR: batched move item %ld is %ld\n", item, big);
+			exit(1);
+		}
+	}
+	unlink(mmdq_dequepath_from_handle(srchp));
+	unlink(mmdq_dequepath_from_handle(dsthp));
+	mmdq_close(srchp);
+	mmdq_close(dsthp);
+	fprintf(stdout, "TEST-M -- Passed.\n");
+	return 0;
+}
+
+#define TQ_WORDS 8
+#define TQ_WRITERS 2
+#define TQ_WRITES 20000
+/*
+ * Test q: lock free record reads. Writer processes fill a record with
+ * one value per update while the parent reads it with
+ * mmfor_read_record; a read that mixes two updates fails the test. A
+ * writer that dies mid update must be reported by the next read and
+ * cleared by the next write.
+ */
+static int process_switch_testq() {
+	char fpath[512];
+	long rec[TQ_WORDS];
+	MMFOR_HANDLE* mmfhp;
+	long* recp;
+	pid_t pid;
+	int status;
+	long reads = 0;
+	int running;
+	int w;
+	int i;
+	int k;
+
+	if (!cmdarg_fetch_switch(NULL, "q")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-Q -- Lock free record reads.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-Q.DAT", cmdarg_fetch_string(NULL, "d"));
+	mmfhp = mmfor_create_flags(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), 2,
+		MMFOR_FLAG_SEQLOCK);
+	if ((NULL == mmfhp) || (mmfor_read_record(mmfhp, 0, rec) != 0) || !mmfor_read_record(mmfhp, 2, rec)) {
+		fprintf(stdout, "TEST-Q Fails: unable to create and read a sequence locked file\n");
+		exit(1);
+	}
+	for (w = 0; w < TQ_WRITERS; w++) {
+		if (0 == fork()) {
+			for (i = 0; i < TQ_WRITES; i++) {
+				recp = (long*)mmfor_write_begin(mmfhp, 0);
+				for (k = 0; k < TQ_WORDS; k++) {
+					recp[k] = (long)getpid() * TQ_WRITES + i;
+				}
+				mmfor_write_end(mmfhp, 0);
+			}
+			_exit(0);
+		}
+	}
+	for (running = TQ_WRITERS; running > 0; ) {
+		if (mmfor_read_record(mmfhp, 0, rec)) {
+			fprintf(stdout, "ERROR: record read failed\n");
+			exit(1);
+		}
+		for (i = 1; i < TQ_WORDS; i++) {
+			if (rec[i] != rec[0]) {
+				fprintf(stdout, "ERROR: torn read: word %d is %ld, word 0 is %ld\n", i, rec[i], rec[0]);
+				exit(1);
+			}
+		}
+		reads++;
+		if (waitpid(-1, &status, WNOHANG) > 0) {
+			running--;
+		}
+	}
+	fprintf(stdout, "TEST-Q: %ld consistent reads during %d updates\n", reads, TQ_WRITERS * TQ_WRITES);
+
+	// A writer dies in the middle of an update of record 1
+	if (0 == (pid = fork())) {
+		mmfor_write_begin(mmfhp, 1);
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+	if (!mmfor_read_record(mmfhp, 1, rec)) {
+		fprintf(stdout, "ERROR: half written record not reported\n");
+		exit(1);
+	}
+	memset(rec, 0, sizeof(rec));
+	if (mmfor_write_record(mmfhp, 1, rec) || mmfor_read_record(mmfhp, 1, rec)) {
+		fprintf(stdout, "ERROR: half written record not cleared by the next write\n");
+		exit(1);
+	}
+	mmfor_close(mmfhp);
+	unlink(fpath);
+	fprintf(stdout, "TEST-Q -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test e. Growable files. A child maps the file before it grows
+ * and must see every appended record afterwards. Files whose header
+ * is not of this version, or that are shorter than their header says,
+ * must not open.
+ */
+#define TE_INITIAL 4
+#define TE_APPENDS 1000
+static int process_switch_teste() {
+	char fpath[512];
+	long rec[4];
+	MMFOR_HANDLE* mmfhp;
+	long* recp;
+	size_t x;
+	pid_t pid;
+	int pipefd[2];
+	int status;
+	int fd;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "e")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-E -- Growable files.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-E.DAT", cmdarg_fetch_string(NULL, "d"));
+	mmfhp = mmfor_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), TE_INITIAL);
+	if ((NULL == mmfhp) || (mmfor_capacity(mmfhp) < TE_INITIAL) || pipe(pipefd)) {
+		fprintf(stdout, "TEST-E Fails: unable to create file\n");
+		exit(1);
+	}
+	if (0 == (pid = fork())) {
+		// Holds the original mapping until the parent is done growing
+		close(pipefd[1]);
+		if (read(pipefd[0], &i, sizeof(i)) != sizeof(i)) {
+			_exit(2);
+		}
+		if (mmfor_record_count(mmfhp) != TE_INITIAL + TE_APPENDS) {
+			_exit(3);
+		}
+		for (x = TE_INITIAL; x < TE_INITIAL + TE_APPENDS; x++) {
+			recp = (long*)mmfor_x2p(mmfhp, x);
+			if ((recp[0] != (long)x) || (recp[3] != -(long)x)) {
+				_exit(4);
+			}
+		}
+		_exit(0);
+	}
+	close(pipefd[0]);
+	for (i = 0; i < TE_APPENDS; i++) {
+		rec[0] = TE_INITIAL + i;
+		rec[3] = -rec[0];
+		x = mmfor_append(mmfhp, rec);
+		if (x != (size_t)(TE_INITIAL + i)) {
+			fprintf(stdout, "ERROR: append %d returned index %ld\n", i, (long)x);
+			exit(1);
+		}
+	}
+	if ((mmfor_record_count(mmfhp) != TE_INITIAL + TE_APPENDS) ||
+		(mmfor_capacity(mmfhp) < TE_INITIAL + TE_APPENDS) ||
+		(mmfor_capacity(mmfhp) > 2 * (TE_INITIAL + TE_APPENDS))) {
+		fprintf(stdout, "ERROR: count %ld capacity %ld after appends\n",
+			(long)mmfor_record_count(mmfhp), (long)mmfor_capacity(mmfhp));
+		exit(1);
+	}
+	fprintf(stdout, "TEST-E: %d appends grew capacity to %ld in %u remaps\n",
+		TE_APPENDS, (long)mmfor_capacity(mmfhp), mmfhp->generation);
+	if ((write(pipefd[1], &i, sizeof(i)) != sizeof(i)) ||
+		(waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stdout, "ERROR: child with the old mapping failed (status %d)\n", status);
+		exit(1);
+	}
+	close(pipefd[1]);
+
+	// Growing under a whole file lock leaves the header locked
+	if (mmfor_lock_file_write(mmfhp)) {
+		fprintf(stdout, "ERROR: unable to lock file\n");
+		exit(1);
+	}
+	for (i = 0; i < TE_APPENDS; i++) {
+		if (MMFOR_NO_RECORD == mmfor_append(mmfhp, rec)) {
+			fprintf(stdout, "ERROR: locked append %d failed\n", i);
+			exit(1);
+		}
+	}
+	if (0 == (pid = fork())) {
+		struct flock lock;
+
+		lock.l_type = F_WRLCK;
+		lock.l_start = 0;
+		lock.l_whence = SEEK_SET;
+		lock.l_len = 1;
+		if (fcntl(mmfhp->mmahp->mm_ref.filedes, F_GETLK, &lock)) {
+			_exit(2);
+		}
+		_exit((F_UNLCK == lock.l_type) ? 3 : 0);
+	}
+	if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stdout, "ERROR: header unlocked by growth under a file lock (status %d)\n", status);
+		exit(1);
+	}
+	mmfor_unlock_file(mmfhp);
+	mmfor_close(mmfhp);
+
+	// A foreign header and a truncated file are refused
+	i = 0;
+	if (((fd = open(fpath, O_RDWR)) < 0) || (pwrite(fd, &i, sizeof(i), 0) != sizeof(i)) ||
+		(NULL != mmfor_open(fpath, MMA_READ_WRITE, MMF_SHARED)) ||
+		(mma_error != MMA_ERR_FOR_FORMAT)) {
+		fprintf(stdout, "ERROR: file without a header of this version not refused\n");
+		exit(1);
+	}
+	close(fd);
+	unlink(fpath);
+	mmfhp = mmfor_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), 2 * TE_APPENDS);
+	mmfor_close(mmfhp);
+	if (truncate(fpath, sizeof(rec) * TE_APPENDS) ||
+		(NULL != mmfor_open(fpath, MMA_READ_WRITE, MMF_SHARED)) ||
+		(mma_error != MMA_ERR_FOR_FORMAT)) {
+		fprintf(stdout, "ERROR: truncated file not refused\n");
+		exit(1);
+	}
+	unlink(fpath);
+
+	// A linear list grows rather than filling up
+	snprintf(fpath, sizeof(fpath), "%s/TEST-E.LST", cmdarg_fetch_string(NULL, "d"));
+	mmfhp = linlist_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), 2);
+	for (i = 0; (mmfhp != NULL) && (i < 10); i++) {
+		rec[0] = i;
+		if (NULL == linlist_add_record(mmfhp, rec)) {
+			break;
+		}
+	}
+	if ((NULL == mmfhp) || (linlist_length(mmfhp) != 10) || (linlist_capacity(mmfhp) < 10) ||
+		(((long*)mmfor_x2p(mmfhp, 10))[0] != 9)) {
+		fprintf(stdout, "ERROR: linear list did not grow\n");
+		exit(1);
+	}
+	mmfor_close(mmfhp);
+	unlink(fpath);
+	fprintf(stdout, "TEST-E -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test i. Hash index on a linear list. Enough records are added to
+ * grow both the list and its index, then half are deleted, which
+ * relocates fence records, and every key is looked up again.
+ */
+#define TI_RECS 5000
+typedef struct {
+	long value;
+	char key[24];
+	long check;
+} TI_REC;
+
+static int ti_verify(MMFOR_HANDLE* mmfhp, int deleted) {
+	char key[24];
+	TI_REC* recp;
+	int i;
+
+	for (i = 0; i < TI_RECS; i++) {
+		snprintf(key, sizeof(key), "session-%d", i);
+		recp = (TI_REC*)linlist_find(mmfhp, key, strlen(key));
+		if ((i < deleted) && (i % 2)) {
+			if (recp != NULL) {
+				fprintf(stdout, "ERROR: deleted key %s found\n", key);
+				return 1;
+			}
+		} else if ((NULL == recp) || (recp->value != i) || (recp->check != -i)) {
+			fprintf(stdout, "ERROR: key %s not found\n", key);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int process_switch_testi() {
+	char fpath[512];
+	char ipath[sizeof(fpath) + sizeof(LINLIST_INDEX_SUFFIX)];
+	MMFOR_HANDLE* mmfhp;
+	TI_REC rec;
+	pid_t pid;
+	int status;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "i")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-I -- Linear list hash index.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-I.LST", cmdarg_fetch_string(NULL, "d"));
+	snprintf(ipath, sizeof(ipath), "%s%s", fpath, LINLIST_INDEX_SUFFIX);
+	mmfhp = linlist_create_indexed(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), 100,
+		offsetof(TI_REC, key), sizeof(rec.key));
+	if (NULL == mmfhp) {
+		fprintf(stdout, "TEST-I Fails: unable to create indexed list\n");
+		exit(1);
+	}
+	for (i = 0; i < TI_RECS; i++) {
+		memset(&rec, 0, sizeof(rec));
+		rec.value = i;
+		rec.check = -i;
+		snprintf(rec.key, sizeof(rec.key), "session-%d", i);
+		if (NULL == linlist_add_record(mmfhp, &rec)) {
+			fprintf(stdout, "ERROR: add %d failed\n", i);
+			exit(1);
+		}
+	}
+	if (ti_verify(mmfhp, 0) || (linlist_find(mmfhp, "session-x", 9) != NULL)) {
+		exit(1);
+	}
+	// Delete the odd keys. Most deletions move the fence record.
+	for (i = 1; i < TI_RECS; i += 2) {
+		snprintf(rec.key, sizeof(rec.key), "session-%d", i);
+		if (linlist_delete_recordp(mmfhp, linlist_find(mmfhp, rec.key, strlen(rec.key)))) {
+			fprintf(stdout, "ERROR: delete %s failed\n", rec.key);
+			exit(1);
+		}
+	}
+	if ((linlist_length(mmfhp) != TI_RECS / 2) || ti_verify(mmfhp, TI_RECS)) {
+		exit(1);
+	}
+	// Another process opens the list and gets its index
+	if (0 == (pid = fork())) {
+		linlist_close(mmfhp);
+		mmfhp = linlist_open(fpath, MMA_READ_WRITE, MMF_SHARED);
+		_exit((NULL == mmfhp) || ti_verify(mmfhp, TI_RECS));
+	}
+	if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stdout, "ERROR: index not usable from another process\n");
+		exit(1);
+	}
+	linlist_close(mmfhp);
+	unlink(fpath);
+	unlink(ipath);
+	fprintf(stdout, "TEST-I -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test o. Memory mapped B+tree. Small pages give a deep tree. Keys
+ * go in in a scrambled order, come out of range scans in order, and
+ * survive deletes. A bulk loaded tree is scanned by another process
+ * while this one inserts into it.
+ */
+#define TO_KEYS 20000
+#define TO_BULK 200000
+#define TO_PAGE 256
+
+static int to_scan(MMBT_HANDLE* mmbthp, unsigned long from, unsigned long to,
+	unsigned long step, unsigned long* countp) {
+	MMBT_CURSOR cursor;
+	unsigned long key;
+	unsigned long value;
+	unsigned long last = 0;
+	unsigned long count = 0;
+	int rc;
+
+	mmbt_cursor_seek(mmbthp, &cursor, &from);
+	while ((0 == (rc = mmbt_cursor_next(&cursor, &key, &value))) && (key <= to)) {
+		if ((key < from) || (count && (key <= last)) || (step && (key % step)) || (value != ~key)) {
+			fprintf(stdout, "ERROR: scan returned key %lu value %lx after %lu\n", key, value, last);
+			return 1;
+		}
+		last = key;
+		count++;
+	}
+	*countp = count;
+	return (rc < 0);
+}
+
+static int process_switch_testo() {
+	char fpath[512];
+	MMBT_HANDLE* mmbthp;
+	unsigned long* keys;
+	unsigned long* values;
+	unsigned long key;
+	unsigned long value;
+	unsigned long count;
+	unsigned long i;
+	pid_t pid;
+	int status;
+	struct timespec t0, t1;
+
+	if (!cmdarg_fetch_switch(NULL, "o")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-O -- Memory mapped B+tree.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-O.BT", cmdarg_fetch_string(NULL, "d"));
+	unlink(fpath);
+	mmbthp = mmbt_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, MMBT_KEY_ULONG,
+		sizeof(unsigned long), sizeof(unsigned long), TO_PAGE);
+	if (NULL == mmbthp) {
+		fprintf(stdout, "TEST-O Fails: unable to create tree\n");
+		exit(1);
+	}
+	// Keys 3, 6, 9 ... in a scrambled order (7919 is prime to TO_KEYS)
+	for (i = 0; i < TO_KEYS; i++) {
+		key = 3 * (1 + (i * 7919) % TO_KEYS);
+		value = ~key;
+		if (mmbt_insert(mmbthp, &key, &value) != 0) {
+			fprintf(stdout, "ERROR: insert of %lu failed\n", key);
+			exit(1);
+		}
+	}
+	key = 3;
+	value = ~key;
+	if ((mmbt_insert(mmbthp, &key, &value) != 1) || (mmbt_count(mmbthp) != TO_KEYS)) {
+		fprintf(stdout, "ERROR: replace or count wrong\n");
+		exit(1);
+	}
+	for (key = 1; key <= 3 * TO_KEYS + 1; key++) {
+		if (mmbt_find(mmbthp, &key, &value) != ((key % 3) ? 1 : 0) || (!(key % 3) && (value != ~key))) {
+			fprintf(stdout, "ERROR: find of %lu wrong\n", key);
+			exit(1);
+		}
+	}
+	if (to_scan(mmbthp, 3000, 6000, 3, &count) || (count != 1001)) {
+		fprintf(stdout, "ERROR: range 3000 to 6000 returned %lu keys\n", count);
+		exit(1);
+	}
+	// Delete the odd multiples of 3 below 30000
+	for (key = 3; key < 30000; key += 6) {
+		if (mmbt_delete(mmbthp, &key) != 0) {
+			fprintf(stdout, "ERROR: delete of %lu failed\n", key);
+			exit(1);
+		}
+	}
+	key = 3;
+	if ((mmbt_delete(mmbthp, &key) != 1) || to_scan(mmbthp, 0, 30000, 6, &count) || (count != 5000)) {
+		fprintf(stdout, "ERROR: scan after deletes returned %lu keys\n", count);
+		exit(1);
+	}
+	fprintf(stdout, "TEST-O: %d inserts, height %u\n", TO_KEYS, mmbt_height(mmbthp));
+	mmbt_close(mmbthp);
+	unlink(fpath);
+
+	// Bulk load
+	keys = malloc(TO_BULK * sizeof(unsigned long));
+	values = malloc(TO_BULK * sizeof(unsigned long));
+	for (i = 0; i < TO_BULK; i++) {
+		keys[i] = 2 * (i + 1);
+		values[i] = ~keys[i];
+	}
+	mmbthp = mmbt_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, MMBT_KEY_ULONG,
+		sizeof(unsigned long), sizeof(unsigned long), 4096);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((NULL == mmbthp) || mmbt_bulk_load(mmbthp, keys, values, TO_BULK) ||
+		!mmbt_bulk_load(mmbthp, keys, values, TO_BULK)) {
+		fprintf(stdout, "ERROR: bulk load failed\n");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (to_scan(mmbthp, 0, ~0UL, 2, &count) || (count != TO_BULK)) {
+		fprintf(stdout, "ERROR: scan of bulk loaded tree returned %lu keys\n", count);
+		exit(1);
+	}
+	fprintf(stdout, "TEST-O: bulk load of %d keys, height %u, %.1f ms\n", TO_BULK,
+		mmbt_height(mmbthp), (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+	// A reader in another process scans while odd keys are inserted
+	if (0 == (pid = fork())) {
+		mmbt_close(mmbthp);
+		mmbthp = mmbt_open(fpath, MMA_READ_WRITE, MMF_SHARED);
+		for (i = 0; (mmbthp != NULL) && (i < 20); i++) {
+			if (to_scan(mmbthp, 0, ~0UL, 0, &count) || (count < TO_BULK)) {
+				_exit(1);
+			}
+		}
+		_exit(NULL == mmbthp);
+	}
+	for (key = 1; key < 2 * TO_BULK; key += 20) {
+		value = ~key;
+		mmbt_insert(mmbthp, &key, &value);
+	}
+	if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stdout, "ERROR: scan during inserts failed\n");
+		exit(1);
+	}
+	if (to_scan(mmbthp, 0, ~0UL, 0, &count) || (count != TO_BULK + TO_BULK / 10)) {
+		fprintf(stdout, "ERROR: final scan returned %lu keys\n", count);
+		exit(1);
+	}
+	mmbt_close(mmbthp);
+	unlink(fpath);
+	free(keys);
+	free(values);
+	fprintf(stdout, "TEST-O -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test j. Lock free appends to a linear list. Producer processes add
+ * records singly and in batches while this process reads them back
+ * and deletes some (moving fence records). Every record must be whole
+ * and appear once. Then lock free and locked appends are timed.
+ */
+#define TJ_PRODUCERS 4
+#define TJ_RECS 100000
+#define TJ_BATCH 16
+#define TJ_DELETES 1000
+typedef struct {
+	long producer;
+	long seq;
+	long check[6];
+} TJ_REC;
+
+static void tj_fill(TJ_REC* recp, long producer, long seq) {
+	int k;
+
+	recp->producer = producer;
+	recp->seq = seq;
+	for (k = 0; k < 6; k++) {
+		recp->check[k] = producer * TJ_RECS + seq;
+	}
+}
+
+static int tj_whole(TJ_REC* recp) {
+	int k;
+
+	for (k = 0; k < 6; k++) {
+		if (recp->check[k] != recp->producer * TJ_RECS + recp->seq) {
+			return 0;
+		}
+	}
+	return (recp->producer >= 0) && (recp->producer < TJ_PRODUCERS) &&
+		(recp->seq >= 0) && (recp->seq < TJ_RECS);
+}
+
+static double tj_produce(char* fpath, unsigned int list_flags, int deletes) {
+	TJ_REC batch[TJ_BATCH];
+	TJ_REC rec;
+	MMFOR_HANDLE* mmfhp;
+	char* seen;
+	struct timespec t0, t1;
+	long reads = 0;
+	int deleted = 0;
+	int running;
+	int status;
+	int n;
+	int p;
+	int i;
+	int k;
+	size_t x;
+
+	mmfhp = linlist_create_flags(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(TJ_REC), 1000, list_flags);
+	if (NULL == mmfhp) {
+		fprintf(stdout, "TEST-J Fails: unable to create list\n");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (p = 0; p < TJ_PRODUCERS; p++) {
+		if (0 == fork()) {
+			// Alternate single adds and batches
+			for (i = 0; i < TJ_RECS; i += n) {
+				n = ((i / TJ_BATCH) % 2) ? 1 : TJ_BATCH;
+				n = (TJ_RECS - i < n) ? TJ_RECS - i : n;
+				for (k = 0; k < n; k++) {
+					tj_fill(&batch[k], p, i + k);
+				}
+				if (linlist_add_records(mmfhp, batch, n) < 0) {
+					_exit(1);
+				}
+			}
+			_exit(0);
+		}
+	}
+	for (running = TJ_PRODUCERS; running > 0; ) {
+		n = linlist_length(mmfhp);
+		if (n > 0) {
+			x = (reads * 7919) % n;
+			if ((0 == linlist_read_record(mmfhp, x, &rec)) && !tj_whole(&rec)) {
+				fprintf(stdout, "ERROR: torn record at %ld\n", (long)x);
+				exit(1);
+			}
+			reads++;
+			if ((deleted < deletes) && (0 == linlist_read_record(mmfhp, 0, &rec)) &&
+				(0 == linlist_delete_recordx(mmfhp, 0))) {
+				deleted++;
+			}
+		}
+		if (waitpid(-1, &status, WNOHANG) > 0) {
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+				fprintf(stdout, "ERROR: producer failed\n");
+				exit(1);
+			}
+			running--;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	// Every record whole, published and seen once
+	seen = calloc(TJ_PRODUCERS * TJ_RECS, 1);
+	n = linlist_length(mmfhp);
+	if (n != TJ_PRODUCERS * TJ_RECS - deleted) {
+		fprintf(stdout, "ERROR: list length %d, expected %d\n", n, TJ_PRODUCERS * TJ_RECS - deleted);
+		exit(1);
+	}
+	for (x = 0; x < (size_t)n; x++) {
+		if (linlist_read_record(mmfhp, x, &rec) || !tj_whole(&rec) ||
+			seen[rec.producer * TJ_RECS + rec.seq]++) {
+			fprintf(stdout, "ERROR: record %ld missing, torn or repeated\n", (long)x);
+			exit(1);
+		}
+	}
+	free(seen);
+	linlist_close(mmfhp);
+	unlink(fpath);
+	if (deletes) {
+		fprintf(stdout, "TEST-J: %ld checked reads and %d deletes during appends\n", reads, deleted);
+	}
+	return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+static int process_switch_testj() {
+	char fpath[512];
+	double lockfree_secs;
+	double locked_secs;
+
+	if (!cmdarg_fetch_switch(NULL, "j")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-J -- Lock free linear list appends.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-J.LST", cmdarg_fetch_string(NULL, "d"));
+	tj_produce(fpath, LINLIST_FLAG_LOCKFREE, TJ_DELETES);
+	lockfree_secs = tj_produce(fpath, LINLIST_FLAG_LOCKFREE, 0);
+	locked_secs = tj_produce(fpath, 0, 0);
+	fprintf(stdout, "TEST-J: %d producers, %d records: lock free %.0f/s, locked %.0f/s\n",
+		TJ_PRODUCERS, TJ_PRODUCERS * TJ_RECS,
+		TJ_PRODUCERS * TJ_RECS / lockfree_secs, TJ_PRODUCERS * TJ_RECS / locked_secs);
+	fprintf(stdout, "TEST-J -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test u. Stable indices in a linear list. Deleted records leave
+ * tombstones that later additions reuse, no surviving record moves
+ * until a compaction, and the compaction reports every move.
+ */
+#define TU_RECS 100
+#define TU_ADDS 10
+typedef struct {
+	long id;
+	long pad[2];
+} TU_REC;
+
+static void tu_relocate(void* arg, size_t from, size_t to) {
+	long* where = arg;
+	int i;
+
+	for (i = 0; i < TU_RECS + TU_ADDS; i++) {
+		if (where[i] == (long)from) {
+			where[i] = to;
+		}
+	}
+}
+
+static int process_switch_testu() {
+	char fpath[512];
+	long where[TU_RECS + TU_ADDS];		// index of each id, -1 once deleted
+	MMFOR_HANDLE* mmfhp;
+	TU_REC rec;
+	TU_REC* recp;
+	size_t x;
+	long n;
+	long moves;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "u")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-U -- Linear list stable indices.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-U.LST", cmdarg_fetch_string(NULL, "d"));
+	mmfhp = linlist_create_flags(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), 8,
+		LINLIST_FLAG_STABLE);
+	if ((NULL == mmfhp) ||
+		(linlist_create_flags(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), 8,
+			LINLIST_FLAG_STABLE | LINLIST_FLAG_LOCKFREE) != NULL)) {
+		fprintf(stdout, "TEST-U Fails: unable to create list\n");
+		exit(1);
+	}
+	memset(&rec, 0, sizeof(rec));
+	for (i = 0; i < TU_RECS; i++) {
+		rec.id = i;
+		where[i] = linlist_add_records(mmfhp, &rec, 1);
+	}
+	// Delete every third id. No other record may move.
+	for (i = 0; i < TU_RECS; i += 3) {
+		if (linlist_delete_recordx(mmfhp, where[i])) {
+			fprintf(stdout, "ERROR: delete of id %d failed\n", i);
+			exit(1);
+		}
+	}
+	if (!linlist_delete_recordx(mmfhp, where[0]) || (linlist_length(mmfhp) != TU_RECS - 34)) {
+		fprintf(stdout, "ERROR: second delete allowed or length %ld wrong\n", (long)linlist_length(mmfhp));
+		exit(1);
+	}
+	for (i = 0; i < TU_RECS; i++) {
+		recp = (TU_REC*)linlist_x2p(mmfhp, where[i]);
+		if ((i % 3) && (recp->id != i)) {
+			fprintf(stdout, "ERROR: id %d moved from index %ld\n", i, where[i]);
+			exit(1);
+		}
+		if (!(i % 3)) {
+			where[i] = -1;
+		}
+	}
+	// New records fill the holes
+	for (i = TU_RECS; i < TU_RECS + TU_ADDS; i++) {
+		rec.id = i;
+		where[i] = linlist_add_records(mmfhp, &rec, 1);
+		if ((where[i] < 0) || (where[i] >= TU_RECS) || (where[i] % 3)) {
+			fprintf(stdout, "ERROR: id %d added at index %ld, not in a hole\n", i, where[i]);
+			exit(1);
+		}
+	}
+	// The iterator sees each live record once
+	for (x = 0, n = 0; (recp = linlist_next(mmfhp, &x)) != NULL; x++, n++) {
+		if (where[recp->id] != (long)x) {
+			fprintf(stdout, "ERROR: iterator found id %ld at %ld\n", recp->id, (long)x);
+			exit(1);
+		}
+	}
+	if (n != TU_RECS - 34 + TU_ADDS) {
+		fprintf(stdout, "ERROR: iterator found %ld records\n", n);
+		exit(1);
+	}
+	moves = linlist_compact(mmfhp, tu_relocate, where);
+	for (i = 0; i < TU_RECS + TU_ADDS; i++) {
+		if ((where[i] >= n) ||
+			((where[i] >= 0) && (linlist_read_record(mmfhp, where[i], &rec) || (rec.id != i)))) {
+			fprintf(stdout, "ERROR: id %d not at reported index %ld after compaction\n", i, where[i]);
+			exit(1);
+		}
+	}
+	rec.id = 0;
+	if ((linlist_add_records(mmfhp, &rec, 1) != n) || (linlist_length(mmfhp) != (size_t)n + 1)) {
+		fprintf(stdout, "ERROR: add after compaction did not append\n");
+		exit(1);
+	}
+	fprintf(stdout, "TEST-U: %ld live records, compaction moved %ld\n", n, moves);
+	linlist_close(mmfhp);
+	unlink(fpath);
+	fprintf(stdout, "TEST-U -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test v. Parallel scans. Every record is visited exactly once by a
+ * scan, including records straddling chunk boundaries, a reduce
+ * matches the sequential sum, and a callback can stop a scan.
+ */
+#define TV_RECS 200000
+#define TV_THREADS 4
+#define TV_STOP 7
+typedef struct {
+	unsigned long id;
+	unsigned long sq;
+	unsigned long pad;
+} TV_REC;
+
+typedef struct {
+	unsigned long count;
+	unsigned long sum;
+} TV_ACC;
+
+static int tv_visit(void* ctx, size_t x, void* rec) {
+	unsigned char* visits = ctx;
+
+	if (((TV_REC*)rec)->id != x) {
+		return 1;
+	}
+	__atomic_fetch_add(&visits[x], 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int tv_stop(void* ctx, size_t x, void* rec) {
+	(void)ctx;
+	(void)rec;
+	return (x == TV_RECS / 2) ? TV_STOP : 0;
+}
+
+static int tv_map(void* ctx, size_t x, void* rec, void* acc) {
+	(void)ctx;
+	(void)x;
+	((TV_ACC*)acc)->count++;
+	((TV_ACC*)acc)->sum += ((TV_REC*)rec)->sq;
+	return 0;
+}
+
+static void tv_reduce(void* ctx, void* result, void* acc) {
+	(void)ctx;
+	((TV_ACC*)result)->count += ((TV_ACC*)acc)->count;
+	((TV_ACC*)result)->sum += ((TV_ACC*)acc)->sum;
+}
+
+static int process_switch_testv() {
+	char fpath[512];
+	unsigned char* visits;
+	MMFOR_HANDLE* mmfhp;
+	TV_REC rec;
+	TV_ACC acc;
+	unsigned long sum;
+	unsigned int flags;
+	size_t x;
+	int rc;
+
+	if (!cmdarg_fetch_switch(NULL, "v")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-V -- Parallel record scans.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-V.FOR", cmdarg_fetch_string(NULL, "d"));
+	visits = (unsigned char*)calloc(TV_RECS, 1);
+	for (flags = 0; flags <= MMFOR_FLAG_SEQLOCK; flags += MMFOR_FLAG_SEQLOCK) {
+		mmfhp = mmfor_create_flags(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), TV_RECS, flags);
+		if (NULL == mmfhp) {
+			fprintf(stdout, "ERROR: unable to create %s\n", fpath);
+			exit(1);
+		}
+		memset(&rec, 0, sizeof(rec));
+		for (x = 0, sum = 0; x < TV_RECS; x++) {
+			rec.id = x;
+			rec.sq = x * x;
+			sum += rec.sq;
+			mmfor_write_record(mmfhp, x, &rec);
+		}
+		mmfor_advise(mmfhp, MADV_SEQUENTIAL);
+		memset(visits, 0, TV_RECS);
+		rc = mmfor_parallel_scan(mmfhp, TV_THREADS, tv_visit, visits);
+		for (x = 0; (0 == rc) && (x < TV_RECS); x++) {
+			if (visits[x] != 1) {
+				rc = 1;
+			}
+		}
+		if (rc) {
+			fprintf(stdout, "ERROR: record %ld visited %d times (flags %u)\n",
+				(long)x - 1, visits[x - 1], flags);
+			exit(1);
+		}
+		memset(&acc, 0, sizeof(acc));
+		if (mmfor_parallel_reduce(mmfhp, TV_THREADS, tv_map, tv_reduce, NULL, &acc, sizeof(acc)) ||
+			(acc.count != TV_RECS) || (acc.sum != sum)) {
+			fprintf(stdout, "ERROR: reduce found %lu records summing to %lu, expected %lu\n",
+				acc.count, acc.sum, sum);
+			exit(1);
+		}
+		if (mmfor_parallel_scan(mmfhp, 0, tv_stop, NULL) != TV_STOP) {
+			fprintf(stdout, "ERROR: scan was not stopped\n");
+			exit(1);
+		}
+		mmfor_close(mmfhp);
+		unlink(fpath);
+	}
+	free(visits);
+	fprintf(stdout, "TEST-V -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test w. Columnar files. Rows read back field for field after a
+ * reopen, columns are contiguous arrays of one field, and sums and
+ * filters over a column agree with a row by row pass.
+ */
+#define TW_ROWS 10000
+#define TW_FIELDS 4
+typedef struct {
+	long id;
+	double price;
+	int qty;
+	char tag[12];
+	char unused[32];		// not stored
+} TW_ROW;
+
+static int process_switch_testw() {
+	char fpath[512];
+	char cpath[sizeof(fpath) + sizeof(MMCOL_COLUMN_SUFFIX) + 12];
+	MMCOL_FIELD fields[TW_FIELDS] = {
+		{ offsetof(TW_ROW, id), sizeof(long), MMCOL_LONG, 0 },
+		{ offsetof(TW_ROW, price), sizeof(double), MMCOL_DOUBLE, 0 },
+		{ offsetof(TW_ROW, qty), sizeof(int), MMCOL_INT, 0 },
+		{ offsetof(TW_ROW, tag), 12, MMCOL_BYTES, 0 }
+	};
+	unsigned char* match;
+	MMCOL_HANDLE* mmcolhp;
+	TW_ROW row;
+	double* prices;
+	double price_sum = 0.0;
+	double dsum;
+	long id_sum = 0;
+	long lsum;
+	long matches = 0;
+	size_t nrows;
+	size_t x;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "w")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-W -- Columnar files.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-W.COL", cmdarg_fetch_string(NULL, "d"));
+	fields[1].size = 4;
+	if (mmcol_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, fields, TW_FIELDS, 16) != NULL) {
+		fprintf(stdout, "ERROR: field of the wrong size accepted\n");
+		exit(1);
+	}
+	fields[1].size = sizeof(double);
+
+	// A column that cannot be made takes the files made before it along
+	snprintf(cpath, sizeof(cpath), "%s%s%d", fpath, MMCOL_COLUMN_SUFFIX, 2);
+	if (mkdir(cpath, 0770) ||
+		(mmcol_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, fields, TW_FIELDS, 16) != NULL) ||
+		rmdir(cpath) || (0 == access(fpath, F_OK))) {
+		fprintf(stdout, "ERROR: failed create not refused or schema left behind\n");
+		exit(1);
+	}
+	for (i = 0; i < 2; i++) {
+		snprintf(cpath, sizeof(cpath), "%s%s%d", fpath, MMCOL_COLUMN_SUFFIX, i);
+		if (0 == access(cpath, F_OK)) {
+			fprintf(stdout, "ERROR: column %d left behind by a failed create\n", i);
+			exit(1);
+		}
+	}
+	mmcolhp = mmcol_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, fields, TW_FIELDS, 16);
+	if (NULL == mmcolhp) {
+		fprintf(stdout, "ERROR: unable to create %s\n", fpath);
+		exit(1);
+	}
+	memset(&row, 0, sizeof(row));
+	for (i = 0; i < TW_ROWS; i++) {
+		row.id = i;
+		row.price = i * 0.25;
+		row.qty = i % 100;
+		snprintf(row.tag, sizeof(row.tag), "row%d", i);
+		if (mmcol_append(mmcolhp, &row) != (size_t)i) {
+			fprintf(stdout, "ERROR: append of row %d failed\n", i);
+			exit(1);
+		}
+		id_sum += row.id;
+		price_sum += row.price;
+		matches += (row.qty >= 10) && (row.qty <= 19);
+	}
+	mmcol_close(mmcolhp);
+	mmcolhp = mmcol_open(fpath, MMA_READ_WRITE, MMF_SHARED);
+	if ((NULL == mmcolhp) || (mmcol_row_count(mmcolhp) != TW_ROWS)) {
+		fprintf(stdout, "ERROR: reopen failed\n");
+		exit(1);
+	}
+	for (i = 0; i < TW_ROWS; i += 97) {
+		memset(&row, 0x5a, sizeof(row));
+		if (mmcol_read_row(mmcolhp, i, &row) || (row.id != i) || (row.price != i * 0.25) ||
+			(row.qty != i % 100) || (atoi(row.tag + 3) != i) || (row.unused[0] != 0x5a) ||
+			(*(int*)mmcol_x2p(mmcolhp, 2, i) != i % 100)) {
+			fprintf(stdout, "ERROR: row %d read back wrong\n", i);
+			exit(1);
+		}
+	}
+	prices = (double*)mmcol_column(mmcolhp, 1, &nrows);
+	for (x = 0, dsum = 0.0; x < nrows; x++) {
+		dsum += prices[x];
+	}
+	if ((nrows != TW_ROWS) || (dsum != price_sum)) {
+		fprintf(stdout, "ERROR: price column sums to %f, expected %f\n", dsum, price_sum);
+		exit(1);
+	}
+	if (mmcol_sum_long(mmcolhp, 0, &lsum) || (lsum != id_sum) ||
+		mmcol_sum_double(mmcolhp, 1, &dsum) || (dsum != price_sum) ||
+		!mmcol_sum_long(mmcolhp, 1, &lsum) || !mmcol_sum_double(mmcolhp, 3, &dsum)) {
+		fprintf(stdout, "ERROR: column sums wrong\n");
+		exit(1);
+	}
+	match = (unsigned char*)calloc(TW_ROWS, 1);
+	if ((mmcol_filter(mmcolhp, 2, 10, 19, match) != matches) || !match[110] || match[120]) {
+		fprintf(stdout, "ERROR: filter wrong\n");
+		exit(1);
+	}
+	row.id = -1;
+	if (mmcol_write_row(mmcolhp, 5, &row) || mmcol_read_row(mmcolhp, 5, &row) || (row.id != -1) ||
+		!mmcol_write_row(mmcolhp, TW_ROWS, &row)) {
+		fprintf(stdout, "ERROR: row rewrite wrong\n");
+		exit(1);
+	}
+	fprintf(stdout, "TEST-W: %d rows, %ld matched the filter\n", TW_ROWS, matches);
+	free(match);
+	mmcol_close(mmcolhp);
+	unlink(fpath);
+	for (i = 0; i < TW_FIELDS; i++) {
+		snprintf(fpath, sizeof(fpath), "%s/TEST-W.COL%s%d", cmdarg_fetch_string(NULL, "d"),
+			MMCOL_COLUMN_SUFFIX, i);
+		unlink(fpath);
+	}
+	fprintf(stdout, "TEST-W -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test x. Snapshots. A child process rewrites every record round after
+ * round while snapshots are taken. Each snapshot must hold whole
+ * records from one moment: the records the writer has reached in
+ * the current round, then the rest from the round before. Snapshots
+ * must not change afterwards, and a named one is kept. Files with
+ * sequence words are copied mostly without the lock, others under it.
+ */
+#define TX_RECS 20000
+#define TX_WORDS 4
+#define TX_SNAPS 5
+
+static int tx_check(MMFOR_HANDLE* snaphp, unsigned long* firstp) {
+	unsigned long rec[TX_WORDS];
+	unsigned long prev = 0;
+	size_t x;
+	int w;
+
+	if (mmfor_record_count(snaphp) != TX_RECS) {
+		return 1;
+	}
+	for (x = 0; x < TX_RECS; x++) {
+		if (mmfor_read_record(snaphp, x, rec)) {
+			return 1;
+		}
+		for (w = 1; w < TX_WORDS; w++) {
+			if (rec[w] != rec[0]) {
+				return 1;
+			}
+		}
+		if ((x > 0) && ((rec[0] > prev) || (rec[0] + 1 < *firstp))) {
+			return 1;
+		}
+		if (0 == x) {
+			*firstp = rec[0];
+		}
+		prev = rec[0];
+	}
+	return 0;
+}
+
+static int process_switch_testx() {
+	static unsigned int for_flags[] = {MMFOR_FLAG_SEQLOCK, 0};
+	char fpath[512];
+	char spath[512];
+	unsigned long rec[TX_WORDS];
+	unsigned long first;
+	unsigned long again;
+	MMFOR_HANDLE* mmfhp;
+	MMFOR_HANDLE* snaphp;
+	size_t x;
+	pid_t pid;
+	int status;
+	int m;
+	int i;
+	int w;
+
+	if (!cmdarg_fetch_switch(NULL, "x")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-X -- Snapshots.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-X.FOR", cmdarg_fetch_string(NULL, "d"));
+	snprintf(spath, sizeof(spath), "%s/TEST-X.SNAP", cmdarg_fetch_string(NULL, "d"));
+	for (m = 0; m < 2; m++) {
+		mmfhp = mmfor_create_flags(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(rec), TX_RECS,
+			for_flags[m]);
+		if (NULL == mmfhp) {
+			fprintf(stdout, "ERROR: unable to create %s\n", fpath);
+			exit(1);
+		}
+		pid = fork();
+		if (0 == pid) {
+			// Rewrite every record with the round number, until killed
+			mmfhp = mmfor_open(fpath, MMA_READ_WRITE, MMF_SHARED);
+			for (rec[0] = 1; ; rec[0]++) {
+				for (w = 1; w < TX_WORDS; w++) {
+					rec[w] = rec[0];
+				}
+				for (x = 0; x < TX_RECS; x++) {
+					mmfor_write_record(mmfhp, x, rec);
+				}
+			}
+		}
+		for (i = 0; i < TX_SNAPS; i++) {
+			usleep(20000);
+			snaphp = mmfor_snapshot(mmfhp, (i & 1) ? spath : NULL);
+			if ((NULL == snaphp) || tx_check(snaphp, &first)) {
+				fprintf(stdout, "ERROR: snapshot %d is not a consistent copy\n", i);
+				kill(pid, SIGKILL);
+				exit(1);
+			}
+			usleep(20000);
+			if (tx_check(snaphp, &again) || (again != first)) {
+				fprintf(stdout, "ERROR: snapshot %d changed\n", i);
+				kill(pid, SIGKILL);
+				exit(1);
+			}
+			fprintf(stdout, "TEST-X: %s snapshot %d taken in round %lu\n",
+				for_flags[m] ? "seqlock" : "plain", i, first);
+			mmfor_close(snaphp);
+		}
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+		snaphp = mmfor_open(spath, MMA_READ, MMF_SHARED);
+		if ((NULL == snaphp) || (mmfor_record_count(snaphp) != TX_RECS)) {
+			fprintf(stdout, "ERROR: named snapshot was not kept\n");
+			exit(1);
+		}
+		mmfor_close(snaphp);
+		unlink(spath);
+		mmfor_close(mmfhp);
+		unlink(fpath);
+	}
+	fprintf(stdout, "TEST-X -- Passed.\n");
+	return 0;
+}
+
+/**
+ * Test y: bulk export and import. A seqlock file of records is exported
+ * to a dump file and through a pipe, imported under new paths and
+ * compared; the import must take appends and a truncated dump must be
+ * refused. A deque whose items wrap around its buffer is exported and
+ * imported under a new name and must pop the same items in the same
+ * order. TEST-Y.FOR is kept for the mmfortool lines of test-memmapio.sh.
+ */
+#define TY_RECS 3000
+#define TY_ITEMS 6
+
+static int ty_compare(MMFOR_HANDLE* mmfhp, MMFOR_HANDLE* copyhp) {
+	TESTA_REC rec;
+	TESTA_REC copy;
+	size_t x;
+
+	if ((mmfor_record_count(copyhp) != mmfor_record_count(mmfhp)) ||
+		(mmfor_record_size(copyhp) != mmfor_record_size(mmfhp)) ||
+		(copyhp->flags != mmfhp->flags)) {
+		return 1;
+	}
+	for (x = 0; x < mmfor_record_count(mmfhp); x++) {
+		if (mmfor_read_record(mmfhp, x, &rec) || mmfor_read_record(copyhp, x, &copy) ||
+			memcmp(&rec, &copy, sizeof(rec))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int process_switch_testy() {
+	char fpath[512];
+	char cpath[512];
+	char dpath[512];
+	char name[MAX_DEQUE_NAME_LEN];
+	char text[16];
+	TESTA_REC rec;
+	MMFOR_HANDLE* mmfhp;
+	MMFOR_HANDLE* copyhp;
+	MMA_HANDLE* dqhp;
+	MMA_HANDLE* dqcopyhp;
+	DQSTATS stats;
+	struct stat sb;
+	long item;
+	long copy;
+	size_t x;
+	pid_t pid;
+	int pipefd[2];
+	int status;
+	int fd;
+
+	if (!cmdarg_fetch_switch(NULL, "y")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-Y -- Bulk export and import.\n");
+	snprintf(fpath, sizeof(fpath), "%s/TEST-Y.FOR", cmdarg_fetch_string(NULL, "d"));
+	snprintf(cpath, sizeof(cpath), "%s/TEST-Y-COPY.FOR", cmdarg_fetch_string(NULL, "d"));
+	snprintf(dpath, sizeof(dpath), "%s/TEST-Y.DUMP", cmdarg_fetch_string(NULL, "d"));
+	mmfhp = mmfor_create_flags(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, sizeof(TESTA_REC), 0,
+		MMFOR_FLAG_SEQLOCK);
+	if (NULL == mmfhp) {
+		fprintf(stdout, "ERROR: unable to create %s\n", fpath);
+		exit(1);
+	}
+	for (x = 0; x < TY_RECS; x++) {
+		snprintf(text, sizeof(text), "Y%07lu", (unsigned long)x);
+		if (mmfor_append(mmfhp, write_testa_rec(&rec, text, (unsigned short)x)) != x) {
+			fprintf(stdout, "ERROR: append of record %lu failed\n", (unsigned long)x);
+			exit(1);
+		}
+	}
+
+	// Through a dump file
+	fd = open(dpath, O_RDWR | O_CREAT | O_TRUNC, 0660);
+	if ((fd < 0) || mmfor_export(mmfhp, fd)) {
+		fprintf(stdout, "ERROR: export to %s failed\n", dpath);
+		exit(1);
+	}
+	lseek(fd, 0, SEEK_SET);
+	copyhp = mmfor_import(cpath, MMA_READ_WRITE, MMF_SHARED, 0660, fd);
+	if ((NULL == copyhp) || ty_compare(mmfhp, copyhp)) {
+		fprintf(stdout, "ERROR: import from a dump file is not a copy\n");
+		exit(1);
+	}
+	write_testa_rec(&rec, "YAFTER", TY_RECS);
+	if ((mmfor_append(copyhp, &rec) != TY_RECS) || (mmfor_record_count(mmfhp) != TY_RECS)) {
+		fprintf(stdout, "ERROR: append to an imported file failed\n");
+		exit(1);
+	}
+	mmfor_close(copyhp);
+	unlink(cpath);
+	fprintf(stdout, "TEST-Y: %d records imported from a dump file\n", TY_RECS);
+
+	// A truncated dump is refused
+	fstat(fd, &sb);
+	if (ftruncate(fd, sb.st_size / 2)) {
+		fprintf(stdout, "ERROR: unable to truncate %s\n", dpath);
+		exit(1);
+	}
+	lseek(fd, 0, SEEK_SET);
+	if (NULL != mmfor_import(cpath, MMA_READ_WRITE, MMF_SHARED, 0660, fd)) {
+		fprintf(stdout, "ERROR: import of a truncated dump not refused\n");
+		exit(1);
+	}
+	close(fd);
+	unlink(cpath);
+	unlink(dpath);
+
+	// Through a pipe
+	if (pipe(pipefd)) {
+		fprintf(stdout, "ERROR: unable to create a pipe\n");
+		exit(1);
+	}
+	fflush(stdout);
+	pid = fork();
+	if (0 == pid) {
+		close(pipefd[0]);
+		_exit(mmfor_export(mmfhp, pipefd[1]) ? 1 : 0);
+	}
+	close(pipefd[1]);
+	copyhp = mmfor_import(cpath, MMA_READ_WRITE, MMF_SHARED, 0660, pipefd[0]);
+	close(pipefd[0]);
+	waitpid(pid, &status, 0);
+	if ((NULL == copyhp) || !WIFEXITED(status) || WEXITSTATUS(status) ||
+		ty_compare(mmfhp, copyhp)) {
+		fprintf(stdout, "ERROR: import through a pipe is not a copy\n");
+		exit(1);
+	}
+	mmfor_close(copyhp);
+	unlink(cpath);
+	mmfor_close(mmfhp);
+	fprintf(stdout, "TEST-Y: %d records imported through a pipe\n", TY_RECS);
+
+	// A deque whose items wrap around the end of its buffer
+	appenv_set_env_var(MMDQ_DIR_PATH, cmdarg_fetch_string(NULL, "d"));
+	snprintf(name, sizeof(name), "%s-y", cmdarg_fetch_string(NULL, "p"));
+	dqhp = mmdq_create(name, sizeof(long), TY_ITEMS);
+	if (NULL == dqhp) {
+		fprintf(stdout, "ERROR: unable to create deque %s\n", name);
+		exit(1);
+	}
+	for (item = 1; item <= TY_ITEMS; item++) {
+		mmdq_abd(dqhp, &item);
+	}
+	for (item = 1; item <= TY_ITEMS / 2; item++) {
+		mmdq_rtd(dqhp, &copy);
+	}
+	for (item = TY_ITEMS + 1; item <= TY_ITEMS + TY_ITEMS / 2; item++) {
+		mmdq_abd(dqhp, &item);
+	}
+	// Export from an open, as dequetool does: the mapping is whole pages
+	mmdq_close(dqhp);
+	dqhp = mmdq_open(name);
+	fd = open(dpath, O_RDWR | O_CREAT | O_TRUNC, 0660);
+	if ((fd < 0) || mmdq_export(dqhp, fd)) {
+		fprintf(stdout, "ERROR: deque export failed\n");
+		exit(1);
+	}
+	lseek(fd, 0, SEEK_SET);
+	snprintf(name, sizeof(name), "%s-y-copy", cmdarg_fetch_string(NULL, "p"));
+	dqcopyhp = mmdq_import(name, fd);
+	close(fd);
+	unlink(dpath);
+	if ((NULL == dqcopyhp) || (mmdq_stats(dqcopyhp, &stats)->dquse != TY_ITEMS) ||
+		(stats.dqslots != TY_ITEMS) || (stats.dqitem_size != sizeof(long))) {
+		fprintf(stdout, "ERROR: imported deque does not match\n");
+		exit(1);
+	}
+	for (x = 0; x < TY_ITEMS; x++) {
+		if (mmdq_rtd(dqhp, &item) || mmdq_rtd(dqcopyhp, &copy) || (item != copy) ||
+			(item != (long)(TY_ITEMS / 2 + 1 + x))) {
+			fprintf(stdout, "ERROR: imported deque pops %ld, expected %ld\n", copy,
+				(long)(TY_ITEMS / 2 + 1 + x));
+			exit(1);
+		}
+	}
+	if (!mmdq_isempty(dqcopyhp)) {
+		fprintf(stdout, "ERROR: imported deque holds extra items\n");
+		exit(1);
+	}
+	mmdq_close(dqcopyhp);
+	mmdq_close(dqhp);
+	fprintf(stdout, "TEST-Y: deque of %d items imported\n", TY_ITEMS);
+	fprintf(stdout, "TEST-Y -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Absolute CLOCK_REALTIME deadline msecs from now, for the message
+ * deque tests.
+ */
+static struct timespec* deadline_ms(struct timespec* tsp, long msecs) {
+	clock_gettime(CLOCK_REALTIME, tsp);
+	tsp->tv_sec += msecs / 1000;
+	tsp->tv_nsec += (msecs % 1000) * 1000000L;
+	if (tsp->tv_nsec >= 1000000000L) {
+		tsp->tv_sec++;
+		tsp->tv_nsec -= 1000000000L;
+	}
+	return tsp;
+}
+
+/*
+ * Test n: blocking sends. A send to a full message deque times out,
+ * and a producer parked on it is woken by a receive. The shared stats
+ * must count both waits and the timeout. A producer killed while
+ * parked stays counted as waiting, but receives must not pile up
+ * wakeups behind it. Delete removes the files and semaphores.
+ */
+#define TN_ITEMS 2
+#define TN_RECEIVES 10
+
+static int process_switch_testn() {
+	char name[MAX_MSGCELL_NAME];
+	char dqpath[512];
+	MSGCELL* cellp;
+	MSGCELL* childp;
+	MSGDEQUE_STATS stats;
+	struct timespec deadline;
+	sem_t* semp;
+	long item;
+	long got[TN_ITEMS];
+	pid_t pid;
+	int status;
+	int posted;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "n")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-N -- Blocking message deque sends.\n");
+	appenv_set_env_var(MMDQ_DIR_PATH, cmdarg_fetch_string(NULL, "d"));
+	snprintf(name, sizeof(name), "test-memmapio-n-%d", (int)getpid());
+	cellp = msgdeque_create(name, 0660, sizeof(long), TN_ITEMS);
+	if ((NULL == cellp) || cellp->errcode) {
+		fprintf(stdout, "ERROR: unable to create message deque %s\n", name);
+		exit(1);
+	}
+	snprintf(dqpath, sizeof(dqpath), "%s", mma_get_disk_file_path(((MSGDEQUE*)cellp->datap)->deque));
+	for (item = 1; item <= TN_ITEMS; item++) {
+		msgdeque_send(cellp, &item);
+	}
+
+	// Full: a send times out
+	if (!msgdeque_send_wait(cellp, &item, deadline_ms(&deadline, 50)) ||
+		(cellp->errcode != ETIMEDOUT) || (msgdeque_stats(cellp, &stats)->send_waits != 1) ||
+		(stats.send_timeouts != 1) || (stats.waiting_producers != 0) ||
+		(stats.blocked_nsecs < 40000000ULL)) {
+		fprintf(stdout, "ERROR: send to a full deque did not time out\n");
+		exit(1);
+	}
+
+	// A parked producer is woken by a receive
+	fflush(stdout);
+	if (0 == (pid = fork())) {
+		childp = msgdeque_attach(name);
+		item = TN_ITEMS + 1;
+		_exit(msgdeque_send_wait(childp, &item, NULL) ? 1 : 0);
+	}
+	for (i = 0; (i < 100) && (msgdeque_stats(cellp, &stats)->waiting_producers != 1); i++) {
+		usleep(10000);
+	}
+	if ((stats.waiting_producers != 1) ||
+		(msgdeque_rec_batch(cellp, got, 1, deadline_ms(&deadline, 1000)) != 1) || (got[0] != 1) ||
+		(waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stdout, "ERROR: parked producer was not woken\n");
+		exit(1);
+	}
+	if ((msgdeque_rec_batch(cellp, got, TN_ITEMS, deadline_ms(&deadline, 1000)) != TN_ITEMS) ||
+		(got[0] != 2) || (got[1] != TN_ITEMS + 1) ||
+		(msgdeque_stats(cellp, &stats)->send_waits != 2) || (stats.send_timeouts != 1) ||
+		(stats.waiting_producers != 0)) {
+		fprintf(stdout, "ERROR: items or stats wrong after a wakeup\n");
+		exit(1);
+	}
+	fprintf(stdout, "TEST-N: send waits %lu timeouts %lu blocked %llu ms\n", stats.send_waits,
+		stats.send_timeouts, stats.blocked_nsecs / 1000000ULL);
+
+	// A producer killed while parked
+	for (item = 1; item <= TN_ITEMS; item++) {
+		msgdeque_send(cellp, &item);
+	}
+	fflush(stdout);
+	if (0 == (pid = fork())) {
+		childp = msgdeque_attach(name);
+		_exit(msgdeque_send_wait(childp, &item, NULL) ? 1 : 0);
+	}
+	for (i = 0; (i < 100) && (msgdeque_stats(cellp, &stats)->waiting_producers != 1); i++) {
+		usleep(10000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	for (i = 0; i < TN_RECEIVES; i++) {
+		msgdeque_rec_batch(cellp, got, 1, deadline_ms(&deadline, 1000));
+		msgdeque_send(cellp, &item);
+	}
+	if ((sem_getvalue(((MSGDEQUE*)cellp->datap)->spacesemp, &posted) != 0) || (posted > 1)) {
+		fprintf(stdout, "ERROR: %d wakeups piled up behind a dead producer\n", posted);
+		exit(1);
+	}
+
+	// Delete removes the files and both semaphores
+	if (msgdeque_delete(cellp) || (0 == access(dqpath, F_OK))) {
+		fprintf(stdout, "ERROR: message deque files not removed\n");
+		exit(1);
+	}
+	semp = sem_open(name, O_RDWR);
+	if (SEM_FAILED != semp) {
+		fprintf(stdout, "ERROR: message deque semaphore not removed\n");
+		exit(1);
+	}
+	strcat(name, "-space");
+	semp = sem_open(name, O_RDWR);
+	if (SEM_FAILED != semp) {
+		fprintf(stdout, "ERROR: space semaphore not removed\n");
+		exit(1);
+	}
+	fprintf(stdout, "TEST-N -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test R: request/reply over message deques. A forked server answers
+ * with the request plus one, after a delay for slow requests. The
+ * client checks a call, pipelined requests collected out of order, a
+ * call that times out and whose late reply is discarded, and a client
+ * that closes and opens again under the same process ID. Closing the
+ * client must delete its reply deque.
+ */
+#define TR_WINDOW 4
+#define TR_SLOW 1000000L
+#define TR_QUIT -1L
+
+static int tr_handler(void* ctxp, void* reqp, size_t reqlen, void* replyp, size_t* replylenp) {
+	long req;
+
+	memcpy(&req, reqp, sizeof(req));
+	if (TR_QUIT == req) {
+		*(int*)ctxp = 1;
+	} else if (req >= TR_SLOW) {
+		usleep(200000);
+	}
+	req++;
+	memcpy(replyp, &req, sizeof(req));
+	*replylenp = sizeof(req);
+	return (reqlen == sizeof(req)) ? 0 : 1;
+}
+
+static int tr_call(MSGRPC_CLIENT* clientp, long req, long msecs) {
+	struct timespec deadline;
+	size_t replylen = sizeof(long);
+	long reply = 0;
+
+	if (msgrpc_call(clientp, &req, sizeof(req), &reply, &replylen,
+		deadline_ms(&deadline, msecs)) != 0) {
+		return 1;
+	}
+	return (replylen != sizeof(reply)) || (reply != req + 1);
+}
+
+static int process_switch_testR() {
+	char name[MSGRPC_MAX_NAME];
+	char replypath[512];
+	MSGRPC_SERVER* serverp;
+	MSGRPC_CLIENT* clientp;
+	struct timespec deadline;
+	unsigned int corr_ids[TR_WINDOW];
+	size_t replylen;
+	long req;
+	long reply;
+	pid_t pid;
+	int quit = 0;
+	int status;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "R")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-RPC -- Request/reply over message deques.\n");
+	appenv_set_env_var(MMDQ_DIR_PATH, cmdarg_fetch_string(NULL, "d"));
+	snprintf(name, sizeof(name), "test-memmapio-R-%d", (int)getpid());
+	serverp = msgrpc_server_create(name, 0660, sizeof(long), 4 * TR_WINDOW, TR_WINDOW);
+	if (NULL == serverp) {
+		fprintf(stdout, "ERROR: unable to create server %s\n", name);
+		exit(1);
+	}
+	fflush(stdout);
+	if (0 == (pid = fork())) {
+		while (!quit) {
+			if (msgrpc_server_dispatch(serverp, tr_handler, &quit, deadline_ms(&deadline, 5000)) <= 0) {
+				_exit(2);
+			}
+		}
+		_exit(serverp->dropped ? 3 : 0);
+	}
+	clientp = msgrpc_client_open(name, TR_WINDOW);
+	if ((NULL == clientp) || tr_call(clientp, 41, 1000)) {
+		fprintf(stdout, "ERROR: call failed\n");
+		exit(1);
+	}
+
+	// Pipelined requests, collected newest first
+	for (i = 0; i < TR_WINDOW; i++) {
+		req = 100 + i;
+		corr_ids[i] = msgrpc_submit(clientp, &req, sizeof(req), deadline_ms(&deadline, 1000));
+		if (0 == corr_ids[i]) {
+			fprintf(stdout, "ERROR: submit %d failed\n", i);
+			exit(1);
+		}
+	}
+	req = 200;
+	if ((msgrpc_submit(clientp, &req, sizeof(req), deadline_ms(&deadline, 1000)) != 0) ||
+		(clientp->errcode != EBUSY)) {
+		fprintf(stdout, "ERROR: submit beyond a window of uncollected replies not refused\n");
+		exit(1);
+	}
+	for (i = TR_WINDOW - 1; i >= 0; i--) {
+		replylen = sizeof(reply);
+		if ((msgrpc_wait(clientp, corr_ids[i], &reply, &replylen, deadline_ms(&deadline, 1000)) != 0) ||
+			(reply != 101 + i)) {
+			fprintf(stdout, "ERROR: pipelined reply %d wrong\n", i);
+			exit(1);
+		}
+	}
+
+	// A slow call times out, and its late reply is not taken for the next one
+	if (!tr_call(clientp, TR_SLOW, 50) || (clientp->errcode != ETIMEDOUT) ||
+		(clientp->outstanding != 0) || tr_call(clientp, 7, 1000)) {
+		fprintf(stdout, "ERROR: timed out call or the call after it wrong\n");
+		exit(1);
+	}
+	fprintf(stdout, "TEST-RPC: call, %d pipelined and timed out calls done\n", TR_WINDOW);
+
+	// Close and open again: the server must not reply through its old route
+	snprintf(replypath, sizeof(replypath), "%s",
+		mma_get_disk_file_path(((MSGDEQUE*)clientp->reply->datap)->deque));
+	msgrpc_client_close(clientp);
+	if (0 == access(replypath, F_OK)) {
+		fprintf(stdout, "ERROR: reply deque not deleted on close\n");
+		exit(1);
+	}
+	clientp = msgrpc_client_open(name, TR_WINDOW);
+	if ((NULL == clientp) || tr_call(clientp, 9, 1000)) {
+		fprintf(stdout, "ERROR: call after the client opened again failed\n");
+		exit(1);
+	}
+	req = TR_QUIT;
+	msgrpc_call(clientp, &req, sizeof(req), NULL, NULL, deadline_ms(&deadline, 1000));
+	msgrpc_client_close(clientp);
+	if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stdout, "ERROR: server failed (status %d)\n", status);
+		exit(1);
+	}
+	msgrpc_server_close(serverp);
+	fprintf(stdout, "TEST-RPC -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test B: pool buffers sent by reference over a message deque. The
+ * sender gives up ownership, a receiver process takes it and returns
+ * the buffer to the pool. A send to a full deque leaves the sender the
+ * owner, and an index outside the pool is refused on receipt.
+ */
+static int process_switch_testB() {
+	char name[MAX_MSGCELL_NAME];
+	char pool_name[MMPOOL_MAX_POOL_NAME];
+	char* strdir;
+	BPOOL_HANDLE* bphp;
+	BPCF_BUFFER_REF* buff_refp;
+	BPCF_BUFFER_REF* fullp;
+	BPOOL_INDEX bpx;
+	MSGCELL* cellp;
+	pid_t pid;
+	int status;
+
+	if (!cmdarg_fetch_switch(NULL, "B")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-BREF -- Pool buffers sent by reference.\n");
+	strdir = cmdarg_fetch_string(NULL, "d");
+	setenv(MMPOOL_ENV_DATA_DIR, strdir, 1);
+	appenv_set_env_var(MMDQ_DIR_PATH, strdir);
+	snprintf(pool_name, sizeof(pool_name), "%s", cmdarg_fetch_string(NULL, "p"));
+	bphp = fresh_pool(strdir, pool_name, 1, 64, 4, 0);
+	snprintf(name, sizeof(name), "test-memmapio-B-%d", (int)getpid());
+	cellp = msgdeque_create_buffref(name, 0660, 1);
+	if ((NULL == bphp) || (NULL == cellp) || cellp->errcode ||
+		(((MSGDEQUE*)cellp->datap)->timer != NULL)) {
+		fprintf(stdout, "TEST-BREF Fails: unable to create pool or deque\n");
+		exit(1);
+	}
+
+	// Round trip: the receiver owns the buffer and returns it
+	buff_refp = mmpool_getbuff(bphp);
+	strcpy(mmpool_buffer_data(buff_refp), "by reference");
+	if (msgdeque_send_buff(cellp, buff_refp) || (buff_refp->owner_pid != 0) ||
+		(mmpool_getstats(bphp)->remaining != mmpool_getstats(bphp)->capacity - 1)) {
+		fprintf(stdout, "ERROR: sent buffer not given up by the sender\n");
+		exit(1);
+	}
+	fflush(stdout);
+	if (0 == (pid = fork())) {
+		BPOOL_HANDLE* cbphp = mmpool_open(pool_name);
+		MSGCELL* ccellp = msgdeque_attach(name);
+		BPCF_BUFFER_REF* crefp = msgdeque_rec_buff(ccellp, cbphp);
+
+		if ((NULL == crefp) || strcmp(mmpool_buffer_data(crefp), "by reference") ||
+			(crefp->owner_pid != getpid()) || mmpool_putbuff(cbphp, crefp)) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+	if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || WEXITSTATUS(status) ||
+		(mmpool_getstats(bphp)->remaining != mmpool_getstats(bphp)->capacity) ||
+		(BPOOL_BUFF_IN != mmpool_buff_state(bphp, buff_refp->bpindex))) {
+		fprintf(stdout, "ERROR: receiver did not return the buffer to the pool\n");
+		exit(1);
+	}
+
+	// A send to a full deque leaves the sender the owner
+	buff_refp = mmpool_getbuff(bphp);
+	fullp = mmpool_getbuff(bphp);
+	if (msgdeque_send_buff(cellp, buff_refp) || !msgdeque_send_buff(cellp, fullp) ||
+		(fullp->owner_pid != getpid())) {
+		fprintf(stdout, "ERROR: buffer refused by a full deque not kept by the sender\n");
+		exit(1);
+	}
+	if ((msgdeque_rec_buff(cellp, bphp) != buff_refp) || mmpool_putbuff(bphp, buff_refp) ||
+		mmpool_putbuff(bphp, fullp)) {
+		fprintf(stdout, "ERROR: unable to return buffers\n");
+		exit(1);
+	}
+
+	// An index outside the pool is refused
+	bpx = mmpool_getstats(bphp)->capacity;
+	if (msgdeque_send(cellp, &bpx) || (msgdeque_rec_buff(cellp, bphp) != NULL) ||
+		(cellp->errcode != EINVAL)) {
+		fprintf(stdout, "ERROR: buffer index outside the pool not refused\n");
+		exit(1);
+	}
+	if (mmpool_getstats(bphp)->remaining != mmpool_getstats(bphp)->capacity) {
+		fprintf(stdout, "ERROR: %d buffers still out\n",
+			mmpool_getstats(bphp)->capacity - mmpool_getstats(bphp)->remaining);
+		exit(1);
+	}
+	msgdeque_delete(cellp);
+	mmpool_close(bphp);
+	fprintf(stdout, "TEST-BREF -- Passed.\n");
+	return 0;
+}
+
+/*
+ * Test S: scheduled delivery. Records sent with msgdeque_send_at out
+ * of deadline order are held in the timer file and promoted to the
+ * deque by receives in deadline order, none before it is due. A full
+ * timer file refuses further records with ENOSPC, and a deque created
+ * without MSGDEQUE_FLAG_TIMED refuses them with EINVAL.
+ */
+#define TS_ITEMS 3
+
+static int process_switch_testS() {
+	static long delays[TS_ITEMS] = {300, 100, 200};
+	char name[MAX_MSGCELL_NAME];
+	MSGCELL* cellp;
+	struct timespec due[TS_ITEMS + 1];
+	struct timespec deadline;
+	struct timespec now;
+	long item;
+	long got[TS_ITEMS];
+	long* recp;
+	int i;
+
+	if (!cmdarg_fetch_switch(NULL, "S")) {
+		return 0;
+	}
+	fprintf(stdout, "TEST-SCHED -- Scheduled message deque delivery.\n");
+	appenv_set_env_var(MMDQ_DIR_PATH, cmdarg_fetch_string(NULL, "d"));
+	snprintf(name, sizeof(name), "test-memmapio-S-%d", (int)getpid());
+	cellp = msgdeque_create_flags(name, 0660, sizeof(long), TS_ITEMS, MSGDEQUE_FLAG_TIMED);
+	if ((NULL == cellp) || cellp->errcode) {
+		fprintf(stdout, "ERROR: unable to create message deque %s\n", name);
+		exit(1);
+	}
+
+	// Item delays[i] / 100 is due after delays[i] msecs
+	for (i = 0; i < TS_ITEMS; i++) {
+		item = delays[i] / 100;
+		if (msgdeque_send_at(cellp, &item, deadline_ms(&due[item], delays[i]))) {
+			fprintf(stdout, "ERROR: unable to schedule item %ld\n", item);
+			exit(1);
+		}
+	}
+	item = TS_ITEMS + 1;
+	if (!msgdeque_send_at(cellp, &item, deadline_ms(&deadline, 1000)) || (cellp->errcode != ENOSPC) ||
+		(msgdeque_scheduled(cellp) != TS_ITEMS)) {
+		fprintf(stdout, "ERROR: full timer file did not refuse a record\n");
+		exit(1);
+	}
+
+	// A record due now is sent at once, ahead of the scheduled ones
+	item = 0;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (msgdeque_send_at(cellp, &item, &deadline) ||
+		(msgdeque_rec_batch(cellp, got, TS_ITEMS, deadline_ms(&deadline, 10)) != 1) || (got[0] != 0)) {
+		fprintf(stdout, "ERROR: record due now was not sent at once\n");
+		exit(1);
+	}
+	if ((msgdeque_rec_batch(cellp, got, TS_ITEMS, deadline_ms(&deadline, 50)) != 0) ||
+		(cellp->errcode != ETIMEDOUT)) {
+		fprintf(stdout, "ERROR: scheduled record delivered early\n");
+		exit(1);
+	}
+
+	// Receives sleep until the next record is due, then promote it
+	for (item = 1; item <= TS_ITEMS; item++) {
+		recp = msgdeque_rec(cellp);
+		clock_gettime(CLOCK_REALTIME, &now);
+		if ((NULL == recp) || (*recp != item) || (now.tv_sec < due[item].tv_sec) ||
+			((now.tv_sec == due[item].tv_sec) && (now.tv_nsec < due[item].tv_nsec))) {
+			fprintf(stdout, "ERROR: scheduled record %ld out of order or early\n", item);
+			exit(1);
+		}
+		free(recp);
+		if (msgdeque_scheduled(cellp) != TS_ITEMS - item) {
+			fprintf(stdout, "ERROR: %d records still scheduled after %ld received\n",
+				msgdeque_scheduled(cellp), item);
+			exit(1);
+		}
+	}
+	msgdeque_delete(cellp);
+
+	// Scheduling is opt in: a plain deque has no timer file
+	cellp = msgdeque_create(name, 0660, sizeof(long), TS_ITEMS);
+	if ((NULL == cellp) || cellp->errcode || (((MSGDEQUE*)cellp->datap)->timer != NULL) ||
+		!msgdeque_send_at(cellp, &item, deadline_ms(&deadline, 1000)) || (cellp->errcode != EINVAL)) {
+		fprintf(stdout, "ERROR: plain message deque accepted a scheduled record\n");
+		exit(1);
+	}
+	msgdeque_delete(cellp);
+	fprintf(stdout, "TEST-SCHED -- Passed.\n");
+	return 0;
+}
+
 static void register_args(int argc, char* argv[]) {
 	
 	cmdarg_init(argc, argv);
@@ -334,6 +2865,54 @@ static void register_args(int argc, char* argv[]) {
 		"Run Test b -- basic buffer allocation", NULL, NULL);
 	cmdarg_register_option("c", "testc", CA_SWITCH,
 		"Run Test c -- basic buffer read and deallocation", NULL, NULL); 
+	cmdarg_register_option("e", "teste", CA_SWITCH,
+		"Run Test e -- growable files", NULL, NULL);
+	cmdarg_register_option("f", "testf", CA_SWITCH,
+		"Run Test f -- buffer fan out by reference count", NULL, NULL);
+	cmdarg_register_option("g", "testg", CA_SWITCH,
+		"Run Test g -- aligned buffer pools", NULL, NULL);
+	cmdarg_register_option("i", "testi", CA_SWITCH,
+		"Run Test i -- linear list hash index", NULL, NULL);
+	cmdarg_register_option("j", "testj", CA_SWITCH,
+		"Run Test j -- lock free linear list appends", NULL, NULL);
+	cmdarg_register_option("k", "testk", CA_SWITCH,
+		"Run Test k -- buffer chains", NULL, NULL);
+	cmdarg_register_option("m", "testm", CA_SWITCH,
+		"Run Test m -- moves between memory mapped deques", NULL, NULL);
+	cmdarg_register_option("n", "testn", CA_SWITCH,
+		"Run Test n -- blocking message deque sends", NULL, NULL);
+	cmdarg_register_option("o", "testo", CA_SWITCH,
+		"Run Test o -- memory mapped B+tree", NULL, NULL);
+	cmdarg_register_option("q", "testq", CA_SWITCH,
+		"Run Test q -- lock free record reads", NULL, NULL);
+	cmdarg_register_option("r", "testr", CA_SWITCH,
+		"Run Test r -- reclaim of buffers held by dead processes", NULL, NULL);
+	cmdarg_register_option("s", "tests", CA_SWITCH,
+		"Run Test s -- slab group (mmslab) allocation", NULL, NULL);
+	cmdarg_register_option("t", "testt", CA_SWITCH,
+		"Run Test t -- multi process lock vs lock free pool stress", NULL, NULL);
+	cmdarg_register_option("u", "testu", CA_SWITCH,
+		"Run Test u -- linear list stable indices", NULL, NULL);
+	cmdarg_register_option("v", "testv", CA_SWITCH,
+		"Run Test v -- parallel record scans", NULL, NULL);
+	cmdarg_register_option("w", "testw", CA_SWITCH,
+		"Run Test w -- columnar files", NULL, NULL);
+	cmdarg_register_option("x", "testx", CA_SWITCH,
+		"Run Test x -- snapshots", NULL, NULL);
+	cmdarg_register_option("y", "testy", CA_SWITCH,
+		"Run Test y -- bulk export and import", NULL, NULL);
+	cmdarg_register_option("z", "testz", CA_SWITCH,
+		"Run Test z -- lazy pool formatting and reset", NULL, NULL);
+	cmdarg_register_option("B", "testB", CA_SWITCH,
+		"Run Test B -- pool buffers sent by reference", NULL, NULL);
+	cmdarg_register_option("R", "testR", CA_SWITCH,
+		"Run Test R -- request/reply over message deques", NULL, NULL);
+	cmdarg_register_option("S", "testS", CA_SWITCH,
+		"Run Test S -- scheduled message deque delivery", NULL, NULL);
+	cmdarg_register_option("P", "procs", CA_DEFAULT_ARG,
+		"Max stress processes for testt (1, 2, 4 ... up to this)", "8", "t");
+	cmdarg_register_option("N", "cycles", CA_DEFAULT_ARG,
+		"Get/put cycles per process for testt", "100000", "t");
 	cmdarg_register_option("h", "help", CA_SWITCH,
 		"Print command help", NULL, NULL);
 
@@ -351,12 +2930,34 @@ static void register_args(int argc, char* argv[]) {
 
 int main(int argc, char* argv[]) {
 	char* pargv[] = {"a", "b", "c"};
-	static int switches[] = {'h', 'a', 'b', 'c', '\0'};
+	static int switches[] = {'h', 'a', 'b', 'c', 'e', 'f', 'g', 'i', 'j', 'k', 'm', 'n', 'o', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 'B', 'R', 'S', '\0'};
 	static int (*process_func[])() = { 
 		process_switch_help, 
 		process_switch_testa,
 		process_switch_testb,
 		process_switch_testc,
+		process_switch_teste,
+		process_switch_testf,
+		process_switch_testg,
+		process_switch_testi,
+		process_switch_testj,
+		process_switch_testk,
+		process_switch_testm,
+		process_switch_testn,
+		process_switch_testo,
+		process_switch_testq,
+		process_switch_testr,
+		process_switch_tests,
+		process_switch_testt,
+		process_switch_testu,
+		process_switch_testv,
+		process_switch_testw,
+		process_switch_testx,
+		process_switch_testy,
+		process_switch_testz,
+		process_switch_testB,
+		process_switch_testR,
+		process_switch_testS,
 		NULL
 	};
 	int status = 0;
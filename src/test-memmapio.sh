@@ -18,6 +18,20 @@ function runtest() {
 		exit 1
 	fi
 }
+
+function runtool() {
+	label=$1
+	command=$2
+	echo ""
+	echo "Running tool: $label"
+	eval "$command"
+
+	if [ $? -ne 0 ]; then
+		echo "Tool failure: $datadir has been preserved for examination"
+		echo "$label fails!"
+		exit 1
+	fi
+}
 	
 if [ -d $datadir ]; then
 	rm -rf $datadir
@@ -36,6 +50,37 @@ echo "Running tests"
 runtest '-a' pool1 /tmp/test-data 'mmfor: memory mapped file of records'
 runtest '-b' pool1 /tmp/test-data 'mmbuffpool: Allocate and write to memory mapped buffers'
 runtest '-c' pool1 /tmp/test-data 'mmbuffpool: Read memory mapped buffers and deallocate'
+runtest '-e' grow /tmp/test-data 'mmfor: Growable files with append and remap'
+runtest '-f' fanout /tmp/test-data 'mmbuffpool: Buffer fan out by reference count'
+runtest '-g' aligned /tmp/test-data 'mmbuffpool: Aligned buffer pools'
+runtest '-i' index /tmp/test-data 'linearlist: Hash index lookup'
+runtest '-j' lockfree /tmp/test-data 'linearlist: Lock free appends'
+runtest '-k' chain /tmp/test-data 'mmbuffpool: Buffer chains'
+runtest '-m' move /tmp/test-data 'mmdeque: Moves between memory mapped deques'
+runtest '-n' msgwait /tmp/test-data 'msgdeque: Blocking sends, wakeups and timeouts'
+runtest '-o' btree /tmp/test-data 'mmbtree: B+tree inserts, range scans and bulk load'
+runtest '-q' seqlock /tmp/test-data 'mmfor: Lock free record reads'
+runtest '-r' reclaim /tmp/test-data 'mmbuffpool: Reclaim of buffers held by dead processes'
+runtest '-s' slab1 /tmp/test-data 'mmslab: Size classed slab group allocation'
+runtool 'mmbuffpool: Slab group report' './mmbuffpool -S -p slab1 -d $datadir'
+runtest '-t -P 4 -N 2000' stress /tmp/test-data 'mmbuffpool: Multi process lock and lock free pool stress'
+runtest '-u' stable /tmp/test-data 'linearlist: Tombstones, free list and compaction'
+runtest '-v' scan /tmp/test-data 'mmfor: Parallel record scans and reductions'
+runtest '-w' columns /tmp/test-data 'mmcol: Columnar files, column sums and filters'
+runtest '-x' snapshot /tmp/test-data 'mmfor: Point in time snapshots under a live writer'
+runtest '-y' dump /tmp/test-data 'mmfor, mmdeque: Bulk export and import'
+runtool 'mmfortool: Export records' './mmfortool -E -p $datadir/TEST-Y.FOR -f $datadir/TEST-Y.DUMP'
+runtool 'mmfortool: Import records' './mmfortool -I -p $datadir/TEST-Y-TOOL.FOR -f $datadir/TEST-Y.DUMP'
+runtool 'mmfortool: Report imported file' './mmfortool -r -p $datadir/TEST-Y-TOOL.FOR'
+runtest '-z' lazy /tmp/test-data 'mmbuffpool: Lazy pool formatting and reset'
+runtool 'mmbuffpool: Reset lazy pool' './mmbuffpool -z -p lazy-0 -d $datadir'
+runtool 'mmbuffpool: Display reset pool' './mmbuffpool -D -p lazy-0 -d $datadir'
+runtool 'mmbuffpool: Export pool' './mmbuffpool -E -p lazy-0 -d $datadir -f $datadir/lazy-0.dump'
+runtool 'mmbuffpool: Import pool' './mmbuffpool -I -p lazy-copy -d $datadir -f $datadir/lazy-0.dump'
+runtool 'mmbuffpool: Display imported pool' './mmbuffpool -D -p lazy-copy -d $datadir'
+runtest '-B' bref /tmp/test-data 'msgdeque: Pool buffers sent by reference'
+runtest '-R' rpc /tmp/test-data 'msgrpc: Calls, pipelining, timeouts and late replies'
+runtest '-S' sched /tmp/test-data 'msgdeque: Scheduled delivery in deadline order'
 
 echo "All tests successful!" 
 
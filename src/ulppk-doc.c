@@ -107,6 +107,7 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * 		<li>Memory Mapped Linear Lists @see linearlist.c</li>
  * 		<li>Memory Mapped Double Ended Queue Support @see mmdeque.c</li>
  * 		<li>Memory Mapped Buffer Pool Support @see </li>
+ * 		<li>Size Classed Slab Allocator over Buffer Pools @see mmslab.c</li>
  * 	</ul>
  * <li>Process Management and Communications Support</li>
  * 	<ul>
@@ -118,6 +119,7 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * 		<li>State machine for event driven code @see statemachine.c</li>
  * 		<li>Process synchronization support @see msgcell.c</li>
  * 		<li>Process-to-process queing support @see msgdeque.c</li>
+ * 		<li>Request/reply RPC over message deques @see msgrpc.c</li>
  * 	</ul>
  * </ul>
  *
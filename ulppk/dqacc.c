@@ -342,6 +342,38 @@ return (flag);
 
 }
 
+/**
+ * Copy an item near the top of the deque without removing it.
+ * @param deque Pointer to deque header
+ * @param depth Position of the item: 0 is the top item, 1 the one below it ...
+ * @param item Pointer to memory are of at least deque item_size bytes,
+ * @return 0 if successful, non-zero if the deque holds no more than depth items.
+ */
+int dq_ptd(PDQHEADER deque, ushort depth, void* item) {
+	if ((!deque->dq_open) || (depth >= deque->dquse)) {
+		return TRUE;
+	}
+	memcpy(item, map_slot(deque, (deque->dqtop + deque->dqslots - depth) % deque->dqslots),
+		deque->dqitem_size);
+	return FALSE;
+}
+
+/**
+ * Copy an item near the bottom of the deque without removing it.
+ * @param deque Pointer to deque header
+ * @param depth Position of the item: 0 is the bottom item, 1 the one above it ...
+ * @param item Pointer to memory are of at least deque item_size bytes,
+ * @return 0 if successful, non-zero if the deque holds no more than depth items.
+ */
+int dq_pbd(PDQHEADER deque, ushort depth, void* item) {
+	if ((!deque->dq_open) || (depth >= deque->dquse)) {
+		return TRUE;
+	}
+	memcpy(item, map_slot(deque, (deque->dqbottom + depth) % deque->dqslots),
+		deque->dqitem_size);
+	return FALSE;
+}
+
 /**
  * return status information from the given deque header.
  * If dq_statsp is not NULL, the status data is written
@@ -108,6 +108,8 @@ extern "C" {
     int dq_abd(PDQHEADER deque,void* itemp);
     int dq_rtd(PDQHEADER deque,void* itemp);
     int dq_rbd(PDQHEADER deque,void* itemp);
+    int dq_ptd(PDQHEADER deque, ushort depth, void* itemp);
+    int dq_pbd(PDQHEADER deque, ushort depth, void* itemp);
     DQSTATS* dq_stats(PDQHEADER dequep, DQSTATS* dq_statsp);
     
 #ifdef __cplusplus
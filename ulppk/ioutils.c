@@ -25,13 +25,18 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 *********************************************************************
 */
 
+#define _GNU_SOURCE		// copy_file_range
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 
 #include <dqacc.h>
 #include <diagnostics.h>
@@ -49,6 +54,7 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 static char localbuff[1024 * 4];		// plenty big local buffer for formatted I/O
 
 #define IOBLOCKSZ 256				// a "block" ... arbitrary number of bytes to operate on
+#define IOCOPYSZ (1024 * 1024)		// most bytes moved per copy system call
 
 #if 0
 #define READ_DEQUE_SIZE (IOBLOCKSZ*4)		// make the deque size an integral number of blocks
@@ -70,7 +76,8 @@ static size_t fetchfromdeque(char* buff, size_t buffsize, int* eolp);
  * @return Number of bytes read.
  */
 size_t ioutils_writen(int fd, const void *vptr, size_t n) {
-        size_t          nleft, nwritten;
+        size_t          nleft;
+        ssize_t         nwritten;
         const char      *ptr;
 
         ptr = vptr;     /* can't do pointer arithmetic on void* */
@@ -95,7 +102,8 @@ size_t ioutils_writen(int fd, const void *vptr, size_t n) {
  */
 size_t ioutils_readn(int fd, void *vptr, size_t n)
 {
-        size_t  nleft, nread;
+        size_t  nleft;
+        ssize_t nread;
         char    *ptr;
 
         ptr = vptr;
@@ -348,3 +356,96 @@ size_t ioutils_file_size(char* filepath) {
 	}
 	return size;
 }
+
+/**
+ * Make a file share the contents of another without copying them
+ * (a reflink), on filesystems that can (btrfs, XFS, ...). Any data
+ * cached for the source is written out first.
+ *
+ * @param from Descriptor of the source file, open for reading.
+ * @param to Descriptor of the target file, open for writing.
+ * @return 0 on success, non-zero if the files cannot share their
+ * 	contents (errno EOPNOTSUPP, EXDEV, ...).
+ */
+int ioutils_clone_file(int from, int to) {
+#ifdef FICLONE
+	return ioctl(to, FICLONE, from);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/**
+ * Copy a range of bytes from one file to another inside the kernel.
+ * copy_file_range is tried first (it may share extents rather than
+ * copy them), then sendfile, then pread and pwrite.
+ *
+ * @param from Descriptor of the source, open for reading.
+ * @param from_off Offset of the first byte to copy.
+ * @param to Descriptor of the target, open for writing. Its file
+ * 	position is left undefined unless to_off is negative.
+ * @param to_off Offset at which to write the first byte, or -1 to
+ * 	write at (and advance) the file position of to, which may then
+ * 	be a pipe or socket.
+ * @param len Number of bytes to copy.
+ * @return Number of bytes copied, less than len at the end of the
+ * 	source or on error (see errno).
+ */
+size_t ioutils_copy_range(int from, off_t from_off, int to, off_t to_off, size_t len) {
+	char* buff = NULL;
+	size_t done = 0;
+	ssize_t n;
+	ssize_t w;
+	ssize_t r;
+	loff_t in;
+	loff_t out;
+	off_t soff;
+	int method = 0;		// 0 copy_file_range, 1 sendfile, 2 read/write
+
+	while (done < len) {
+		n = -1;
+		if (0 == method) {
+			in = from_off + done;
+			out = to_off + done;
+			n = copy_file_range(from, &in, to, (to_off < 0) ? NULL : &out,
+				(len - done < IOCOPYSZ) ? len - done : IOCOPYSZ, 0);
+			if ((n < 0) && ((ENOSYS == errno) || (EXDEV == errno) || (EINVAL == errno) ||
+				(EOPNOTSUPP == errno))) {
+				method = 1;
+				continue;
+			}
+		} else if (1 == method) {
+			soff = from_off + done;
+			if ((to_off >= 0) && (lseek(to, to_off + done, SEEK_SET) < 0)) {
+				break;
+			}
+			n = sendfile(to, from, &soff, (len - done < IOCOPYSZ) ? len - done : IOCOPYSZ);
+			if ((n < 0) && ((ENOSYS == errno) || (EINVAL == errno))) {
+				method = 2;
+				continue;
+			}
+		} else {
+			if ((NULL == buff) && (NULL == (buff = (char*)malloc(IOCOPYSZ)))) {
+				break;
+			}
+			n = pread(from, buff, (len - done < IOCOPYSZ) ? len - done : IOCOPYSZ, from_off + done);
+			for (w = 0; (n > 0) && (w < n); w += r) {
+				r = (to_off < 0) ? write(to, buff + w, n - w) :
+					pwrite(to, buff + w, n - w, to_off + done + w);
+				if (r <= 0) {
+					n = -1;
+				}
+			}
+		}
+		if ((n < 0) && (EINTR == errno)) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	free(buff);
+	return done;
+}
@@ -34,6 +34,7 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  */
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/types.h>
 
 size_t ioutils_writen(int fd, const void *vptr, size_t n);
 size_t ioutils_readn(int fd, void *vptr, size_t n);
@@ -45,5 +46,7 @@ int ioutils_is_directory(FILE* f_log, const char* path);
 int ioutils_is_regular_file(FILE* f_log, const char* file);
 char* ioutils_makefullpath(char* buff, const char* dirpath, const char* fn);
 int ioutils_remove_file(char* filepath);
+int ioutils_clone_file(int from, int to);
+size_t ioutils_copy_range(int from, off_t from_off, int to, off_t to_off, size_t len);
 #endif
 
@@ -37,16 +37,63 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  *
  * @brief Implementation of a linear list of memory mapped records.
  *
- * A linear list has a fixed capacity determined at creation time.
+ * A linear list starts with the capacity given at creation time and
+ * grows its file (see mmfor_reserve) when records are added to a full list.
  * Active records begin at index 0 and are kept contiguous. Inactive
  * records are maintained at high indices.
  *
  * See linearlist.h for some general comments.
  */
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <linearlist.h>
 #include <ulppk_log.h>
 
+static void index_path(char* buf, size_t len, MMFOR_HANDLE* mmforhp);
+
+static unsigned long long key_hash(void* key, size_t key_len);
+
+static LINLIST_INDEX_HEADER* index_header(MMFOR_HANDLE* mmforhp);
+
+static LINLIST_INDEX_SLOT* index_slot(MMFOR_HANDLE* mmforhp, size_t i);
+
+static long index_lookup(MMFOR_HANDLE* mmforhp, size_t x);
+
+static int index_insert(MMFOR_HANDLE* mmforhp, size_t x);
+
+static void index_remove(MMFOR_HANDLE* mmforhp, size_t x);
+
+static void index_relocate(MMFOR_HANDLE* mmforhp, size_t from, size_t to);
+
+static int index_rebuild(MMFOR_HANDLE* mmforhp, unsigned int nslots, size_t length);
+
+static int lockfree(MMFOR_HANDLE* mmforhp);
+
+static int published(MMFOR_HANDLE* mmforhp, size_t x1);
+
+static long claim(MMFOR_HANDLE* mmforhp, size_t n);
+
+static int grow_list(MMFOR_HANDLE* mmforhp, size_t n);
+
+static int stable(MMFOR_HANDLE* mmforhp);
+
+static LINLIST_SLOT* slot(MMFOR_HANDLE* mmforhp, size_t x);
+
+static int live(MMFOR_HANDLE* mmforhp, size_t x);
+
+static size_t extent(MMFOR_HANDLE* mmforhp);
+
+static long add_stable(MMFOR_HANDLE* mmforhp, void* recs, size_t n);
+
+static int delete_stable(MMFOR_HANDLE* mmforhp, size_t x);
+
+static void free_slot(MMFOR_HANDLE* mmforhp, size_t x);
+
 /**
  * Create a linear list file. Set up the header record at mmfor record index 0.
  * @param filepath Path to the memory mapped I/O file
@@ -59,24 +106,116 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  */
 MMFOR_HANDLE* linlist_create(char* filepath,  MMA_ACCESS_MODES mode,
 		MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs) {
+	return linlist_create_flags(filepath, mode, flags, permissions, rec_size, nrecs, 0);
+}
+
+/**
+ * Create a linear list file with options.
+ * @param filepath Path to the memory mapped I/O file
+ * @param mode see mmatom.h for a description of MMA_ACCESS_MODES
+ * @param flags see mmatom.h for a description of MMA_MAP_FLAGS
+ * @param permissions see man page open(2)
+ * @param rec_size Size of the records.
+ * @param nrecs Record capacity of the linear list.
+ * @param list_flags Zero, LINLIST_FLAG_LOCKFREE or LINLIST_FLAG_STABLE
+ * @return Pointer to a MMFOR_HANDLE, NULL on failure (errno EINVAL
+ * if both flags are given).
+ */
+MMFOR_HANDLE* linlist_create_flags(char* filepath,  MMA_ACCESS_MODES mode,
+		MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs,
+		unsigned int list_flags) {
 
 	size_t total_recs;
+	size_t slot_size = rec_size;
 	MMFOR_HANDLE* mmforhp;
 	LINEAR_LIST_HEADER* headerp;
 
+	if ((list_flags & LINLIST_FLAG_LOCKFREE) && (list_flags & LINLIST_FLAG_STABLE)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Lock free appends need records that can move");
+		errno = EINVAL;
+		return NULL;
+	}
+	if (list_flags & LINLIST_FLAG_STABLE) {
+		// Room for the slot word, and for the whole header in record 0
+		slot_size = rec_size + sizeof(LINLIST_SLOT);
+		if (slot_size < sizeof(LINEAR_LIST_HEADER)) {
+			slot_size = sizeof(LINEAR_LIST_HEADER);
+		}
+	}
 	total_recs = nrecs + 1;		// reserve index 0 for control record
-	mmforhp = mmfor_create(filepath, mode, flags, permissions, rec_size, total_recs);
+	mmforhp = mmfor_create_flags(filepath, mode, flags, permissions, slot_size, total_recs,
+		(list_flags & LINLIST_FLAG_LOCKFREE) ? MMFOR_FLAG_SEQLOCK : 0);
+
+	if (NULL == mmforhp) {
+		return NULL;
+	}
 
 	// Now write the linear list header to record 0.
 	headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
 	headerp->nextx = 1;
 	headerp->capacity = nrecs;
 	headerp->rec_size = rec_size;
+	if (slot_size >= sizeof(LINEAR_LIST_HEADER)) {
+		headerp->flags = list_flags;
+		headerp->free_head = 0;
+		headerp->live = 0;
+	}
 
 	return mmforhp;
 
 }
 
+/**
+ * Create a linear list file with a companion hash index on a
+ * key field of its records. The index file is created alongside
+ * the list (see LINLIST_INDEX_SUFFIX) with at least twice as many
+ * slots as the list has records, and doubles when it is 3/4 full.
+ *
+ * @param filepath Path to the memory mapped I/O file
+ * @param mode see mmatom.h for a description of MMA_ACCESS_MODES
+ * @param flags see mmatom.h for a description of MMA_MAP_FLAGS
+ * @param permissions see man page open(2)
+ * @param rec_size Size of the records.
+ * @param nrecs Record capacity of the linear list.
+ * @param key_offset Offset of the key field within a record.
+ * @param key_len Size of the key field (at most LINLIST_MAX_KEY).
+ * @return Pointer to a MMFOR_HANDLE, NULL on failure.
+ */
+MMFOR_HANDLE* linlist_create_indexed(char* filepath,  MMA_ACCESS_MODES mode,
+		MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs,
+		size_t key_offset, size_t key_len) {
+	char path[PATH_MAX];
+	MMFOR_HANDLE* mmforhp;
+	MMFOR_HANDLE* idxp;
+	LINLIST_INDEX_HEADER* ihp;
+	unsigned int nslots;
+
+	if ((0 == key_len) || (key_len > LINLIST_MAX_KEY) || (key_offset + key_len > rec_size)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Invalid key field: offset = %ld length = %ld",
+				(long)key_offset, (long)key_len);
+		return NULL;
+	}
+	mmforhp = linlist_create(filepath, mode, flags, permissions, rec_size, nrecs);
+	if (NULL == mmforhp) {
+		return NULL;
+	}
+	for (nslots = 8; nslots < 2 * nrecs; nslots <<= 1);
+	index_path(path, sizeof(path), mmforhp);
+	idxp = mmfor_create(path, mode, flags, permissions, sizeof(LINLIST_INDEX_SLOT), nslots + 1);
+	if (NULL == idxp) {
+		linlist_close(mmforhp);
+		unlink(filepath);
+		return NULL;
+	}
+	ihp = (LINLIST_INDEX_HEADER*)mmfor_x2p(idxp, 0);
+	ihp->key_offset = key_offset;
+	ihp->key_len = key_len;
+	ihp->nslots = nslots;
+	ihp->count = 0;
+	mmforhp->companion = idxp;
+	return mmforhp;
+}
+
 /**
  * Open a previously created linear list file.
  *
@@ -86,7 +225,23 @@ MMFOR_HANDLE* linlist_create(char* filepath,  MMA_ACCESS_MODES mode,
  * @return mmforhp Pointer to a memory mapped file of records (MMFOR) handle
  */
 MMFOR_HANDLE* linlist_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags) {
-	return mmfor_open(filepath, mode, flags);
+	char path[PATH_MAX];
+	MMFOR_HANDLE* mmforhp;
+
+	mmforhp = mmfor_open(filepath, mode, flags);
+	if (mmforhp != NULL) {
+		// Attach the hash index if the list has one
+		index_path(path, sizeof(path), mmforhp);
+		if (0 == access(path, F_OK)) {
+			mmforhp->companion = mmfor_open(path, mode, flags);
+			if (NULL == mmforhp->companion) {
+				ULPPK_LOG(ULPPK_LOG_ERROR, "Unable to open list index %s", path);
+				mmfor_close(mmforhp);
+				mmforhp = NULL;
+			}
+		}
+	}
+	return mmforhp;
 }
 
 /**
@@ -95,7 +250,12 @@ MMFOR_HANDLE* linlist_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS
  * @return 0 on success, non-zero on failure
  */
 int linlist_close(MMFOR_HANDLE* mmforhp) {
-	return mmfor_close(mmforhp);
+	int status = 0;
+
+	if (mmforhp->companion != NULL) {
+		status = mmfor_close(mmforhp->companion);
+	}
+	return (mmfor_close(mmforhp) | status);
 }
 
 /**
@@ -110,6 +270,9 @@ void* linlist_x2p(MMFOR_HANDLE* mmforhp, size_t x) {
 
 	// First user record is at index 1.
 	x1 = x + 1;
+	if (stable(mmforhp)) {
+		return (char*)mmfor_x2p(mmforhp, x1) + sizeof(LINLIST_SLOT);
+	}
 	return mmfor_x2p(mmforhp, x1);
 }
 
@@ -156,8 +319,11 @@ size_t linlist_capacity(MMFOR_HANDLE* mmforhp) {
 size_t linlist_length(MMFOR_HANDLE* mmforhp) {
 	LINEAR_LIST_HEADER* headerp;
 
-	headerp = mmfor_x2p(mmforhp, 0);
-	return (headerp->nextx - 1);
+	if (stable(mmforhp)) {
+		headerp = mmfor_x2p(mmforhp, 0);
+		return headerp->live;
+	}
+	return extent(mmforhp);
 }
 /**
  * Given data at userp, add a new record to the linear
@@ -170,29 +336,90 @@ size_t linlist_length(MMFOR_HANDLE* mmforhp) {
  * @param userp Pointer to data to be added (copied) to the next available linear list
  * 	record.
  * @return Pointer to the memory mapped record on success,
- * NULL if the list is full.
+ * NULL if the list is full and the file could not grow.
+ * Growth may remap the file, so pointers obtained earlier
+ * must be refetched.
  */
 void* linlist_add_record(MMFOR_HANDLE* mmforhp, void* userp) {
-	int x;
-	LINEAR_LIST_HEADER* headerp;
-	void* recp;
+	long x;
 
-	// Lock access
-	linlist_list_lock(mmforhp);
+	x = linlist_add_records(mmforhp, userp, 1);
+	return (x < 0) ? NULL : linlist_x2p(mmforhp, x);
+}
 
-	// Get the header record
-	headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+/**
+ * Add n records, copied from the array at recs, to the end of the
+ * list. They get consecutive indices, except in a LINLIST_FLAG_STABLE
+ * list, which fills free slots first.
+ *
+ * In a LINLIST_FLAG_LOCKFREE list the slots are claimed with an atomic
+ * compare and swap on nextx and filled without the list lock, each
+ * record published by its sequence word. The lock is taken only to
+ * grow the file, so each appending thread needs its own handle. Other
+ * lists add under the list lock.
+ *
+ * @param mmforhp Pointer to a memory mapped file of records (MMFOR) handle
+ * @param recs n records to copy into the list
+ * @param n Number of records
+ * @return Zero based index of the first new record, -1 on failure,
+ * in which case none of the records are added.
+ */
+long linlist_add_records(MMFOR_HANDLE* mmforhp, void* recs, size_t n) {
+	LINEAR_LIST_HEADER* headerp;
+	size_t rec_size;
+	int locked = 0;
+	long x;
+	size_t i;
+	void* recp;
 
-	if (headerp->nextx > headerp->capacity) {
-		recp = NULL;
-	} else {
-		recp = mmfor_x2p(mmforhp, headerp->nextx);
-		memcpy(recp, userp, headerp->rec_size);
-		headerp->nextx++;
+	if (0 == n) {
+		return -1;
 	}
-	// Unlock access
-	linlist_list_unlock(mmforhp);
-	return recp;
+	if (stable(mmforhp)) {
+		return add_stable(mmforhp, recs, n);
+	}
+	if (!lockfree(mmforhp)) {
+		linlist_list_lock(mmforhp);
+		locked = 1;
+	}
+	// Claim n slots, growing the list under the lock when it is full
+	while ((x = claim(mmforhp, n)) < 0) {
+		if (!locked) {
+			linlist_list_lock(mmforhp);
+			locked = 1;
+		} else if (grow_list(mmforhp, n)) {
+			break;
+		}
+	}
+	if (locked && lockfree(mmforhp)) {
+		linlist_list_unlock(mmforhp);
+		locked = 0;
+	}
+	if (x > 0) {
+		headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+		rec_size = headerp->rec_size;
+		for (i = 0; i < n; i++) {
+			recp = mmfor_owned_write_begin(mmforhp, x + i);
+			memcpy(recp, (char*)recs + i * rec_size, rec_size);
+			mmfor_owned_write_end(mmforhp, x + i);
+		}
+		for (i = 0; i < n; i++) {
+			if (index_insert(mmforhp, x + i - 1)) {
+				// Keep the list and its index in step
+				ULPPK_LOG(ULPPK_LOG_ERROR, "Unable to index new record");
+				while (i-- > 0) {
+					index_remove(mmforhp, x + i - 1);
+				}
+				__atomic_store_n(&headerp->nextx, x, __ATOMIC_RELEASE);
+				x = -1;
+				break;
+			}
+		}
+	}
+	if (locked) {
+		linlist_list_unlock(mmforhp);
+	}
+	return (x > 0) ? (x - 1) : -1;
 }
 
 /**
@@ -220,14 +447,27 @@ int linlist_delete_recordx(MMFOR_HANDLE* mmforhp, size_t x) {
 	size_t fence;
 	void* pfence;
 	void* pdelrec;
+	int nextx;
+	int spins;
 	int retval = 0;
 
+	if (stable(mmforhp)) {
+		return delete_stable(mmforhp, x);
+	}
+
 	// Lock access to table
 	linlist_list_lock(mmforhp);
 
+	// Hold off lock free appends while records move
 	headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
-	fence = headerp->nextx - 2;		// -1 to get high index, another -1 to account for header
-	if (fence < 0) {
+	nextx = __atomic_fetch_or(&headerp->nextx, LINLIST_NEXTX_CLOSED, __ATOMIC_ACQ_REL) &
+		~LINLIST_NEXTX_CLOSED;
+	fence = nextx - 2;		// -1 to get high index, another -1 to account for header
+	for (spins = 0; (nextx >= 2) && !published(mmforhp, fence + 1) &&
+		(spins < LINLIST_PUBLISH_SPINS); spins++) {
+		sched_yield();			// an append is still filling the fence record
+	}
+	if (nextx < 2) {
 		// List is empty. Can't delete
 		ULPPK_LOG(ULPPK_LOG_ERROR, "list is empty ... cannot delete");
 		retval = 1;
@@ -236,24 +476,143 @@ int linlist_delete_recordx(MMFOR_HANDLE* mmforhp, size_t x) {
 		ULPPK_LOG(ULPPK_LOG_ERROR, "Invalid record index: recordx = %d fence = %d",
 				x, fence);
 		retval = 1;
+	} else if (spins == LINLIST_PUBLISH_SPINS) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Fence record [%d] was never published", fence);
+		retval = 1;
 	} else if (fence == x) {
 		// Deleting record at the fence. Just decrement nextx
-		headerp->nextx -= 1;
+		index_remove(mmforhp, x);
+		nextx -= 1;
 		ULPPK_LOG(ULPPK_LOG_DEBUG, "Deleted fence record [%d]", x);
 	} else {
 		// Copy record at the fence to record index x and dec nextx
-		pdelrec = linlist_x2p(mmforhp, x);
+		index_remove(mmforhp, x);
+		index_relocate(mmforhp, fence, x);
+		pdelrec = mmfor_owned_write_begin(mmforhp, x + 1);
 		pfence = linlist_x2p(mmforhp, fence);
 		memcpy(pdelrec, pfence, headerp->rec_size);
+		mmfor_owned_write_end(mmforhp, x + 1);
 		ULPPK_LOG(ULPPK_LOG_DEBUG, "Deleted recordx [%d] moved record [%d]",
 				x, fence);
 
-		headerp->nextx -= 1;
+		nextx -= 1;
 	}
+	if (0 == retval) {
+		// The old fence slot is unpublished until it is claimed again
+		mmfor_owned_write_begin(mmforhp, fence + 1);
+	}
+	__atomic_store_n(&headerp->nextx, nextx, __ATOMIC_RELEASE);
 	linlist_list_unlock(mmforhp);
 	return retval;
 }
 
+/**
+ * Copy user record x to out. In a LINLIST_FLAG_LOCKFREE list this
+ * takes no lock and fails for a slot whose append has not yet
+ * published it.
+ *
+ * @param mmforhp Pointer to a memory mapped file of records (MMFOR) handle
+ * @param x Zero based index of the record
+ * @param out Receives the record
+ * @return 0 on success, non-zero if x is out of range or not published.
+ */
+int linlist_read_record(MMFOR_HANDLE* mmforhp, size_t x, void* out) {
+	int retval = 0;
+
+	if (stable(mmforhp)) {
+		// A free slot can be refilled at any time
+		mma_lock_atom_read(mmforhp->mmahp);
+		if ((x < extent(mmforhp)) && live(mmforhp, x)) {
+			memcpy(out, linlist_x2p(mmforhp, x), ((LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0))->rec_size);
+		} else {
+			retval = 1;
+		}
+		linlist_list_unlock(mmforhp);
+		return retval;
+	}
+	if ((x >= linlist_length(mmforhp)) || !published(mmforhp, x + 1)) {
+		return 1;
+	}
+	return mmfor_read_record(mmforhp, x + 1, out);
+}
+
+/**
+ * Iterate over the records of the list, skipping tombstones
+ * (LINLIST_FLAG_STABLE) and unpublished slots (LINLIST_FLAG_LOCKFREE).
+ *
+ *	for (x = 0; (p = linlist_next(mmforhp, &x)) != NULL; x++) ...
+ *
+ * @param mmforhp Pointer to a memory mapped file of records (MMFOR) handle
+ * @param xp Index to start from. Set to the index of the record found.
+ * @return Pointer to the first record at or after *xp, NULL at the end of the list.
+ */
+void* linlist_next(MMFOR_HANDLE* mmforhp, size_t* xp) {
+	size_t end;
+	size_t x;
+
+	end = extent(mmforhp);
+	for (x = *xp; x < end; x++) {
+		if (live(mmforhp, x)) {
+			*xp = x;
+			return linlist_x2p(mmforhp, x);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Move the live records of a LINLIST_FLAG_STABLE list into the holes
+ * left by deletions, so that they occupy indices 0 to length - 1 and
+ * the free list is empty. The last live record fills the first hole,
+ * and so on, so few records move. Each move is reported to relocate
+ * (if not NULL), called with the list locked. Other lists have no
+ * holes.
+ *
+ * @param mmforhp Pointer to a memory mapped file of records (MMFOR) handle
+ * @param relocate Called as relocate(arg, from, to) for each record moved.
+ * @param arg Passed to relocate.
+ * @return Number of records moved.
+ */
+long linlist_compact(MMFOR_HANDLE* mmforhp, LINLIST_RELOCATE_FN relocate, void* arg) {
+	LINEAR_LIST_HEADER* headerp;
+	size_t lo = 0;
+	size_t hi;
+	long moves = 0;
+
+	if (!stable(mmforhp)) {
+		return 0;
+	}
+	linlist_list_lock(mmforhp);
+	headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+	hi = extent(mmforhp);
+	for (;;) {
+		while ((lo < hi) && live(mmforhp, lo)) {
+			lo++;
+		}
+		while ((hi > lo) && !live(mmforhp, hi - 1)) {
+			hi--;
+		}
+		if (lo >= hi) {
+			break;
+		}
+		// lo is a hole, hi - 1 the last live record
+		index_relocate(mmforhp, hi - 1, lo);
+		memcpy(linlist_x2p(mmforhp, lo), linlist_x2p(mmforhp, hi - 1), headerp->rec_size);
+		slot(mmforhp, lo)->state = LINLIST_SLOT_LIVE;
+		slot(mmforhp, hi - 1)->state = LINLIST_SLOT_DEAD;
+		if (relocate != NULL) {
+			relocate(arg, hi - 1, lo);
+		}
+		moves++;
+	}
+	// Everything from hi on is a hole
+	headerp->free_head = 0;
+	__atomic_store_n(&headerp->nextx, hi + 1, __ATOMIC_RELEASE);
+	linlist_list_unlock(mmforhp);
+	ULPPK_LOG(ULPPK_LOG_DEBUG, "Compacted list: %ld records moved, %ld live", moves, (long)hi);
+	return moves;
+}
+
 /**
  * Lock access to the list.
  *
@@ -281,3 +640,395 @@ int linlist_list_unlock(MMFOR_HANDLE* mmforhp) {
 
 	return mma_unlock_atom(mmforhp->mmahp);
 }
+
+/**
+ * Find a record by key in a list created with linlist_create_indexed.
+ * A key shorter than the key field is matched as if padded with
+ * zero bytes. When several records have the same key, one of them
+ * is returned.
+ *
+ * @param mmforhp Pointer to a memory mapped file of records (MMFOR) handle
+ * @param key Key to look for.
+ * @param keylen Length of the key (bytes).
+ * @return Pointer to the memory mapped record, NULL if there is no
+ * such record or the list has no index.
+ */
+void* linlist_find(MMFOR_HANDLE* mmforhp, void* key, size_t keylen) {
+	unsigned char padded[LINLIST_MAX_KEY];
+	LINLIST_INDEX_HEADER* ihp;
+	LINLIST_INDEX_SLOT* slotp;
+	unsigned long long hash;
+	unsigned int mask;
+	unsigned int i;
+	void* recp = NULL;
+
+	if ((NULL == mmforhp->companion) || (keylen > index_header(mmforhp)->key_len)) {
+		return NULL;
+	}
+	mma_lock_atom_read(mmforhp->mmahp);
+	ihp = index_header(mmforhp);
+	memset(padded, 0, ihp->key_len);
+	memcpy(padded, key, keylen);
+	hash = key_hash(padded, ihp->key_len);
+	mask = ihp->nslots - 1;
+	for (i = hash & mask; (slotp = index_slot(mmforhp, i))->recx != 0; i = (i + 1) & mask) {
+		if ((slotp->hash == hash) &&
+			(0 == memcmp(linlist_x2p(mmforhp, slotp->recx - 1) + ihp->key_offset, padded, ihp->key_len))) {
+			recp = linlist_x2p(mmforhp, slotp->recx - 1);
+			break;
+		}
+	}
+	linlist_list_unlock(mmforhp);
+	return recp;
+}
+
+/*
+ * Index file path for a list.
+ */
+static void index_path(char* buf, size_t len, MMFOR_HANDLE* mmforhp) {
+	snprintf(buf, len, "%s%s", mma_get_disk_file_path(mmforhp->mmahp), LINLIST_INDEX_SUFFIX);
+}
+
+/*
+ * 64 bit FNV-1a hash of a key field.
+ */
+static unsigned long long key_hash(void* key, size_t key_len) {
+	unsigned char* p = key;
+	unsigned long long hash = 14695981039346656037ULL;
+
+	while (key_len--) {
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static LINLIST_INDEX_HEADER* index_header(MMFOR_HANDLE* mmforhp) {
+	return (LINLIST_INDEX_HEADER*)mmfor_x2p(mmforhp->companion, 0);
+}
+
+static LINLIST_INDEX_SLOT* index_slot(MMFOR_HANDLE* mmforhp, size_t i) {
+	return (LINLIST_INDEX_SLOT*)mmfor_x2p(mmforhp->companion, i + 1);
+}
+
+/*
+ * Return the slot holding user record index x, -1 if none does.
+ * The list is locked by the caller.
+ */
+static long index_lookup(MMFOR_HANDLE* mmforhp, size_t x) {
+	LINLIST_INDEX_HEADER* ihp;
+	LINLIST_INDEX_SLOT* slotp;
+	unsigned int mask;
+	unsigned int i;
+
+	ihp = index_header(mmforhp);
+	mask = ihp->nslots - 1;
+	i = key_hash(linlist_x2p(mmforhp, x) + ihp->key_offset, ihp->key_len) & mask;
+	for ( ; (slotp = index_slot(mmforhp, i))->recx != 0; i = (i + 1) & mask) {
+		if (slotp->recx == x + 1) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Index user record x. The index doubles (and is rebuilt from the
+ * records before x) when it would be over 3/4 full.
+ */
+static int index_insert(MMFOR_HANDLE* mmforhp, size_t x) {
+	LINLIST_INDEX_HEADER* ihp;
+	LINLIST_INDEX_SLOT* slotp;
+	unsigned long long hash;
+	unsigned int mask;
+	unsigned int i;
+
+	if (NULL == mmforhp->companion) {
+		return 0;
+	}
+	ihp = index_header(mmforhp);
+	if (4 * (ihp->count + 1) > 3 * ihp->nslots) {
+		// Stable lists index a record before marking it live
+		if (index_rebuild(mmforhp, 2 * ihp->nslots, stable(mmforhp) ? extent(mmforhp) : x)) {
+			return 1;
+		}
+		ihp = index_header(mmforhp);
+	}
+	hash = key_hash(linlist_x2p(mmforhp, x) + ihp->key_offset, ihp->key_len);
+	mask = ihp->nslots - 1;
+	for (i = hash & mask; (slotp = index_slot(mmforhp, i))->recx != 0; i = (i + 1) & mask);
+	slotp->hash = hash;
+	slotp->recx = x + 1;
+	ihp->count++;
+	return 0;
+}
+
+/*
+ * Drop user record x from the index. Later members of the probe
+ * run are shifted back so that no tombstones are needed.
+ */
+static void index_remove(MMFOR_HANDLE* mmforhp, size_t x) {
+	LINLIST_INDEX_HEADER* ihp;
+	LINLIST_INDEX_SLOT* slotp;
+	unsigned int mask;
+	unsigned int home;
+	unsigned int hole;
+	unsigned int j;
+	long i;
+
+	if ((NULL == mmforhp->companion) || ((i = index_lookup(mmforhp, x)) < 0)) {
+		return;
+	}
+	ihp = index_header(mmforhp);
+	mask = ihp->nslots - 1;
+	hole = i;
+	for (j = (hole + 1) & mask; (slotp = index_slot(mmforhp, j))->recx != 0; j = (j + 1) & mask) {
+		home = slotp->hash & mask;
+		// Move the entry unless its home lies cyclically in (hole, j]
+		if (((hole < j) && ((home <= hole) || (home > j))) ||
+			((hole > j) && (home <= hole) && (home > j))) {
+			*index_slot(mmforhp, hole) = *slotp;
+			hole = j;
+		}
+	}
+	memset(index_slot(mmforhp, hole), 0, sizeof(LINLIST_INDEX_SLOT));
+	ihp->count--;
+}
+
+/*
+ * User record from is about to be copied to index to.
+ */
+static void index_relocate(MMFOR_HANDLE* mmforhp, size_t from, size_t to) {
+	long i;
+
+	if ((mmforhp->companion != NULL) && ((i = index_lookup(mmforhp, from)) >= 0)) {
+		index_slot(mmforhp, i)->recx = to + 1;
+	}
+}
+
+/*
+ * Resize the index to nslots and reinsert the live records among the
+ * first length records of the list.
+ */
+static int index_rebuild(MMFOR_HANDLE* mmforhp, unsigned int nslots, size_t length) {
+	LINLIST_INDEX_HEADER* ihp;
+	size_t x;
+
+	if (mmfor_resize(mmforhp->companion, nslots + 1)) {
+		return 1;
+	}
+	ihp = index_header(mmforhp);
+	memset(index_slot(mmforhp, 0), 0, sizeof(LINLIST_INDEX_SLOT) * ihp->nslots);
+	ihp->nslots = nslots;
+	ihp->count = 0;
+	for (x = 0; x < length; x++) {
+		if (live(mmforhp, x)) {
+			index_insert(mmforhp, x);
+		}
+	}
+	ULPPK_LOG(ULPPK_LOG_DEBUG, "Rebuilt list index: %u slots %ld records", nslots, (long)length);
+	return 0;
+}
+
+/*
+ * Appends claim slots without the list lock. Indexed lists update
+ * their index under the lock, so they never do.
+ */
+static int lockfree(MMFOR_HANDLE* mmforhp) {
+	return (mmforhp->flags & MMFOR_FLAG_SEQLOCK) && (NULL == mmforhp->companion);
+}
+
+/*
+ * Is mmfor record x1 published? A sequence word is 0 before the first
+ * append fills the slot and odd while one does.
+ */
+static int published(MMFOR_HANDLE* mmforhp, size_t x1) {
+	unsigned long seq;
+
+	if (!(mmforhp->flags & MMFOR_FLAG_SEQLOCK)) {
+		return 1;
+	}
+	seq = mmfor_record_seq(mmforhp, x1);
+	return (seq != 0) && !(seq & 1);
+}
+
+/*
+ * Claim n slots at the end of the list. Returns the mmfor index of the
+ * first, or -1 if the list is too full or a delete is under way.
+ */
+static long claim(MMFOR_HANDLE* mmforhp, size_t n) {
+	LINEAR_LIST_HEADER* headerp;
+	int nextx;
+
+	headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+	nextx = __atomic_load_n(&headerp->nextx, __ATOMIC_ACQUIRE);
+	do {
+		if ((nextx & LINLIST_NEXTX_CLOSED) ||
+			(nextx + n > (size_t)__atomic_load_n(&headerp->capacity, __ATOMIC_ACQUIRE) + 1)) {
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&headerp->nextx, &nextx, nextx + n, 1,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return nextx;
+}
+
+/*
+ * Make room for n more records. The file grows geometrically and the
+ * list takes all of it. Called with the list locked.
+ */
+static int grow_list(MMFOR_HANDLE* mmforhp, size_t n) {
+	LINEAR_LIST_HEADER* headerp;
+	int nextx;
+
+	headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+	nextx = __atomic_load_n(&headerp->nextx, __ATOMIC_ACQUIRE);
+	if (nextx & LINLIST_NEXTX_CLOSED) {
+		// Only a delete holding the lock sets it: that process died
+		ULPPK_LOG(ULPPK_LOG_WARN, "Clearing append hold left by an interrupted delete");
+		nextx &= ~LINLIST_NEXTX_CLOSED;
+		__atomic_store_n(&headerp->nextx, nextx, __ATOMIC_RELEASE);
+	}
+	if (nextx + n <= (size_t)headerp->capacity + 1) {
+		return 0;
+	}
+	if (mmfor_reserve(mmforhp, nextx + n) ||
+		mmfor_resize(mmforhp, mmfor_capacity(mmforhp))) {
+		return 1;
+	}
+	headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+	__atomic_store_n(&headerp->capacity, mmfor_record_count(mmforhp) - 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Records never move: LINLIST_FLAG_STABLE. Lists whose records are
+ * too small to hold the whole header cannot have flags.
+ */
+static int stable(MMFOR_HANDLE* mmforhp) {
+	return (mmfor_record_size(mmforhp) >= sizeof(LINEAR_LIST_HEADER)) &&
+		(((LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0))->flags & LINLIST_FLAG_STABLE);
+}
+
+/*
+ * Slot word of user record x in a stable list.
+ */
+static LINLIST_SLOT* slot(MMFOR_HANDLE* mmforhp, size_t x) {
+	return (LINLIST_SLOT*)mmfor_x2p(mmforhp, x + 1);
+}
+
+/*
+ * Does user record x below the extent of the list hold a record?
+ */
+static int live(MMFOR_HANDLE* mmforhp, size_t x) {
+	if (stable(mmforhp)) {
+		return (LINLIST_SLOT_LIVE == slot(mmforhp, x)->state);
+	}
+	return published(mmforhp, x + 1);
+}
+
+/*
+ * Number of slots in use, holes included.
+ */
+static size_t extent(MMFOR_HANDLE* mmforhp) {
+	LINEAR_LIST_HEADER* headerp;
+
+	headerp = mmfor_x2p(mmforhp, 0);
+	return ((__atomic_load_n(&headerp->nextx, __ATOMIC_ACQUIRE) & ~LINLIST_NEXTX_CLOSED) - 1);
+}
+
+/*
+ * Add records to a stable list, reusing free slots first. The slot
+ * is indexed before it is marked live. On failure the records this
+ * call added are deleted again.
+ */
+static long add_stable(MMFOR_HANDLE* mmforhp, void* recs, size_t n) {
+	LINEAR_LIST_HEADER* headerp;
+	long first = -1;
+	long x1 = 0;
+	long* added;
+	size_t i;
+
+	if (NULL == (added = malloc(n * sizeof(long)))) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Unable to allocate %ld slot indices", (long)n);
+		return -1;
+	}
+	linlist_list_lock(mmforhp);
+	for (i = 0; i < n; i++) {
+		headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+		if (headerp->free_head != 0) {
+			x1 = headerp->free_head;
+			headerp->free_head = slot(mmforhp, x1 - 1)->next_free;
+		} else {
+			while (((x1 = claim(mmforhp, 1)) < 0) && !grow_list(mmforhp, 1)) {
+				;
+			}
+			if (x1 < 0) {
+				break;
+			}
+			headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+		}
+		memcpy(linlist_x2p(mmforhp, x1 - 1), (char*)recs + i * headerp->rec_size, headerp->rec_size);
+		if (index_insert(mmforhp, x1 - 1)) {
+			ULPPK_LOG(ULPPK_LOG_ERROR, "Unable to index new record");
+			free_slot(mmforhp, x1 - 1);
+			break;
+		}
+		headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+		slot(mmforhp, x1 - 1)->state = LINLIST_SLOT_LIVE;
+		headerp->live++;
+		added[i] = x1 - 1;
+		if (first < 0) {
+			first = x1 - 1;
+		}
+	}
+	if (i < n) {
+		// Keep the call all or nothing
+		headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+		while (i-- > 0) {
+			index_remove(mmforhp, added[i]);
+			free_slot(mmforhp, added[i]);
+			headerp->live--;
+		}
+		first = -1;
+	}
+	linlist_list_unlock(mmforhp);
+	free(added);
+	return first;
+}
+
+/*
+ * Delete from a stable list: tombstone the slot and put it on the
+ * free list.
+ */
+static int delete_stable(MMFOR_HANDLE* mmforhp, size_t x) {
+	LINEAR_LIST_HEADER* headerp;
+	int retval = 0;
+
+	linlist_list_lock(mmforhp);
+	if ((x >= extent(mmforhp)) || !live(mmforhp, x)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "No record at index %ld", (long)x);
+		retval = 1;
+	} else {
+		index_remove(mmforhp, x);
+		free_slot(mmforhp, x);
+		headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+		headerp->live--;
+		ULPPK_LOG(ULPPK_LOG_DEBUG, "Tombstoned record [%ld]", (long)x);
+	}
+	linlist_list_unlock(mmforhp);
+	return retval;
+}
+
+/*
+ * Mark slot x dead and push it on the free list.
+ */
+static void free_slot(MMFOR_HANDLE* mmforhp, size_t x) {
+	LINEAR_LIST_HEADER* headerp;
+	LINLIST_SLOT* slotp;
+
+	headerp = (LINEAR_LIST_HEADER*)mmfor_x2p(mmforhp, 0);
+	slotp = slot(mmforhp, x);
+	slotp->state = LINLIST_SLOT_DEAD;
+	slotp->next_free = headerp->free_head;
+	headerp->free_head = x + 1;
+}
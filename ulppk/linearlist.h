@@ -53,6 +53,38 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  *      Consequently, deletion will cause ordering of the records
  *      in the list to change (unless the record being deleted is at the
  *      end of the list.)
+ *
+ *      A list created with linlist_create_indexed has a companion hash
+ *      index file (the list path plus LINLIST_INDEX_SUFFIX) keyed on a
+ *      fixed size field of the records. The index is an open addressing
+ *      (linear probing) table of key hash and record index, kept in step
+ *      by add and delete, including the relocation of the fence record.
+ *      linlist_open attaches the index when it exists. linlist_find
+ *      then locates a record by key without scanning the list.
+ *
+ *      A list created with LINLIST_FLAG_LOCKFREE (and no index) adds
+ *      records without the list lock: producers claim slots with an
+ *      atomic update of nextx, then fill them. Each record has a sequence
+ *      word (MMFOR_FLAG_SEQLOCK) that is odd or zero until the record is
+ *      published. linlist_read_record skips unpublished slots, so readers
+ *      never see half written records. Deletion still takes the lock and
+ *      holds off lock free appends (LINLIST_NEXTX_CLOSED) while it moves
+ *      the fence record. Growing the file remaps it through the handle
+ *      of the appender that grows it, which may move the mapping under
+ *      another append in flight on the same handle. Each thread that
+ *      appends lock free must therefore use its own MMFOR_HANDLE (a
+ *      process forked after the open has its own copy).
+ *
+ *      A list created with LINLIST_FLAG_STABLE never moves records, so
+ *      record indices held by other processes stay valid. Pointers do
+ *      not: growing the list may remap the file to another address, so
+ *      a pointer must be refetched from its index after any addition.
+ *      Each record is preceded by a LINLIST_SLOT. Deletion marks the slot
+ *      dead (a tombstone) and pushes it on a free list threaded through
+ *      the dead slots, and additions reuse free slots before extending
+ *      the list. Both are O(1). linlist_next iterates over live records.
+ *      linlist_compact moves live records into the holes when asked,
+ *      reporting each move to the caller.
  */
 
 #ifndef LINEARLIST_H_
@@ -69,8 +101,28 @@ typedef struct {
 	int nextx;       ///< next available record index
 	int capacity;    ///< number of user records this list can store
 	size_t rec_size; ///< size of the records
+	unsigned int flags;		///< LINLIST_FLAG_... (only if records are large enough to hold it)
+	unsigned int free_head;	///< LINLIST_FLAG_STABLE: first free slot index + 1, 0 if none
+	unsigned int live;		///< LINLIST_FLAG_STABLE: number of live records
+	unsigned int spare;		///< keep alignment nice
 } LINEAR_LIST_HEADER ;
 
+/**
+ * Slot state word preceding each record of a LINLIST_FLAG_STABLE list.
+ */
+typedef struct {
+	unsigned int state;		///< LINLIST_SLOT_LIVE or LINLIST_SLOT_DEAD
+	unsigned int next_free;	///< dead slots: next free slot index + 1, 0 at the end
+} LINLIST_SLOT;
+
+#define LINLIST_SLOT_LIVE 1		///< Slot holds a record
+#define LINLIST_SLOT_DEAD 2		///< Slot is a tombstone on the free list
+
+/**
+ * Called by linlist_compact for each record it moves.
+ */
+typedef void (*LINLIST_RELOCATE_FN)(void* arg, size_t from, size_t to);
+
 /**
  *
  * This can be used by union types to distinguish between data
@@ -81,21 +133,58 @@ typedef enum {
 	LINLIST_RECTYPE_DATA			///< Data record
 } LINEAR_LIST_RECTYPE;
 
+#define LINLIST_FLAG_LOCKFREE 0x0001		///< Add records without the list lock
+#define LINLIST_FLAG_STABLE 0x0002		///< Tombstones and a free list: records never move
+#define LINLIST_NEXTX_CLOSED 0x40000000	///< Set in nextx while a delete holds off appends
+#define LINLIST_PUBLISH_SPINS 100000	///< Max waits for an append to publish a record
+#define LINLIST_INDEX_SUFFIX ".idx"	///< Appended to the list path to name its index
+#define LINLIST_MAX_KEY 256			///< Largest key field an index supports (bytes)
+
+/**
+ * Hash index header. This is record 0 of the index file.
+ * Slot i is record i + 1.
+ */
+typedef struct {
+	unsigned int key_offset;	///< offset of the key field in a list record
+	unsigned int key_len;		///< size of the key field (bytes)
+	unsigned int nslots;		///< number of slots (a power of 2)
+	unsigned int count;			///< slots in use
+} LINLIST_INDEX_HEADER;
+
+/**
+ * Hash index slot.
+ */
+typedef struct {
+	unsigned long long hash;	///< hash of the record's key field
+	unsigned long long recx;	///< user record index + 1 (0 if the slot is empty)
+} LINLIST_INDEX_SLOT;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 	void* linlist_add_record(MMFOR_HANDLE* mmforhp, void* userp);
+	long linlist_add_records(MMFOR_HANDLE* mmforhp, void* recs, size_t n);
 	size_t linlist_capacity(MMFOR_HANDLE* mmforhp);
 	int linlist_close(MMFOR_HANDLE* mmforhp);
+	long linlist_compact(MMFOR_HANDLE* mmforhp, LINLIST_RELOCATE_FN relocate, void* arg);
 	MMFOR_HANDLE* linlist_create(char* filepath,  MMA_ACCESS_MODES mode,
 			MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs);
+	MMFOR_HANDLE* linlist_create_flags(char* filepath,  MMA_ACCESS_MODES mode,
+			MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs,
+			unsigned int list_flags);
+	MMFOR_HANDLE* linlist_create_indexed(char* filepath,  MMA_ACCESS_MODES mode,
+			MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs,
+			size_t key_offset, size_t key_len);
+	void* linlist_find(MMFOR_HANDLE* mmforhp, void* key, size_t keylen);
 	size_t linlist_length(MMFOR_HANDLE* mmforhp);
 	int linlist_list_lock(MMFOR_HANDLE* mmforhp);
 	int linlist_list_unlock(MMFOR_HANDLE* mmforhp);
 	int linlist_delete_recordx(MMFOR_HANDLE* mmforhp, size_t x);
 	int linlist_delete_recordp(MMFOR_HANDLE* mmforhp, void* p);
 	MMFOR_HANDLE* linlist_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags);
+	void* linlist_next(MMFOR_HANDLE* mmforhp, size_t* xp);
 	size_t linlist_p2x(MMFOR_HANDLE* mmforhp, void*p);
+	int linlist_read_record(MMFOR_HANDLE* mmforhp, size_t x, void* out);
 	void* linlist_x2p(MMFOR_HANDLE* mmforhp, size_t x);
 
 #ifdef __cplusplus
@@ -44,6 +44,7 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * and dumping memory mapped atoms.
  */
 
+#define _GNU_SOURCE		// fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,6 +54,7 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 #include <errno.h>
 
 #include <mmatom.h>
+#include <ioutils.h>
 
 int mma_error = 0;
 int mma_os_error = 0;
@@ -96,7 +98,10 @@ char* mma_strerror(char* buff, size_t len) {
  		"Requested map size exceeds underlying disk file size",
  		"Error obtaining memory mapped file's file status",
  		"Error setting mandatory lock for memory mapped file",
-		"Illegal file name. Possible NULL pointer to char"
+		"Illegal file name. Possible NULL pointer to char",
+		"Error copying a dump of a memory mapped atom",
+		"Not a dump of the expected kind of memory mapped atom",
+		"Not a file of records of this version, or its length disagrees with its header"
  	};
  	
  	memset(buff, 0, len);
@@ -181,45 +186,23 @@ char* mma_strerror(char* buff, size_t len) {
  			// the file. This is necessary if we did a file create. Also
  			// necessary is to set the file mode to MANDATORY LOCKING.
  			if (oflags & O_CREAT) {
- 				if (lseek(dfrefp->filedes, dfrefp->len - 1, SEEK_SET) == -1) {
+ 				// Reserve the blocks without writing them, so that a large
+ 				// file is sized in constant time and later page faults
+ 				// cannot fail for lack of space. File systems without
+ 				// fallocate get a sparse file.
+ 				if (fallocate(dfrefp->filedes, 0, 0, dfrefp->len) &&
+ 					((errno != EOPNOTSUPP) || ftruncate(dfrefp->filedes, dfrefp->len))) {
  					mma_error = MMA_ERR_FILE_SET_SIZE;
  					mma_os_error = errno;
+ 					close(dfrefp->filedes);
+ 					free(dfrefp);
+ 					dfrefp = NULL;
+ 				} else if (set_mandatory_locking(dfrefp->filedes)) {
+ 					// Error setting mandatory locking mode
+ 					// error codes already captured.
+ 					close(dfrefp->filedes);
  					free(dfrefp);
  					dfrefp = NULL;
- 				} else {
- 					int xoflags;
- 					char buff[] = {'\0','\0'};
- 					if (write(dfrefp->filedes, buff,1) != 1) {
- 						mma_error = MMA_ERR_FILE_SET_SIZE;
- 						mma_os_error = errno;
- 						free(dfrefp);
- 						dfrefp = NULL;
- 					} else {
-	 					// Successful write ... close and reopen file.
-	 					if (close(dfrefp->filedes)) {
-	 						fprintf(stderr, 
-	 							"mma_new_disk_file_ref: FATAL ERROR Closing File \n%s\n",
-	 							strerror(errno));
-	 							exit(1);
-	 					}
-	 					xoflags = oflags;
-	 					if (oflags & O_CREAT) {
-	 						xoflags ^= O_CREAT;		// clear creation bit
-	 					}
-	 					if (oflags & O_TRUNC) {
-	 						xoflags ^= O_TRUNC;		// clear truncation bit
-	 					}
- 						dfrefp->filedes = open(dfrefp->str_pathname, xoflags);
- 						
- 						// Set the file mode up for mandatory locking
- 						if (set_mandatory_locking(dfrefp->filedes)) {
- 							// Error setting mandatory locking mode
- 							// error codes already captured.
- 							close(dfrefp->filedes);
- 							free(dfrefp);
- 							dfrefp = NULL;
- 						}
- 					}
  				}
  			} else {
  				// Just opening the file ... determine file size
@@ -402,6 +385,181 @@ int mma_unlock_atom(MMA_HANDLE* mmahp) {
 	return lock_cntrl(mmahp, F_SETLK, F_UNLCK);
 }
 
+/**
+ * @brief Change the length of the mapped region of an atom.
+ *
+ * The region is extended in place if possible, otherwise it moves:
+ * pointers into the old region are then no longer valid. Used when the
+ * backing file has grown (see mma_grow).
+ *
+ * If an error is encountered, writes an error code to mma_error.
+ *
+ * @param mmahp Pointer to MMA_HANDLE structure.
+ * @param len Required length of the mapped region in bytes.
+ * @return 0 on success, non-zero on failure (the old mapping remains).
+ */
+int mma_remap(MMA_HANDLE* mmahp, size_t len) {
+	void* pa;
+
+	if (len == mmahp->mm_ref.len) {
+		return 0;
+	}
+	pa = mremap(mmahp->mm_ref.pa, mmahp->mm_ref.len, len, 0);
+	if (MAP_FAILED == pa) {
+		pa = mremap(mmahp->mm_ref.pa, mmahp->mm_ref.len, len, MREMAP_MAYMOVE);
+	}
+	if (MAP_FAILED == pa) {
+		mma_error = MMA_ERR_MAP_FAILED;
+		mma_os_error = errno;
+		return 1;
+	}
+	mmahp->mm_ref.pa = pa;
+	mmahp->mm_ref.len = len;
+	return 0;
+}
+
+/**
+ * @brief Extend the backing file of an atom and map the new length.
+ *
+ * The file is extended with ftruncate (the new part reads as zeros and
+ * takes no disk blocks until written). A file already long enough, e.g.
+ * grown by another process, is left as it is.
+ *
+ * If an error is encountered, writes an error code to mma_error.
+ *
+ * @param mmahp Pointer to MMA_HANDLE structure.
+ * @param len Required length of the file and mapped region in bytes.
+ * @return 0 on success, non-zero on failure.
+ */
+int mma_grow(MMA_HANDLE* mmahp, size_t len) {
+	struct stat statbuf;
+	off_t flen;
+
+	flen = (off_t)len;
+	if ((flen < 0) || ((size_t)flen != len)) {
+		mma_error = MMA_ERR_FILE_SET_SIZE;
+		mma_os_error = EFBIG;
+		return 1;
+	}
+	if (fstat(mmahp->mm_ref.filedes, &statbuf) < 0) {
+		mma_error = MMA_ERR_FILE_STATUS;
+		mma_os_error = errno;
+		return 1;
+	}
+	if ((statbuf.st_size < flen) && ftruncate(mmahp->mm_ref.filedes, flen)) {
+		mma_error = MMA_ERR_FILE_SET_SIZE;
+		mma_os_error = errno;
+		return 1;
+	}
+	if ((MMT_FILE == mmahp->obj_type) && (mmahp->u.df_refp->len < flen)) {
+		mmahp->u.df_refp->len = flen;
+	}
+	return mma_remap(mmahp, len);
+}
+
+
+/**
+ * @brief Write a dump of an atom: a header, then an image of its first
+ * hdrp->length bytes.
+ *
+ * The image of a shared file mapping is copied from the file in the
+ * kernel (ioutils_copy_range: copy_file_range, else sendfile); that of
+ * a private mapping, or what the kernel cannot copy, is written from
+ * the mapped region in large writes. fd may be a file, pipe or socket;
+ * the dump is written at its file position. The caller fills in the
+ * kind, flags, length and geometry of the header and locks the atom
+ * as its layer requires.
+ *
+ * If an error is encountered, writes an error code to mma_error.
+ *
+ * @param mmahp Pointer to MMA_HANDLE structure.
+ * @param fd Descriptor to write the dump to.
+ * @param hdrp Dump header. The magic number and version are set here.
+ * @return 0 on success, non-zero on failure.
+ */
+int mma_dump(MMA_HANDLE* mmahp, int fd, MMA_DUMP_HEADER* hdrp) {
+	size_t done = 0;
+	size_t len;
+
+	hdrp->magic = MMA_DUMP_MAGIC;
+	hdrp->version = MMA_DUMP_VERSION;
+	len = hdrp->length;
+	if (len > mmahp->mm_ref.len) {
+		mma_error = MMA_FILE_MAP_SIZE;
+		mma_os_error = EINVAL;
+		return 1;
+	}
+	if (ioutils_writen(fd, hdrp, sizeof(MMA_DUMP_HEADER)) != sizeof(MMA_DUMP_HEADER)) {
+		mma_error = MMA_ERR_DUMP_IO;
+		mma_os_error = errno;
+		return 1;
+	}
+	if (!(mmahp->mm_ref.flags & MAP_PRIVATE)) {
+		done = ioutils_copy_range(mmahp->mm_ref.filedes, 0, fd, -1, len);
+	}
+	if ((done < len) &&
+		(ioutils_writen(fd, mmahp->mm_ref.pa + done, len - done) != len - done)) {
+		mma_error = MMA_ERR_DUMP_IO;
+		mma_os_error = errno;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Read the header of a dump written by mma_dump and check that
+ * it is a dump of the expected kind.
+ *
+ * If an error is encountered, writes an error code to mma_error.
+ *
+ * @param fd Descriptor positioned at the start of the dump.
+ * @param kind Expected MMA_DUMP_KIND.
+ * @param hdrp Receives the header.
+ * @return 0 on success, non-zero on failure.
+ */
+int mma_dump_header(int fd, MMA_DUMP_KIND kind, MMA_DUMP_HEADER* hdrp) {
+	if (ioutils_readn(fd, hdrp, sizeof(MMA_DUMP_HEADER)) != sizeof(MMA_DUMP_HEADER)) {
+		mma_error = MMA_ERR_DUMP_IO;
+		mma_os_error = errno;
+		return 1;
+	}
+	if ((hdrp->magic != MMA_DUMP_MAGIC) || (hdrp->version != MMA_DUMP_VERSION) ||
+		(hdrp->kind != kind)) {
+		mma_error = MMA_ERR_DUMP_FORMAT;
+		mma_os_error = EINVAL;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Load the image of a dump into an atom.
+ *
+ * The image is read straight into the mapped region, with no buffer
+ * in between. The atom must be at least hdrp->length bytes long and is
+ * normally one just created by the layer that owns the dump, from the
+ * geometry in the header.
+ *
+ * If an error is encountered, writes an error code to mma_error.
+ *
+ * @param mmahp Pointer to MMA_HANDLE structure.
+ * @param fd Descriptor positioned after the header (see mma_dump_header).
+ * @param hdrp Dump header.
+ * @return 0 on success, non-zero on failure.
+ */
+int mma_load(MMA_HANDLE* mmahp, int fd, MMA_DUMP_HEADER* hdrp) {
+	if (hdrp->length > mmahp->mm_ref.len) {
+		mma_error = MMA_FILE_MAP_SIZE;
+		mma_os_error = EINVAL;
+		return 1;
+	}
+	if (ioutils_readn(fd, mmahp->mm_ref.pa, hdrp->length) != hdrp->length) {
+		mma_error = MMA_ERR_DUMP_IO;
+		mma_os_error = errno;
+		return 1;
+	}
+	return 0;
+}
 
 /**
  * Retrieve data reference pointer from a handle
@@ -487,6 +645,7 @@ static MMA_HANDLE* create_atom(int filedes,
 	mmhp->mm_ref.addr = (void*)0;
 	mmhp->mm_ref.off = 0;
 	mmhp->mm_ref.filedes = filedes;
+	mmhp->lock_type = F_UNLCK;
 	mmhp->mm_ref.pa = mmap(
 		mmhp->mm_ref.addr,
 		mmhp->mm_ref.len,
@@ -536,7 +695,11 @@ static int lock_cntrl(MMA_HANDLE* mmahp, int cmd, int type) {
 	lock.l_whence = SEEK_SET;
 	lock.l_len = 0;			// 0 means to EOF
 
-	return (fcntl(mmahp->mm_ref.filedes, cmd, &lock));
+	if (fcntl(mmahp->mm_ref.filedes, cmd, &lock)) {
+		return -1;
+	}
+	mmahp->lock_type = type;
+	return 0;
 }
 
 
@@ -574,7 +737,7 @@ int mma_destroy_atom(MMA_HANDLE* mmahp) {
 		// No other object types defined yet!
 		break;
 	}
-	status = munmap(mmahp->mm_ref.addr, mmahp->mm_ref.len);
+	status = munmap(mmahp->mm_ref.pa, mmahp->mm_ref.len);
 	free(mmahp);
 	return status;
 }
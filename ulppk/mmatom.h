@@ -96,6 +96,35 @@ typedef enum {
 
 #define MMA_MAX_TAG_LEN 256
 
+#define MMA_DUMP_MAGIC 0x444d4d55		///< "UMMD": start of a dump of an atom
+#define MMA_DUMP_VERSION 1				///< Dump header layout version
+
+/**
+ * What a dump holds. Each layer that exports its files names its own.
+ */
+typedef enum {
+	MMA_DUMP_RAW = 0,			///< image of an atom, no geometry
+	MMA_DUMP_MMFOR,				///< file of records (mmfor.c, linearlist.c)
+	MMA_DUMP_DEQUE,				///< memory mapped deque (mmdeque.c)
+	MMA_DUMP_POOL_BPMF,			///< buffer pool management file (mmpool.c)
+	MMA_DUMP_POOL_BPCF			///< buffer pool contents file (mmpool.c)
+} MMA_DUMP_KIND;
+
+/**
+ * Header written before the image of an atom by mma_dump. The
+ * geometry fields are filled in by the layer that owns the file,
+ * which uses them to recreate it before loading the image.
+ */
+typedef struct _mma_dump_header {
+	unsigned int magic;				///< MMA_DUMP_MAGIC
+	unsigned int version;			///< MMA_DUMP_VERSION
+	unsigned int kind;				///< MMA_DUMP_KIND
+	unsigned int flags;				///< layer specific flags
+	unsigned long long length;		///< bytes of image after the header
+	unsigned long long rec_size;	///< record or item size (bytes)
+	unsigned long long nrecs;		///< number of records or items
+} MMA_DUMP_HEADER;
+
 /**
  * Memory mapped atom handle. This structure is used to reference
  * and access the memory mapped atom.
@@ -109,6 +138,7 @@ typedef struct {
 		void* void_refp;			///< Pointer to TBD backing object reference
 	} u;
 	MMA_MEMMAP_REF mm_ref;			///< pointer to memorary mapped region reference structure
+	int lock_type;					///< whole atom lock held via this handle (F_RDLCK, F_WRLCK, F_UNLCK)
 } MMA_HANDLE;
 
 
@@ -119,6 +149,9 @@ typedef struct {
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+extern int mma_error;			///< MMA_ERR_... code of the last error
+extern int mma_os_error;		///< errno of the last error
  
  char* mma_strerror(char* buff, size_t len);
 /*
@@ -172,6 +205,31 @@ int mma_lock_atom_write(MMA_HANDLE* mmahp);
  */
 int mma_unlock_atom(MMA_HANDLE* mmahp);
 
+/*
+ * Map len bytes of the backing file, e.g. after another process grew it.
+ */
+int mma_remap(MMA_HANDLE* mmahp, size_t len);
+
+/*
+ * Extend the backing file to at least len bytes and map all of it.
+ */
+int mma_grow(MMA_HANDLE* mmahp, size_t len);
+
+/*
+ * Write a dump header and the first hdrp->length bytes of an atom to a file.
+ */
+int mma_dump(MMA_HANDLE* mmahp, int fd, MMA_DUMP_HEADER* hdrp);
+
+/*
+ * Read and check the header of a dump.
+ */
+int mma_dump_header(int fd, MMA_DUMP_KIND kind, MMA_DUMP_HEADER* hdrp);
+
+/*
+ * Read the image that follows a dump header into an atom.
+ */
+int mma_load(MMA_HANDLE* mmahp, int fd, MMA_DUMP_HEADER* hdrp);
+
 /*
  * Access method ... get a disk file atom's file path. Returns NULL if atom is
  * not open or if not a disk file based memory mapped atom.
@@ -205,5 +263,8 @@ int mma_destroy_atom(MMA_HANDLE* mmahp);
  #define MMA_ERR_FILE_STATUS 8
  #define MMA_MANDATORY_LOCK_FAIL 9
  #define MMA_INVALID_FILENAME 10
+ #define MMA_ERR_DUMP_IO 11
+ #define MMA_ERR_DUMP_FORMAT 12
+ #define MMA_ERR_FOR_FORMAT 13
  
 #endif /*MMATOM_H_*/
@@ -0,0 +1,926 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file mmbtree.c
+ *
+ * @brief Memory Mapped B+tree
+ *
+ * An ordered index of fixed size keys and values shared by processes.
+ * The tree lives in a memory mapped file of records (mmfor) whose
+ * records are fixed size pages: page 0 is the tree header, the rest
+ * are leaf and branch pages. Leaves are chained left to right, so a
+ * range scan descends once and then walks the chain (see
+ * mmbt_cursor_seek and mmbt_cursor_next). The file grows as pages are
+ * added (see mmfor_resize).
+ *
+ * Writers take a write lock on the file and make the header sequence
+ * word odd while they change the tree. Readers take no lock: they note
+ * the sequence word, search, copy out what they found and retry if the
+ * word changed meanwhile (the scheme of mmfor_read_record). Every page
+ * number and key count a reader uses is range checked, so a search
+ * that races a writer fails its check or its retry rather than
+ * straying. After MMBT_READ_SPINS attempts a reader takes a read lock.
+ *
+ * Deleting keys does not merge pages. Empty leaves stay on the chain
+ * and are skipped by scans. mmbt_bulk_load builds a packed tree from
+ * sorted input in one pass.
+ *
+ * The ordering of keys is recorded in the file (MMBT_KEY_TYPE) so that
+ * all processes agree on it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include <mmbtree.h>
+#include <ulppk_log.h>
+
+/* Cursor states */
+#define CURSOR_FIRST 0		///< next key is the first in the tree
+#define CURSOR_FROM 1		///< next key is the first >= key
+#define CURSOR_AFTER 2		///< next key is the first > key
+#define CURSOR_END 3		///< scan is over
+
+/* Optimistic read of the tree (see read_begin) */
+typedef struct {
+	MMBT_HANDLE* mmbthp;
+	unsigned long seq;
+	int tries;
+	int locked;
+} TREE_READ;
+
+static MMBT_HANDLE* open_handle(MMFOR_HANDLE* mmforhp);
+
+static int compare_bytes(const void* a, const void* b, size_t len);
+
+static int compare_ulong(const void* a, const void* b, size_t len);
+
+static MMBT_HEADER* header(MMBT_HANDLE* mmbthp);
+
+static MMBT_PAGE* page(MMBT_HANDLE* mmbthp, unsigned int pg);
+
+static void* leaf_key(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i);
+
+static void* leaf_value(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i);
+
+static unsigned int* branch_child(MMBT_PAGE* pp);
+
+static void* branch_key(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i);
+
+static size_t search(MMBT_HANDLE* mmbthp, void* keys, size_t n, void* key, int after);
+
+static int locate(MMBT_HANDLE* mmbthp, void* key, int state, unsigned int* pagep, unsigned int* posp);
+
+static int read_begin(TREE_READ* readp);
+
+static int read_retry(TREE_READ* readp);
+
+static void read_end(TREE_READ* readp);
+
+static int write_begin(MMBT_HANDLE* mmbthp);
+
+static void write_end(MMBT_HANDLE* mmbthp);
+
+static unsigned int alloc_page(MMBT_HANDLE* mmbthp, MMBT_PAGE_TYPE type);
+
+static void leaf_put(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i, void* key, void* value);
+
+static void branch_put(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i, void* key, unsigned int child);
+
+static unsigned int leaf_insert(MMBT_HANDLE* mmbthp, unsigned int pg, size_t i,
+	void* key, void* value, void* sep);
+
+static unsigned int branch_insert(MMBT_HANDLE* mmbthp, unsigned int pg, size_t i,
+	void* key, unsigned int child, void* sep);
+
+/**
+ * @brief Create a B+tree file.
+ *
+ * @param filepath Pathname of the file to be created.
+ * @param mode Memory mapped atom access mode. (see mmatom.h)
+ * @param flags Shared/private (see mmatom.h)
+ * @param permissions access permissions (see man open(2))
+ * @param key_type How keys are ordered
+ * @param key_size Key size in bytes (sizeof(unsigned long) for MMBT_KEY_ULONG)
+ * @param value_size Value size in bytes
+ * @param page_size Page size in bytes. Leaf and branch pages must
+ * 	hold at least MMBT_MIN_FANOUT keys.
+ * @return B+tree handle, NULL on error (errno EINVAL for a bad geometry).
+ */
+MMBT_HANDLE* mmbt_create(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags,
+	int permissions, MMBT_KEY_TYPE key_type, size_t key_size, size_t value_size, size_t page_size) {
+	MMFOR_HANDLE* mmforhp;
+	MMBT_HEADER* hdrp;
+	MMBT_PAGE* pp;
+	size_t leaf_cap;
+	size_t branch_cap;
+
+	leaf_cap = (page_size - sizeof(MMBT_PAGE)) / (key_size + value_size);
+	branch_cap = (page_size - sizeof(MMBT_PAGE) - sizeof(unsigned int)) /
+		(key_size + sizeof(unsigned int));
+	if ((0 == key_size) || (key_size > MMBT_MAX_KEY) ||
+		((MMBT_KEY_ULONG == key_type) && (key_size != sizeof(unsigned long))) ||
+		(page_size < sizeof(MMBT_HEADER)) || (page_size <= sizeof(MMBT_PAGE) + sizeof(unsigned int)) ||
+		(leaf_cap < MMBT_MIN_FANOUT) || (branch_cap < MMBT_MIN_FANOUT)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "B+tree %s: key size %ld value size %ld do not fit page size %ld",
+			filepath, (long)key_size, (long)value_size, (long)page_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	// Page 0 is the header, page 1 the (empty leaf) root
+	mmforhp = mmfor_create(filepath, mode, flags, permissions, page_size, 2);
+	if (NULL == mmforhp) {
+		return NULL;
+	}
+	hdrp = (MMBT_HEADER*)mmfor_x2p(mmforhp, 0);
+	hdrp->version = MMBT_VERSION;
+	hdrp->key_type = key_type;
+	hdrp->key_size = key_size;
+	hdrp->value_size = value_size;
+	hdrp->leaf_cap = leaf_cap;
+	hdrp->branch_cap = branch_cap;
+	hdrp->root = 1;
+	hdrp->height = 1;
+	hdrp->seq = 0;
+	hdrp->count = 0;
+	pp = (MMBT_PAGE*)mmfor_x2p(mmforhp, 1);
+	pp->type = MMBT_PAGE_LEAF;
+	return open_handle(mmforhp);
+}
+
+/**
+ * @brief Open an existing B+tree file.
+ *
+ * @param filepath Pathname of the file.
+ * @param mode Memory mapped atom access mode. (see mmatom.h)
+ * @param flags Shared/private (see mmatom.h)
+ * @return B+tree handle, NULL on error (errno EINVAL if the file
+ * 	is not a B+tree).
+ */
+MMBT_HANDLE* mmbt_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags) {
+	MMFOR_HANDLE* mmforhp;
+
+	mmforhp = mmfor_open(filepath, mode, flags);
+	if (NULL == mmforhp) {
+		return NULL;
+	}
+	if ((mmfor_record_size(mmforhp) < sizeof(MMBT_HEADER)) ||
+		(((MMBT_HEADER*)mmfor_x2p(mmforhp, 0))->version != MMBT_VERSION)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "%s is not a B+tree file", filepath);
+		mmfor_close(mmforhp);
+		errno = EINVAL;
+		return NULL;
+	}
+	return open_handle(mmforhp);
+}
+
+/**
+ * @brief Close a B+tree.
+ *
+ * @param mmbthp B+tree handle
+ * @return 0 on success, non-zero on failure.
+ */
+int mmbt_close(MMBT_HANDLE* mmbthp) {
+	int status;
+
+	status = mmfor_close(mmbthp->mmforhp);
+	free(mmbthp->scratch);
+	free(mmbthp);
+	return status;
+}
+
+/**
+ * @brief Insert a key, or replace the value of a key already in the tree.
+ *
+ * @param mmbthp B+tree handle
+ * @param key Key (key_size bytes)
+ * @param value Value (value_size bytes)
+ * @return 0 if the key was added, 1 if its value was replaced, -1 on error.
+ */
+int mmbt_insert(MMBT_HANDLE* mmbthp, void* key, void* value) {
+	unsigned int path[MMBT_MAX_HEIGHT];
+	size_t slots[MMBT_MAX_HEIGHT];
+	unsigned char sep[MMBT_MAX_KEY];
+	unsigned char upsep[MMBT_MAX_KEY];
+	MMBT_HEADER* hdrp;
+	MMBT_PAGE* pp;
+	unsigned int newpg;
+	unsigned int pg;
+	unsigned int level;
+	int depth = 0;
+	size_t i;
+	int retval = 0;
+
+	if (write_begin(mmbthp)) {
+		return -1;
+	}
+	hdrp = header(mmbthp);
+	// Splits never fail part way: reserve a page per level plus a new root
+	if (mmfor_reserve(mmbthp->mmforhp, mmfor_record_count(mmbthp->mmforhp) + hdrp->height + 1)) {
+		write_end(mmbthp);
+		return -1;
+	}
+	hdrp = header(mmbthp);
+	pg = hdrp->root;
+	for (level = hdrp->height; level > 1; level--) {
+		pp = page(mmbthp, pg);
+		i = search(mmbthp, branch_key(mmbthp, pp, 0), pp->nkeys, key, 1);
+		path[depth] = pg;
+		slots[depth] = i;
+		depth++;
+		pg = branch_child(pp)[i];
+	}
+	pp = page(mmbthp, pg);
+	i = search(mmbthp, leaf_key(mmbthp, pp, 0), pp->nkeys, key, 0);
+	if ((i < pp->nkeys) && (0 == mmbthp->compare(leaf_key(mmbthp, pp, i), key, mmbthp->key_size))) {
+		memcpy(leaf_value(mmbthp, pp, i), value, mmbthp->value_size);
+		retval = 1;
+	} else {
+		newpg = leaf_insert(mmbthp, pg, i, key, value, sep);
+		// Carry splits up the path
+		while (newpg != 0) {
+			if (0 == depth) {
+				pg = alloc_page(mmbthp, MMBT_PAGE_BRANCH);
+				hdrp = header(mmbthp);
+				pp = page(mmbthp, pg);
+				branch_child(pp)[0] = hdrp->root;
+				branch_put(mmbthp, pp, 0, sep, newpg);
+				hdrp->root = pg;
+				hdrp->height++;
+				break;
+			}
+			depth--;
+			newpg = branch_insert(mmbthp, path[depth], slots[depth], sep, newpg, upsep);
+			memcpy(sep, upsep, mmbthp->key_size);
+		}
+		header(mmbthp)->count++;
+	}
+	write_end(mmbthp);
+	return retval;
+}
+
+/**
+ * @brief Remove a key from the tree.
+ *
+ * @param mmbthp B+tree handle
+ * @param key Key (key_size bytes)
+ * @return 0 if the key was removed, 1 if it was not in the tree, -1 on error.
+ */
+int mmbt_delete(MMBT_HANDLE* mmbthp, void* key) {
+	MMBT_PAGE* pp;
+	unsigned int pg;
+	unsigned int pos;
+	size_t n;
+	int retval = 1;
+
+	if (write_begin(mmbthp)) {
+		return -1;
+	}
+	if (locate(mmbthp, key, CURSOR_FROM, &pg, &pos)) {
+		retval = -1;
+	} else {
+		pp = page(mmbthp, pg);
+		n = pp->nkeys;
+		if ((pos < n) && (0 == mmbthp->compare(leaf_key(mmbthp, pp, pos), key, mmbthp->key_size))) {
+			memmove(leaf_key(mmbthp, pp, pos), leaf_key(mmbthp, pp, pos + 1),
+				(n - pos - 1) * mmbthp->key_size);
+			memmove(leaf_value(mmbthp, pp, pos), leaf_value(mmbthp, pp, pos + 1),
+				(n - pos - 1) * mmbthp->value_size);
+			pp->nkeys--;
+			header(mmbthp)->count--;
+			retval = 0;
+		}
+	}
+	write_end(mmbthp);
+	return retval;
+}
+
+/**
+ * @brief Look up a key.
+ *
+ * Takes no lock unless writers keep the tree busy (see MMBT_READ_SPINS).
+ *
+ * @param mmbthp B+tree handle
+ * @param key Key (key_size bytes)
+ * @param value Receives the value (value_size bytes) if the key is found.
+ * 	May be NULL.
+ * @return 0 if the key was found, 1 if not, -1 on error (the tree was
+ * 	left inconsistent by a writer that died).
+ */
+int mmbt_find(MMBT_HANDLE* mmbthp, void* key, void* value) {
+	TREE_READ tr = { mmbthp, 0, 0, 0 };
+	MMBT_PAGE* pp;
+	unsigned int pg;
+	unsigned int pos;
+	int retval;
+
+	do {
+		if (read_begin(&tr)) {
+			retval = -1;
+			break;
+		}
+		retval = locate(mmbthp, key, CURSOR_FROM, &pg, &pos);
+		if (0 == retval) {
+			pp = page(mmbthp, pg);
+			if ((pos < pp->nkeys) &&
+				(0 == mmbthp->compare(leaf_key(mmbthp, pp, pos), key, mmbthp->key_size))) {
+				if (value != NULL) {
+					memcpy(value, leaf_value(mmbthp, pp, pos), mmbthp->value_size);
+				}
+			} else {
+				retval = 1;
+			}
+		}
+	} while (read_retry(&tr));
+	read_end(&tr);
+	return retval;
+}
+
+/**
+ * @brief Build the tree from keys in ascending order.
+ *
+ * Leaves are filled completely and written left to right, then each
+ * level of branches above them, so n keys cost one pass and about
+ * n / leaf_cap pages. The tree must be empty.
+ *
+ * @param mmbthp B+tree handle
+ * @param keys n keys (key_size bytes each), strictly ascending
+ * @param values n values (value_size bytes each)
+ * @param n Number of keys
+ * @return 0 on success, non-zero on failure (errno EINVAL if the keys
+ * 	are not ascending, EEXIST if the tree is not empty).
+ */
+int mmbt_bulk_load(MMBT_HANDLE* mmbthp, void* keys, void* values, size_t n) {
+	MMBT_HEADER* hdrp;
+	MMBT_PAGE* pp;
+	char* firsts;
+	size_t nlevel;
+	size_t npages;
+	size_t nchild;
+	size_t taken;
+	size_t base;
+	size_t pg;
+	size_t i;
+	size_t j;
+	unsigned int height;
+
+	for (i = 1; i < n; i++) {
+		if (mmbthp->compare((char*)keys + (i - 1) * mmbthp->key_size,
+			(char*)keys + i * mmbthp->key_size, mmbthp->key_size) >= 0) {
+			errno = EINVAL;
+			return 1;
+		}
+	}
+	if (0 == n) {
+		return 0;
+	}
+	// First key of each page of the level being built
+	nlevel = (n + mmbthp->leaf_cap - 1) / mmbthp->leaf_cap;
+	if (NULL == (firsts = malloc(nlevel * mmbthp->key_size))) {
+		return 1;
+	}
+	if (write_begin(mmbthp)) {
+		free(firsts);
+		return 1;
+	}
+	if (header(mmbthp)->count != 0) {
+		write_end(mmbthp);
+		free(firsts);
+		errno = EEXIST;
+		return 1;
+	}
+	// Allocate every page at once
+	for (npages = nlevel, i = nlevel; i > 1; npages += i) {
+		i = (i + mmbthp->branch_cap) / (mmbthp->branch_cap + 1);
+	}
+	base = mmfor_record_count(mmbthp->mmforhp);
+	if (mmfor_resize(mmbthp->mmforhp, base + npages)) {
+		write_end(mmbthp);
+		free(firsts);
+		return 1;
+	}
+	// Leaves
+	for (pg = 0, taken = 0; pg < nlevel; pg++, taken += i) {
+		pp = page(mmbthp, base + pg);
+		pp->type = MMBT_PAGE_LEAF;
+		i = ((n - taken) < mmbthp->leaf_cap) ? (n - taken) : mmbthp->leaf_cap;
+		pp->nkeys = i;
+		pp->next = (pg + 1 < nlevel) ? base + pg + 1 : 0;
+		memcpy(leaf_key(mmbthp, pp, 0), (char*)keys + taken * mmbthp->key_size, i * mmbthp->key_size);
+		memcpy(leaf_value(mmbthp, pp, 0), (char*)values + taken * mmbthp->value_size,
+			i * mmbthp->value_size);
+		memcpy(firsts + pg * mmbthp->key_size, leaf_key(mmbthp, pp, 0), mmbthp->key_size);
+	}
+	// Branch levels until one page is left
+	for (height = 1; nlevel > 1; height++) {
+		base += nlevel;
+		for (pg = 0, taken = 0; taken < nlevel; pg++, taken += nchild) {
+			pp = page(mmbthp, base + pg);
+			pp->type = MMBT_PAGE_BRANCH;
+			nchild = ((nlevel - taken) < mmbthp->branch_cap + 1) ? (nlevel - taken) : mmbthp->branch_cap + 1;
+			pp->nkeys = nchild - 1;
+			for (j = 0; j < nchild; j++) {
+				branch_child(pp)[j] = base - nlevel + taken + j;
+			}
+			memcpy(branch_key(mmbthp, pp, 0), firsts + (taken + 1) * mmbthp->key_size,
+				(nchild - 1) * mmbthp->key_size);
+			memmove(firsts + pg * mmbthp->key_size, firsts + taken * mmbthp->key_size, mmbthp->key_size);
+		}
+		nlevel = pg;
+	}
+	hdrp = header(mmbthp);
+	hdrp->root = base;
+	hdrp->height = height;
+	hdrp->count = n;
+	write_end(mmbthp);
+	free(firsts);
+	return 0;
+}
+
+/**
+ * @brief Number of keys in the tree.
+ *
+ * @param mmbthp B+tree handle
+ * @return Key count.
+ */
+unsigned long mmbt_count(MMBT_HANDLE* mmbthp) {
+	return __atomic_load_n(&header(mmbthp)->count, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Number of levels in the tree (1 when the root is a leaf).
+ *
+ * @param mmbthp B+tree handle
+ * @return Tree height.
+ */
+unsigned int mmbt_height(MMBT_HANDLE* mmbthp) {
+	return __atomic_load_n(&header(mmbthp)->height, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Start a range scan.
+ *
+ * The cursor is positioned lazily by the first mmbt_cursor_next.
+ *
+ * @param mmbthp B+tree handle
+ * @param cursorp Cursor to set up
+ * @param key Scan starts at the first key >= key. NULL to start at
+ * 	the first key in the tree.
+ */
+void mmbt_cursor_seek(MMBT_HANDLE* mmbthp, MMBT_CURSOR* cursorp, void* key) {
+	cursorp->mmbthp = mmbthp;
+	cursorp->seq = 0;
+	cursorp->page = 0;
+	cursorp->pos = 0;
+	if (NULL == key) {
+		cursorp->state = CURSOR_FIRST;
+	} else {
+		cursorp->state = CURSOR_FROM;
+		memcpy(cursorp->key, key, mmbthp->key_size);
+	}
+}
+
+/**
+ * @brief Return the next key of a range scan, in ascending order.
+ *
+ * The cursor keeps its leaf position while the tree is unchanged. If
+ * a writer changed the tree since the last call, the cursor descends
+ * again to the first key after the one it last returned.
+ *
+ * @param cursorp Cursor set up by mmbt_cursor_seek
+ * @param key Receives the key (key_size bytes). May be NULL.
+ * @param value Receives the value (value_size bytes). May be NULL.
+ * @return 0 if a key was returned, 1 at the end of the tree, -1 on error.
+ */
+int mmbt_cursor_next(MMBT_CURSOR* cursorp, void* key, void* value) {
+	MMBT_HANDLE* mmbthp = cursorp->mmbthp;
+	TREE_READ tr = { mmbthp, 0, 0, 0 };
+	unsigned char found[MMBT_MAX_KEY];
+	MMBT_PAGE* pp;
+	size_t npages;
+	size_t hops;
+	unsigned int pg;
+	unsigned int pos;
+	int retval;
+
+	if (CURSOR_END == cursorp->state) {
+		return 1;
+	}
+	do {
+		if (read_begin(&tr)) {
+			retval = -1;
+			break;
+		}
+		if ((cursorp->page != 0) && (cursorp->seq == tr.seq)) {
+			pg = cursorp->page;
+			pos = cursorp->pos;
+			retval = 0;
+		} else {
+			retval = locate(mmbthp, cursorp->key, cursorp->state, &pg, &pos);
+		}
+		// Walk the leaf chain past exhausted (or empty) leaves
+		npages = mmfor_record_count(mmbthp->mmforhp);
+		for (hops = 0; (0 == retval) && (pos >= (pp = page(mmbthp, pg))->nkeys); hops++) {
+			pg = pp->next;
+			pos = 0;
+			if (0 == pg) {
+				retval = 1;
+			} else if ((pg >= npages) || (hops >= npages)) {
+				retval = -1;
+			}
+		}
+		if (0 == retval) {
+			if (pos >= mmbthp->leaf_cap) {
+				retval = -1;
+			} else {
+				// Not into the cursor: a read that must be retried may be torn
+				memcpy(found, leaf_key(mmbthp, pp, pos), mmbthp->key_size);
+				if (value != NULL) {
+					memcpy(value, leaf_value(mmbthp, pp, pos), mmbthp->value_size);
+				}
+			}
+		}
+	} while (read_retry(&tr));
+	read_end(&tr);
+
+	if (0 == retval) {
+		memcpy(cursorp->key, found, mmbthp->key_size);
+		cursorp->page = pg;
+		cursorp->pos = pos + 1;
+		cursorp->seq = tr.seq;
+		cursorp->state = CURSOR_AFTER;
+		if (key != NULL) {
+			memcpy(key, cursorp->key, mmbthp->key_size);
+		}
+	} else if (1 == retval) {
+		cursorp->state = CURSOR_END;
+	}
+	return retval;
+}
+
+static MMBT_HANDLE* open_handle(MMFOR_HANDLE* mmforhp) {
+	MMBT_HANDLE* mmbthp;
+	MMBT_HEADER* hdrp;
+
+	mmbthp = (MMBT_HANDLE*)calloc(1, sizeof(MMBT_HANDLE));
+	if (mmbthp != NULL) {
+		mmbthp->scratch = malloc(2 * mmfor_record_size(mmforhp));
+	}
+	if ((NULL == mmbthp) || (NULL == mmbthp->scratch)) {
+		free(mmbthp);
+		mmfor_close(mmforhp);
+		return NULL;
+	}
+	hdrp = (MMBT_HEADER*)mmfor_x2p(mmforhp, 0);
+	mmbthp->mmforhp = mmforhp;
+	mmbthp->compare = (MMBT_KEY_ULONG == hdrp->key_type) ? compare_ulong : compare_bytes;
+	mmbthp->key_size = hdrp->key_size;
+	mmbthp->value_size = hdrp->value_size;
+	mmbthp->leaf_cap = hdrp->leaf_cap;
+	mmbthp->branch_cap = hdrp->branch_cap;
+	return mmbthp;
+}
+
+static int compare_bytes(const void* a, const void* b, size_t len) {
+	return memcmp(a, b, len);
+}
+
+/*
+ * Keys are not aligned within pages, so copy them out first.
+ */
+static int compare_ulong(const void* a, const void* b, size_t len) {
+	unsigned long ua;
+	unsigned long ub;
+
+	(void)len;			// always sizeof(unsigned long)
+	memcpy(&ua, a, sizeof(ua));
+	memcpy(&ub, b, sizeof(ub));
+	return (ua < ub) ? -1 : (ua > ub);
+}
+
+static MMBT_HEADER* header(MMBT_HANDLE* mmbthp) {
+	return (MMBT_HEADER*)mmfor_x2p(mmbthp->mmforhp, 0);
+}
+
+static MMBT_PAGE* page(MMBT_HANDLE* mmbthp, unsigned int pg) {
+	return (MMBT_PAGE*)mmfor_x2p(mmbthp->mmforhp, pg);
+}
+
+static void* leaf_key(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i) {
+	return (char*)(pp + 1) + i * mmbthp->key_size;
+}
+
+static void* leaf_value(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i) {
+	return (char*)(pp + 1) + mmbthp->leaf_cap * mmbthp->key_size + i * mmbthp->value_size;
+}
+
+static unsigned int* branch_child(MMBT_PAGE* pp) {
+	return (unsigned int*)(pp + 1);
+}
+
+static void* branch_key(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i) {
+	return (char*)(branch_child(pp) + mmbthp->branch_cap + 1) + i * mmbthp->key_size;
+}
+
+/*
+ * Binary search of n sorted keys. Returns the index of the first key
+ * >= key, or > key when after is set.
+ */
+static size_t search(MMBT_HANDLE* mmbthp, void* keys, size_t n, void* key, int after) {
+	size_t lo = 0;
+	size_t mid;
+	int cmp;
+
+	while (lo < n) {
+		mid = lo + (n - lo) / 2;
+		cmp = mmbthp->compare((char*)keys + mid * mmbthp->key_size, key, mmbthp->key_size);
+		if ((cmp < 0) || (after && (0 == cmp))) {
+			lo = mid + 1;
+		} else {
+			n = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Descend to the leaf position of the first key >= key (CURSOR_FROM),
+ * > key (CURSOR_AFTER) or of the first key in the tree (CURSOR_FIRST).
+ * Branches send keys equal to a separator right. Returns -1 if a page
+ * number, page type or key count is out of range, which a reader sees
+ * when it races a writer.
+ */
+static int locate(MMBT_HANDLE* mmbthp, void* key, int state, unsigned int* pagep, unsigned int* posp) {
+	MMBT_HEADER* hdrp;
+	MMBT_PAGE* pp;
+	size_t npages;
+	size_t n;
+	unsigned int level;
+	unsigned int pg;
+	size_t i;
+
+	hdrp = header(mmbthp);
+	pg = hdrp->root;
+	level = hdrp->height;
+	npages = mmfor_record_count(mmbthp->mmforhp);
+	if ((0 == level) || (level > MMBT_MAX_HEIGHT)) {
+		return -1;
+	}
+	for ( ; ; level--) {
+		if ((0 == pg) || (pg >= npages)) {
+			return -1;
+		}
+		pp = page(mmbthp, pg);
+		n = pp->nkeys;
+		if (1 == level) {
+			if ((pp->type != MMBT_PAGE_LEAF) || (n > mmbthp->leaf_cap)) {
+				return -1;
+			}
+			*pagep = pg;
+			*posp = (CURSOR_FIRST == state) ? 0 :
+				search(mmbthp, leaf_key(mmbthp, pp, 0), n, key, CURSOR_AFTER == state);
+			return 0;
+		}
+		if ((pp->type != MMBT_PAGE_BRANCH) || (n > mmbthp->branch_cap)) {
+			return -1;
+		}
+		i = (CURSOR_FIRST == state) ? 0 : search(mmbthp, branch_key(mmbthp, pp, 0), n, key, 1);
+		pg = branch_child(pp)[i];
+	}
+}
+
+/*
+ * Start (or restart) a lock free read. Returns non-zero if the read
+ * lock shows that a writer died part way through a change.
+ */
+static int read_begin(TREE_READ* readp) {
+	MMBT_HEADER* hdrp;
+
+	for ( ; ; readp->tries++) {
+		if ((MMBT_READ_SPINS == readp->tries) && !readp->locked) {
+			if (mma_lock_atom_read(readp->mmbthp->mmforhp->mmahp)) {
+				return 1;
+			}
+			readp->locked = 1;
+		}
+		hdrp = header(readp->mmbthp);
+		readp->seq = __atomic_load_n(&hdrp->seq, __ATOMIC_ACQUIRE);
+		if (!(readp->seq & 1)) {
+			return 0;
+		}
+		if (readp->locked) {
+			ULPPK_LOG(ULPPK_LOG_ERROR, "B+tree %s: writer died during an update",
+				mma_get_disk_file_path(readp->mmbthp->mmforhp->mmahp));
+			return 1;
+		}
+		sched_yield();			// let the writer finish
+	}
+}
+
+/*
+ * Returns non-zero if a writer changed the tree during the read.
+ */
+static int read_retry(TREE_READ* readp) {
+	if (readp->locked) {
+		return 0;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&header(readp->mmbthp)->seq, __ATOMIC_RELAXED) == readp->seq) {
+		return 0;
+	}
+	readp->tries++;
+	return 1;
+}
+
+static void read_end(TREE_READ* readp) {
+	if (readp->locked) {
+		mma_unlock_atom(readp->mmbthp->mmforhp->mmahp);
+	}
+}
+
+/*
+ * Lock the tree and make the sequence word odd. It is still odd if
+ * the last writer died mid update: carry on from there.
+ */
+static int write_begin(MMBT_HANDLE* mmbthp) {
+	MMBT_HEADER* hdrp;
+
+	if (mma_lock_atom_write(mmbthp->mmforhp->mmahp)) {
+		return 1;
+	}
+	hdrp = header(mmbthp);
+	if (!(hdrp->seq & 1)) {
+		__atomic_store_n(&hdrp->seq, hdrp->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static void write_end(MMBT_HANDLE* mmbthp) {
+	MMBT_HEADER* hdrp;
+
+	hdrp = header(mmbthp);
+	__atomic_store_n(&hdrp->seq, hdrp->seq + 1, __ATOMIC_RELEASE);
+	mma_unlock_atom(mmbthp->mmforhp->mmahp);
+}
+
+/*
+ * Add a zeroed page to the file. The file may be remapped, so page
+ * pointers must be fetched again afterwards. Room has been reserved
+ * by the caller.
+ */
+static unsigned int alloc_page(MMBT_HANDLE* mmbthp, MMBT_PAGE_TYPE type) {
+	size_t pg;
+
+	pg = mmfor_record_count(mmbthp->mmforhp);
+	mmfor_resize(mmbthp->mmforhp, pg + 1);
+	page(mmbthp, pg)->type = type;
+	return pg;
+}
+
+/*
+ * Insert a key and value at position i of a leaf with room for them.
+ */
+static void leaf_put(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i, void* key, void* value) {
+	size_t n = pp->nkeys;
+
+	memmove(leaf_key(mmbthp, pp, i + 1), leaf_key(mmbthp, pp, i), (n - i) * mmbthp->key_size);
+	memmove(leaf_value(mmbthp, pp, i + 1), leaf_value(mmbthp, pp, i), (n - i) * mmbthp->value_size);
+	memcpy(leaf_key(mmbthp, pp, i), key, mmbthp->key_size);
+	memcpy(leaf_value(mmbthp, pp, i), value, mmbthp->value_size);
+	pp->nkeys++;
+}
+
+/*
+ * Insert a key at position i of a branch with room for it, with
+ * child as the page to the right of the key.
+ */
+static void branch_put(MMBT_HANDLE* mmbthp, MMBT_PAGE* pp, size_t i, void* key, unsigned int child) {
+	unsigned int* children = branch_child(pp);
+	size_t n = pp->nkeys;
+
+	memmove(branch_key(mmbthp, pp, i + 1), branch_key(mmbthp, pp, i), (n - i) * mmbthp->key_size);
+	memmove(children + i + 2, children + i + 1, (n - i) * sizeof(unsigned int));
+	memcpy(branch_key(mmbthp, pp, i), key, mmbthp->key_size);
+	children[i + 1] = child;
+	pp->nkeys++;
+}
+
+/*
+ * Insert into leaf pg at position i. If the leaf is full it is split
+ * in two: the new right page is returned and its first key copied to
+ * sep. Returns 0 if there was no split.
+ */
+static unsigned int leaf_insert(MMBT_HANDLE* mmbthp, unsigned int pg, size_t i,
+	void* key, void* value, void* sep) {
+	MMBT_PAGE* pp;
+	MMBT_PAGE* np;
+	unsigned int newpg;
+	size_t left;
+	size_t n;
+
+	pp = page(mmbthp, pg);
+	n = pp->nkeys;
+	if (n < mmbthp->leaf_cap) {
+		leaf_put(mmbthp, pp, i, key, value);
+		return 0;
+	}
+	newpg = alloc_page(mmbthp, MMBT_PAGE_LEAF);
+	pp = page(mmbthp, pg);
+	np = page(mmbthp, newpg);
+	// The left page keeps (n + 1) / 2 keys once the new key is in
+	left = (n + 1) / 2;
+	if (i < left) {
+		left--;
+	}
+	np->nkeys = n - left;
+	memcpy(leaf_key(mmbthp, np, 0), leaf_key(mmbthp, pp, left), np->nkeys * mmbthp->key_size);
+	memcpy(leaf_value(mmbthp, np, 0), leaf_value(mmbthp, pp, left), np->nkeys * mmbthp->value_size);
+	pp->nkeys = left;
+	if (i <= left) {
+		leaf_put(mmbthp, pp, i, key, value);
+	} else {
+		leaf_put(mmbthp, np, i - left, key, value);
+	}
+	np->next = pp->next;
+	pp->next = newpg;
+	memcpy(sep, leaf_key(mmbthp, np, 0), mmbthp->key_size);
+	return newpg;
+}
+
+/*
+ * Insert key (with child to its right) at position i of branch pg. If
+ * the branch is full it is split in two around its middle key, which
+ * moves up: it is copied to sep and the new right page returned.
+ * Returns 0 if there was no split.
+ */
+static unsigned int branch_insert(MMBT_HANDLE* mmbthp, unsigned int pg, size_t i,
+	void* key, unsigned int child, void* sep) {
+	MMBT_PAGE* pp;
+	MMBT_PAGE* np;
+	unsigned int* children;
+	unsigned int* tchild;
+	char* tkeys;
+	unsigned int newpg;
+	size_t mid;
+	size_t n;
+
+	pp = page(mmbthp, pg);
+	n = pp->nkeys;
+	if (n < mmbthp->branch_cap) {
+		branch_put(mmbthp, pp, i, key, child);
+		return 0;
+	}
+	// Build the overfull key and child lists in scratch space
+	children = branch_child(pp);
+	tchild = (unsigned int*)mmbthp->scratch;
+	tkeys = (char*)(tchild + n + 2);
+	memcpy(tchild, children, (i + 1) * sizeof(unsigned int));
+	tchild[i + 1] = child;
+	memcpy(tchild + i + 2, children + i + 1, (n - i) * sizeof(unsigned int));
+	memcpy(tkeys, branch_key(mmbthp, pp, 0), i * mmbthp->key_size);
+	memcpy(tkeys + i * mmbthp->key_size, key, mmbthp->key_size);
+	memcpy(tkeys + (i + 1) * mmbthp->key_size, branch_key(mmbthp, pp, i), (n - i) * mmbthp->key_size);
+
+	newpg = alloc_page(mmbthp, MMBT_PAGE_BRANCH);
+	pp = page(mmbthp, pg);
+	np = page(mmbthp, newpg);
+	// Left keeps mid keys, the key at mid moves up, right takes the rest
+	mid = (n + 1) / 2;
+	memcpy(sep, tkeys + mid * mmbthp->key_size, mmbthp->key_size);
+	pp->nkeys = mid;
+	memcpy(branch_child(pp), tchild, (mid + 1) * sizeof(unsigned int));
+	memcpy(branch_key(mmbthp, pp, 0), tkeys, mid * mmbthp->key_size);
+	np->nkeys = n - mid;
+	memcpy(branch_child(np), tchild + mid + 1, (n - mid + 1) * sizeof(unsigned int));
+	memcpy(branch_key(mmbthp, np, 0), tkeys + (mid + 1) * mmbthp->key_size, (n - mid) * mmbthp->key_size);
+	return newpg;
+}
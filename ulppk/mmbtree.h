@@ -0,0 +1,143 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file mmbtree.h
+ * @brief Memory Mapped B+tree
+ *
+ *  Declarations for an ordered index of fixed size keys and values
+ *  stored in fixed size pages of a memory mapped file of records
+ *  (mmfor). See mmbtree.c for details.
+ */
+
+#ifndef MMBTREE_H_
+#define MMBTREE_H_
+
+#include <mmfor.h>
+
+#define MMBT_VERSION 0x42540001		///< B+tree file layout version ("BT" 1)
+#define MMBT_MAX_HEIGHT 16			///< Max levels of a tree (root to leaf)
+#define MMBT_MAX_KEY 256			///< Max key size (bytes)
+#define MMBT_MIN_FANOUT 4			///< Pages must hold at least this many keys
+#define MMBT_READ_SPINS 1000		///< Lock free read attempts before taking a read lock
+
+/**
+ * @brief How keys are ordered. Stored in the file so that every
+ * process orders keys the same way.
+ */
+typedef enum {
+	MMBT_KEY_BYTES = 0,		///< memcmp order (big endian integers, strings)
+	MMBT_KEY_ULONG			///< native unsigned long
+} MMBT_KEY_TYPE;
+
+/**
+ * @brief Page types.
+ */
+typedef enum {
+	MMBT_PAGE_LEAF = 1,		///< keys and values
+	MMBT_PAGE_BRANCH		///< keys and child page numbers
+} MMBT_PAGE_TYPE;
+
+/**
+ * @brief Start of every tree page. Leaves follow this with leaf_cap keys
+ * then leaf_cap values; branches with branch_cap + 1 child page numbers
+ * then branch_cap keys.
+ */
+typedef struct _MMBT_PAGE {
+	unsigned int type;			///< MMBT_PAGE_TYPE
+	unsigned int nkeys;			///< keys in use
+	unsigned int next;			///< leaves: right sibling page, 0 for the last leaf
+	unsigned int spare;			///< keep alignment nice
+} MMBT_PAGE;
+
+/**
+ * @brief Tree header. Page 0 of the file.
+ */
+typedef struct _MMBT_HEADER {
+	unsigned int version;		///< MMBT_VERSION
+	unsigned int key_type;		///< MMBT_KEY_TYPE
+	unsigned int key_size;		///< key size (bytes)
+	unsigned int value_size;	///< value size (bytes)
+	unsigned int leaf_cap;		///< max keys in a leaf page
+	unsigned int branch_cap;	///< max keys in a branch page
+	unsigned int root;			///< root page
+	unsigned int height;		///< levels, 1 when the root is a leaf
+	unsigned long seq;			///< odd while a writer changes the tree
+	unsigned long count;		///< keys in the tree
+} MMBT_HEADER;
+
+/**
+ * @brief B+tree handle (process local).
+ */
+typedef struct _MMBT_HANDLE {
+	MMFOR_HANDLE* mmforhp;		///< the file of pages
+	int (*compare)(const void*, const void*, size_t);	///< key order
+	size_t key_size;			///< key size (bytes)
+	size_t value_size;			///< value size (bytes)
+	size_t leaf_cap;			///< max keys in a leaf page
+	size_t branch_cap;			///< max keys in a branch page
+	void* scratch;				///< room to split a branch page
+} MMBT_HANDLE;
+
+/**
+ * @brief Range scan position (process local). A cursor remembers the
+ * last key it returned, so it survives changes made to the tree by
+ * other processes between calls.
+ */
+typedef struct _MMBT_CURSOR {
+	MMBT_HANDLE* mmbthp;		///< tree being scanned
+	unsigned long seq;			///< tree sequence when page and pos were found
+	unsigned int page;			///< leaf page of the next key, 0 if unknown
+	unsigned int pos;			///< index of the next key in page
+	int state;					///< where the next key is relative to key
+	unsigned char key[MMBT_MAX_KEY];	///< seek key, then last key returned
+} MMBT_CURSOR;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+MMBT_HANDLE* mmbt_create(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags,
+	int permissions, MMBT_KEY_TYPE key_type, size_t key_size, size_t value_size, size_t page_size);
+MMBT_HANDLE* mmbt_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags);
+int mmbt_close(MMBT_HANDLE* mmbthp);
+
+int mmbt_insert(MMBT_HANDLE* mmbthp, void* key, void* value);
+int mmbt_delete(MMBT_HANDLE* mmbthp, void* key);
+int mmbt_find(MMBT_HANDLE* mmbthp, void* key, void* value);
+int mmbt_bulk_load(MMBT_HANDLE* mmbthp, void* keys, void* values, size_t n);
+unsigned long mmbt_count(MMBT_HANDLE* mmbthp);
+unsigned int mmbt_height(MMBT_HANDLE* mmbthp);
+
+void mmbt_cursor_seek(MMBT_HANDLE* mmbthp, MMBT_CURSOR* cursorp, void* key);
+int mmbt_cursor_next(MMBT_CURSOR* cursorp, void* key, void* value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MMBTREE_H_ */
@@ -0,0 +1,523 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file mmcol.c
+ *
+ * @brief Memory Mapped Columnar file of records
+ *
+ * A file of records stored as a structure of arrays. The caller
+ * describes its row structure with one MMCOL_FIELD per field (offset,
+ * size and type) and each field is kept in a memory mapped file of
+ * records (mmfor) of its own, <path>.col<n>. Scanning one field of a
+ * wide row then pulls only that field through the cache, and the
+ * values of a field lie contiguously in memory where a compiler can
+ * vectorize loops over them (see mmcol_column, mmcol_sum_long,
+ * mmcol_sum_double and mmcol_filter). Rows are still addressed by
+ * index: mmcol_read_row and mmcol_write_row gather and scatter a row
+ * structure, and mmcol_x2p gives the address of one field of a row.
+ *
+ * The schema is kept in <path> itself, a file of records whose record 0
+ * is a MMCOL_HEADER and records 1 to nfields the fields.
+ *
+ * Rows are appended to the columns in field order under a write lock
+ * on the schema file, so appends from several processes do not mix.
+ * The row count is that of the last column, which is the last to get
+ * a new row; a reader therefore never sees a row that some column
+ * lacks. Columns grow independently (mmfor_reserve), so pointers from
+ * mmcol_x2p and mmcol_column are good until the next append.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <mmcol.h>
+#include <ulppk_log.h>
+
+/* Schema records hold a header or a field */
+#define SCHEMA_REC_SIZE (sizeof(MMCOL_HEADER) > sizeof(MMCOL_FIELD) ? \
+	sizeof(MMCOL_HEADER) : sizeof(MMCOL_FIELD))
+
+/* Fold a column of type T into acc */
+#define SUM_COLUMN(T, p, n, acc) \
+	for (x = 0; x < (n); x++) { \
+		(acc) += ((T*)(p))[x]; \
+	}
+
+/* Mark the values of a column of type T in [lo, hi] */
+#define FILTER_COLUMN(T, p, n) \
+	for (x = 0; x < (n); x++) { \
+		match[x] = (((T*)(p))[x] >= lo) & (((T*)(p))[x] <= hi); \
+		count += match[x]; \
+	}
+
+static MMCOL_HANDLE* open_handle(MMFOR_HANDLE* schemap, char* filepath,
+	MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags);
+
+static void column_path(char* buf, size_t len, char* filepath, unsigned int field);
+
+static int check_field(MMCOL_FIELD* fieldp);
+
+static void* numeric_column(MMCOL_HANDLE* mmcolhp, unsigned int field, size_t* nrows);
+
+/**
+ * @brief Create a new columnar file.
+ *
+ * @param filepath Pathname of the schema file. Column files are made
+ * 	alongside it (see MMCOL_COLUMN_SUFFIX).
+ * @param mode Memory mapped atom access mode. (see mmatom.h)
+ * @param flags Shared/private (see mmatom.h)
+ * @param permissions access permissions (see man open(2))
+ * @param fields Description of each field of a row.
+ * @param nfields Number of fields (1 to MMCOL_MAX_FIELDS).
+ * @param nrows Number of rows to make room for. The file starts empty.
+ * @return Columnar file handle, NULL on error (errno EINVAL if the
+ * 	fields are not valid). Files made before an error are removed.
+ */
+MMCOL_HANDLE* mmcol_create(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags,
+	int permissions, MMCOL_FIELD* fields, unsigned int nfields, size_t nrows) {
+	char path[PATH_MAX];
+	MMFOR_HANDLE* schemap;
+	MMFOR_HANDLE* colp;
+	MMCOL_HEADER* hdrp;
+	size_t row_size = 0;
+	unsigned int i;
+
+	for (i = 0; i < nfields; i++) {
+		if (check_field(&fields[i])) {
+			break;
+		}
+		if (fields[i].offset + fields[i].size > row_size) {
+			row_size = fields[i].offset + fields[i].size;
+		}
+	}
+	if ((0 == nfields) || (nfields > MMCOL_MAX_FIELDS) || (i < nfields)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Columnar file %s: invalid field %u of %u", filepath, i, nfields);
+		errno = EINVAL;
+		return NULL;
+	}
+	schemap = mmfor_create(filepath, mode, flags, permissions, SCHEMA_REC_SIZE, nfields + 1);
+	if (NULL == schemap) {
+		return NULL;
+	}
+	hdrp = (MMCOL_HEADER*)mmfor_x2p(schemap, 0);
+	hdrp->version = MMCOL_VERSION;
+	hdrp->nfields = nfields;
+	hdrp->row_size = row_size;
+	for (i = 0; i < nfields; i++) {
+		memcpy(mmfor_x2p(schemap, i + 1), &fields[i], sizeof(MMCOL_FIELD));
+		column_path(path, sizeof(path), filepath, i);
+		colp = mmfor_create(path, mode, flags, permissions, fields[i].size, nrows);
+		if ((NULL == colp) || mmfor_resize(colp, 0)) {
+			if (colp != NULL) {
+				mmfor_close(colp);
+				i++;
+			}
+			mmfor_close(schemap);
+			// Remove the columns made so far and the schema
+			while (i-- > 0) {
+				column_path(path, sizeof(path), filepath, i);
+				unlink(path);
+			}
+			unlink(filepath);
+			return NULL;
+		}
+		mmfor_close(colp);
+	}
+	return open_handle(schemap, filepath, mode, flags);
+}
+
+/**
+ * @brief Open an existing columnar file.
+ *
+ * @param filepath Pathname of the schema file.
+ * @param mode Memory mapped atom access mode. (see mmatom.h)
+ * @param flags Shared/private (see mmatom.h)
+ * @return Columnar file handle, NULL on error (errno EINVAL if the
+ * 	file is not a columnar file).
+ */
+MMCOL_HANDLE* mmcol_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags) {
+	MMFOR_HANDLE* schemap;
+	MMCOL_HEADER* hdrp;
+
+	schemap = mmfor_open(filepath, mode, flags);
+	if (NULL == schemap) {
+		return NULL;
+	}
+	hdrp = (MMCOL_HEADER*)mmfor_x2p(schemap, 0);
+	if ((mmfor_record_size(schemap) != SCHEMA_REC_SIZE) || (hdrp->version != MMCOL_VERSION) ||
+		(0 == hdrp->nfields) || (hdrp->nfields > MMCOL_MAX_FIELDS) ||
+		(mmfor_record_count(schemap) < hdrp->nfields + 1)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "%s is not a columnar file", filepath);
+		mmfor_close(schemap);
+		errno = EINVAL;
+		return NULL;
+	}
+	return open_handle(schemap, filepath, mode, flags);
+}
+
+/**
+ * @brief Close a columnar file.
+ *
+ * @param mmcolhp Columnar file handle
+ * @return 0 on success, non-zero on failure.
+ */
+int mmcol_close(MMCOL_HANDLE* mmcolhp) {
+	int status = 0;
+	unsigned int i;
+
+	for (i = 0; i < mmcolhp->nfields; i++) {
+		if (mmcolhp->columns[i] != NULL) {
+			status |= mmfor_close(mmcolhp->columns[i]);
+		}
+	}
+	status |= mmfor_close(mmcolhp->schemap);
+	free(mmcolhp->columns);
+	free(mmcolhp->fields);
+	free(mmcolhp);
+	return status;
+}
+
+/**
+ * @brief Return the number of rows.
+ *
+ * @param mmcolhp Columnar file handle
+ * @return Number of rows.
+ */
+size_t mmcol_row_count(MMCOL_HANDLE* mmcolhp) {
+	return mmfor_record_count(mmcolhp->columns[mmcolhp->nfields - 1]);
+}
+
+/**
+ * @brief Make room for at least nrows rows in every column.
+ *
+ * @param mmcolhp Columnar file handle
+ * @param nrows Number of rows the file must be able to hold.
+ * @return 0 on success, non-zero on failure.
+ */
+int mmcol_reserve(MMCOL_HANDLE* mmcolhp, size_t nrows) {
+	unsigned int i;
+
+	for (i = 0; i < mmcolhp->nfields; i++) {
+		if (mmfor_reserve(mmcolhp->columns[i], nrows)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Add a row after the last one.
+ *
+ * Each field of the row is appended to its column, in field order,
+ * under a write lock on the schema file. A column left a row ahead
+ * by an append that failed part way is cut back first.
+ *
+ * @param mmcolhp Columnar file handle
+ * @param row Row structure holding the fields.
+ * @return Index of the new row, MMFOR_NO_RECORD on failure.
+ */
+size_t mmcol_append(MMCOL_HANDLE* mmcolhp, void* row) {
+	MMFOR_HANDLE* colp;
+	size_t x;
+	unsigned int i;
+
+	if (mmfor_lock_file_write(mmcolhp->schemap)) {
+		return MMFOR_NO_RECORD;
+	}
+	x = mmcol_row_count(mmcolhp);
+	for (i = 0; i < mmcolhp->nfields; i++) {
+		colp = mmcolhp->columns[i];
+		if ((mmfor_record_count(colp) > x) && mmfor_resize(colp, x)) {
+			break;
+		}
+		if (mmfor_append(colp, row + mmcolhp->fields[i].offset) != x) {
+			break;
+		}
+	}
+	mmfor_unlock_file(mmcolhp->schemap);
+	return (i < mmcolhp->nfields) ? MMFOR_NO_RECORD : x;
+}
+
+/**
+ * @brief Gather a row into a row structure.
+ *
+ * Each field is read with mmfor_read_record. Bytes of the row structure
+ * that belong to no field are left alone. A row being rewritten by
+ * another process may be read with some fields old and some new.
+ *
+ * @param mmcolhp Columnar file handle
+ * @param x Zero based row index.
+ * @param row Row structure to receive the fields.
+ * @return 0 on success, non-zero if x is out of range or a read fails.
+ */
+int mmcol_read_row(MMCOL_HANDLE* mmcolhp, size_t x, void* row) {
+	unsigned int i;
+
+	if (x >= mmcol_row_count(mmcolhp)) {
+		return 1;
+	}
+	for (i = 0; i < mmcolhp->nfields; i++) {
+		if (mmfor_read_record(mmcolhp->columns[i], x, row + mmcolhp->fields[i].offset)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Scatter a row structure over an existing row.
+ *
+ * Each field is written with mmfor_write_record.
+ *
+ * @param mmcolhp Columnar file handle
+ * @param x Zero based row index.
+ * @param row Row structure holding the fields.
+ * @return 0 on success, non-zero if x is out of range or a write fails.
+ */
+int mmcol_write_row(MMCOL_HANDLE* mmcolhp, size_t x, void* row) {
+	unsigned int i;
+
+	if (x >= mmcol_row_count(mmcolhp)) {
+		return 1;
+	}
+	for (i = 0; i < mmcolhp->nfields; i++) {
+		if (mmfor_write_record(mmcolhp->columns[i], x, row + mmcolhp->fields[i].offset)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Given a field and a row index, calculate a pointer to the
+ * field's value in its column. (As mmfor_x2p.)
+ *
+ * @param mmcolhp Columnar file handle
+ * @param field Field number (order given to mmcol_create).
+ * @param x Zero based row index.
+ * @return Pointer to the value, NULL if field is out of range.
+ */
+void* mmcol_x2p(MMCOL_HANDLE* mmcolhp, unsigned int field, size_t x) {
+	if (field >= mmcolhp->nfields) {
+		return NULL;
+	}
+	return mmfor_x2p(mmcolhp->columns[field], x);
+}
+
+/**
+ * @brief Return the values of a field as an array.
+ *
+ * @param mmcolhp Columnar file handle
+ * @param field Field number (order given to mmcol_create).
+ * @param nrows Receives the number of rows (array elements).
+ * @return Pointer to the first value, NULL if field is out of range.
+ */
+void* mmcol_column(MMCOL_HANDLE* mmcolhp, unsigned int field, size_t* nrows) {
+	if (field >= mmcolhp->nfields) {
+		return NULL;
+	}
+	*nrows = mmcol_row_count(mmcolhp);
+	return mmfor_x2p(mmcolhp->columns[field], 0);
+}
+
+/**
+ * @brief Add up an integer field over all rows.
+ *
+ * @param mmcolhp Columnar file handle
+ * @param field Field number of a MMCOL_INT, MMCOL_LONG or MMCOL_ULONG field.
+ * @param sum Receives the sum.
+ * @return 0 on success, non-zero if the field is not an integer field.
+ */
+int mmcol_sum_long(MMCOL_HANDLE* mmcolhp, unsigned int field, long* sum) {
+	void* p;
+	size_t n;
+	size_t x;
+	long acc = 0;
+
+	p = numeric_column(mmcolhp, field, &n);
+	if (NULL == p) {
+		return 1;
+	}
+	switch (mmcolhp->fields[field].type) {
+	case MMCOL_INT:
+		SUM_COLUMN(int, p, n, acc);
+		break;
+	case MMCOL_LONG:
+	case MMCOL_ULONG:
+		SUM_COLUMN(long, p, n, acc);
+		break;
+	default:
+		return 1;
+	}
+	*sum = acc;
+	return 0;
+}
+
+/**
+ * @brief Add up a numeric field over all rows, in double precision.
+ *
+ * @param mmcolhp Columnar file handle
+ * @param field Field number of a numeric field.
+ * @param sum Receives the sum.
+ * @return 0 on success, non-zero if the field is not numeric.
+ */
+int mmcol_sum_double(MMCOL_HANDLE* mmcolhp, unsigned int field, double* sum) {
+	void* p;
+	size_t n;
+	size_t x;
+	double acc = 0.0;
+
+	p = numeric_column(mmcolhp, field, &n);
+	if (NULL == p) {
+		return 1;
+	}
+	switch (mmcolhp->fields[field].type) {
+	case MMCOL_INT:
+		SUM_COLUMN(int, p, n, acc);
+		break;
+	case MMCOL_LONG:
+		SUM_COLUMN(long, p, n, acc);
+		break;
+	case MMCOL_ULONG:
+		SUM_COLUMN(unsigned long, p, n, acc);
+		break;
+	default:
+		SUM_COLUMN(double, p, n, acc);
+		break;
+	}
+	*sum = acc;
+	return 0;
+}
+
+/**
+ * @brief Find the rows whose value of a numeric field is in a range.
+ *
+ * @param mmcolhp Columnar file handle
+ * @param field Field number of a numeric field.
+ * @param lo Lowest value to match.
+ * @param hi Highest value to match.
+ * @param match Array of at least mmcol_row_count bytes. Receives 1 for
+ * 	each row that matches, 0 for the others.
+ * @return Number of rows that match, -1 if the field is not numeric.
+ */
+long mmcol_filter(MMCOL_HANDLE* mmcolhp, unsigned int field, double lo, double hi,
+	unsigned char* match) {
+	void* p;
+	size_t n;
+	size_t x;
+	long count = 0;
+
+	p = numeric_column(mmcolhp, field, &n);
+	if (NULL == p) {
+		return -1;
+	}
+	switch (mmcolhp->fields[field].type) {
+	case MMCOL_INT:
+		FILTER_COLUMN(int, p, n);
+		break;
+	case MMCOL_LONG:
+		FILTER_COLUMN(long, p, n);
+		break;
+	case MMCOL_ULONG:
+		FILTER_COLUMN(unsigned long, p, n);
+		break;
+	default:
+		FILTER_COLUMN(double, p, n);
+		break;
+	}
+	return count;
+}
+
+/*
+ * Build a handle around an open schema file, opening the columns.
+ */
+static MMCOL_HANDLE* open_handle(MMFOR_HANDLE* schemap, char* filepath,
+	MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags) {
+	char path[PATH_MAX];
+	MMCOL_HANDLE* mmcolhp;
+	MMCOL_HEADER* hdrp;
+	unsigned int i;
+
+	hdrp = (MMCOL_HEADER*)mmfor_x2p(schemap, 0);
+	mmcolhp = (MMCOL_HANDLE*)calloc(1, sizeof(MMCOL_HANDLE));
+	mmcolhp->schemap = schemap;
+	mmcolhp->nfields = hdrp->nfields;
+	mmcolhp->row_size = hdrp->row_size;
+	mmcolhp->fields = (MMCOL_FIELD*)calloc(mmcolhp->nfields, sizeof(MMCOL_FIELD));
+	mmcolhp->columns = (MMFOR_HANDLE**)calloc(mmcolhp->nfields, sizeof(MMFOR_HANDLE*));
+	for (i = 0; i < mmcolhp->nfields; i++) {
+		memcpy(&mmcolhp->fields[i], mmfor_x2p(schemap, i + 1), sizeof(MMCOL_FIELD));
+		column_path(path, sizeof(path), filepath, i);
+		mmcolhp->columns[i] = mmfor_open(path, mode, flags);
+		if ((NULL == mmcolhp->columns[i]) ||
+			(mmfor_record_size(mmcolhp->columns[i]) != mmcolhp->fields[i].size)) {
+			ULPPK_LOG(ULPPK_LOG_ERROR, "Columnar file %s: column %s missing or damaged", filepath, path);
+			mmcol_close(mmcolhp);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	return mmcolhp;
+}
+
+static void column_path(char* buf, size_t len, char* filepath, unsigned int field) {
+	snprintf(buf, len, "%s%s%u", filepath, MMCOL_COLUMN_SUFFIX, field);
+}
+
+/*
+ * Fields must have a size, and numeric fields the size of their type.
+ */
+static int check_field(MMCOL_FIELD* fieldp) {
+	switch (fieldp->type) {
+	case MMCOL_BYTES:
+		return (0 == fieldp->size);
+	case MMCOL_INT:
+		return (fieldp->size != sizeof(int));
+	case MMCOL_LONG:
+	case MMCOL_ULONG:
+		return (fieldp->size != sizeof(long));
+	case MMCOL_DOUBLE:
+		return (fieldp->size != sizeof(double));
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Array of the values of a numeric field, NULL for other fields.
+ */
+static void* numeric_column(MMCOL_HANDLE* mmcolhp, unsigned int field, size_t* nrows) {
+	if ((field >= mmcolhp->nfields) || (MMCOL_BYTES == mmcolhp->fields[field].type)) {
+		return NULL;
+	}
+	return mmcol_column(mmcolhp, field, nrows);
+}
@@ -0,0 +1,117 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file mmcol.h
+ * @brief Memory Mapped Columnar file of records
+ *
+ *  Declarations for files of records stored column by column: each
+ *  field of the record is kept in a file of its own, so a scan of one
+ *  field reads only that field. See mmcol.c for details.
+ */
+
+#ifndef MMCOL_H_
+#define MMCOL_H_
+
+#include <mmfor.h>
+
+#define MMCOL_VERSION 0x434c0001		///< Columnar file layout version ("CL" 1)
+#define MMCOL_MAX_FIELDS 256			///< Max fields in a record
+#define MMCOL_COLUMN_SUFFIX ".col"		///< Column files are <path>.col<field number>
+
+/**
+ * @brief Field types. Numeric fields can be summed and filtered
+ * (mmcol_sum_long, mmcol_sum_double, mmcol_filter).
+ */
+typedef enum {
+	MMCOL_BYTES = 0,		///< opaque bytes, any size
+	MMCOL_INT,				///< native int
+	MMCOL_LONG,				///< native long
+	MMCOL_ULONG,			///< native unsigned long
+	MMCOL_DOUBLE			///< double
+} MMCOL_TYPE;
+
+/**
+ * @brief Where a field lives in the caller's record (row) structure,
+ * for example { offsetof(ROW, price), sizeof(double), MMCOL_DOUBLE }.
+ */
+typedef struct _MMCOL_FIELD {
+	size_t offset;				///< offset of the field in a row
+	size_t size;				///< size of the field (bytes)
+	unsigned int type;			///< MMCOL_TYPE
+	unsigned int spare;			///< keep alignment nice
+} MMCOL_FIELD;
+
+/**
+ * @brief Schema header. Record 0 of the schema file, which holds
+ * the fields in records 1 to nfields.
+ */
+typedef struct _MMCOL_HEADER {
+	unsigned int version;		///< MMCOL_VERSION
+	unsigned int nfields;		///< fields in a row
+	size_t row_size;			///< size of a row (bytes)
+	size_t spare;				///< same size as a field
+} MMCOL_HEADER;
+
+/**
+ * @brief Columnar file handle (process local).
+ */
+typedef struct _MMCOL_HANDLE {
+	MMFOR_HANDLE* schemap;		///< the schema file
+	MMFOR_HANDLE** columns;		///< a file of records per field
+	MMCOL_FIELD* fields;		///< copy of the schema
+	unsigned int nfields;		///< fields in a row
+	size_t row_size;			///< size of a row (bytes)
+} MMCOL_HANDLE;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+MMCOL_HANDLE* mmcol_create(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags,
+	int permissions, MMCOL_FIELD* fields, unsigned int nfields, size_t nrows);
+MMCOL_HANDLE* mmcol_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags);
+int mmcol_close(MMCOL_HANDLE* mmcolhp);
+
+size_t mmcol_row_count(MMCOL_HANDLE* mmcolhp);
+int mmcol_reserve(MMCOL_HANDLE* mmcolhp, size_t nrows);
+size_t mmcol_append(MMCOL_HANDLE* mmcolhp, void* row);
+int mmcol_read_row(MMCOL_HANDLE* mmcolhp, size_t x, void* row);
+int mmcol_write_row(MMCOL_HANDLE* mmcolhp, size_t x, void* row);
+
+void* mmcol_x2p(MMCOL_HANDLE* mmcolhp, unsigned int field, size_t x);
+void* mmcol_column(MMCOL_HANDLE* mmcolhp, unsigned int field, size_t* nrows);
+int mmcol_sum_long(MMCOL_HANDLE* mmcolhp, unsigned int field, long* sum);
+int mmcol_sum_double(MMCOL_HANDLE* mmcolhp, unsigned int field, double* sum);
+long mmcol_filter(MMCOL_HANDLE* mmcolhp, unsigned int field, double lo, double hi,
+	unsigned char* match);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MMCOL_H_ */
@@ -49,6 +49,9 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <appenv.h>
 #include <mmdeque.h>
@@ -79,17 +82,64 @@ static char* lerrmsg(MMA_HANDLE* mmahp, char* opstring) {
 	sprintf(buff, "%s : File: %s", opstring, mmahp->u.df_refp->str_pathname);
 	return buff;
 }
+/*
+ * Offset of the move journal: just after the slots, on a long boundary.
+ */
+static size_t journal_offset(ushort item_size, ushort nitems) {
+	size_t len;
+
+	len = sizeof(DQHEADER) + (item_size * nitems);
+	return (len + sizeof(long) - 1) / sizeof(long) * sizeof(long);
+}
+
+/*
+ * Number of items the move journal holds: a batch, or the whole deque
+ * if it is smaller.
+ */
+static ushort journal_slots(ushort nitems) {
+	return (nitems < MMDQ_MOVE_BATCH) ? nitems : MMDQ_MOVE_BATCH;
+}
+
 /*
  * Calculate total file size given the size of the deque items and
- * the number of items the deque can contain.
+ * the number of items the deque can contain, move journal included.
  */
 static size_t deque_file_len(ushort item_size, ushort nitems) {
 	size_t len;
 	
-	len = sizeof(DQHEADER) + (item_size * nitems);
+	len = journal_offset(item_size, nitems) + sizeof(MMDQ_JOURNAL) + (item_size * journal_slots(nitems));
 	return len;
 }
 
+/*
+ * Add the journaled items not yet added to the deque. Both are locked
+ * by the caller. Returns the count of items added.
+ */
+static int replay_journal(DQHEADER* dequep, MMDQ_JOURNAL* journalp) {
+	char* itemsp;
+	int count = 0;
+	int error;
+
+	if (MMDQ_JOURNAL_MOVING != journalp->state) {
+		return 0;
+	}
+	itemsp = (char*)(journalp + 1);
+	while (journalp->pushed < journalp->count) {
+		if (MMDQ_TOP == journalp->dst_end) {
+			error = dq_atd(dequep, itemsp + journalp->pushed * dequep->dqitem_size);
+		} else {
+			error = dq_abd(dequep, itemsp + journalp->pushed * dequep->dqitem_size);
+		}
+		if (error) {
+			return count;		// full ... the rest waits for room
+		}
+		__atomic_store_n(&journalp->pushed, journalp->pushed + 1, __ATOMIC_RELEASE);
+		count++;
+	}
+	__atomic_store_n(&journalp->state, MMDQ_JOURNAL_IDLE, __ATOMIC_RELEASE);
+	return count;
+}
+
 /**
  * @brief Return the path to the memory mapped deque directory.
  * The deque directory is where an application or system of
@@ -123,7 +173,7 @@ char* mmdq_dequepath(char* pathbuff, const char* dequename) {
 	dequedir = mmdq_dequedir();
 	if (pathbuff == NULL) {
 		int pathbufflen;
-		pathbufflen = strlen(dequedir) + strlen(dequename) + 3;
+		pathbufflen = strlen(dequedir) + strlen(dequename) + 5;	// "/", ".dq" and the terminator
 		pathbuff = (char*)calloc(pathbufflen, sizeof(char));
 	}
 	strcpy(pathbuff, dequedir);
@@ -320,6 +370,10 @@ int mmdq_rbd(MMA_HANDLE* mmdqhp,void* itemp) {
 /**
  * @brief Reset a memory mapped deque to the empty state.
  *
+ * Only the deque header is rewritten. Slots beyond the items in use are
+ * never read, so the slot area is left as it is and a reset costs the
+ * same whatever the size of the deque.
+ *
  * @param mmdqhp Pointer to MMA_HANDLE structure representing the memory mapped deque.
  * @return 0 on success.
  */
@@ -332,13 +386,226 @@ int mmdq_reset(MMA_HANDLE* mmdqhp) {
 	
 	dequep = (DQHEADER*)mma_data_pointer(mmdqhp);
 	memcpy(&tempdq, dequep, sizeof(DQHEADER));
-	memset(dequep, 0, mmdqhp->mm_ref.len);
 	dq_init_memmap(tempdq.dqslots, tempdq.dqitem_size, tempdq.dqbuffx, dequep); 
+	if (mmdq_journal(mmdqhp) != NULL) {
+		mmdq_journal(mmdqhp)->state = MMDQ_JOURNAL_IDLE;	// drop any unfinished move
+	}
 
 	if (mma_unlock_atom(mmdqhp)) APP_ERR(stderr, lerrmsg(mmdqhp, "Error unlocking atom!"));
 	return retval;
 }
 
+/**
+ * @brief Write a memory mapped deque to a file descriptor in bulk.
+ *
+ * A MMA_DUMP_HEADER (kind MMA_DUMP_DEQUE, with the item size and
+ * capacity) is followed by an image of the deque file, copied in the
+ * kernel where possible (see mma_dump). The deque is read locked
+ * meanwhile, so the image is of one moment between operations.
+ *
+ * @param mmdqhp Pointer to MMA_HANDLE structure representing the memory mapped deque.
+ * @param fd Descriptor of a file, pipe or socket, written at its position.
+ * @return 0 on success, non-zero on failure (see mma_error).
+ */
+int mmdq_export(MMA_HANDLE* mmdqhp, int fd) {
+	MMA_DUMP_HEADER hdr;
+	DQHEADER* dequep;
+	int retval;
+
+	if (mma_lock_atom_read(mmdqhp)) APP_ERR(stderr, lerrmsg(mmdqhp,"Error locking atom!"));
+	dequep = (DQHEADER*)mma_data_pointer(mmdqhp);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.kind = MMA_DUMP_DEQUE;
+	hdr.rec_size = dequep->dqitem_size;
+	hdr.nrecs = dequep->dqslots;
+	hdr.length = deque_file_len(dequep->dqitem_size, dequep->dqslots);
+	retval = mma_dump(mmdqhp, fd, &hdr);
+	if (mma_unlock_atom(mmdqhp)) APP_ERR(stderr, lerrmsg(mmdqhp, "Error unlocking atom!"));
+	return retval;
+}
+
+/**
+ * @brief Create a memory mapped deque from a dump written by mmdq_export.
+ *
+ * The deque is created with the item size and capacity in the dump and
+ * the image is read straight into the mapped file, so the new deque
+ * holds the same items in the same order, and any unfinished move.
+ *
+ * @param dequename Name of the new deque
+ * @param fd Descriptor of a file or pipe positioned at the dump.
+ * @return Pointer to MMA_HANDLE structure representing the new deque,
+ * 	NULL on failure (see mma_error).
+ */
+MMA_HANDLE* mmdq_import(const char* dequename, int fd) {
+	MMA_DUMP_HEADER hdr;
+	MMA_HANDLE* mmahp;
+	char dequefile[PATH_MAX];
+
+	if (mma_dump_header(fd, MMA_DUMP_DEQUE, &hdr)) {
+		return NULL;
+	}
+	if ((0 == hdr.rec_size) || (hdr.rec_size > USHRT_MAX) || (hdr.nrecs > USHRT_MAX) ||
+		(hdr.length > deque_file_len(hdr.rec_size, hdr.nrecs))) {
+		mma_error = MMA_ERR_DUMP_FORMAT;
+		mma_os_error = EINVAL;
+		return NULL;
+	}
+	mmahp = mmdq_create(dequename, hdr.rec_size, hdr.nrecs);
+	if (NULL == mmahp) {
+		return NULL;
+	}
+	if (mma_load(mmahp, fd, &hdr)) {
+		snprintf(dequefile, sizeof(dequefile), "%s", mmdq_dequepath_from_handle(mmahp));
+		mmdq_close(mmahp);
+		unlink(dequefile);
+		return NULL;
+	}
+	return mmahp;
+}
+
+/**
+ * @brief Move items from one memory mapped deque to another.
+ *
+ * Up to n items are removed from one end of the source and added, in
+ * the order removed, to one end of the destination, as though by n
+ * pairs of remove and add calls. Both deques are locked once, in the
+ * order of their file path names, so movers cannot deadlock. The move
+ * is all or nothing: it fails if the source holds fewer than n items
+ * or the destination lacks room for them.
+ *
+ * The items go through the destination's move journal in batches of
+ * at most MMDQ_MOVE_BATCH: each batch is copied to the journal, then
+ * removed from the source and added to the destination. If the mover
+ * dies part way, the rest of its batch is done from the journal by the
+ * next move into the destination or by mmdq_move_recover, and the
+ * items of later batches stay in the source. Items may then appear
+ * twice (at least once delivery). Until a stalled journal
+ * (destination full) has been emptied, further moves into the
+ * destination fail.
+ *
+ * Source and destination may be the same deque, e.g. to rotate it.
+ *
+ * @param srchp Pointer to MMA_HANDLE structure of the source deque.
+ * @param src_end End of the source to remove items from.
+ * @param dsthp Pointer to MMA_HANDLE structure of the destination deque.
+ * @param dst_end End of the destination to add items to.
+ * @param n Number of items to move.
+ * @return 0 on success, non-zero if nothing was moved (-1 if the destination
+ * 	file has no move journal, i.e. predates it and must be recreated).
+ */
+int mmdq_move(MMA_HANDLE* srchp, MMDQ_END src_end, MMA_HANDLE* dsthp, MMDQ_END dst_end, ushort n) {
+	DQHEADER* srcp;
+	DQHEADER* dstp;
+	MMDQ_JOURNAL* journalp;
+	MMA_HANDLE* firstp;
+	MMA_HANDLE* secondp = NULL;
+	char* itemsp;
+	int order;
+	int retval = 0;
+	ushort batch;
+	ushort i;
+
+	journalp = mmdq_journal(dsthp);
+	if (NULL == journalp) {
+		return -1;
+	}
+	// Lock in path name order. A deque moved to itself is locked once.
+	order = strcmp(mmdq_dequepath_from_handle(srchp), mmdq_dequepath_from_handle(dsthp));
+	firstp = (order <= 0) ? srchp : dsthp;
+	if (order != 0) {
+		secondp = (order < 0) ? dsthp : srchp;
+	}
+	if (mma_lock_atom_write(firstp)) APP_ERR(stderr, lerrmsg(firstp, "Error locking atom!"));
+	if ((secondp != NULL) && mma_lock_atom_write(secondp)) {
+		APP_ERR(stderr, lerrmsg(secondp, "Error locking atom!"));
+	}
+
+	srcp = (DQHEADER*)mma_data_pointer(srchp);
+	dstp = (DQHEADER*)mma_data_pointer(dsthp);
+
+	// Finish the move of a mover that died
+	replay_journal(dstp, journalp);
+
+	if ((MMDQ_JOURNAL_IDLE != journalp->state) || (srcp->dqitem_size != dstp->dqitem_size) ||
+		(n > srcp->dquse) || ((secondp != NULL) && (n > dstp->dqslots - dstp->dquse))) {
+		retval = 1;
+	} else {
+		itemsp = (char*)(journalp + 1);
+		for (; n > 0; n -= batch) {
+			// Journal copies of a batch of items, then commit the journal
+			batch = (n < journal_slots(dstp->dqslots)) ? n : journal_slots(dstp->dqslots);
+			for (i = 0; i < batch; i++) {
+				if (MMDQ_TOP == src_end) {
+					dq_ptd(srcp, i, itemsp + i * srcp->dqitem_size);
+				} else {
+					dq_pbd(srcp, i, itemsp + i * srcp->dqitem_size);
+				}
+			}
+			journalp->dst_end = dst_end;
+			journalp->count = batch;
+			journalp->pushed = 0;
+			journalp->pid = getpid();
+			__atomic_store_n(&journalp->state, MMDQ_JOURNAL_MOVING, __ATOMIC_RELEASE);
+
+			// Remove from the source (into the journal copies they match) ...
+			for (i = 0; i < batch; i++) {
+				if (MMDQ_TOP == src_end) {
+					dq_rtd(srcp, itemsp + i * srcp->dqitem_size);
+				} else {
+					dq_rbd(srcp, itemsp + i * srcp->dqitem_size);
+				}
+			}
+			// ... and add to the destination
+			replay_journal(dstp, journalp);
+		}
+	}
+
+	if ((secondp != NULL) && mma_unlock_atom(secondp)) {
+		APP_ERR(stderr, lerrmsg(secondp, "Error unlocking atom!"));
+	}
+	if (mma_unlock_atom(firstp)) APP_ERR(stderr, lerrmsg(firstp, "Error unlocking atom!"));
+	return retval;
+}
+
+/**
+ * @brief Finish an unfinished move into a memory mapped deque.
+ *
+ * Adds the items left in the deque's move journal by a mover that died.
+ *
+ * @param mmdqhp Pointer to MMA_HANDLE structure representing the memory mapped deque.
+ * @return count of items added, -1 if the deque has no move journal.
+ */
+int mmdq_move_recover(MMA_HANDLE* mmdqhp) {
+	MMDQ_JOURNAL* journalp;
+	int count;
+
+	journalp = mmdq_journal(mmdqhp);
+	if (NULL == journalp) {
+		return -1;
+	}
+	if (mma_lock_atom_write(mmdqhp)) APP_ERR(stderr, lerrmsg(mmdqhp,"Error locking atom!"));
+	count = replay_journal((DQHEADER*)mma_data_pointer(mmdqhp), journalp);
+	if (mma_unlock_atom(mmdqhp)) APP_ERR(stderr, lerrmsg(mmdqhp, "Error unlocking atom!"));
+	return count;
+}
+
+/**
+ * @brief Locate the move journal of a memory mapped deque.
+ *
+ * @param mmdqhp Pointer to MMA_HANDLE structure representing the memory mapped deque.
+ * @return Pointer to the journal, NULL if the deque file was created
+ * 	without room for one.
+ */
+MMDQ_JOURNAL* mmdq_journal(MMA_HANDLE* mmdqhp) {
+	DQHEADER* dequep;
+
+	dequep = (DQHEADER*)mma_data_pointer(mmdqhp);
+	if (deque_file_len(dequep->dqitem_size, dequep->dqslots) > mmdqhp->mm_ref.len) {
+		return NULL;
+	}
+	return (MMDQ_JOURNAL*)((char*)dequep + journal_offset(dequep->dqitem_size, dequep->dqslots));
+}
+
 /**
  * Obtains memory mapped data pointer to deque and
  * calls dq_stats.
@@ -39,6 +39,14 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * sysconfig.c and ini file support (ifile.c) then this environment variable
  * can be overridden by inifile settings.
  *
+ * Items can be moved from one deque to another in one locked operation
+ * (mmdq_move). Each deque file has room after its slots for a move
+ * journal: the items on their way into the deque, at most
+ * MMDQ_MOVE_BATCH at a time. A mover that dies part way leaves the
+ * journal behind, and the rest of the move is done
+ * by the next move into the deque or by mmdq_move_recover. An item may
+ * then be delivered twice but is never lost.
+ *
  */
 #include <mmapfile.h>
 #include <dqacc.h>
@@ -47,6 +55,33 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 #define MMDQ_DIR_PATH "MMDQ_DIR_PATH"
 #define DEFAULT_MMDQ_DIR_PATH "/var/ulppk/data/deques"
 
+/**
+ * End of a deque
+ */
+typedef enum _enum_mmdq_end {
+	MMDQ_TOP = 0,
+	MMDQ_BOTTOM
+} MMDQ_END;
+
+#define MMDQ_MOVE_BATCH 64			///< Most items the move journal holds
+
+#define MMDQ_JOURNAL_IDLE 0			///< No move in progress
+#define MMDQ_JOURNAL_MOVING 1		///< Items in the journal are being added to the deque
+
+/**
+ * Move journal, at the end of a deque file. The items being moved
+ * follow the structure.
+ */
+typedef struct _mmdq_journal {
+	unsigned int state;			///< MMDQ_JOURNAL_IDLE or MMDQ_JOURNAL_MOVING
+	ushort dst_end;				///< end of the deque the items are added to (MMDQ_END)
+	ushort count;				///< items in the journal
+	ushort pushed;				///< items already added to the deque
+	ushort spare;				///< keep alignment nice
+	pid_t pid;					///< process that wrote the journal
+	long align8byte[0];			///< items start on a long boundary
+} MMDQ_JOURNAL;
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -66,6 +101,15 @@ int mmdq_rbd(MMA_HANDLE* mmdqhp,void* itemp);
 int mmdq_reset(MMA_HANDLE* mmdqhp);
 DQSTATS* mmdq_stats(MMA_HANDLE* mmdqhp, DQSTATS* dq_statsp);
 
+// Move items between deques under both locks, with a journal for recovery
+int mmdq_move(MMA_HANDLE* srchp, MMDQ_END src_end, MMA_HANDLE* dsthp, MMDQ_END dst_end, ushort n);
+int mmdq_move_recover(MMA_HANDLE* mmdqhp);
+MMDQ_JOURNAL* mmdq_journal(MMA_HANDLE* mmdqhp);
+
+// Bulk copy of a deque (items, positions and journal) to and from a file or pipe
+int mmdq_export(MMA_HANDLE* mmdqhp, int fd);
+MMA_HANDLE* mmdq_import(const char* dequename, int fd);
+
 // Return path to deque directory.
 char* mmdq_dequedir();
 // Given a deque name, retrieve the full path to
@@ -39,13 +39,72 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <mmfor.h>
+#include <ioutils.h>
+
+// Optimistic read attempts before a reader waits on the record lock
+#define MMFOR_SEQ_SPINS 1000
+
+// Parallel scan accumulators are kept this far apart
+#define MMFOR_CACHE_LINE 64
+
+/*
+ * A parallel scan. The mapping and record count are captured before
+ * the threads start so that the threads never use the handle, whose
+ * mapping may move when it notices the file has grown.
+ */
+typedef struct {
+	void* p0;				// first record slot
+	size_t slot_size;		// distance between records
+	size_t rec_off;			// offset of the record within its slot
+	size_t nrecs;			// records to visit
+	size_t nchunks;			// MMFOR_SCAN_CHUNK chunks covering them
+	size_t next_chunk;		// next chunk to be taken by a thread
+	int stop;				// first non-zero callback return
+	MMFOR_SCAN_FN scan;		// per record function (scan) ...
+	MMFOR_MAP_FN map;		// ... or (reduce)
+	void* ctx;				// callback context
+} SCAN_JOB;
+
+typedef struct {
+	SCAN_JOB* jobp;
+	void* acc;				// this thread's accumulator (reduce)
+	pthread_t tid;
+} SCAN_WORKER;
 
 static int lock_cntrl(MMFOR_HANDLE* mmforhp, int cmd, int type, size_t start);
 
+static size_t slot_size(size_t rec_size, unsigned int for_flags);
+
+static int bad_header(MMA_HANDLE* mmahp);
+
+static unsigned long* seq_word(MMFOR_HANDLE* mmforhp, size_t x);
+
+static int refresh(MMFOR_HANDLE* mmforhp);
+
+static int grow(MMFOR_HANDLE* mmforhp, size_t nrecs);
+
+static int header_lock(MMFOR_HANDLE* mmforhp, int cmd, int type);
+
+static int settle_copy(MMFOR_HANDLE* mmforhp, int fd, size_t len);
+
+static size_t chunk_first(SCAN_JOB* jobp, size_t c);
+
+static void* scan_worker(void* arg);
+
+static int run_scan(MMFOR_HANDLE* mmforhp, int nthreads, SCAN_JOB* jobp,
+	MMFOR_REDUCE_FN reduce, void* result, size_t result_size);
+
 /**
  * @brief Create a new memory mapped file of records.
  *
@@ -60,23 +119,48 @@ static int lock_cntrl(MMFOR_HANDLE* mmforhp, int cmd, int type, size_t start);
  */
  MMFOR_HANDLE* mmfor_create(char* filepath,  MMA_ACCESS_MODES mode,
  	MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs) {
+	return mmfor_create_flags(filepath, mode, flags, permissions, rec_size, nrecs, 0);
+}
+
+/**
+ * @brief Create a new memory mapped file of records with options.
+ *
+ * @param filepath Pathname of the file to be created.
+ * @param mode Memory mapped atom access mode. (see mmatom.h)
+ * @param flags Shared/private (see mmatom.h)
+ * @param permissions access permissions (see man open(2))
+ * @param rec_size Size of a record in bytes
+ * @param nrecs Number of records file must store
+ * @param for_flags Zero or MMFOR_FLAG_SEQLOCK
+ * @return Returns pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ */
+MMFOR_HANDLE* mmfor_create_flags(char* filepath,  MMA_ACCESS_MODES mode,
+	MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs, unsigned int for_flags) {
 
 	MMFOR_HANDLE* mmforhp;
 	MMFOR_HEADER* mmforhdp;
 	size_t len;
 	
-	len = (rec_size * nrecs) + sizeof(MMFOR_HEADER);
+	len = (slot_size(rec_size, for_flags) * nrecs) + sizeof(MMFOR_HEADER);
 	
 	mmforhp = (MMFOR_HANDLE*)calloc(1, sizeof(MMFOR_HANDLE));
 	mmforhp->mmahp = mmapfile_create(NULL, filepath, len, mode, flags,
 		permissions);
 	if (mmforhp->mmahp != NULL) {
 		mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
+		mmforhdp->magic = MMFOR_MAGIC;
+		mmforhdp->version = MMFOR_VERSION;
 		mmforhdp->rec_size = rec_size;
 		mmforhdp->file_size = len;
 		mmforhdp->nrecs = nrecs;
+		mmforhdp->flags = for_flags;
+		mmforhdp->generation = 0;
 		mmforhp->rec_size = rec_size;
 		mmforhp->nrecs = nrecs;
+		mmforhp->flags = for_flags;
+		mmforhp->slot_size = slot_size(rec_size, for_flags);
+		mmforhp->generation = 0;
 	} else {
 		free(mmforhp);
 		mmforhp = NULL;
@@ -87,11 +171,16 @@ static int lock_cntrl(MMFOR_HANDLE* mmforhp, int cmd, int type, size_t start);
  /**
   * @brief Intialize/open an existing memory mapped file of records.
   *
+  * The file must start with a header of this version and be long
+  * enough for the whole records its header describes; otherwise the
+  * open fails with mma_error set to MMA_ERR_FOR_FORMAT. Files written
+  * before the header carried a magic number must be recreated.
+  *
   * @param filepath Pathname of the file to be created.
   * @param mode Memory mapped atom access mode. (see mmatom.h)
   * @param flags Shared/private (see mmatom.h)
   * @return Returns pointer to a MMFOR_HANDLE representing the memory
-  * 	mapped file and region.
+  * 	mapped file and region, NULL on failure.
   */
 MMFOR_HANDLE* mmfor_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags) {
 	MMFOR_HANDLE* mmforhp;
@@ -99,10 +188,19 @@ MMFOR_HANDLE* mmfor_open(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS fl
 	 		
 	mmforhp = (MMFOR_HANDLE*)calloc(1, sizeof(MMFOR_HANDLE));
 	mmforhp->mmahp = mmapfile_open(NULL, filepath, mode, flags);
+	if ((mmforhp->mmahp != NULL) && bad_header(mmforhp->mmahp)) {
+		mma_destroy_atom(mmforhp->mmahp);
+		mmforhp->mmahp = NULL;
+		mma_error = MMA_ERR_FOR_FORMAT;
+		mma_os_error = EINVAL;
+	}
 	if (mmforhp->mmahp != NULL) {
 		mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
 		mmforhp->nrecs = mmforhdp->nrecs;
 		mmforhp->rec_size = mmforhdp->rec_size;
+		mmforhp->flags = mmforhdp->flags;
+		mmforhp->slot_size = slot_size(mmforhdp->rec_size, mmforhdp->flags);
+		mmforhp->generation = mmforhdp->generation;
 	} else {
 		free(mmforhp);
 		mmforhp = NULL;
@@ -139,9 +237,13 @@ void* mmfor_x2p(MMFOR_HANDLE* mmforhp, size_t x) {
 	void* px;
 	MMFOR_HEADER* mmforhdp;
 	
+	refresh(mmforhp);
 	mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
 	p0 = ((void*)mmforhdp) + sizeof(MMFOR_HEADER);
-	px = p0 + (mmforhdp->rec_size) * x;
+	px = p0 + mmforhp->slot_size * x;
+	if (mmforhp->flags & MMFOR_FLAG_SEQLOCK) {
+		px += sizeof(unsigned long);		// skip the sequence word
+	}
 	return px;
 }
 
@@ -159,10 +261,11 @@ size_t mmfor_p2x(MMFOR_HANDLE* mmforhp, void* p) {
 	size_t x;
 	MMFOR_HEADER* mmforhdp;
 	
+	refresh(mmforhp);
 	mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
 	p0 = (void*)(mmforhdp + 1);
 	nbytes = (size_t)(p - p0);
-	x = nbytes / mmforhdp->rec_size;
+	x = nbytes / mmforhp->slot_size;
 	return x;
 }
 
@@ -218,7 +321,7 @@ int mmfor_lock_record_x_write(MMFOR_HANDLE* mmforhp, size_t x) {
 	void* p;
 
 	p = mmfor_x2p(mmforhp, x);
-	return mmfor_lock_record_p_read(mmforhp,p);
+	return mmfor_lock_record_p_write(mmforhp,p);
 }
 
 /**
@@ -280,9 +383,114 @@ int mmfor_unlock_record_p(MMFOR_HANDLE* mmforhp, void* p) {
  * @return Record capacity of the memory mapped file of records.
  */
 size_t mmfor_record_count(MMFOR_HANDLE* mmforhp) {
+	refresh(mmforhp);
+	mmforhp->nrecs = __atomic_load_n(
+		&((MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp))->nrecs, __ATOMIC_ACQUIRE);
 	return mmforhp->nrecs;
 }
 
+/**
+ * @brief Return the number of records the file can hold without growing.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @return Record capacity of the file.
+ */
+size_t mmfor_capacity(MMFOR_HANDLE* mmforhp) {
+	refresh(mmforhp);
+	return (((MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp))->file_size - sizeof(MMFOR_HEADER)) /
+		mmforhp->slot_size;
+}
+
+/**
+ * @brief Make room for at least nrecs records.
+ *
+ * If the file is too small it is extended to hold nrecs records or
+ * twice its current capacity, whichever is more. The record count is
+ * not changed. The file's header is locked while it grows.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param nrecs Number of records the file must be able to hold.
+ * @return 0 on success, non-zero on failure (see mma_error).
+ */
+int mmfor_reserve(MMFOR_HANDLE* mmforhp, size_t nrecs) {
+	int retval;
+
+	if (header_lock(mmforhp, F_SETLKW, F_WRLCK)) {
+		return 1;
+	}
+	retval = grow(mmforhp, nrecs);
+	header_lock(mmforhp, F_SETLK, mmforhp->mmahp->lock_type);
+	return retval;
+}
+
+/**
+ * @brief Set the number of records in the file.
+ *
+ * The file grows as for mmfor_reserve. Records added to the end
+ * of the file are zeroed. Shrinking the count leaves the file
+ * length alone.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param nrecs New record count.
+ * @return 0 on success, non-zero on failure (see mma_error).
+ */
+int mmfor_resize(MMFOR_HANDLE* mmforhp, size_t nrecs) {
+	MMFOR_HEADER* mmforhdp;
+	size_t x;
+	int retval;
+
+	if (header_lock(mmforhp, F_SETLKW, F_WRLCK)) {
+		return 1;
+	}
+	x = mmfor_record_count(mmforhp);
+	retval = grow(mmforhp, nrecs);
+	if (0 == retval) {
+		mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
+		if (nrecs > x) {
+			memset((void*)(mmforhdp + 1) + mmforhp->slot_size * x, 0,
+				mmforhp->slot_size * (nrecs - x));
+		}
+		__atomic_store_n(&mmforhdp->nrecs, nrecs, __ATOMIC_RELEASE);
+		mmforhp->nrecs = nrecs;
+	}
+	header_lock(mmforhp, F_SETLK, mmforhp->mmahp->lock_type);
+	return retval;
+}
+
+/**
+ * @brief Add a record after the last record of the file.
+ *
+ * The file grows geometrically as needed (see mmfor_reserve), then the
+ * record is copied in and the record count bumped.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param rec Record size bytes to copy into the new record.
+ * @return Index of the new record, MMFOR_NO_RECORD on failure.
+ */
+size_t mmfor_append(MMFOR_HANDLE* mmforhp, void* rec) {
+	MMFOR_HEADER* mmforhdp;
+	size_t x;
+
+	if (header_lock(mmforhp, F_SETLKW, F_WRLCK)) {
+		return MMFOR_NO_RECORD;
+	}
+	x = mmfor_record_count(mmforhp);
+	if (grow(mmforhp, x + 1)) {
+		x = MMFOR_NO_RECORD;
+	} else {
+		memcpy(mmfor_x2p(mmforhp, x), rec, mmforhp->rec_size);
+		mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
+		__atomic_store_n(&mmforhdp->nrecs, x + 1, __ATOMIC_RELEASE);
+		mmforhp->nrecs = x + 1;
+	}
+	header_lock(mmforhp, F_SETLK, mmforhp->mmahp->lock_type);
+	return x;
+}
+
 /**
  * @brief Return size of the user area of the record
  *
@@ -294,6 +502,711 @@ size_t mmfor_record_size(MMFOR_HANDLE* mmforhp){
 	return mmforhp->rec_size;
 }
 
+/**
+ * @brief Copy a record.
+ *
+ * In a MMFOR_FLAG_SEQLOCK file the copy is made without a lock and
+ * retried until the record's sequence word is even and unchanged
+ * across the copy. If a writer holds the record too long, the reader
+ * waits on the record lock instead; finding the sequence word still
+ * odd then means the writer died part way through its update. Other
+ * files are read under the record's read lock.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param x Zero based record index.
+ * @param out Buffer of at least the record size to receive the copy.
+ * @return 0 on success, non-zero if x is out of range, the lock fails
+ * 	or the record was left half written by a writer that died.
+ */
+int mmfor_read_record(MMFOR_HANDLE* mmforhp, size_t x, void* out) {
+	unsigned long* seqp;
+	unsigned long seq;
+	int spins;
+	int retval;
+
+	if (x >= mmfor_record_count(mmforhp)) {
+		return 1;
+	}
+	if (mmforhp->flags & MMFOR_FLAG_SEQLOCK) {
+		seqp = seq_word(mmforhp, x);
+		for (spins = 0; spins < MMFOR_SEQ_SPINS; spins++) {
+			seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+			if (!(seq & 1)) {
+				memcpy(out, mmfor_x2p(mmforhp, x), mmforhp->rec_size);
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(seqp, __ATOMIC_RELAXED) == seq) {
+					return 0;
+				}
+			} else {
+				sched_yield();			// let the writer finish
+			}
+		}
+	}
+	if (mmfor_lock_record_x_read(mmforhp, x)) {
+		return 1;
+	}
+	memcpy(out, mmfor_x2p(mmforhp, x), mmforhp->rec_size);
+	retval = (mmforhp->flags & MMFOR_FLAG_SEQLOCK) ? (int)(*seq_word(mmforhp, x) & 1) : 0;
+	mmfor_unlock_record_x(mmforhp, x);
+	return retval;
+}
+
+/**
+ * @brief Start an update of a record.
+ *
+ * Locks the record for writing and, in a MMFOR_FLAG_SEQLOCK file, makes
+ * its sequence word odd so that lock free readers retry. Threads of one
+ * process share their record locks, so they must not update the same
+ * record at once.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param x Zero based record index.
+ * @return Pointer to the record, NULL if x is out of range or the lock fails.
+ */
+void* mmfor_write_begin(MMFOR_HANDLE* mmforhp, size_t x) {
+	if ((x >= mmfor_record_count(mmforhp)) || mmfor_lock_record_x_write(mmforhp, x)) {
+		return NULL;
+	}
+	return mmfor_owned_write_begin(mmforhp, x);
+}
+
+/**
+ * @brief Finish an update started by mmfor_write_begin.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param x Zero based record index.
+ * @return 0 on success, non-zero on failure.
+ */
+int mmfor_write_end(MMFOR_HANDLE* mmforhp, size_t x) {
+	mmfor_owned_write_end(mmforhp, x);
+	return mmfor_unlock_record_x(mmforhp, x);
+}
+
+/**
+ * @brief Start an update of a record the caller already owns.
+ *
+ * As mmfor_write_begin, but no lock is taken. For records that the
+ * caller has claimed by other means (for example an atomic claim of
+ * a slot, see linearlist.c), so that no other writer can touch them.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param x Zero based record index.
+ * @return Pointer to the record.
+ */
+void* mmfor_owned_write_begin(MMFOR_HANDLE* mmforhp, size_t x) {
+	unsigned long* seqp;
+
+	if (mmforhp->flags & MMFOR_FLAG_SEQLOCK) {
+		seqp = seq_word(mmforhp, x);
+		// Still odd if the last writer died mid update: carry on from there
+		if (!(*seqp & 1)) {
+			__atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+		}
+	}
+	return mmfor_x2p(mmforhp, x);
+}
+
+/**
+ * @brief Finish an update started by mmfor_owned_write_begin.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param x Zero based record index.
+ */
+void mmfor_owned_write_end(MMFOR_HANDLE* mmforhp, size_t x) {
+	unsigned long* seqp;
+
+	if (mmforhp->flags & MMFOR_FLAG_SEQLOCK) {
+		seqp = seq_word(mmforhp, x);
+		__atomic_store_n(seqp, *seqp + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * @brief Return the sequence word of a record.
+ *
+ * Odd while the record is being written, otherwise the number of
+ * completed updates times two. 0 in files without sequence words.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param x Zero based record index.
+ * @return Sequence word.
+ */
+unsigned long mmfor_record_seq(MMFOR_HANDLE* mmforhp, size_t x) {
+	if (mmforhp->flags & MMFOR_FLAG_SEQLOCK) {
+		return __atomic_load_n(seq_word(mmforhp, x), __ATOMIC_ACQUIRE);
+	}
+	return 0;
+}
+
+/**
+ * @brief Replace the contents of a record.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param x Zero based record index.
+ * @param in Record size bytes to copy into the record.
+ * @return 0 on success, non-zero on failure.
+ */
+int mmfor_write_record(MMFOR_HANDLE* mmforhp, size_t x, void* in) {
+	void* p;
+
+	p = mmfor_write_begin(mmforhp, x);
+	if (NULL == p) {
+		return 1;
+	}
+	memcpy(p, in, mmforhp->rec_size);
+	return mmfor_write_end(mmforhp, x);
+}
+
+/**
+ * @brief Call a function for every record, from several threads.
+ *
+ * The records present when the call is made are split into chunks of
+ * MMFOR_SCAN_CHUNK bytes of file, starting on page boundaries. The
+ * calling thread and nthreads - 1 others take chunks one at a time
+ * until all are done, so the order in which records are visited is
+ * not defined, and scan must be safe to call from several threads.
+ * Records are passed in place, without locks: callers that scan files
+ * being updated must make their own arrangements (see
+ * mmfor_read_record). The handle must not be used by other threads
+ * during the scan.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param nthreads Number of threads, or 0 for one per online processor.
+ * @param scan Called with ctx, the record index and a pointer to the record.
+ * 	A non-zero return stops the scan once each thread finishes its chunk.
+ * @param ctx Passed to scan.
+ * @return 0 if every record was visited, the first non-zero value returned
+ * 	by scan, or -1 on failure.
+ */
+int mmfor_parallel_scan(MMFOR_HANDLE* mmforhp, int nthreads, MMFOR_SCAN_FN scan, void* ctx) {
+	SCAN_JOB job;
+
+	memset(&job, 0, sizeof(job));
+	job.scan = scan;
+	job.ctx = ctx;
+	return run_scan(mmforhp, nthreads, &job, NULL, NULL, 0);
+}
+
+/**
+ * @brief Map every record into per thread accumulators, from several
+ * threads, and reduce the accumulators into a result.
+ *
+ * Work is shared as for mmfor_parallel_scan. Each thread starts with
+ * an accumulator holding a copy of result, on its own cache lines, and
+ * calls map for the records it visits. When all threads are done the
+ * calling thread passes each accumulator, in thread order, to reduce.
+ * Reduction happens even if the scan is stopped early.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param nthreads Number of threads, or 0 for one per online processor.
+ * @param map Called with ctx, the record index, a pointer to the record
+ * 	and the thread's accumulator. A non-zero return stops the scan.
+ * @param reduce Called with ctx, result and each accumulator in turn.
+ * @param ctx Passed to map and reduce.
+ * @param result On entry the starting value of every accumulator, which
+ * 	should be an identity of reduce (zero for a sum). The result on return.
+ * @param result_size Size of result (and each accumulator) in bytes.
+ * @return 0 if every record was visited, the first non-zero value returned
+ * 	by map, or -1 on failure.
+ */
+int mmfor_parallel_reduce(MMFOR_HANDLE* mmforhp, int nthreads, MMFOR_MAP_FN map,
+	MMFOR_REDUCE_FN reduce, void* ctx, void* result, size_t result_size) {
+	SCAN_JOB job;
+
+	memset(&job, 0, sizeof(job));
+	job.map = map;
+	job.ctx = ctx;
+	return run_scan(mmforhp, nthreads, &job, reduce, result, result_size);
+}
+
+/**
+ * @brief Advise the kernel how the mapped file will be used.
+ *
+ * For example MADV_SEQUENTIAL before a scan, so that pages are read
+ * well ahead and dropped soon after. The advice covers the current
+ * mapping, and is lost if the file grows and is remapped.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param advice MADV_... value (see madvise(2)).
+ * @return 0 on success, non-zero on failure (see errno).
+ */
+int mmfor_advise(MMFOR_HANDLE* mmforhp, int advice) {
+	if (refresh(mmforhp)) {
+		return 1;
+	}
+	return madvise(mmforhp->mmahp->mm_ref.pa, mmforhp->mmahp->mm_ref.len, advice);
+}
+
+/**
+ * @brief Make a point in time copy of the file for a long running reader.
+ *
+ * The copy is made under a read lock on the whole file, which waits
+ * for writers holding record locks and for growth to finish, and holds
+ * off new ones until the copy is made. Where the filesystem supports
+ * it the copy is a reflink (ioutils_clone_file): only the extent map
+ * is copied, writers are held off for a moment whatever the file's
+ * size, and the copy takes no space until the original changes.
+ *
+ * Otherwise the bytes are copied in the kernel (ioutils_copy_range).
+ * A file with sequence words (MMFOR_FLAG_SEQLOCK) is copied without
+ * the lock. Under the lock, the records whose sequence word has moved
+ * on since are copied again, with the header and any growth, so
+ * writers wait only for that. Other files are copied whole under the
+ * lock, and writers wait for as long as the copy of the file takes.
+ *
+ * A private (MAP_PRIVATE) mapping of the file would not do instead:
+ * pages the reader has not yet touched show later changes.
+ *
+ * Writers that take no lock (the lock free appends of linearlist.c)
+ * are not held off. Records they were writing are copied with an odd
+ * sequence word, and mmfor_read_record on the snapshot reports them
+ * as damaged. Companion files, such as a list's hash index, are not
+ * copied. The calling process must not hold record locks on the file
+ * (a whole file lock replaces them).
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param snappath Pathname for the copy, which is kept after it is
+ * 	closed. If NULL an unnamed copy is made next to the file and
+ * 	removed when closed.
+ * @return Handle for the copy, opened read only, or NULL on failure.
+ */
+MMFOR_HANDLE* mmfor_snapshot(MMFOR_HANDLE* mmforhp, char* snappath) {
+	char path[PATH_MAX];
+	MMFOR_HANDLE* snaphp = NULL;
+	struct stat st;
+	size_t len;
+	int from;
+	int fd;
+	int status;
+
+	from = mmforhp->mmahp->mm_ref.filedes;
+	if (fstat(from, &st)) {
+		return NULL;
+	}
+	if (NULL == snappath) {
+		snprintf(path, sizeof(path), "%s%sXXXXXX", mma_get_disk_file_path(mmforhp->mmahp),
+			MMFOR_SNAPSHOT_SUFFIX);
+		fd = mkstemp(path);
+		if (fd >= 0) {
+			fchmod(fd, st.st_mode & 0777);
+		}
+	} else {
+		snprintf(path, sizeof(path), "%s", snappath);
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, st.st_mode & 0777);
+	}
+	if (fd < 0) {
+		return NULL;
+	}
+	if (mmfor_lock_file_read(mmforhp)) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	status = refresh(mmforhp);
+	if ((0 == status) && ioutils_clone_file(from, fd)) {
+		len = ((MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp))->file_size;
+		if (mmforhp->flags & MMFOR_FLAG_SEQLOCK) {
+			// Copy without the lock, then catch up under it
+			mmfor_unlock_file(mmforhp);
+			status = (ioutils_copy_range(from, 0, fd, 0, len) != len);
+			if (mmfor_lock_file_read(mmforhp)) {
+				close(fd);
+				unlink(path);
+				return NULL;
+			}
+			status = status || refresh(mmforhp) || settle_copy(mmforhp, fd, len);
+		} else {
+			status = (ioutils_copy_range(from, 0, fd, 0, len) != len);
+		}
+	}
+	mmfor_unlock_file(mmforhp);
+	close(fd);
+	if (0 == status) {
+		snaphp = mmfor_open(path, MMA_READ, MMF_SHARED);
+	}
+	if ((NULL == snappath) || (NULL == snaphp)) {
+		unlink(path);		// the mapping keeps an unnamed copy alive
+	}
+	return snaphp;
+}
+
+/**
+ * @brief Write the records of the file to a file descriptor in bulk.
+ *
+ * A MMA_DUMP_HEADER (kind MMA_DUMP_MMFOR, with the record size, record
+ * count and MMFOR_FLAG_... flags) is followed by the file's header and
+ * records, up to the last record in use; spare capacity is left out.
+ * The records are copied in the kernel where possible (see mma_dump)
+ * under a read lock on the whole file, so writers taking record locks
+ * wait until the copy is done. Companion files, such as a list's hash
+ * index, are not written.
+ *
+ * @param mmforhp pointer to a MMFOR_HANDLE representing the memory
+ * 	mapped file and region.
+ * @param fd Descriptor of a file, pipe or socket, written at its position.
+ * @return 0 on success, non-zero on failure (see mma_error).
+ */
+int mmfor_export(MMFOR_HANDLE* mmforhp, int fd) {
+	MMA_DUMP_HEADER hdr;
+	int status;
+
+	if (mmfor_lock_file_read(mmforhp)) {
+		return 1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.kind = MMA_DUMP_MMFOR;
+	hdr.flags = mmforhp->flags;
+	hdr.rec_size = mmforhp->rec_size;
+	hdr.nrecs = mmfor_record_count(mmforhp);
+	hdr.length = sizeof(MMFOR_HEADER) + mmforhp->slot_size * hdr.nrecs;
+	status = mma_dump(mmforhp->mmahp, fd, &hdr);
+	mmfor_unlock_file(mmforhp);
+	return status;
+}
+
+/**
+ * @brief Create a file of records from a dump written by mmfor_export.
+ *
+ * The file is created with the geometry in the dump header and the
+ * records are read straight into the mapped region. The new file has
+ * no spare capacity; it grows as usual on the next append.
+ *
+ * @param filepath Pathname of the file to be created.
+ * @param mode Memory mapped atom access mode. (see mmatom.h)
+ * @param flags Shared/private (see mmatom.h)
+ * @param permissions access permissions (see man open(2))
+ * @param fd Descriptor of a file or pipe positioned at the dump.
+ * @return Returns pointer to a MMFOR_HANDLE representing the new file,
+ * 	NULL on failure (see mma_error).
+ */
+MMFOR_HANDLE* mmfor_import(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags,
+	int permissions, int fd) {
+	MMFOR_HANDLE* mmforhp;
+	MMFOR_HEADER* mmforhdp;
+	MMA_DUMP_HEADER hdr;
+
+	if (mma_dump_header(fd, MMA_DUMP_MMFOR, &hdr)) {
+		return NULL;
+	}
+	if ((0 == hdr.rec_size) || (hdr.length != sizeof(MMFOR_HEADER) +
+		slot_size(hdr.rec_size, hdr.flags) * hdr.nrecs)) {
+		mma_error = MMA_ERR_DUMP_FORMAT;
+		mma_os_error = EINVAL;
+		return NULL;
+	}
+	mmforhp = mmfor_create_flags(filepath, mode, flags, permissions, hdr.rec_size, hdr.nrecs,
+		hdr.flags);
+	if (NULL == mmforhp) {
+		return NULL;
+	}
+	if (mma_load(mmforhp->mmahp, fd, &hdr)) {
+		mmfor_close(mmforhp);
+		unlink(filepath);
+		return NULL;
+	}
+	// The dumped header describes the old file
+	mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
+	mmforhdp->magic = MMFOR_MAGIC;
+	mmforhdp->version = MMFOR_VERSION;
+	mmforhdp->file_size = hdr.length;
+	mmforhdp->nrecs = hdr.nrecs;
+	mmforhdp->generation = 0;
+	return mmforhp;
+}
+
+/*
+ * Distance between records: a sequence word, if any, precedes each
+ * record and keeps it long aligned.
+ */
+static size_t slot_size(size_t rec_size, unsigned int for_flags) {
+	if (for_flags & MMFOR_FLAG_SEQLOCK) {
+		return sizeof(unsigned long) +
+			(rec_size + sizeof(unsigned long) - 1) / sizeof(unsigned long) * sizeof(unsigned long);
+	}
+	return rec_size;
+}
+
+/*
+ * Check the header of a file just mapped by mmfor_open. A file grown
+ * by another process since it was mapped is remapped at its new
+ * length; one shorter than its header says is refused.
+ */
+static int bad_header(MMA_HANDLE* mmahp) {
+	MMFOR_HEADER* mmforhdp;
+	struct stat statbuf;
+	size_t file_size;
+	size_t slot;
+
+	if (mmahp->mm_ref.len < sizeof(MMFOR_HEADER)) {
+		return 1;
+	}
+	mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmahp);
+	if ((mmforhdp->magic != MMFOR_MAGIC) || (mmforhdp->version != MMFOR_VERSION) ||
+		(0 == mmforhdp->rec_size) || (mmforhdp->flags & ~MMFOR_FLAG_SEQLOCK)) {
+		return 1;
+	}
+	slot = slot_size(mmforhdp->rec_size, mmforhdp->flags);
+	file_size = __atomic_load_n(&mmforhdp->file_size, __ATOMIC_ACQUIRE);
+	if ((file_size < sizeof(MMFOR_HEADER)) || ((file_size - sizeof(MMFOR_HEADER)) % slot) ||
+		(mmforhdp->nrecs > (file_size - sizeof(MMFOR_HEADER)) / slot)) {
+		return 1;
+	}
+	if (file_size > mmahp->mm_ref.len) {
+		if ((fstat(mmahp->mm_ref.filedes, &statbuf) < 0) || ((size_t)statbuf.st_size < file_size) ||
+			mma_remap(mmahp, file_size)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Bring up to date a copy of a seqlock file of which len bytes were
+ * copied without the lock: copy again the header, any growth since,
+ * and the records whose sequence word no longer matches (a writer
+ * changed them during the copy). The caller holds the file read
+ * locked, so the file is still until the copy matches it.
+ */
+static int settle_copy(MMFOR_HANDLE* mmforhp, int fd, size_t len) {
+	MMFOR_HEADER* mmforhdp;
+	char* copyp;
+	char* slotp;
+	char* livep;
+	size_t file_size;
+	size_t nslots;
+	size_t x;
+
+	mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
+	file_size = mmforhdp->file_size;
+	if (file_size > len) {
+		if (ioutils_copy_range(mmforhp->mmahp->mm_ref.filedes, len, fd, len, file_size - len) !=
+			file_size - len) {
+			return 1;
+		}
+		nslots = (len - sizeof(MMFOR_HEADER)) / mmforhp->slot_size;
+	} else {
+		if ((file_size < len) && ftruncate(fd, file_size)) {
+			return 1;
+		}
+		nslots = (file_size - sizeof(MMFOR_HEADER)) / mmforhp->slot_size;
+	}
+	copyp = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == copyp) {
+		return 1;
+	}
+	memcpy(copyp, mmforhdp, sizeof(MMFOR_HEADER));
+	for (x = 0; x < nslots; x++) {
+		slotp = copyp + sizeof(MMFOR_HEADER) + x * mmforhp->slot_size;
+		livep = (char*)(mmforhdp + 1) + x * mmforhp->slot_size;
+		if (*(unsigned long*)slotp != __atomic_load_n((unsigned long*)livep, __ATOMIC_ACQUIRE)) {
+			memcpy(slotp, livep, mmforhp->slot_size);
+		}
+	}
+	munmap(copyp, file_size);
+	return 0;
+}
+
+/*
+ * Address of the sequence word of record x
+ */
+static unsigned long* seq_word(MMFOR_HANDLE* mmforhp, size_t x) {
+	return (unsigned long*)(mmfor_x2p(mmforhp, x) - sizeof(unsigned long));
+}
+
+/*
+ * Remap the file if another process has grown it since we mapped it.
+ * Grown files publish the new length before the new generation.
+ */
+static int refresh(MMFOR_HANDLE* mmforhp) {
+	MMFOR_HEADER* mmforhdp;
+	unsigned int generation;
+
+	mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
+	generation = __atomic_load_n(&mmforhdp->generation, __ATOMIC_ACQUIRE);
+	if (generation == mmforhp->generation) {
+		return 0;
+	}
+	if (mma_remap(mmforhp->mmahp, mmforhdp->file_size)) {
+		return 1;
+	}
+	mmforhp->generation = generation;
+	return 0;
+}
+
+/*
+ * Extend the file to hold at least nrecs records, at least doubling its
+ * capacity. The caller holds the header lock.
+ */
+static int grow(MMFOR_HANDLE* mmforhp, size_t nrecs) {
+	MMFOR_HEADER* mmforhdp;
+	size_t capacity;
+	size_t len;
+
+	if (refresh(mmforhp)) {
+		return 1;
+	}
+	capacity = mmfor_capacity(mmforhp);
+	if (nrecs <= capacity) {
+		return 0;
+	}
+	if (nrecs < 2 * capacity) {
+		nrecs = 2 * capacity;
+	}
+	len = sizeof(MMFOR_HEADER) + mmforhp->slot_size * nrecs;
+	if (mma_grow(mmforhp->mmahp, len)) {
+		return 1;
+	}
+	mmforhdp = (MMFOR_HEADER*)mma_data_pointer(mmforhp->mmahp);
+	mmforhdp->file_size = len;
+	mmforhp->generation = mmforhdp->generation + 1;
+	__atomic_store_n(&mmforhdp->generation, mmforhp->generation, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Lock the file header. Record locks never overlap it, so this
+ * serializes growth without blocking record access. Callers release
+ * it by passing the handle's whole file lock type, so a file lock
+ * held around the call (see mmfor_lock_file_write) still covers the
+ * header afterwards.
+ */
+static int header_lock(MMFOR_HANDLE* mmforhp, int cmd, int type) {
+	struct flock lock;
+
+	lock.l_type = type;
+	lock.l_start = 0;
+	lock.l_whence = SEEK_SET;
+	lock.l_len = sizeof(MMFOR_HEADER);
+
+	return (fcntl(mmforhp->mmahp->mm_ref.filedes, cmd, &lock));
+}
+
+/*
+ * Index of the first record starting in chunk c, nrecs past the last chunk.
+ */
+static size_t chunk_first(SCAN_JOB* jobp, size_t c) {
+	size_t off;
+	size_t x;
+
+	off = c * MMFOR_SCAN_CHUNK;
+	if (off <= sizeof(MMFOR_HEADER)) {
+		return 0;
+	}
+	x = (off - sizeof(MMFOR_HEADER) + jobp->slot_size - 1) / jobp->slot_size;
+	return (x < jobp->nrecs) ? x : jobp->nrecs;
+}
+
+/*
+ * Take chunks until none are left or the scan is stopped.
+ */
+static void* scan_worker(void* arg) {
+	SCAN_WORKER* wp = (SCAN_WORKER*)arg;
+	SCAN_JOB* jobp = wp->jobp;
+	void* p;
+	size_t c;
+	size_t x;
+	size_t end;
+	int rc;
+	int zero;
+
+	while (!__atomic_load_n(&jobp->stop, __ATOMIC_RELAXED)) {
+		c = __atomic_fetch_add(&jobp->next_chunk, 1, __ATOMIC_RELAXED);
+		if (c >= jobp->nchunks) {
+			break;
+		}
+		end = chunk_first(jobp, c + 1);
+		for (x = chunk_first(jobp, c); x < end; x++) {
+			p = jobp->p0 + jobp->slot_size * x + jobp->rec_off;
+			rc = (jobp->map != NULL) ? jobp->map(jobp->ctx, x, p, wp->acc) :
+				jobp->scan(jobp->ctx, x, p);
+			if (rc) {
+				zero = 0;
+				__atomic_compare_exchange_n(&jobp->stop, &zero, rc, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Run a parallel scan. The calling thread is worker 0. If a thread
+ * cannot be started the others do its share.
+ */
+static int run_scan(MMFOR_HANDLE* mmforhp, int nthreads, SCAN_JOB* jobp,
+	MMFOR_REDUCE_FN reduce, void* result, size_t result_size) {
+	SCAN_WORKER* workers;
+	void* accs = NULL;
+	size_t stride = 0;
+	int started;
+	int i;
+
+	jobp->nrecs = mmfor_record_count(mmforhp);
+	jobp->p0 = mma_data_pointer(mmforhp->mmahp) + sizeof(MMFOR_HEADER);
+	jobp->slot_size = mmforhp->slot_size;
+	jobp->rec_off = (mmforhp->flags & MMFOR_FLAG_SEQLOCK) ? sizeof(unsigned long) : 0;
+	jobp->nchunks = (sizeof(MMFOR_HEADER) + jobp->slot_size * jobp->nrecs +
+		MMFOR_SCAN_CHUNK - 1) / MMFOR_SCAN_CHUNK;
+	if (nthreads <= 0) {
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if ((size_t)nthreads > jobp->nchunks) {
+		nthreads = (int)jobp->nchunks;
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	workers = (SCAN_WORKER*)calloc(nthreads, sizeof(SCAN_WORKER));
+	if (NULL == workers) {
+		return -1;
+	}
+	if (reduce != NULL) {
+		stride = (result_size + MMFOR_CACHE_LINE - 1) / MMFOR_CACHE_LINE * MMFOR_CACHE_LINE;
+		if (posix_memalign(&accs, MMFOR_CACHE_LINE, stride * nthreads)) {
+			free(workers);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		workers[i].jobp = jobp;
+		if (reduce != NULL) {
+			workers[i].acc = accs + stride * i;
+			memcpy(workers[i].acc, result, result_size);
+		}
+	}
+	for (started = 1; started < nthreads; started++) {
+		if (pthread_create(&workers[started].tid, NULL, scan_worker, &workers[started])) {
+			break;
+		}
+	}
+	scan_worker(&workers[0]);
+	for (i = 1; i < started; i++) {
+		pthread_join(workers[i].tid, NULL);
+	}
+	if (reduce != NULL) {
+		for (i = 0; i < started; i++) {
+			reduce(jobp->ctx, result, workers[i].acc);
+		}
+		free(accs);
+	}
+	free(workers);
+	return jobp->stop;
+}
+
 static int lock_cntrl(MMFOR_HANDLE* mmforhp, int cmd, int type, size_t start) {
 	struct flock lock;
 
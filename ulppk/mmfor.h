@@ -39,9 +39,44 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * This is built on the functions and types of mmaptom.c
  * and mmapfile.c
  *
+ * A file may be created with a sequence word per record
+ * (MMFOR_FLAG_SEQLOCK). Writers make the word odd while they update
+ * the record (mmfor_write_begin, mmfor_write_end) and readers copy the
+ * record with mmfor_read_record, retrying until they see the same even
+ * word before and after the copy. Reads then take no lock and make no
+ * system call. Writers still take the record's write lock, which keeps
+ * writers in different processes apart and lets readers detect a
+ * writer that died during an update.
+ *
+ * A file can grow: mmfor_append adds a record and mmfor_reserve makes
+ * room for more. The file is extended geometrically, so appends cost
+ * amortized constant time. The new length is published in the header
+ * with a bumped generation number; other processes remap the file on
+ * their next access through their handle. A remap may move the mapped
+ * region, so pointers to records must not be held across calls that
+ * may grow the file or notice its growth (any call taking the handle).
+ *
+ * mmfor_parallel_scan and mmfor_parallel_reduce walk every record with
+ * a pool of threads. The file is cut into MMFOR_SCAN_CHUNK byte chunks
+ * on page boundaries and threads take chunks in turn, so each thread
+ * streams through whole pages of its own.
+ *
+ * mmfor_snapshot gives a long running reader a point in time copy of a
+ * file, so that it neither sees records change under it nor holds a
+ * lock that stalls writers while it reads. mmfor_export and mmfor_import
+ * move the records of a file to and from another file or a pipe in
+ * bulk, for backups and migrations.
+ *
  */
 #include <mmapfile.h>
 
+#define MMFOR_MAGIC 0x524f464d		///< "MFOR": start of every file of records
+#define MMFOR_VERSION 2				///< File of records header layout version
+#define MMFOR_FLAG_SEQLOCK 0x0001	///< Records carry a sequence word for lock free reads
+#define MMFOR_NO_RECORD ((size_t)-1)	///< Record index returned on failure
+#define MMFOR_SNAPSHOT_SUFFIX ".snap"	///< Unnamed snapshots are <path>.snapXXXXXX while being made
+#define MMFOR_SCAN_CHUNK (1024 * 1024)	///< Bytes of file per parallel scan work unit (whole pages)
+
 /**
  * A specialization of the MMA_HANDLE structure with additional
  * info necessary to support arrays of records.
@@ -50,17 +85,44 @@ typedef struct _mmfor_handle {
 	MMA_HANDLE* mmahp;		///< Pointer to memory mapped atom handle structure
 	size_t rec_size;     	///< size of the records in bytes
 	size_t nrecs;        	///< number of records in the file
+	unsigned int flags;		///< MMFOR_FLAG_... values
+	size_t slot_size;		///< distance between records (bytes)
+	unsigned int generation;	///< header generation when the file was last mapped
+	struct _mmfor_handle* companion;	///< file kept in step with this one (e.g. an index), or NULL
 } MMFOR_HANDLE;
 
 /**
  * The first thing written to any of these files is the header.
+ * mmfor_open refuses a file whose magic, version or length does not
+ * agree with it.
  */
 typedef struct _mmfor_header {
+	unsigned int magic;		///< MMFOR_MAGIC
+	unsigned int version;		///< MMFOR_VERSION
 	size_t rec_size;		///< size of the records (bytes)
 	size_t file_size;		///< size of the file (bytes)
 	size_t nrecs;			///< number of records
+	unsigned int flags;		///< MMFOR_FLAG_... values
+	unsigned int generation;	///< bumped each time the file grows
 } MMFOR_HEADER;
 
+/**
+ * Called by mmfor_parallel_scan for each record. Returning non-zero
+ * stops the scan.
+ */
+typedef int (*MMFOR_SCAN_FN)(void* ctx, size_t x, void* rec);
+
+/**
+ * Called by mmfor_parallel_reduce for each record, to fold the record
+ * into the calling thread's accumulator. Returning non-zero stops the scan.
+ */
+typedef int (*MMFOR_MAP_FN)(void* ctx, size_t x, void* rec, void* acc);
+
+/**
+ * Called by mmfor_parallel_reduce once per thread, to fold the thread's
+ * accumulator into the result.
+ */
+typedef void (*MMFOR_REDUCE_FN)(void* ctx, void* result, void* acc);
 
 #ifdef __cplusplus
 extern "C" {
@@ -71,6 +133,11 @@ extern "C" {
  */
  MMFOR_HANDLE* mmfor_create(char* filepath,  MMA_ACCESS_MODES mode,
  	MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs);
+/*
+ * Create a new memory mapped file of records with MMFOR_FLAG_... options.
+ */
+MMFOR_HANDLE* mmfor_create_flags(char* filepath,  MMA_ACCESS_MODES mode,
+	MMA_MAP_FLAGS flags, int permissions, size_t rec_size, size_t nrecs, unsigned int for_flags);
  /*
   * Intialize an existing memory mapped file of records.
   */
@@ -94,6 +161,26 @@ size_t mmfor_p2x(MMFOR_HANDLE* mmforhp, void* p);
  */
 size_t mmfor_record_count(MMFOR_HANDLE* mmforhp);
  
+/*
+ * Return the number of records the file can hold without growing.
+ */
+size_t mmfor_capacity(MMFOR_HANDLE* mmforhp);
+
+/*
+ * Make room for at least nrecs records, growing the file if necessary.
+ */
+int mmfor_reserve(MMFOR_HANDLE* mmforhp, size_t nrecs);
+
+/*
+ * Add a record after the last one, growing the file if necessary.
+ */
+size_t mmfor_append(MMFOR_HANDLE* mmforhp, void* rec);
+
+/*
+ * Set the number of records, growing the file if necessary.
+ */
+int mmfor_resize(MMFOR_HANDLE* mmforhp, size_t nrecs);
+
 /*
  * Return size of the user area of the record
  */
@@ -133,6 +220,73 @@ int mmfor_lock_record_x_write(MMFOR_HANDLE* mmforhp, size_t x);
  */
 int mmfor_lock_record_p_write(MMFOR_HANDLE* mmforhp, void* p);
 
+/*
+ * Copy a record, without locking in a MMFOR_FLAG_SEQLOCK file.
+ */
+int mmfor_read_record(MMFOR_HANDLE* mmforhp, size_t x, void* out);
+
+/*
+ * Start an update of a record: lock it for writing and, in a
+ * MMFOR_FLAG_SEQLOCK file, make its sequence word odd.
+ */
+void* mmfor_write_begin(MMFOR_HANDLE* mmforhp, size_t x);
+
+/*
+ * Finish an update started by mmfor_write_begin.
+ */
+int mmfor_write_end(MMFOR_HANDLE* mmforhp, size_t x);
+
+/*
+ * Replace a record (mmfor_write_begin, copy, mmfor_write_end).
+ */
+int mmfor_write_record(MMFOR_HANDLE* mmforhp, size_t x, void* in);
+
+/*
+ * Update a record the caller owns by other means: as mmfor_write_begin
+ * and mmfor_write_end, but without the record lock.
+ */
+void* mmfor_owned_write_begin(MMFOR_HANDLE* mmforhp, size_t x);
+void mmfor_owned_write_end(MMFOR_HANDLE* mmforhp, size_t x);
+
+/*
+ * Return a record's sequence word (0 without MMFOR_FLAG_SEQLOCK).
+ */
+unsigned long mmfor_record_seq(MMFOR_HANDLE* mmforhp, size_t x);
+
+/*
+ * Call a function for every record, from nthreads threads.
+ */
+int mmfor_parallel_scan(MMFOR_HANDLE* mmforhp, int nthreads, MMFOR_SCAN_FN scan, void* ctx);
+
+/*
+ * Map every record into per thread accumulators, from nthreads threads,
+ * then reduce the accumulators into a result.
+ */
+int mmfor_parallel_reduce(MMFOR_HANDLE* mmforhp, int nthreads, MMFOR_MAP_FN map,
+	MMFOR_REDUCE_FN reduce, void* ctx, void* result, size_t result_size);
+
+/*
+ * Advise the kernel how the mapped file will be used (see madvise(2)).
+ */
+int mmfor_advise(MMFOR_HANDLE* mmforhp, int advice);
+
+/*
+ * Make a point in time, read only copy of the file.
+ */
+MMFOR_HANDLE* mmfor_snapshot(MMFOR_HANDLE* mmforhp, char* snappath);
+
+/*
+ * Write the records of the file, with a header describing them, to a
+ * file descriptor.
+ */
+int mmfor_export(MMFOR_HANDLE* mmforhp, int fd);
+
+/*
+ * Create a file of records from a dump written by mmfor_export.
+ */
+MMFOR_HANDLE* mmfor_import(char* filepath, MMA_ACCESS_MODES mode, MMA_MAP_FLAGS flags,
+	int permissions, int fd);
+
 /*
  * Lock the entire file for read access. (Uses mma_lock_atom_read).
  */
@@ -62,10 +62,28 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 #include <sys/types.h>
 #include <dirent.h>
 #include <stddef.h>
+#include <signal.h>
+#include <errno.h>
 
 #include <mmpool.h>
 #include <appenv.h>
 #include <diagnostics.h>
+#include <ulppk_log.h>
+
+/*
+ * The lock free stack next index array follows the state bytes, aligned
+ * for unsigned int access.
+ */
+#define BPMF_LFNEXT_OFFSET(statebuffx, capacity) \
+	((((statebuffx) + (capacity)) + sizeof(unsigned int) - 1) & ~(sizeof(unsigned int) - 1))
+/*
+ * Round n up to a multiple of a power of two
+ */
+#define BPOOL_ROUNDUP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+#define BPMF_SIZE(capacity) \
+	(BPMF_LFNEXT_OFFSET(sizeof(BPMF_REC) + 2 * sizeof(BPOOL_INDEX) * (capacity), (capacity)) + \
+	sizeof(unsigned int) * (capacity))
 
 static MMPOOL_VARIABLES variables = {
 	0,				// init flag
@@ -78,16 +96,25 @@ static MMA_HANDLE* new_bpmf(
 	char name[MMPOOL_MAX_POOL_NAME],	// Symbolic name of the buffer pool
 	unsigned short bp_id,		// Buffer pool ID
 	size_t max_data_size,		// max number of user bytes to be written to these buffers
-	unsigned short rqst_capacity	// min number of buffers to allocate
+	unsigned short rqst_capacity,	// min number of buffers to allocate
+	unsigned int flags,			// BPOOL_FLAG_... values
+	unsigned int alignment		// user data alignment in bytes
 );
 static MMFOR_HANDLE* new_bpcf(
 	char name[MMPOOL_MAX_POOL_NAME],	// name of the pool
-	size_t max_data_size,		// max number of user data bytes one buffer will hold
-	unsigned short nitems		// number of buffers to create
+	BPMF_STATS* statsp			// pool geometry
 );
 static off_t bpcf_data_offset();
 
-static int allocate_buffers(MMA_HANDLE* bpmfhp, MMFOR_HANDLE* bpcfhp);
+static size_t bpcf_stride(size_t max_data_size, unsigned int alignment);
+
+static BPCF_BUFFER_REF* bpcf_buffer(BPMF_STATS* statsp, MMFOR_HANDLE* bpcfhp, BPOOL_INDEX bpx);
+
+static int valid_alignment(unsigned int alignment);
+
+static int take_buffer(BPOOL_HANDLE* bphp, BPOOL_INDEX* bpxp);
+
+static int fresh_buffer(BPOOL_HANDLE* bphp, BPOOL_INDEX* bpxp);
 
 static char* bpfile_full_path(const char* filename);
 
@@ -103,6 +130,44 @@ static void lock_pool(BPOOL_HANDLE* bphp);
 
 static void unlock_pool(BPOOL_HANDLE* bphp);
 
+static unsigned char* buff_states(BPOOL_HANDLE* bphp);
+
+static void rebuild_outpool(BPOOL_HANDLE* bphp);
+
+static BPCF_BUFFER_REF* magazine_getbuff(BPOOL_HANDLE* bphp);
+
+static int magazine_putbuff(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buffp);
+
+static void magazine_drain(BPOOL_HANDLE* bphp, unsigned short keep);
+
+static void magazine_free(BPOOL_HANDLE* bphp);
+
+static unsigned int* lf_next(BPMF_REC* bpmf_recp);
+
+static int lf_pop(BPMF_REC* bpmf_recp, BPOOL_INDEX* bpxp);
+
+static void lf_push(BPMF_REC* bpmf_recp, BPOOL_INDEX bpx);
+
+static void set_owner(BPCF_BUFFER_REF* buff_refp, pid_t pid);
+
+static int reclaim_buffer(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* bufrefp, int lockfree);
+
+static pid_t self_pid();
+
+/*
+ * Cached process ID of this process, for owner records. Reset in a
+ * forked child.
+ */
+static pid_t owner_pid = 0;
+static pthread_once_t owner_pid_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Handles with magazines in this process, so they can be flushed at exit.
+ */
+static BPOOL_HANDLE* magazine_handles = NULL;
+static pthread_mutex_t magazine_handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static int magazine_hooks_installed = 0;
+
 #if 0
 static void setup_deques(BPOOL_HANDLE* bphp);
 #endif
@@ -122,6 +187,59 @@ BPOOL_HANDLE* mmpool_define_pool(
 	unsigned short bp_id,		// Buffer pool ID
 	size_t max_data_size,		// max number of user bytes to be written to these buffers
 	unsigned short rqst_capacity	// min number of buffers to allocate
+) {
+	return mmpool_define_pool_flags(name, bp_id, max_data_size, rqst_capacity, 0);
+}
+
+/**
+ * @brief Define a buffer pool with creation flags.
+ *
+ * As mmpool_define_pool. With BPOOL_FLAG_LOCKFREE the free buffers are
+ * kept on a lock free stack and mmpool_getbuff/mmpool_putbuff do not take
+ * the pool lock. Flags only apply when the pool is created: an existing
+ * pool is opened with the flags it was created with.
+ *
+ * @param name Symbolic name of the pool
+ * @param bp_id Buffer pool ID assigned by the caller.
+ * @param max_data_size Max number of user bytes to be written to these buffers
+ * @param rqst_capacity Min number of buffers to allocate.
+ * @param flags BPOOL_FLAG_... values.
+ * @return Pointer to buffer pool handle.
+ */
+BPOOL_HANDLE* mmpool_define_pool_flags(
+	char name[MMPOOL_MAX_POOL_NAME],	// Symbolic name of the buffer pool
+	unsigned short bp_id,		// Buffer pool ID
+	size_t max_data_size,		// max number of user bytes to be written to these buffers
+	unsigned short rqst_capacity,	// min number of buffers to allocate
+	unsigned int flags			// BPOOL_FLAG_... values
+) {
+	return mmpool_define_pool_aligned(name, bp_id, max_data_size, rqst_capacity, flags, 0);
+}
+
+/**
+ * @brief Define a buffer pool with creation flags and user data alignment.
+ *
+ * As mmpool_define_pool_flags. The user data of every buffer starts on a
+ * multiple of alignment bytes, and buffers are a multiple of alignment
+ * bytes apart, so data can be handed to vector code or O_DIRECT I/O
+ * without a bounce buffer. For O_DIRECT, also make max_data_size a
+ * multiple of the device block size.
+ *
+ * @param name Symbolic name of the pool
+ * @param bp_id Buffer pool ID assigned by the caller.
+ * @param max_data_size Max number of user bytes to be written to these buffers
+ * @param rqst_capacity Min number of buffers to allocate.
+ * @param flags BPOOL_FLAG_... values.
+ * @param alignment Power of two up to the page size, 0 for BPOOL_DEFAULT_ALIGNMENT.
+ * @return Pointer to buffer pool handle, NULL if alignment is invalid.
+ */
+BPOOL_HANDLE* mmpool_define_pool_aligned(
+	char name[MMPOOL_MAX_POOL_NAME],	// Symbolic name of the buffer pool
+	unsigned short bp_id,		// Buffer pool ID
+	size_t max_data_size,		// max number of user bytes to be written to these buffers
+	unsigned short rqst_capacity,	// min number of buffers to allocate
+	unsigned int flags,			// BPOOL_FLAG_... values
+	unsigned int alignment		// user data alignment in bytes
 ) {
 	MMA_HANDLE* bpmf_mmahp = NULL;		// mmatom handle to BPMF object
 	MMFOR_HANDLE* bpcf_mmafhp = NULL;		// MM File of Records handle to BPCF object
@@ -132,14 +250,22 @@ BPOOL_HANDLE* mmpool_define_pool(
 	if (mmpool_bpfiles_exist(name)) {
 		return mmpool_open(name);
 	}	
-	bpmf_mmahp = new_bpmf(name, bp_id, max_data_size, rqst_capacity);
+	if (0 == alignment) {
+		alignment = BPOOL_DEFAULT_ALIGNMENT;
+	}
+	if (!valid_alignment(alignment)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Buffer pool %s: alignment %u is not a power of two up to the page size",
+			name, alignment);
+		return NULL;
+	}
+	bpmf_mmahp = new_bpmf(name, bp_id, max_data_size, rqst_capacity, flags, alignment);
 	if (NULL == bpmf_mmahp) {
 		return NULL;
 	}
 	
 	// Get ptr to memory mapped BPMF_REC 
 	bpmf_recp = (BPMF_REC*)mma_data_pointer(bpmf_mmahp);
-	bpcf_mmafhp = new_bpcf(name, max_data_size, bpmf_recp->stats.capacity);
+	bpcf_mmafhp = new_bpcf(name, &bpmf_recp->stats);
 
 	if (NULL == bpcf_mmafhp) {
 		// TODO: Need to destroy the mmahp here.
@@ -147,11 +273,9 @@ BPOOL_HANDLE* mmpool_define_pool(
 	}
 	
 	// We have the Buffer Pool Management File setup ... we have
-	// the Buffer Pool Contents File setup. Now all we have to do
-	// is divide the bytes in the BPCF into buffers and allocate
-	// them to the pool.
-	
-	allocate_buffers(bpmf_mmahp, bpcf_mmafhp);
+	// the Buffer Pool Contents File setup. The buffers are all above
+	// the high-water mark, so they are free: each is formatted when it
+	// is first taken (see fresh_buffer).
 	
 	// Construct a BPOOL_HANDLE structure 
 	bphp = (BPOOL_HANDLE*)calloc(1, sizeof(BPOOL_HANDLE));
@@ -172,6 +296,7 @@ BPOOL_HANDLE* mmpool_open(char* pool_name) {
 	MMA_HANDLE* bpmfp;
 	MMFOR_HANDLE* bpcfp;
 	BPOOL_HANDLE* bphp;
+	BPMF_STATS* statsp;
 	
 	init();
 	
@@ -188,6 +313,14 @@ BPOOL_HANDLE* mmpool_open(char* pool_name) {
 		return NULL;
 	}
 	
+	// Refuse pools laid out by an incompatible version of this module
+	if (((BPMF_REC*)mma_data_pointer(bpmfp))->version != BPMF_VERSION) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Buffer pool %s has an incompatible management file layout: recreate the pool",
+			pool_name);
+		mmapfile_close(bpmfp);
+		return NULL;
+	}
+
 	// Open the Buffer Pool Contents File
 	bpcfp = open_bpcf(pool_name);
 	
@@ -196,6 +329,21 @@ BPOOL_HANDLE* mmpool_open(char* pool_name) {
 		mmapfile_close(bpmfp);
 		return NULL;
 	}
+
+	// The contents file must have the geometry the management file expects
+	statsp = &((BPMF_REC*)mma_data_pointer(bpmfp))->stats;
+	if (!valid_alignment(statsp->alignment) ||
+		(statsp->stride != bpcf_stride(statsp->max_data_size, statsp->alignment)) ||
+		(mmfor_record_size(bpcfp) != statsp->stride) ||
+		(mmfor_record_count(bpcfp) < statsp->capacity) ||
+		(statsp->capacity && (mmpool_buffer_data(bpcf_buffer(statsp, bpcfp, statsp->capacity - 1)) +
+			statsp->max_data_size > mmfor_x2p(bpcfp, mmfor_record_count(bpcfp))))) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Buffer pool %s has an inconsistent alignment or contents file geometry",
+			pool_name);
+		mmfor_close(bpcfp);
+		mmapfile_close(bpmfp);
+		return NULL;
+	}
 	
 	// Construct a BPOOL_HANDLE structure 
 	bphp = (BPOOL_HANDLE*)calloc(1, sizeof(BPOOL_HANDLE));
@@ -215,6 +363,11 @@ BPOOL_HANDLE* mmpool_open(char* pool_name) {
 int mmpool_close(BPOOL_HANDLE* bphp) {
 	int retval = 0;
 
+	// Give cached buffers back before the mappings go away
+	if (bphp->magp != NULL) {
+		mmpool_magazine_flush(bphp);
+		magazine_free(bphp);
+	}
 	if (bphp->bpcfp != NULL) {
 		mmfor_close(bphp->bpcfp);
 		if (bphp->bpmfp != NULL) {
@@ -239,35 +392,88 @@ int mmpool_close(BPOOL_HANDLE* bphp) {
 BPCF_BUFFER_REF* mmpool_getbuff(BPOOL_HANDLE* bphp) {
 	BPCF_BUFFER_REF* buff_refp = NULL;
 	BPOOL_INDEX bpx;
-	lock_pool(bphp);
-	if (!dq_rtd(&bphp->bpmf_recp->dq_inpool, &bpx)) {
-		// Get reference to the buffer
-		buff_refp = mmpool_buffx2refp(bphp, bpx);
-		// Add the buffer to the out of pool deque
-		dq_abd(&bphp->bpmf_recp->dq_outpool, &bpx);
-		bphp->bpmf_recp->stats.remaining--;
+
+	if (bphp->bpmf_recp->flags & BPOOL_FLAG_LOCKFREE) {
+		if (!take_buffer(bphp, &bpx)) {
+			// The buffer is ours once popped
+			buff_refp = mmpool_buffx2refp(bphp, bpx);
+			buff_states(bphp)[bpx] = BPOOL_BUFF_OUT;
+			__sync_fetch_and_sub(&bphp->bpmf_recp->stats.remaining, 1);
+		}
+	} else if ((bphp->magp != NULL) && !bphp->bpmf_recp->audit) {
+		buff_refp = magazine_getbuff(bphp);
+	} else {
+		lock_pool(bphp);
+		if (!take_buffer(bphp, &bpx)) {
+			// Get reference to the buffer and mark it allocated
+			buff_refp = mmpool_buffx2refp(bphp, bpx);
+			buff_states(bphp)[bpx] = BPOOL_BUFF_OUT;
+			if (bphp->bpmf_recp->audit) {
+				// Add the buffer to the out of pool deque
+				dq_abd(&bphp->bpmf_recp->dq_outpool, &bpx);
+			}
+			bphp->bpmf_recp->stats.remaining--;
+		}
+		unlock_pool(bphp);
+	}
+	if (buff_refp != NULL) {
+		// The caller holds the only reference
+		__atomic_store_n(&buff_refp->refcount, 1, __ATOMIC_RELEASE);
+		set_owner(buff_refp, self_pid());
+		buff_refp->next_bpx = BPOOL_CHAIN_END;
+		buff_refp->data_len = bphp->bpmf_recp->stats.max_data_size;
 	}
-	unlock_pool(bphp);
 	return buff_refp;
 }
 
 /**
  * @brief Return a buffer to the pool.
  *
+ * The buffer's state byte is checked, so returning a buffer that
+ * is not allocated (a double free) is detected in constant time.
+ * The buffer is returned whatever its reference count: use
+ * mmpool_buff_unref for buffers that may have several owners.
+ *
  * @param bphp Pointer to buffer pool handle structure.
  * @param buffp Pointer to buffer reference structure of buffer to return
- * @return Pointer to a buffer reference structure.
  * @return 0 if successful, non-zero error code otherwise.
  */
 int mmpool_putbuff(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buffp) {
+	BPOOL_INDEX bpx;
+	unsigned char* statep;
 	int error = 0;
+
+	bpx = buffp->bpindex;
+	if (bphp->bpmf_recp->flags & BPOOL_FLAG_LOCKFREE) {
+		// Claim the buffer by its state byte so that two racing
+		// returns of the same buffer cannot both push it.
+		if ((bpx >= bphp->bpmf_recp->stats.capacity) ||
+			!__sync_bool_compare_and_swap(&buff_states(bphp)[bpx], BPOOL_BUFF_OUT, BPOOL_BUFF_IN)) {
+			return 1;
+		}
+		__atomic_store_n(&buffp->refcount, 0, __ATOMIC_RELAXED);
+		set_owner(buffp, 0);
+		lf_push(bphp->bpmf_recp, bpx);
+		__sync_fetch_and_add(&bphp->bpmf_recp->stats.remaining, 1);
+		return 0;
+	}
+	if ((bphp->magp != NULL) && !bphp->bpmf_recp->audit) {
+		return magazine_putbuff(bphp, buffp);
+	}
 	lock_pool(bphp);
-	/*
-	 * Search the out of pool deque for the item. 
-	 */
-	if (search_deque(&bphp->bpmf_recp->dq_outpool, buffp->bpindex)) {
-		// Found a match ...  do the deallocation.
-		dq_abd(&bphp->bpmf_recp->dq_inpool, &buffp->bpindex);
+	statep = buff_states(bphp);
+	if ((bpx < bphp->bpmf_recp->stats.capacity) && (BPOOL_BUFF_OUT == statep[bpx])) {
+		// Buffer is allocated ...  do the deallocation.
+		if (bphp->bpmf_recp->audit) {
+			if (!search_deque(&bphp->bpmf_recp->dq_outpool, bpx)) {
+				ULPPK_LOG(ULPPK_LOG_ERROR, "Buffer pool %s audit: buffer %lu allocated but not in out deque",
+					bphp->pool_name, (unsigned long)bpx);
+			}
+		}
+		statep[bpx] = BPOOL_BUFF_IN;
+		__atomic_store_n(&buffp->refcount, 0, __ATOMIC_RELAXED);
+		set_owner(buffp, 0);
+		dq_abd(&bphp->bpmf_recp->dq_inpool, &bpx);
 		bphp->bpmf_recp->stats.remaining++;
 	} else {
 		// The buffer pool index of the passed reference is NOT
@@ -278,6 +484,478 @@ int mmpool_putbuff(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buffp) {
 	return error;
 }
 
+/**
+ * @brief Get a chain of buffers for a message larger than one buffer.
+ *
+ * Enough buffers for total_len user data bytes are taken from the pool
+ * in one operation (under the pool lock, or one at a time from a lock
+ * free pool, giving them back if the pool runs short). Each buffer is
+ * filled to max_data_size except the last; the data_len field of each
+ * header says how many bytes it carries. Magazines are bypassed.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param total_len Number of user data bytes the chain must hold.
+ * @return Pointer to the head buffer of the chain, NULL if the pool does
+ * not have enough buffers.
+ */
+BPCF_BUFFER_REF* mmpool_getchain(BPOOL_HANDLE* bphp, size_t total_len) {
+	BPMF_REC* bpmf_recp;
+	BPCF_BUFFER_REF* head_refp = NULL;
+	BPCF_BUFFER_REF* buff_refp;
+	BPCF_BUFFER_REF* prev_refp = NULL;
+	unsigned char* statep;
+	size_t max_data_size;
+	size_t nbuffs;
+	size_t i;
+	BPOOL_INDEX bpx;
+
+	bpmf_recp = bphp->bpmf_recp;
+	max_data_size = bpmf_recp->stats.max_data_size;
+	if (0 == max_data_size) {
+		return NULL;
+	}
+	nbuffs = total_len ? (total_len + max_data_size - 1) / max_data_size : 1;
+	if (nbuffs > bpmf_recp->stats.capacity) {
+		return NULL;
+	}
+	statep = buff_states(bphp);
+
+	// Take the buffers, linking them as we go
+	if (bpmf_recp->flags & BPOOL_FLAG_LOCKFREE) {
+		for (i = 0; i < nbuffs; i++) {
+			if (take_buffer(bphp, &bpx)) {
+				// Pool ran short ... give back what we took. Read each
+				// link before the push: a pushed buffer may be taken at once.
+				for (buff_refp = head_refp; i > 0; i--) {
+					bpx = buff_refp->bpindex;
+					if (i > 1) {
+						buff_refp = mmpool_buffx2refp(bphp, buff_refp->next_bpx);
+					}
+					lf_push(bpmf_recp, bpx);
+				}
+				return NULL;
+			}
+			buff_refp = mmpool_buffx2refp(bphp, bpx);
+			if (NULL == head_refp) {
+				head_refp = buff_refp;
+			} else {
+				prev_refp->next_bpx = bpx;
+			}
+			prev_refp = buff_refp;
+		}
+		for (buff_refp = head_refp, i = 0; i < nbuffs; i++) {
+			statep[buff_refp->bpindex] = BPOOL_BUFF_OUT;
+			if (i + 1 < nbuffs) {
+				buff_refp = mmpool_buffx2refp(bphp, buff_refp->next_bpx);
+			}
+		}
+		__sync_fetch_and_sub(&bpmf_recp->stats.remaining, nbuffs);
+	} else {
+		lock_pool(bphp);
+		if (bpmf_recp->dq_inpool.dquse + (bpmf_recp->stats.capacity - bpmf_recp->hwm) < nbuffs) {
+			unlock_pool(bphp);
+			return NULL;
+		}
+		for (i = 0; i < nbuffs; i++) {
+			take_buffer(bphp, &bpx);
+			statep[bpx] = BPOOL_BUFF_OUT;
+			if (bpmf_recp->audit) {
+				dq_abd(&bpmf_recp->dq_outpool, &bpx);
+			}
+			buff_refp = mmpool_buffx2refp(bphp, bpx);
+			if (NULL == head_refp) {
+				head_refp = buff_refp;
+			} else {
+				prev_refp->next_bpx = bpx;
+			}
+			prev_refp = buff_refp;
+		}
+		bpmf_recp->stats.remaining -= nbuffs;
+		unlock_pool(bphp);
+	}
+	prev_refp->next_bpx = BPOOL_CHAIN_END;
+
+	// Set up the headers: every buffer full but the last
+	for (buff_refp = head_refp; buff_refp != NULL; buff_refp = mmpool_chain_next(bphp, buff_refp)) {
+		buff_refp->data_len = (buff_refp == prev_refp) ?
+			total_len - (nbuffs - 1) * max_data_size : max_data_size;
+		__atomic_store_n(&buff_refp->refcount, 1, __ATOMIC_RELEASE);
+		// Only the head has an owner: it stands for the chain (see mmpool_reclaim)
+		set_owner(buff_refp, (buff_refp == head_refp) ? self_pid() : 0);
+	}
+	return head_refp;
+}
+
+/**
+ * @brief Return every buffer of a chain to the pool.
+ *
+ * Each buffer is returned as by mmpool_putbuff. The walk stops at a
+ * buffer that cannot be returned (e.g. already free).
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param head_refp Pointer to the head buffer of the chain.
+ * @return 0 if successful, non-zero error code otherwise.
+ */
+int mmpool_putchain(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* head_refp) {
+	BPCF_BUFFER_REF* buff_refp;
+	BPCF_BUFFER_REF* next_refp;
+	BPOOL_INDEX nbuffs;
+
+	for (buff_refp = head_refp, nbuffs = 0; buff_refp != NULL; buff_refp = next_refp, nbuffs++) {
+		if ((nbuffs >= bphp->bpmf_recp->stats.capacity) ||
+			(BPOOL_BUFF_OUT != mmpool_buff_state(bphp, buff_refp->bpindex))) {
+			return 1;			// not allocated, or a cycle
+		}
+		next_refp = mmpool_chain_next(bphp, buff_refp);
+		buff_refp->next_bpx = BPOOL_CHAIN_END;
+		if (mmpool_putbuff(bphp, buff_refp)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Get the next buffer of a chain.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param buff_refp Pointer to a buffer of the chain.
+ * @return Pointer to the next buffer, NULL at the end of the chain or if
+ * the next index is out of range.
+ */
+BPCF_BUFFER_REF* mmpool_chain_next(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buff_refp) {
+	if (buff_refp->next_bpx >= bphp->bpmf_recp->stats.capacity) {
+		return NULL;
+	}
+	return mmpool_buffx2refp(bphp, buff_refp->next_bpx);
+}
+
+/**
+ * @brief Describe the user data of a chain as an iovec array.
+ *
+ * The entries point straight into the mapped buffers, so the chain can
+ * be written with writev or sendmsg without flattening it. Call with
+ * iovcnt 0 to size the array.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param head_refp Pointer to the head buffer of the chain.
+ * @param iov Array to fill in (may be NULL if iovcnt is 0).
+ * @param iovcnt Number of entries in iov.
+ * @return Number of buffers in the chain (entries needed), -1 if the
+ * chain is corrupt.
+ */
+int mmpool_chain_iov(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* head_refp, struct iovec* iov, int iovcnt) {
+	BPCF_BUFFER_REF* buff_refp;
+	int nbuffs = 0;
+
+	for (buff_refp = head_refp; buff_refp != NULL; buff_refp = mmpool_chain_next(bphp, buff_refp)) {
+		if (nbuffs >= bphp->bpmf_recp->stats.capacity) {
+			return -1;			// a cycle
+		}
+		if (nbuffs < iovcnt) {
+			iov[nbuffs].iov_base = mmpool_buffer_data(buff_refp);
+			iov[nbuffs].iov_len = buff_refp->data_len;
+		}
+		nbuffs++;
+	}
+	return nbuffs;
+}
+
+/**
+ * @brief Add a reference (owner) to an allocated buffer.
+ *
+ * Used to hand one buffer to several consumers without copying: take
+ * a reference per consumer before publishing the buffer to it, e.g.
+ * with msgdeque_send_buff. Each consumer drops its reference with
+ * mmpool_buff_unref when done.
+ *
+ * @param buff_refp Pointer to buffer reference structure.
+ * @return The new reference count, 0 if the buffer holds no references
+ * (it is not allocated) and so cannot gain one.
+ */
+int mmpool_buff_ref(BPCF_BUFFER_REF* buff_refp) {
+	unsigned int count;
+
+	count = __atomic_load_n(&buff_refp->refcount, __ATOMIC_RELAXED);
+	do {
+		if (0 == count) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&buff_refp->refcount, &count, count + 1,
+		0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	return count + 1;
+}
+
+/**
+ * @brief Drop a reference to a buffer, returning it to the pool on the
+ * last reference. For the head of a chain, the whole chain is returned.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param buff_refp Pointer to buffer reference structure.
+ * @return The remaining reference count (0 once the buffer is back in the
+ * pool), -1 if the buffer held no references or could not be returned.
+ */
+int mmpool_buff_unref(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buff_refp) {
+	unsigned int count;
+
+	count = __atomic_load_n(&buff_refp->refcount, __ATOMIC_RELAXED);
+	do {
+		if (0 == count) {
+			return -1;			// unbalanced unref
+		}
+	} while (!__atomic_compare_exchange_n(&buff_refp->refcount, &count, count - 1,
+		0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	if (count > 1) {
+		return count - 1;
+	}
+	// We dropped the last reference ... the buffer (or chain) is ours alone
+	return mmpool_putchain(bphp, buff_refp) ? -1 : 0;
+}
+
+/**
+ * @brief Enable or disable audit mode.
+ *
+ * In audit mode the out of pool deque is maintained alongside the per
+ * buffer state bytes, giving an ordered list of allocated buffers (see
+ * mmbuffpool -D) at the cost of an O(n) search on every mmpool_putbuff.
+ * Enabling audit mode rebuilds the out deque from the state bytes.
+ * The setting is stored in the BPMF and so applies to all processes
+ * using the pool.
+ *
+ * Magazines are bypassed in audit mode. Enabling audit mode flushes
+ * the caller's magazine; buffers cached by other processes stay
+ * cached until those processes flush.
+ *
+ * Lock free pools have no out deque and cannot be audited.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param on Non-zero to enable, zero to disable.
+ * @return 0 on success, non-zero for a lock free pool.
+ */
+int mmpool_set_audit(BPOOL_HANDLE* bphp, int on) {
+	if (bphp->bpmf_recp->flags & BPOOL_FLAG_LOCKFREE) {
+		return 1;
+	}
+	if (on && (bphp->magp != NULL)) {
+		mmpool_magazine_flush(bphp);
+	}
+	lock_pool(bphp);
+	if (on && !bphp->bpmf_recp->audit) {
+		rebuild_outpool(bphp);
+	}
+	bphp->bpmf_recp->audit = (on != 0);
+	unlock_pool(bphp);
+	return 0;
+}
+
+/*
+ * Magazine fork handler. A child inherits copies of its parent's
+ * magazines, but the cached buffers still belong to the parent. Forget
+ * them so the child neither hands them out nor returns them.
+ */
+static void magazine_atfork_child() {
+	BPOOL_HANDLE* bphp;
+
+	pthread_mutex_init(&magazine_handles_lock, NULL);
+	for (bphp = magazine_handles; bphp != NULL; bphp = bphp->magp->nextp) {
+		pthread_mutex_init(&bphp->magp->mutex, NULL);
+		bphp->magp->count = 0;
+	}
+}
+
+/*
+ * Exit handler. Return every buffer cached by this process.
+ */
+static void magazine_atexit() {
+	BPOOL_HANDLE* bphp;
+
+	pthread_mutex_lock(&magazine_handles_lock);
+	for (bphp = magazine_handles; bphp != NULL; bphp = bphp->magp->nextp) {
+		mmpool_magazine_flush(bphp);
+	}
+	pthread_mutex_unlock(&magazine_handles_lock);
+}
+
+/**
+ * @brief Enable a per process buffer cache (magazine) on a pool handle.
+ *
+ * With a magazine, mmpool_getbuff takes batch buffers from the shared
+ * pool at a time when the magazine is empty, and mmpool_putbuff returns
+ * batch buffers at a time when it holds 2 * batch. In between, getting
+ * and returning buffers takes only a process local mutex rather than
+ * the BPMF file lock, so threads of the process share the magazine.
+ *
+ * Cached buffers count as neither remaining nor allocated: they are
+ * reported in BPMF_STATS.cached. They are returned to the pool by
+ * mmpool_magazine_flush, mmpool_close and at process exit. A process
+ * that dies without exiting normally leaves its cached buffers out of
+ * the pool until mmpool_reclaim, run by any process with the pool
+ * open, takes them back with the rest of the dead process's buffers.
+ *
+ * Lock free pools do not take the pool lock, so they gain nothing from
+ * a magazine and refuse one.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param batch Number of buffers moved to or from the pool at a time.
+ * @return 0 on success, non-zero if batch is 0 or the pool is lock free.
+ */
+int mmpool_magazine_enable(BPOOL_HANDLE* bphp, unsigned short batch) {
+	BPOOL_MAGAZINE* magp;
+
+	if ((0 == batch) || (bphp->bpmf_recp->flags & BPOOL_FLAG_LOCKFREE)) {
+		return 1;
+	}
+	if (bphp->magp != NULL) {
+		mmpool_magazine_flush(bphp);
+		magazine_free(bphp);
+	}
+	magp = (BPOOL_MAGAZINE*)calloc(1, sizeof(BPOOL_MAGAZINE));
+	pthread_mutex_init(&magp->mutex, NULL);
+	magp->batch = batch;
+	magp->buffx = (BPOOL_INDEX*)calloc(2 * batch, sizeof(BPOOL_INDEX));
+
+	pthread_mutex_lock(&magazine_handles_lock);
+	if (!magazine_hooks_installed) {
+		magazine_hooks_installed = 1;
+		atexit(magazine_atexit);
+		pthread_atfork(NULL, NULL, magazine_atfork_child);
+	}
+	bphp->magp = magp;
+	magp->nextp = magazine_handles;
+	magazine_handles = bphp;
+	pthread_mutex_unlock(&magazine_handles_lock);
+	return 0;
+}
+
+/**
+ * @brief Return all buffers cached by this process to the shared pool.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @return Count of buffers returned to the pool.
+ */
+int mmpool_magazine_flush(BPOOL_HANDLE* bphp) {
+	int count = 0;
+
+	if (bphp->magp != NULL) {
+		pthread_mutex_lock(&bphp->magp->mutex);
+		count = bphp->magp->count;
+		magazine_drain(bphp, 0);
+		pthread_mutex_unlock(&bphp->magp->mutex);
+	}
+	return count;
+}
+
+/**
+ * @brief Get the ownership state of a buffer.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param bpx Buffer pool index.
+ * @return BPOOL_BUFF_IN, BPOOL_BUFF_OUT or BPOOL_BUFF_CACHED, -1 if bpx is out of range.
+ */
+int mmpool_buff_state(BPOOL_HANDLE* bphp, BPOOL_INDEX bpx) {
+	if (bpx >= bphp->bpmf_recp->stats.capacity) {
+		return -1;
+	}
+	return buff_states(bphp)[bpx];
+}
+
+/**
+ * @brief Record the owner of an allocated buffer.
+ *
+ * Used when a buffer changes hands, e.g. by msgdeque_send_buff (no owner
+ * while in flight) and msgdeque_rec_buff (the receiver). The lease time
+ * restarts.
+ *
+ * @param buff_refp Pointer to buffer reference structure.
+ * @param pid Owning process, 0 for none.
+ * @return 0 on success, non-zero if the buffer holds no references
+ * (it is not allocated).
+ */
+int mmpool_buff_set_owner(BPCF_BUFFER_REF* buff_refp, pid_t pid) {
+	if (0 == __atomic_load_n(&buff_refp->refcount, __ATOMIC_ACQUIRE)) {
+		return 1;
+	}
+	set_owner(buff_refp, pid);
+	return 0;
+}
+
+/**
+ * @brief Return buffers held by dead processes to the pool.
+ *
+ * Allocated buffers, and buffers cached in a magazine, whose owner
+ * process no longer exists (kill(pid, 0) fails with ESRCH) are returned
+ * to the pool. Buffers with no owner, or with more than one reference,
+ * are left alone. The rest of a chain goes with its head buffer. Only
+ * the headers of outstanding buffers are read, and
+ * liveness is checked once per run of buffers with the same owner, so
+ * the cost is a pass over the state bytes plus work proportional to the
+ * outstanding buffers.
+ *
+ * A process ID reused by a new process makes its predecessor's buffers
+ * look live; they are reclaimed once that process exits too.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @return count of buffers returned to the pool.
+ */
+int mmpool_reclaim(BPOOL_HANDLE* bphp) {
+	BPOOL_INDEX bpx;
+	BPOOL_INDEX chainx;
+	BPCF_BUFFER_REF* bufrefp;
+	BPCF_BUFFER_REF* next_refp;
+	unsigned char* statep;
+	unsigned char state;
+	pid_t pid;
+	pid_t live_pid = 0;			// last owner found alive
+	pid_t dead_pid = 0;			// last owner found dead
+	int lockfree;
+	int count = 0;
+
+	lockfree = bphp->bpmf_recp->flags & BPOOL_FLAG_LOCKFREE;
+	statep = buff_states(bphp);
+	if (!lockfree) {
+		lock_pool(bphp);
+	}
+	// Buffers above the high-water mark have never been handed out
+	for (bpx = 0; bpx < __atomic_load_n(&bphp->bpmf_recp->hwm, __ATOMIC_ACQUIRE); bpx++) {
+		state = statep[bpx];
+		if (BPOOL_BUFF_IN == state) {
+			continue;
+		}
+		bufrefp = mmpool_buffx2refp(bphp, bpx);
+		pid = bufrefp->owner_pid;
+		if ((0 == pid) || (pid == live_pid)) {
+			continue;
+		}
+		if (pid != dead_pid) {
+			if ((kill(pid, 0) == 0) || (errno != ESRCH)) {
+				live_pid = pid;
+				continue;
+			}
+			dead_pid = pid;
+		}
+		if (bufrefp->refcount > 1) {
+			continue;			// shared ... other holders may be alive
+		}
+		// The head of a chain owns the rest of the chain
+		for (chainx = 0; (bufrefp != NULL) && (chainx < bphp->bpmf_recp->stats.capacity); chainx++) {
+			next_refp = mmpool_chain_next(bphp, bufrefp);
+			if (reclaim_buffer(bphp, bufrefp, lockfree)) {
+				ULPPK_LOG(ULPPK_LOG_INFO, "Buffer pool %s: reclaimed buffer %lu from dead process %d",
+					bphp->pool_name, (unsigned long)bufrefp->bpindex, (int)dead_pid);
+				count++;
+			}
+			bufrefp = next_refp;
+		}
+	}
+	if (!lockfree) {
+		if (count && bphp->bpmf_recp->audit) {
+			rebuild_outpool(bphp);
+		}
+		unlock_pool(bphp);
+	}
+	return count;
+}
+
 /**
  * @brief Given a buffer reference, return a pointer to the memory mapped
  * data region of the buffer.
@@ -318,30 +996,130 @@ BPMF_STATS* mmpool_getstats(BPOOL_HANDLE* bphp) {
 	return &bphp->bpmf_recp->stats;
 }
 
+/**
+ * @brief Write both files of a buffer pool to a file descriptor in bulk.
+ *
+ * The management file (MMA_DUMP_POOL_BPMF) and then the contents file
+ * (see mmfor_export) are written, each with a header describing its
+ * geometry, and copied in the kernel where possible. The pool is read
+ * locked meanwhile, so locked pools are copied between operations.
+ * This process's magazine is flushed first. Buffers that other
+ * processes hold, in use or in their magazines, are out of the pool in
+ * the copy: export a quiet pool, or reclaim or zap the copy.
+ *
+ * @param bphp Pointer to buffer pool handle structure.
+ * @param fd Descriptor of a file, pipe or socket, written at its position.
+ * @return 0 on success, non-zero on failure (see mma_error).
+ */
+int mmpool_export(BPOOL_HANDLE* bphp, int fd) {
+	MMA_DUMP_HEADER hdr;
+	int status;
+
+	if (bphp->magp != NULL) {
+		mmpool_magazine_flush(bphp);
+	}
+	if (mma_lock_atom_read(bphp->bpmfp)) {
+		return 1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.kind = MMA_DUMP_POOL_BPMF;
+	hdr.flags = bphp->bpmf_recp->flags;
+	hdr.rec_size = bphp->bpmf_recp->stats.stride;
+	hdr.nrecs = bphp->bpmf_recp->stats.capacity;
+	hdr.length = bphp->bpmfp->mm_ref.len;
+	status = mma_dump(bphp->bpmfp, fd, &hdr);
+	if (0 == status) {
+		status = mmfor_export(bphp->bpcfp, fd);
+	}
+	mma_unlock_atom(bphp->bpmfp);
+	return status;
+}
+
+/**
+ * @brief Create a buffer pool from a dump written by mmpool_export.
+ *
+ * Both pool files are created in the pool data directory under the
+ * new name and loaded straight from the dump, then the pool is opened.
+ *
+ * @param pool_name Symbolic name of the new pool.
+ * @param fd Descriptor of a file or pipe positioned at the dump.
+ * @return Pointer to the new pool's handle, NULL on failure (see mma_error).
+ */
+BPOOL_HANDLE* mmpool_import(char* pool_name, int fd) {
+	char fpath[1024];
+	MMA_DUMP_HEADER hdr;
+	MMA_HANDLE* mmahp;
+	MMFOR_HANDLE* mmfhp;
+	BPMF_REC* bpmf_recp;
+
+	init();
+	if (mma_dump_header(fd, MMA_DUMP_POOL_BPMF, &hdr)) {
+		return NULL;
+	}
+	if (hdr.length < sizeof(BPMF_REC)) {
+		mma_error = MMA_ERR_DUMP_FORMAT;
+		mma_os_error = EINVAL;
+		return NULL;
+	}
+	snprintf(fpath, sizeof(fpath), "%s", bpfile_full_path(mmpool_bpmf_filename(pool_name)));
+	mmahp = mmapfile_create(pool_name, fpath, hdr.length, MMA_READ_WRITE, MMF_SHARED, 0660);
+	if (NULL == mmahp) {
+		return NULL;
+	}
+	if (mma_load(mmahp, fd, &hdr)) {
+		mmapfile_close(mmahp);
+		unlink(fpath);
+		return NULL;
+	}
+	bpmf_recp = (BPMF_REC*)mma_data_pointer(mmahp);
+	memset(bpmf_recp->stats.name, 0, sizeof(bpmf_recp->stats.name));
+	strncpy(bpmf_recp->stats.name, pool_name, MMPOOL_MAX_POOL_NAME);
+	mmapfile_close(mmahp);
+	mmfhp = mmfor_import(bpfile_full_path(mmpool_bpcf_filename(pool_name)), MMA_READ_WRITE,
+		MMF_SHARED, 0660, fd);
+	if (NULL == mmfhp) {
+		unlink(fpath);
+		return NULL;
+	}
+	mmfor_close(mmfhp);
+	return mmpool_open(pool_name);
+}
+
 /**
  * @brief Deallocate all buffers currently out of the pool.
  *
- * Zap 'em clean and put them back in the "in pool" deque.
+ * The pool is reset to its just defined state: the free lists are
+ * emptied, the high-water mark goes back to zero and the pool
+ * generation is bumped. The contents file is not touched; each buffer
+ * header is rewritten when the buffer is next taken. Buffers cached in
+ * process magazines are reclaimed too, so the pool must not be in use
+ * by other processes.
  *
  * @param bphp Pointer to buffer pool handle structure.
  * @return count of items returned to the pool.
  */
 unsigned short mmpool_zap_pool(BPOOL_HANDLE* bphp) {
-	BPOOL_INDEX bpx;
-	BPCF_BUFFER_REF* bufrefp;
-	void* vp;
-	size_t user_data_size;
-	int return_count = 0;
-
-	while (!dq_rtd(&bphp->bpmf_recp->dq_outpool, &bpx)) {
-		bufrefp = mmpool_buffx2refp(bphp, bpx);			// get buffer reference
-		vp = mmpool_buffer_data(bufrefp);				// get pointer to user data
-		user_data_size = bphp->bpmf_recp->stats.max_data_size;	// get the max user data size
-		memset(vp, 0, user_data_size);					// zap the user data
-		dq_abd(&bphp->bpmf_recp->dq_inpool, &bpx);		// put it back into the pool
-		bphp->bpmf_recp->stats.remaining++;				// bump current buffer count
-		return_count++;
+	BPMF_REC* bpmf_recp;
+	int return_count;
+
+	if (bphp->magp != NULL) {
+		mmpool_magazine_flush(bphp);
 	}
+	bpmf_recp = bphp->bpmf_recp;
+	lock_pool(bphp);
+	return_count = bpmf_recp->stats.capacity - bpmf_recp->stats.remaining;
+	memset(buff_states(bphp), BPOOL_BUFF_IN, bpmf_recp->stats.capacity);
+	dq_init_memmap(bpmf_recp->stats.capacity, sizeof(BPOOL_INDEX), bpmf_recp->dq_inpool.dqbuffx,
+		&bpmf_recp->dq_inpool);
+	dq_init_memmap(bpmf_recp->stats.capacity, sizeof(BPOOL_INDEX), bpmf_recp->dq_outpool.dqbuffx,
+		&bpmf_recp->dq_outpool);
+	__atomic_store_n(&bpmf_recp->lf_head,
+		(((bpmf_recp->lf_head >> 32) + 1) << 32) | BPOOL_LF_EMPTY, __ATOMIC_RELEASE);
+	__atomic_store_n(&bpmf_recp->hwm, 0, __ATOMIC_RELEASE);
+	bpmf_recp->generation++;
+	bpmf_recp->stats.remaining = bpmf_recp->stats.capacity;
+	__sync_lock_test_and_set(&bpmf_recp->stats.cached, 0);
+	unlock_pool(bphp);
 	return return_count;
 }
 
@@ -428,7 +1206,9 @@ static MMA_HANDLE* format_bpmf(
 	unsigned short bp_id,		// Buffer pool ID
 	size_t max_data_size,		// max number of user bytes to be written to these buffers
 	unsigned short rqst_capacity,	// min number of buffers to allocate
-	unsigned short alloc_capacity	// actual number of buffers allocated to the pool
+	unsigned short alloc_capacity,	// actual number of buffers allocated to the pool
+	unsigned int flags,			// BPOOL_FLAG_... values
+	unsigned int alignment		// user data alignment in bytes
 ) {
 	void* p0;
 	BPMF_STATS* statsp;
@@ -448,13 +1228,24 @@ static MMA_HANDLE* format_bpmf(
 	dqoutp = &bpmf_recp->dq_outpool;
 	
 	// Calculate pointers into memory mapped area of buffers
-	// for the two deques. "In pool" buffer area comes first ...
-	b1p = ((void*)dqoutp) + sizeof(DQHEADER);
+	// for the two deques. "In pool" buffer area comes first,
+	// followed by the out of pool buffer area and the buffer
+	// state bytes.
+	b1p = p0 + sizeof(BPMF_REC);
 	b2p = b1p + alloc_capacity * sizeof(BPOOL_INDEX);
 
-	// Calculate the offsets relative to p0 of these two deque slot buffers
+	// Calculate the offsets relative to p0 of these areas
 	bpmf_recp->indqbuffx = (size_t)(b1p - p0);
 	bpmf_recp->outdqbuffx = (size_t)(b2p - p0);
+	bpmf_recp->statebuffx = bpmf_recp->outdqbuffx + alloc_capacity * sizeof(BPOOL_INDEX);
+	bpmf_recp->lfnextbuffx = BPMF_LFNEXT_OFFSET(bpmf_recp->statebuffx, alloc_capacity);
+	bpmf_recp->version = BPMF_VERSION;
+	bpmf_recp->audit = 0;
+	bpmf_recp->flags = flags;
+	bpmf_recp->lf_head = BPOOL_LF_EMPTY;
+	bpmf_recp->hwm = 0;
+	bpmf_recp->generation = 1;
+	memset(p0 + bpmf_recp->statebuffx, BPOOL_BUFF_IN, alloc_capacity);
 	
 	// Format the stats record
 	strncpy(statsp->name, name, MMPOOL_MAX_POOL_NAME);
@@ -463,10 +1254,14 @@ static MMA_HANDLE* format_bpmf(
 	statsp->capacity = alloc_capacity;
 	statsp->max_data_size = max_data_size;
 	statsp->remaining = statsp->capacity;
+	statsp->cached = 0;
+	statsp->alignment = alignment;
+	statsp->stride = bpcf_stride(max_data_size, alignment);
 	 
-	// Initialize the deques.
-	dq_init_memmap(statsp->capacity, sizeof(BPOOL_INDEX), bpmf_recp->indqbuffx, dqinp);
-	dq_init_memmap(statsp->capacity, sizeof(BPOOL_INDEX), bpmf_recp->outdqbuffx, dqoutp);
+	// Initialize the deques. Memory mapped deque slot buffers are
+	// located relative to their deque header.
+	dq_init_memmap(statsp->capacity, sizeof(BPOOL_INDEX), (size_t)(b1p - (void*)dqinp), dqinp);
+	dq_init_memmap(statsp->capacity, sizeof(BPOOL_INDEX), (size_t)(b2p - (void*)dqoutp), dqoutp);
 	
 	return mmahp;
 }
@@ -476,7 +1271,9 @@ static MMA_HANDLE* new_bpmf(
 	char name[MMPOOL_MAX_POOL_NAME],	// Symbolic name of the buffer pool
 	unsigned short bp_id,		// Buffer pool ID
 	size_t max_data_size,		// max number of user bytes to be written to these buffers
-	unsigned short rqst_capacity	// min number of buffers to allocate
+	unsigned short rqst_capacity,	// min number of buffers to allocate
+	unsigned int flags,			// BPOOL_FLAG_... values
+	unsigned int alignment		// user data alignment in bytes
 ) {
 	static char fpath[1024];
 	size_t bpmf_size = 0;
@@ -492,9 +1289,10 @@ static MMA_HANDLE* new_bpmf(
 	pagesize = sysconf(_SC_PAGESIZE);
 	
 	// Calculate size of the Buffer Pool Management File for this pool. This
-	// will be size of the BPMF_REC control structure and the size of two deque
-	// elements arrays.
-	bpmf_size = sizeof(BPMF_REC) + (2 * sizeof(BPOOL_INDEX) * rqst_capacity);
+	// will be size of the BPMF_REC control structure, the size of two deque
+	// elements arrays, a state byte per buffer and the (aligned) lock free
+	// stack next index array.
+	bpmf_size = BPMF_SIZE(rqst_capacity);
 	
 	// Calculate number of pages and amount left over
 	pages = bpmf_size / pagesize;
@@ -508,9 +1306,9 @@ static MMA_HANDLE* new_bpmf(
 		pages ++;
 		
 		// Allocate the slop to the two deques
-		itemslop = slop / (2 * sizeof(BPOOL_INDEX));
+		itemslop = slop / (2 * sizeof(BPOOL_INDEX) + 1 + sizeof(unsigned int));
 		alloc_capacity = rqst_capacity + itemslop;
-		bpmf_size = sizeof(BPMF_REC) + (2 * sizeof(BPOOL_INDEX) * alloc_capacity);
+		bpmf_size = BPMF_SIZE(alloc_capacity);
 	}
 #endif
 	
@@ -521,7 +1319,7 @@ static MMA_HANDLE* new_bpmf(
 	if (mmahp != NULL) {
 		// Successful memory mapped file setup. Format the buffer pool
 		// management file.
-		format_bpmf(mmahp, name, bp_id, max_data_size, rqst_capacity, alloc_capacity);
+		format_bpmf(mmahp, name, bp_id, max_data_size, rqst_capacity, alloc_capacity, flags, alignment);
 		
 	}
 	return mmahp; 	
@@ -529,69 +1327,111 @@ static MMA_HANDLE* new_bpmf(
 
 static MMFOR_HANDLE* new_bpcf(
 	char name[MMPOOL_MAX_POOL_NAME],	// name of the pool
-	size_t max_data_size,		// max number of user data bytes one buffer will hold
-	unsigned short nitems		// number of buffers to create
+	BPMF_STATS* statsp			// pool geometry
 ) {
 	static char fpath[1024];
 	MMFOR_HANDLE* mmfhp = NULL;
-	size_t buff_size;			// total size of buffer ... header + data + slop
-	off_t data_offset;
+	size_t nrecs;
 	
-	data_offset = bpcf_data_offset();
-	buff_size = data_offset + max_data_size;
-		
+	// Records start just after the MMFOR_HEADER in a page aligned mapping.
+	// If that is not aligned, one spare record covers the lead in padding.
+	nrecs = statsp->capacity;
+	if (sizeof(MMFOR_HEADER) % statsp->alignment) {
+		nrecs++;
+	}
 	sprintf(fpath, "%s/%s", variables.data_dir, mmpool_bpcf_filename(name));
-	mmfhp = mmfor_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, buff_size, nitems);
+	mmfhp = mmfor_create(fpath, MMA_READ_WRITE, MMF_SHARED, 0660, statsp->stride, nrecs);
 	return mmfhp;
 }
 
 /*
- * Return offset to the first byte of user data in a BPCF_BUFFER.
- * This is independent upon the particular buffer and is a function
- * of the size of the header.
- * The result is always aligned to a 4 byte boundary.
+ * Return offset to the first byte of user data from the start of a
+ * BPCF_BUFFER_REF. The header sits immediately before the user data,
+ * so this is independent of the pool. It is the header size rounded up
+ * to a multiple of sizeof(long).
  */
 static off_t bpcf_data_offset() {
-	size_t header_size;
-	off_t offset;
+	return (off_t)BPOOL_ROUNDUP(sizeof(BPCF_BUFFER_REF), sizeof(long));
+}
+
+/*
+ * Distance between buffers: room for the header and user data, with
+ * padding ahead of the header so the user data is aligned.
+ */
+static size_t bpcf_stride(size_t max_data_size, unsigned int alignment) {
+	return BPOOL_ROUNDUP(BPOOL_ROUNDUP(bpcf_data_offset(), alignment) + max_data_size, alignment);
+}
+
+/*
+ * Address of the header of buffer bpx. Buffers start at the first
+ * aligned address of the record area.
+ */
+static BPCF_BUFFER_REF* bpcf_buffer(BPMF_STATS* statsp, MMFOR_HANDLE* bpcfhp, BPOOL_INDEX bpx) {
+	size_t base;
+
+	base = BPOOL_ROUNDUP((size_t)mmfor_x2p(bpcfhp, 0), statsp->alignment);
+	return (BPCF_BUFFER_REF*)(base + bpx * statsp->stride +
+		BPOOL_ROUNDUP(bpcf_data_offset(), statsp->alignment) - bpcf_data_offset());
+}
+
+/*
+ * Alignment must be a power of two (at least that of the header) no
+ * larger than a page, since the BPCF mapping is only page aligned.
+ */
+static int valid_alignment(unsigned int alignment) {
+	return (alignment >= sizeof(long)) && !(alignment & (alignment - 1)) &&
+		(alignment <= sysconf(_SC_PAGESIZE));
+}
 	
-	header_size = sizeof(BPCF_BUFFER_REF);
-	if (header_size % 4) {
-		int rem;
-		
-		rem = sizeof(BPCF_BUFFER_REF) % 4;
-		header_size += rem;
+/*
+ * Take a free buffer: one returned to the pool if there is one, else a
+ * fresh one from above the high-water mark. The caller holds the pool
+ * lock unless the pool is lock free. Returns 0 on success, non-zero if
+ * the pool is empty.
+ */
+static int take_buffer(BPOOL_HANDLE* bphp, BPOOL_INDEX* bpxp) {
+	if (bphp->bpmf_recp->flags & BPOOL_FLAG_LOCKFREE) {
+		if (!lf_pop(bphp->bpmf_recp, bpxp)) {
+			return 0;
+		}
+	} else if (!dq_rtd(&bphp->bpmf_recp->dq_inpool, bpxp)) {
+		return 0;
 	}
-	offset = (off_t)header_size;
-	return offset;
+	return fresh_buffer(bphp, bpxp);
 }
-	
-static int allocate_buffers(MMA_HANDLE* bpmfhp, MMFOR_HANDLE* bpcfhp) {
-	size_t ibuff;
-	void* vbuffp;
-	void* vbuffp0;
-	BPMF_STATS* bpmf_statsp;
+
+/*
+ * Claim the buffer at the high-water mark and write its header. The
+ * mark is advanced by compare-and-swap so that lock free pools need no
+ * lock. Returns 0 on success, non-zero if every buffer has been formatted.
+ */
+static int fresh_buffer(BPOOL_HANDLE* bphp, BPOOL_INDEX* bpxp) {
 	BPMF_REC* bpmf_recp;
-	BPCF_BUFFER_REF buffref;
-	size_t buff_size;
-
-	bpmf_recp = (BPMF_REC*)mma_data_pointer(bpmfhp);
-	bpmf_statsp = &bpmf_recp->stats;
-	buff_size = bpmf_statsp->max_data_size + bpcf_data_offset();
-	buffref.bp_id = bpmf_statsp->bp_id;
-	buffref.buff_len = buff_size;
- 	buffref.sync_word[0] = 0xA4;
- 	buffref.sync_word[1] = 0xA4;
-	vbuffp0 = (void*)mmfor_x2p(bpcfhp, 0);
-	vbuffp = vbuffp0;
-	for (ibuff = 0; ibuff < bpmf_statsp->capacity; ibuff++) {
-		buffref.bpindex = ibuff;						// set this buffer's index
-		memset(vbuffp, '*' , buff_size);
-		memcpy(vbuffp, &buffref, sizeof(buffref));		// copy our local structure to mapped memory
-		dq_abd(&bpmf_recp->dq_inpool, &ibuff);			// add buffer index to in pool deque
-		vbuffp += buff_size;
-	}
-	return 0;	
+	BPCF_BUFFER_REF* buff_refp;
+	unsigned int hwm;
+
+	bpmf_recp = bphp->bpmf_recp;
+	hwm = __atomic_load_n(&bpmf_recp->hwm, __ATOMIC_ACQUIRE);
+	do {
+		if (hwm >= bpmf_recp->stats.capacity) {
+			return 1;
+		}
+	} while (!__atomic_compare_exchange_n(&bpmf_recp->hwm, &hwm, hwm + 1,
+		0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	buff_refp = mmpool_buffx2refp(bphp, hwm);
+	buff_refp->sync_word[0] = 0xA4;
+	buff_refp->sync_word[1] = 0xA4;
+	buff_refp->bp_id = bpmf_recp->stats.bp_id;
+	buff_refp->refcount = 0;
+	buff_refp->bpindex = hwm;
+	buff_refp->buff_len = bpmf_recp->stats.max_data_size + bpcf_data_offset();
+	buff_refp->owner_pid = 0;
+	buff_refp->generation = bpmf_recp->generation;
+	buff_refp->lease = 0;
+	buff_refp->next_bpx = BPOOL_CHAIN_END;
+	buff_refp->data_len = 0;
+	*bpxp = hwm;
+	return 0;
 }
 
 static char* bpfile_full_path(const char* filename) {
@@ -614,7 +1454,7 @@ static MMFOR_HANDLE* open_bpcf(char* pool_name) {
  * Given a buffer index, form a buffer reference.
  */
 BPCF_BUFFER_REF* mmpool_buffx2refp(BPOOL_HANDLE* bphp, BPOOL_INDEX bpx) {
-	return mmfor_x2p(bphp->bpcfp, bpx);
+	return bpcf_buffer(&bphp->bpmf_recp->stats, bphp->bpcfp, bpx);
 }
 
 /*
@@ -629,7 +1469,7 @@ BPOOL_INDEX mmpool_refp2buffx(BPCF_BUFFER_REF* buff_refp) {
 static int search_deque(DQHEADER* dequep, BPOOL_INDEX bpx) {
 	int nitems;
 	int i;
-	int x;
+	BPOOL_INDEX x;
 	
 	nitems = dequep->dquse;
 	for (i = 0; i < nitems; i++) {
@@ -671,3 +1511,262 @@ static void unlock_pool(BPOOL_HANDLE* bphp) {
 		mma_unlock_atom(bphp->bpmfp);
 	}
 }
+
+/*
+ * Pointer to the per buffer state byte array in the BPMF
+ */
+static unsigned char* buff_states(BPOOL_HANDLE* bphp) {
+	return ((unsigned char*)bphp->bpmf_recp) + bphp->bpmf_recp->statebuffx;
+}
+
+/*
+ * Reload the out of pool deque from the buffer state bytes.
+ * Caller must hold the pool lock.
+ */
+static void rebuild_outpool(BPOOL_HANDLE* bphp) {
+	DQHEADER* dqoutp;
+	unsigned char* statep;
+	BPOOL_INDEX bpx;
+
+	dqoutp = &bphp->bpmf_recp->dq_outpool;
+	dq_init_memmap(dqoutp->dqslots, sizeof(BPOOL_INDEX), dqoutp->dqbuffx, dqoutp);
+	statep = buff_states(bphp);
+	for (bpx = 0; bpx < bphp->bpmf_recp->stats.capacity; bpx++) {
+		if (BPOOL_BUFF_OUT == statep[bpx]) {
+			dq_abd(dqoutp, &bpx);
+		}
+	}
+}
+
+/*
+ * Get a buffer through the magazine, refilling it from the shared
+ * pool if it is empty. Buffers in a magazine belong to this process,
+ * so their state bytes may be changed without the pool lock. The
+ * shared cached count is changed atomically because magazines in other
+ * processes update it without the pool lock.
+ */
+static BPCF_BUFFER_REF* magazine_getbuff(BPOOL_HANDLE* bphp) {
+	BPOOL_MAGAZINE* magp;
+	BPCF_BUFFER_REF* buff_refp = NULL;
+	BPOOL_INDEX bpx;
+	unsigned char* statep;
+
+	magp = bphp->magp;
+	statep = buff_states(bphp);
+	pthread_mutex_lock(&magp->mutex);
+	if (0 == magp->count) {
+		lock_pool(bphp);
+		while ((magp->count < magp->batch) && !take_buffer(bphp, &bpx)) {
+			statep[bpx] = BPOOL_BUFF_CACHED;
+			set_owner(mmpool_buffx2refp(bphp, bpx), self_pid());	// cached by this process
+			magp->buffx[magp->count++] = bpx;
+			bphp->bpmf_recp->stats.remaining--;
+			__sync_fetch_and_add(&bphp->bpmf_recp->stats.cached, 1);
+		}
+		unlock_pool(bphp);
+	}
+	if (magp->count > 0) {
+		bpx = magp->buffx[--magp->count];
+		statep[bpx] = BPOOL_BUFF_OUT;
+		__sync_fetch_and_sub(&bphp->bpmf_recp->stats.cached, 1);
+		buff_refp = mmpool_buffx2refp(bphp, bpx);
+	}
+	pthread_mutex_unlock(&magp->mutex);
+	return buff_refp;
+}
+
+/*
+ * Return a buffer to the magazine, spilling a batch to the shared
+ * pool when the magazine is full.
+ */
+static int magazine_putbuff(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buffp) {
+	BPOOL_MAGAZINE* magp;
+	BPOOL_INDEX bpx;
+	unsigned char* statep;
+	int error = 0;
+
+	magp = bphp->magp;
+	bpx = buffp->bpindex;
+	statep = buff_states(bphp);
+	pthread_mutex_lock(&magp->mutex);
+	if ((bpx < bphp->bpmf_recp->stats.capacity) && (BPOOL_BUFF_OUT == statep[bpx])) {
+		statep[bpx] = BPOOL_BUFF_CACHED;
+		__atomic_store_n(&buffp->refcount, 0, __ATOMIC_RELAXED);
+		set_owner(buffp, self_pid());			// cached by this process
+		magp->buffx[magp->count++] = bpx;
+		__sync_fetch_and_add(&bphp->bpmf_recp->stats.cached, 1);
+		if (magp->count >= 2 * magp->batch) {
+			magazine_drain(bphp, magp->batch);
+		}
+	} else {
+		// Not allocated ... double free or foreign buffer
+		error = 1;
+	}
+	pthread_mutex_unlock(&magp->mutex);
+	return error;
+}
+
+/*
+ * Return cached buffers to the shared pool until keep remain.
+ * Caller must hold the magazine mutex.
+ */
+static void magazine_drain(BPOOL_HANDLE* bphp, unsigned short keep) {
+	BPOOL_MAGAZINE* magp;
+	BPOOL_INDEX bpx;
+	unsigned char* statep;
+
+	magp = bphp->magp;
+	if (magp->count <= keep) {
+		return;
+	}
+	statep = buff_states(bphp);
+	lock_pool(bphp);
+	while (magp->count > keep) {
+		bpx = magp->buffx[--magp->count];
+		statep[bpx] = BPOOL_BUFF_IN;
+		set_owner(mmpool_buffx2refp(bphp, bpx), 0);
+		dq_abd(&bphp->bpmf_recp->dq_inpool, &bpx);
+		bphp->bpmf_recp->stats.remaining++;
+		__sync_fetch_and_sub(&bphp->bpmf_recp->stats.cached, 1);
+	}
+	unlock_pool(bphp);
+}
+
+/*
+ * Unregister and release a handle's magazine. It must already have
+ * been flushed.
+ */
+static void magazine_free(BPOOL_HANDLE* bphp) {
+	BPOOL_HANDLE** linkp;
+
+	pthread_mutex_lock(&magazine_handles_lock);
+	for (linkp = &magazine_handles; *linkp != NULL; linkp = &(*linkp)->magp->nextp) {
+		if (*linkp == bphp) {
+			*linkp = bphp->magp->nextp;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&magazine_handles_lock);
+	pthread_mutex_destroy(&bphp->magp->mutex);
+	free(bphp->magp->buffx);
+	free(bphp->magp);
+	bphp->magp = NULL;
+}
+
+/*
+ * Pointer to the lock free stack next index array in the BPMF
+ */
+static unsigned int* lf_next(BPMF_REC* bpmf_recp) {
+	return (unsigned int*)(((unsigned char*)bpmf_recp) + bpmf_recp->lfnextbuffx);
+}
+
+/*
+ * Pop the top buffer index off the lock free stack (Treiber stack).
+ * The head word carries a tag bumped on every change so that a head
+ * popped and pushed back between our read and our compare-and-swap
+ * (the ABA problem) fails the swap. Reading the next index of a
+ * buffer another process has just popped is harmless: the swap fails.
+ * Returns 0 on success, non-zero if the stack is empty.
+ */
+static int lf_pop(BPMF_REC* bpmf_recp, BPOOL_INDEX* bpxp) {
+	unsigned long long old_head;
+	unsigned long long new_head;
+	unsigned int top;
+	unsigned int* nextp;
+
+	nextp = lf_next(bpmf_recp);
+	old_head = __atomic_load_n(&bpmf_recp->lf_head, __ATOMIC_ACQUIRE);
+	do {
+		top = (unsigned int)(old_head & 0xFFFFFFFF);
+		if (BPOOL_LF_EMPTY == top) {
+			return 1;
+		}
+		new_head = (((old_head >> 32) + 1) << 32) |
+			__atomic_load_n(&nextp[top], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&bpmf_recp->lf_head, &old_head, new_head,
+		0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	*bpxp = top;
+	return 0;
+}
+
+/*
+ * Push a buffer index onto the lock free stack. The caller must own
+ * the buffer.
+ */
+static void lf_push(BPMF_REC* bpmf_recp, BPOOL_INDEX bpx) {
+	unsigned long long old_head;
+	unsigned long long new_head;
+	unsigned int* nextp;
+
+	nextp = lf_next(bpmf_recp);
+	old_head = __atomic_load_n(&bpmf_recp->lf_head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&nextp[bpx], (unsigned int)(old_head & 0xFFFFFFFF), __ATOMIC_RELAXED);
+		new_head = (((old_head >> 32) + 1) << 32) | (unsigned int)bpx;
+	} while (!__atomic_compare_exchange_n(&bpmf_recp->lf_head, &old_head, new_head,
+		0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Return one buffer of a dead owner to the pool. The caller holds the
+ * pool lock unless the pool is lock free. Returns 1 if the buffer was
+ * returned, 0 if it was not outstanding.
+ */
+static int reclaim_buffer(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* bufrefp, int lockfree) {
+	BPOOL_INDEX bpx;
+	unsigned char* statep;
+
+	bpx = bufrefp->bpindex;
+	statep = buff_states(bphp);
+	if (lockfree) {
+		// The owner is dead, but claim the buffer as mmpool_putbuff would
+		if (!__sync_bool_compare_and_swap(&statep[bpx], BPOOL_BUFF_OUT, BPOOL_BUFF_IN)) {
+			return 0;
+		}
+	} else {
+		if (BPOOL_BUFF_IN == statep[bpx]) {
+			return 0;
+		}
+		if (BPOOL_BUFF_CACHED == statep[bpx]) {
+			__sync_fetch_and_sub(&bphp->bpmf_recp->stats.cached, 1);
+		}
+		statep[bpx] = BPOOL_BUFF_IN;
+	}
+	bufrefp->refcount = 0;
+	bufrefp->next_bpx = BPOOL_CHAIN_END;
+	set_owner(bufrefp, 0);
+	if (lockfree) {
+		lf_push(bphp->bpmf_recp, bpx);
+		__sync_fetch_and_add(&bphp->bpmf_recp->stats.remaining, 1);
+	} else {
+		dq_abd(&bphp->bpmf_recp->dq_inpool, &bpx);
+		bphp->bpmf_recp->stats.remaining++;
+	}
+	return 1;
+}
+
+/*
+ * Record the owner of a buffer and start its lease. The caller must
+ * own the buffer (or hold the pool lock).
+ */
+static void set_owner(BPCF_BUFFER_REF* buff_refp, pid_t pid) {
+	buff_refp->owner_pid = pid;
+	buff_refp->lease = pid ? time(NULL) : 0;
+}
+
+static void owner_pid_atfork_child() {
+	owner_pid = getpid();
+}
+
+static void owner_pid_init() {
+	pthread_atfork(NULL, NULL, owner_pid_atfork_child);
+	owner_pid = getpid();
+}
+
+/*
+ * This process's ID, without a system call per buffer.
+ */
+static pid_t self_pid() {
+	pthread_once(&owner_pid_once, owner_pid_init);
+	return owner_pid;
+}
@@ -28,6 +28,11 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 #ifndef MMPOOL_H_
 #define MMPOOL_H_
 
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include <mmfor.h>
 #include <dqacc.h>
 
@@ -59,7 +64,56 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  * This set is called the "out deque", dq_outpool.
  * 
  * Each buffer in the BPCF file consists of a short control header
- * and user specifed data.
+ * and user specifed data. The user data of every buffer is aligned to
+ * the pool's alignment (BPMF_STATS.alignment, a power of two up to the
+ * page size, e.g. 16 or 64 for SIMD or 4096 for O_DIRECT I/O). Buffers
+ * are laid out at a stride that is a multiple of the alignment, with
+ * the header immediately before the user data and any padding before
+ * the header.
+ *
+ * The BPMF also holds a state byte per buffer (BPOOL_BUFF_STATE) which
+ * records whether the buffer is in or out of the pool. Returning a buffer
+ * checks and updates this byte, so mmpool_putbuff and double free
+ * detection are O(1). The out deque is only maintained in audit mode
+ * (see mmpool_set_audit).
+ *
+ * A pool may instead be created in lock free mode (BPOOL_FLAG_LOCKFREE).
+ * The free buffers are then kept on a Treiber stack in the BPMF: a 64 bit
+ * head word holding an ABA tag and the top buffer index, with a next
+ * index per buffer. mmpool_getbuff and mmpool_putbuff are then a
+ * compare-and-swap each and never take the BPMF file lock. The in and
+ * out deques, audit mode and magazines are not used in lock free mode.
+ *
+ * A process may enable a magazine on its pool handle (see
+ * mmpool_magazine_enable). The magazine takes and returns buffers to the
+ * shared pool in batches, so most mmpool_getbuff and mmpool_putbuff calls
+ * only take a process local mutex instead of the BPMF file lock.
+ *
+ * A buffer may be shared by several owners, e.g. published to several
+ * consumer deques without copying. Each buffer header carries an atomic
+ * reference count, 1 when the buffer is allocated. mmpool_buff_ref adds
+ * an owner and mmpool_buff_unref drops one; the last unref returns the
+ * buffer to the pool.
+ *
+ * A message larger than one buffer is carried by a chain of buffers,
+ * linked by the next buffer index in each header (mmpool_getchain). The
+ * chain is walked with mmpool_chain_next or turned into an iovec array
+ * (mmpool_chain_iov) that can be passed to writev or sendmsg as is. The
+ * head buffer stands for the whole chain, e.g. when sent by reference.
+ *
+ * Pools are formatted lazily, so defining a large pool does not touch
+ * the contents file. Buffers below the high-water mark (BPMF_REC.hwm)
+ * have been handed out at least once; the rest are free and their
+ * headers are written when they are first taken. mmpool_zap_pool resets
+ * the pool by dropping the mark back to zero and bumping the pool
+ * generation, which is stamped into each header as it is written.
+ *
+ * Each buffer header records an owner process ID and lease time (when
+ * the owner took the buffer). mmpool_reclaim returns buffers whose
+ * owner process has died, including those cached in a dead process's
+ * magazine, without disturbing buffers of live processes. Buffers sent
+ * with msgdeque_send_buff have no owner until received, and buffers
+ * shared by several references have no owner, so neither is reclaimed.
  *
  * Manages pools of memory mapped fixed length records.
  *
@@ -87,6 +141,14 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
  
 
 #define MMPOOL_MAX_POOL_NAME 32
+#define BPMF_VERSION 0x42500009		///< BPMF layout version ("BP" 9)
+
+#define BPOOL_FLAG_LOCKFREE 0x0001	///< Pool free list is a lock free stack
+#define BPOOL_LF_EMPTY 0xFFFFFFFF	///< Lock free stack end marker
+
+#define BPOOL_CHAIN_END ((BPOOL_INDEX)-1)	///< Next buffer index of the last buffer of a chain
+
+#define BPOOL_DEFAULT_ALIGNMENT sizeof(long)	///< User data alignment when none is requested
 
 // RCG PATCH typedef unsigned long BPOOL_INDEX;	// buffer pool index
 typedef size_t BPOOL_INDEX;	// buffer pool index
@@ -106,14 +168,29 @@ typedef enum  _enum_bpool_status {
 	BPOOL_STAT_OPENED_RW			///<  an existing buffer pool was opened for read/write
 } BPOOL_STATUS;
 
+/**
+ * Buffer ownership states, one byte per buffer in the BPMF.
+ */
+typedef enum _enum_bpool_buff_state {
+	BPOOL_BUFF_IN = 0,				///< Buffer is in the pool (free)
+	BPOOL_BUFF_OUT,					///< Buffer has been allocated
+	BPOOL_BUFF_CACHED				///< Buffer is free but held in a process magazine
+} BPOOL_BUFF_STATE;
+
 /**
  * Buffer Pool Contents File Reference structure
  */
 typedef struct _bpcf_buffer {
 	char sync_word[2];			///< 2 Byte sync word always contains 0xA4A4 (10100101)
 	unsigned short bp_id;		///< Buffer pool id. Which pool does this buffer belong to?
+	unsigned int refcount;		///< References held by owners. 1 on allocation, 0 in the pool
 	BPOOL_INDEX bpindex;		///< index into the buf byte array of start of buffer.
 	size_t buff_len;			///< length is size of user data + header
+	pid_t owner_pid;			///< owning process, 0 if none (free, in flight or shared)
+	unsigned int generation;	///< pool generation when the header was written
+	time_t lease;				///< when the owner took the buffer
+	BPOOL_INDEX next_bpx;		///< next buffer of a chain, BPOOL_CHAIN_END if none
+	size_t data_len;			///< user data bytes of a chain carried by this buffer
 } BPCF_BUFFER_REF;
 
 /**
@@ -126,6 +203,9 @@ typedef struct _bpmf_stats {
 	unsigned short capacity;	///< actual allocated capacity (count of buffers)
 	size_t max_data_size;		///< max data capacity of buffers in this pool. (buffer user data bytes)
 	unsigned short remaining;	///<  buffers remaining in pool
+	unsigned short cached;		///< free buffers held in process magazines
+	unsigned int alignment;		///< user data alignment in bytes (power of two)
+	size_t stride;				///< distance between buffers in the BPCF (bytes)
 	long align4byte[0];			///< makes this end on a 4 byte alignment
 } BPMF_STATS;					///< Pool statistics
 
@@ -137,9 +217,32 @@ typedef struct _bpmf_rec {
 	size_t indqbuffx;			///< index of in the pool deque buffer area
 	size_t outdqbuffx;			///< index of the out of pool deque buffer area
 	DQHEADER dq_inpool;			///< deque header for buffers in the pool
-	DQHEADER dq_outpool;		///< deque header for buffers out of the pool
+	DQHEADER dq_outpool;		///< deque header for buffers out of the pool (audit mode only)
+	unsigned int version;		///< BPMF layout version (BPMF_VERSION)
+	unsigned short audit;		///< non-zero => maintain dq_outpool
+	unsigned short spare;		///< keep alignment nice
+	size_t statebuffx;			///< index of the per buffer state byte array
+	unsigned int flags;			///< pool creation flags (BPOOL_FLAG_...)
+	unsigned int spare2;		///< keep alignment nice
+	size_t lfnextbuffx;			///< index of the lock free stack next index array
+	unsigned long long lf_head;	///< lock free stack head: ABA tag << 32 | top index
+	unsigned int hwm;			///< buffers formatted so far, those above are free
+	unsigned int generation;	///< bumped by every reset of the pool
 } BPMF_REC;
 
+struct _bpmf_pool_handle;
+
+/**
+ * Per process buffer cache (magazine). Lives in process memory only.
+ */
+typedef struct _bpool_magazine {
+	pthread_mutex_t mutex;		///< serializes threads of this process
+	unsigned short batch;		///< buffers moved to/from the pool at a time (K)
+	unsigned short count;		///< buffers currently cached
+	BPOOL_INDEX* buffx;			///< cached buffer indices (2K slots)
+	struct _bpmf_pool_handle* nextp;	///< next handle with a magazine (flush at exit)
+} BPOOL_MAGAZINE;
+
 /**
  * Buffer pool handle structure.
  */
@@ -150,6 +253,7 @@ typedef struct _bpmf_pool_handle {
 	MMA_HANDLE* bpmfp;			///< Memory mapped atom handle to BPMF object
 	MMFOR_HANDLE* bpcfp;		///< File of Records handle to BPCF object
 	BPMF_REC* bpmf_recp;		///< ptr to in memory representation of BPMF record
+	BPOOL_MAGAZINE* magp;		///< process buffer cache (NULL if not enabled)
 } BPOOL_HANDLE;
 
 #ifdef __cplusplus
@@ -169,6 +273,32 @@ BPOOL_HANDLE* mmpool_define_pool(
 	unsigned short rqst_capacity	// min number of buffers to allocate
 );
 
+/*
+ * Define a buffer pool with creation flags (BPOOL_FLAG_...). Otherwise
+ * as mmpool_define_pool.
+ */
+BPOOL_HANDLE* mmpool_define_pool_flags(
+	char name[MMPOOL_MAX_POOL_NAME],	// Symbolic name of the buffer pool
+	unsigned short bp_id,		// Buffer pool ID
+	size_t max_data_size,		// max number of user bytes to be written to these buffers
+	unsigned short rqst_capacity,	// min number of buffers to allocate
+	unsigned int flags			// BPOOL_FLAG_... values
+);
+
+/*
+ * Define a buffer pool with creation flags and user data alignment (a
+ * power of two up to the page size, 0 for BPOOL_DEFAULT_ALIGNMENT).
+ * Otherwise as mmpool_define_pool.
+ */
+BPOOL_HANDLE* mmpool_define_pool_aligned(
+	char name[MMPOOL_MAX_POOL_NAME],	// Symbolic name of the buffer pool
+	unsigned short bp_id,		// Buffer pool ID
+	size_t max_data_size,		// max number of user bytes to be written to these buffers
+	unsigned short rqst_capacity,	// min number of buffers to allocate
+	unsigned int flags,			// BPOOL_FLAG_... values
+	unsigned int alignment		// user data alignment in bytes
+);
+
 /*
  * Open a buffer pool. If the pool does not exist or another error occurs,
  * this function returns NULL. Otherwise it returns a pointer to a 
@@ -192,11 +322,91 @@ BPCF_BUFFER_REF* mmpool_getbuff(BPOOL_HANDLE* bphp);
  */
 int mmpool_putbuff(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buff_refp);
 
+/*
+ * Get a chain of buffers holding total_len user data bytes, all or
+ * nothing. Returns the head buffer, NULL if the pool is short of buffers.
+ */
+BPCF_BUFFER_REF* mmpool_getchain(BPOOL_HANDLE* bphp, size_t total_len);
+
+/*
+ * Return every buffer of a chain to the pool. Returns 0 if successful,
+ * non-zero otherwise.
+ */
+int mmpool_putchain(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* head_refp);
+
+/*
+ * Next buffer of a chain, NULL at the end of the chain.
+ */
+BPCF_BUFFER_REF* mmpool_chain_next(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buff_refp);
+
+/*
+ * Describe the user data of a chain in up to iovcnt iovec entries.
+ * Returns the number of buffers in the chain, -1 if it is corrupt.
+ */
+int mmpool_chain_iov(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* head_refp, struct iovec* iov, int iovcnt);
+
+/*
+ * Add a reference to an allocated buffer. Returns the new reference
+ * count, 0 if the buffer is not allocated.
+ */
+int mmpool_buff_ref(BPCF_BUFFER_REF* buff_refp);
+
+/*
+ * Drop a reference to a buffer. The last reference returns the buffer
+ * to the pool. Returns the remaining reference count, -1 on error.
+ */
+int mmpool_buff_unref(BPOOL_HANDLE* bphp, BPCF_BUFFER_REF* buff_refp);
+
+/*
+ * Enable a per process buffer cache that moves batch buffers at a time
+ * to and from the shared pool.
+ */
+int mmpool_magazine_enable(BPOOL_HANDLE* bphp, unsigned short batch);
+
+/*
+ * Return all buffers cached by this process to the shared pool.
+ * Returns count of buffers returned.
+ */
+int mmpool_magazine_flush(BPOOL_HANDLE* bphp);
+
+/*
+ * Enable or disable audit mode (maintenance of the out of pool deque).
+ */
+int mmpool_set_audit(BPOOL_HANDLE* bphp, int on);
+
+/*
+ * Get the state (BPOOL_BUFF_STATE) of a buffer. Returns -1 if the index
+ * is out of range.
+ */
+int mmpool_buff_state(BPOOL_HANDLE* bphp, BPOOL_INDEX bpx);
+
+/*
+ * Record pid as the owner of an allocated buffer, starting a new lease.
+ * pid 0 leaves the buffer without an owner.
+ */
+int mmpool_buff_set_owner(BPCF_BUFFER_REF* buff_refp, pid_t pid);
+
+/*
+ * Return buffers held by dead processes to the pool. Returns count of
+ * buffers reclaimed.
+ */
+int mmpool_reclaim(BPOOL_HANDLE* bphp);
+
 /*
  * Get pointer to stats structure.
  */ 
 BPMF_STATS* mmpool_getstats(BPOOL_HANDLE* bphp);
 
+/*
+ * Write both files of a pool to a file descriptor in bulk.
+ */
+int mmpool_export(BPOOL_HANDLE* bphp, int fd);
+
+/*
+ * Create a pool from a dump written by mmpool_export.
+ */
+BPOOL_HANDLE* mmpool_import(char* pool_name, int fd);
+
 /*
  * Deallocate all buffers currently out of the pool. Zap 'em clean and
  * put them back in the "in pool" deque. Return count of items returned to
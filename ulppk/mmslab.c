@@ -0,0 +1,403 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file mmslab.c
+ *
+ * @brief Size Classed Shared Memory Slab Allocator
+ *
+ * Every mmpool buffer pool has a single buffer size, so messages much
+ * smaller than a pool's buffers waste most of them. A slab group is a
+ * named set of buffer pools (size classes), each with a larger buffer
+ * size than the last. mmslab_alloc picks the smallest class that fits
+ * the requested length and falls back to larger classes when that one
+ * is empty.
+ *
+ * The group is described by a small memory mapped file, <group>.slab,
+ * in the buffer pool data directory (MMPOOL_DATA_DIR). It lists the
+ * classes and holds group wide counters. The class pools are ordinary
+ * mmpool pools named <group>-cNN, with the class number as pool ID,
+ * so they can also be inspected with mmbuffpool. mmbuffpool -S reports
+ * group wide statistics.
+ *
+ * Buffers carry their class in their pool ID, so mmslab_free needs
+ * only the buffer reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <mmslab.h>
+#include <mmapfile.h>
+#include <appenv.h>
+#include <ulppk_log.h>
+
+static char* slab_file_path(char* name);
+
+static char* class_pool_name(char* buff, char* group_name, int classx);
+
+static MMSLAB_HANDLE* open_pools(MMA_HANDLE* mmahp);
+
+/**
+ * @brief Define a slab group with power of two size classes.
+ *
+ * Classes run from min_size rounded up to a power of two, doubling,
+ * until max_size is covered. If the group already exists it is opened
+ * and the other arguments are ignored.
+ *
+ * @param name Symbolic name of the group
+ * @param min_size Buffer size of the smallest class
+ * @param max_size Largest allocation the group must satisfy
+ * @param capacity Number of buffers in each class
+ * @param flags BPOOL_FLAG_... values for the class pools
+ * @return Slab group handle, NULL on error (errno EINVAL if more than
+ * MMSLAB_MAX_CLASSES classes would be needed).
+ */
+MMSLAB_HANDLE* mmslab_define_group(char* name, size_t min_size, size_t max_size,
+	unsigned short capacity, unsigned int flags) {
+	size_t sizes[MMSLAB_MAX_CLASSES];
+	unsigned short capacities[MMSLAB_MAX_CLASSES];
+	unsigned short nclasses = 0;
+	size_t size;
+
+	for (size = 1; size < min_size; size <<= 1) {
+		;
+	}
+	do {
+		if (nclasses >= MMSLAB_MAX_CLASSES) {
+			errno = EINVAL;
+			return NULL;
+		}
+		sizes[nclasses] = size;
+		capacities[nclasses] = capacity;
+		nclasses++;
+		size <<= 1;
+	} while (sizes[nclasses - 1] < max_size);
+	return mmslab_define_group_classes(name, nclasses, sizes, capacities, flags);
+}
+
+/**
+ * @brief Define a slab group with caller supplied size classes.
+ *
+ * If the group already exists it is opened and the other arguments are
+ * ignored.
+ *
+ * @param name Symbolic name of the group
+ * @param nclasses Number of size classes (1 to MMSLAB_MAX_CLASSES)
+ * @param sizes Buffer size of each class, strictly increasing
+ * @param capacities Number of buffers in each class
+ * @param flags BPOOL_FLAG_... values for the class pools
+ * @return Slab group handle, NULL on error.
+ */
+MMSLAB_HANDLE* mmslab_define_group_classes(char* name, unsigned short nclasses,
+	size_t sizes[], unsigned short capacities[], unsigned int flags) {
+	MMA_HANDLE* mmahp;
+	MMSLAB_REC* recp;
+	MMSLAB_HANDLE* slabp;
+	BPOOL_HANDLE* bphp;
+	int i;
+
+	if (mmslab_group_exists(name)) {
+		return mmslab_open(name);
+	}
+	if ((strlen(name) > MMSLAB_MAX_GROUP_NAME) || (0 == nclasses) || (nclasses > MMSLAB_MAX_CLASSES)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for (i = 1; i < nclasses; i++) {
+		if (sizes[i] <= sizes[i - 1]) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	// Create the class pools first, so a group file always has its pools
+	for (i = 0; i < nclasses; i++) {
+		char pool_name[MMPOOL_MAX_POOL_NAME+1];
+
+		bphp = mmpool_define_pool_flags(class_pool_name(pool_name, name, i), i,
+			sizes[i], capacities[i], flags);
+		if (NULL == bphp) {
+			ULPPK_LOG(ULPPK_LOG_ERROR, "Slab group %s: unable to define class pool %s",
+				name, pool_name);
+			return NULL;
+		}
+		mmpool_close(bphp);
+	}
+
+	mmahp = mmapfile_create(name, slab_file_path(name), sizeof(MMSLAB_REC), MMA_READ_WRITE,
+		MMF_SHARED, 0660);
+	if (NULL == mmahp) {
+		return NULL;
+	}
+	recp = (MMSLAB_REC*)mma_data_pointer(mmahp);
+	memset(recp, 0, sizeof(MMSLAB_REC));
+	strncpy(recp->name, name, MMSLAB_MAX_GROUP_NAME);
+	recp->nclasses = nclasses;
+	for (i = 0; i < nclasses; i++) {
+		recp->classes[i].size = sizes[i];
+		recp->classes[i].capacity = capacities[i];
+		class_pool_name(recp->classes[i].pool_name, name, i);
+	}
+	// Publish the version last ... it marks the record complete
+	__sync_synchronize();
+	recp->version = MMSLAB_VERSION;
+
+	slabp = open_pools(mmahp);
+	if (NULL == slabp) {
+		mmapfile_close(mmahp);
+	}
+	return slabp;
+}
+
+/**
+ * @brief Open an existing slab group.
+ *
+ * @param name Symbolic name of the group
+ * @return Slab group handle, NULL if the group does not exist or is
+ * unusable.
+ */
+MMSLAB_HANDLE* mmslab_open(char* name) {
+	MMA_HANDLE* mmahp;
+	MMSLAB_HANDLE* slabp;
+
+	if (!mmslab_group_exists(name)) {
+		return NULL;
+	}
+	mmahp = mmapfile_open(name, slab_file_path(name), MMA_READ_WRITE, MMF_SHARED);
+	if (NULL == mmahp) {
+		return NULL;
+	}
+	if (((MMSLAB_REC*)mma_data_pointer(mmahp))->version != MMSLAB_VERSION) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Slab group %s has an incompatible or incomplete group file: recreate the group",
+			name);
+		mmapfile_close(mmahp);
+		return NULL;
+	}
+	slabp = open_pools(mmahp);
+	if (NULL == slabp) {
+		mmapfile_close(mmahp);
+	}
+	return slabp;
+}
+
+/**
+ * @brief Close a slab group and its class pools.
+ *
+ * @param slabp Slab group handle
+ * @return 0
+ */
+int mmslab_close(MMSLAB_HANDLE* slabp) {
+	int i;
+
+	for (i = 0; i < slabp->recp->nclasses; i++) {
+		if (slabp->pools[i] != NULL) {
+			mmpool_close(slabp->pools[i]);
+		}
+	}
+	mmapfile_close(slabp->mmahp);
+	free(slabp);
+	return 0;
+}
+
+/**
+ * @brief Determine if the named slab group file exists.
+ *
+ * @param name Symbolic name of the group
+ * @return non-zero if the group exists.
+ */
+int mmslab_group_exists(char* name) {
+	return (0 == access(slab_file_path(name), F_OK));
+}
+
+/**
+ * @brief Given the symbolic name of a group, derive the group file name
+ *
+ * @param name Symbolic name of the group
+ * @return The name of the slab group file (not full path).
+ */
+char* mmslab_filename(char* name) {
+	static char buff[MMSLAB_MAX_GROUP_NAME+7];
+
+	snprintf(buff, sizeof(buff), "%s.slab", name);
+	return buff;
+}
+
+/**
+ * @brief Allocate a buffer of at least len user data bytes.
+ *
+ * The smallest class that fits is tried first, then each larger class
+ * in turn.
+ *
+ * @param slabp Slab group handle
+ * @param len Number of user data bytes needed
+ * @return Buffer reference, NULL with errno EINVAL if len exceeds the
+ * largest class or ENOMEM if every fitting class is empty.
+ */
+BPCF_BUFFER_REF* mmslab_alloc(MMSLAB_HANDLE* slabp, size_t len) {
+	BPCF_BUFFER_REF* buffp;
+	MMSLAB_REC* recp;
+	int first;
+	int i;
+
+	recp = slabp->recp;
+	for (first = 0; (first < recp->nclasses) && (recp->classes[first].size < len); first++) {
+		;
+	}
+	if (first >= recp->nclasses) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for (i = first; i < recp->nclasses; i++) {
+		buffp = mmpool_getbuff(slabp->pools[i]);
+		if (buffp != NULL) {
+			if (i != first) {
+				__sync_fetch_and_add(&recp->fallbacks, 1);
+			}
+			return buffp;
+		}
+	}
+	__sync_fetch_and_add(&recp->failures, 1);
+	errno = ENOMEM;
+	return NULL;
+}
+
+/**
+ * @brief Return a buffer obtained by mmslab_alloc to its class.
+ *
+ * @param slabp Slab group handle
+ * @param buffp Buffer reference
+ * @return 0 on success, non-zero if the buffer does not belong to the
+ * group or is not allocated.
+ */
+int mmslab_free(MMSLAB_HANDLE* slabp, BPCF_BUFFER_REF* buffp) {
+	BPOOL_HANDLE* bphp;
+
+	bphp = mmslab_buff_pool(slabp, buffp);
+	if (NULL == bphp) {
+		return 1;
+	}
+	return mmpool_putbuff(bphp, buffp);
+}
+
+/**
+ * @brief Find the class pool a buffer belongs to.
+ *
+ * @param slabp Slab group handle
+ * @param buffp Buffer reference
+ * @return Class pool handle, NULL if the buffer is not from this group.
+ */
+BPOOL_HANDLE* mmslab_buff_pool(MMSLAB_HANDLE* slabp, BPCF_BUFFER_REF* buffp) {
+	BPOOL_HANDLE* bphp;
+
+	if (buffp->bp_id >= slabp->recp->nclasses) {
+		return NULL;
+	}
+	bphp = slabp->pools[buffp->bp_id];
+	// The pool ID alone could match a buffer of another group
+	if ((buffp->bpindex >= bphp->bpmf_recp->stats.capacity) ||
+		(mmpool_buffx2refp(bphp, buffp->bpindex) != buffp)) {
+		return NULL;
+	}
+	return bphp;
+}
+
+/**
+ * @brief Get group wide statistics, summed over the size classes.
+ *
+ * @param slabp Slab group handle
+ * @param statsp Statistics structure to fill in
+ * @return 0
+ */
+int mmslab_getstats(MMSLAB_HANDLE* slabp, MMSLAB_STATS* statsp) {
+	BPMF_STATS* bpstatsp;
+	unsigned long out;
+	int i;
+
+	memset(statsp, 0, sizeof(MMSLAB_STATS));
+	statsp->nclasses = slabp->recp->nclasses;
+	for (i = 0; i < slabp->recp->nclasses; i++) {
+		bpstatsp = mmpool_getstats(slabp->pools[i]);
+		out = bpstatsp->capacity - bpstatsp->remaining - bpstatsp->cached;
+		statsp->capacity += bpstatsp->capacity;
+		statsp->remaining += bpstatsp->remaining;
+		statsp->cached += bpstatsp->cached;
+		statsp->data_bytes += bpstatsp->capacity * bpstatsp->max_data_size;
+		statsp->data_bytes_out += out * bpstatsp->max_data_size;
+	}
+	statsp->fallbacks = slabp->recp->fallbacks;
+	statsp->failures = slabp->recp->failures;
+	return 0;
+}
+
+/*
+ * Full path of a slab group file
+ */
+static char* slab_file_path(char* name) {
+	static char buff[1024];
+
+	snprintf(buff, sizeof(buff), "%s/%s",
+		appenv_register_env_var(MMPOOL_ENV_DATA_DIR, DEFAULT_MPOOL_ENV_DATA_DIR),
+		mmslab_filename(name));
+	return buff;
+}
+
+/*
+ * Name of the buffer pool of size class classx of a group
+ */
+static char* class_pool_name(char* buff, char* group_name, int classx) {
+	snprintf(buff, MMPOOL_MAX_POOL_NAME+1, "%s-c%02d", group_name, classx);
+	return buff;
+}
+
+/*
+ * Build a handle for a mapped group file and open its class pools.
+ */
+static MMSLAB_HANDLE* open_pools(MMA_HANDLE* mmahp) {
+	MMSLAB_HANDLE* slabp;
+	int i;
+
+	slabp = (MMSLAB_HANDLE*)calloc(1, sizeof(MMSLAB_HANDLE));
+	slabp->mmahp = mmahp;
+	slabp->recp = (MMSLAB_REC*)mma_data_pointer(mmahp);
+	for (i = 0; i < slabp->recp->nclasses; i++) {
+		slabp->pools[i] = mmpool_open(slabp->recp->classes[i].pool_name);
+		if (NULL == slabp->pools[i]) {
+			ULPPK_LOG(ULPPK_LOG_ERROR, "Slab group %s: unable to open class pool %s",
+				slabp->recp->name, slabp->recp->classes[i].pool_name);
+			while (i-- > 0) {
+				mmpool_close(slabp->pools[i]);
+			}
+			free(slabp);
+			return NULL;
+		}
+	}
+	return slabp;
+}
@@ -0,0 +1,117 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file mmslab.h
+ * @brief Size Classed Shared Memory Slab Allocator
+ *
+ *  Declarations for a slab layer over mmpool.c. A named slab group is a
+ *  set of buffer pools (size classes) of increasing buffer size. See
+ *  mmslab.c for details.
+ */
+
+#ifndef MMSLAB_H_
+#define MMSLAB_H_
+
+#include <sys/types.h>
+
+#include <mmatom.h>
+#include <mmpool.h>
+
+#define MMSLAB_MAX_CLASSES 16			///< Max number of size classes in a group
+#define MMSLAB_MAX_GROUP_NAME 24		///< Max group name length (leaves room for class suffix)
+#define MMSLAB_VERSION 0x534C0001		///< Slab group file layout version ("SL" 1)
+
+/**
+ * @brief One size class of a slab group, as stored in the group file.
+ */
+typedef struct _MMSLAB_CLASS {
+	size_t size;				///< max user data bytes of a buffer in this class
+	unsigned short capacity;	///< number of buffers in the class pool
+	unsigned short spare;		///< keep alignment nice
+	char pool_name[MMPOOL_MAX_POOL_NAME+1];	///< name of the class's buffer pool
+} MMSLAB_CLASS;
+
+/**
+ * @brief Slab group file contents. Shared by all processes using the group.
+ */
+typedef struct _MMSLAB_REC {
+	unsigned int version;		///< MMSLAB_VERSION
+	unsigned short nclasses;	///< number of size classes
+	unsigned short spare;		///< keep alignment nice
+	char name[MMSLAB_MAX_GROUP_NAME+1];	///< symbolic name of the group
+	unsigned long fallbacks;	///< allocations served by a larger class than the best fit
+	unsigned long failures;		///< allocations that found every fitting class empty
+	MMSLAB_CLASS classes[MMSLAB_MAX_CLASSES];	///< size classes, smallest first
+} MMSLAB_REC;
+
+/**
+ * @brief Slab group handle (process local).
+ */
+typedef struct _MMSLAB_HANDLE {
+	MMA_HANDLE* mmahp;			///< mapped slab group file
+	MMSLAB_REC* recp;			///< pointer to the mapped group record
+	BPOOL_HANDLE* pools[MMSLAB_MAX_CLASSES];	///< class buffer pools
+} MMSLAB_HANDLE;
+
+/**
+ * @brief Group wide statistics, summed over the size classes.
+ */
+typedef struct _MMSLAB_STATS {
+	unsigned short nclasses;	///< number of size classes
+	unsigned long capacity;		///< total buffers in the group
+	unsigned long remaining;	///< total buffers in the class pools
+	unsigned long cached;		///< total buffers cached in process magazines
+	size_t data_bytes;			///< total user data bytes of all buffers
+	size_t data_bytes_out;		///< user data bytes of allocated buffers
+	unsigned long fallbacks;	///< allocations served by a larger class
+	unsigned long failures;		///< allocations that found every fitting class empty
+} MMSLAB_STATS;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+MMSLAB_HANDLE* mmslab_define_group(char* name, size_t min_size, size_t max_size,
+	unsigned short capacity, unsigned int flags);
+MMSLAB_HANDLE* mmslab_define_group_classes(char* name, unsigned short nclasses,
+	size_t sizes[], unsigned short capacities[], unsigned int flags);
+MMSLAB_HANDLE* mmslab_open(char* name);
+int mmslab_close(MMSLAB_HANDLE* slabp);
+int mmslab_group_exists(char* name);
+char* mmslab_filename(char* name);
+
+BPCF_BUFFER_REF* mmslab_alloc(MMSLAB_HANDLE* slabp, size_t len);
+int mmslab_free(MMSLAB_HANDLE* slabp, BPCF_BUFFER_REF* buffp);
+BPOOL_HANDLE* mmslab_buff_pool(MMSLAB_HANDLE* slabp, BPCF_BUFFER_REF* buffp);
+int mmslab_getstats(MMSLAB_HANDLE* slabp, MMSLAB_STATS* statsp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MMSLAB_H_ */
@@ -62,6 +62,7 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 
 
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <msgcell.h>
 
@@ -94,6 +95,7 @@ MSGCELL* msgcell_create(const char* name, uint permissions,  void* datap, MSGCEL
 	MSGCELL* msgcellp;
 
 	msgcellp = (MSGCELL*)calloc(1, sizeof(MSGCELL));
+	strncpy(msgcellp->name, name, sizeof(msgcellp->name) - 1);
 	msgcellp->datap = datap;
 	if (datacheckfuncp == NULL) {
 		msgcellp->datacheckfuncp = datacheckfunc_stub;
@@ -125,6 +127,7 @@ MSGCELL* msgcell_attach(const char* name, void* datap, MSGCELL_DATACHECK_FUNC* d
 	MSGCELL* msgcellp;
 
 	msgcellp = (MSGCELL*)calloc(1, sizeof(MSGCELL));
+	strncpy(msgcellp->name, name, sizeof(msgcellp->name) - 1);
 	msgcellp->datap = datap;
 	if (datacheckfuncp == NULL) {
 		msgcellp->datacheckfuncp = datacheckfunc_stub;
@@ -251,7 +254,7 @@ int msgcell_timedrec(MSGCELL* msgcellp, const struct timespec* timeout) {
 
 	if (! (*msgcellp->datacheckfuncp)(msgcellp->datap)) {
 		if (sem_timedwait(msgcellp->semp, timeout) != 0) {
-			if (ETIMEDOUT == retval) {
+			if (ETIMEDOUT == errno) {
 				if (!(*msgcellp->datacheckfuncp)(msgcellp->datap)) {
 					msgcellp->errcode = ENODATA;
 					retval = 1;
@@ -47,10 +47,17 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 #include <msgcell.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <ulppk_log.h>
 
 #define DEQUEPREFIX "msgdeque-"
 #define LOCKPREFIX "msgdeque-lock-"
+#define SPACESUFFIX "-space"
+#define TIMERSUFFIX ".timer"
+
+static MSGCELL* create_deque(const char *name, uint permissions, ushort item_size, ushort nitems, int timed);
 
 
 /**
@@ -101,6 +108,264 @@ static char* make_name(char* buff, size_t buffsize, const char* name) {
 	return buff;
 }
 
+/*
+ * Make the name of the "space available" semaphore from a message
+ * cell name. The returned string is allocated from the heap and
+ * must be freed by the caller.
+ */
+static char* make_space_name(const char* name) {
+	char* buff;
+
+	buff = (char*)calloc(strlen(name) + strlen(SPACESUFFIX) + 1, sizeof(char));
+	strcpy(buff, name);
+	strcat(buff, SPACESUFFIX);
+	return buff;
+}
+
+/*
+ * Wake producers parked in msgdeque_send_wait. Called by receivers
+ * after an item has been removed from the deque. The semaphore is
+ * never posted beyond the number of parked producers, so wakeups do
+ * not pile up (e.g. behind the count of a producer killed while
+ * parked). The caller must hold the write lock on the lock file.
+ */
+static void signal_space(MSGDEQUE* msgdqp) {
+	MSGDEQUE_STATS* statsp;
+	int posted;
+
+	statsp = (MSGDEQUE_STATS*)mma_data_pointer(msgdqp->lock);
+	if ((statsp->waiting_producers > 0) && (msgdqp->spacesemp != NULL) &&
+		(0 == sem_getvalue(msgdqp->spacesemp, &posted)) &&
+		(posted < (int)statsp->waiting_producers)) {
+		sem_post(msgdqp->spacesemp);
+	}
+}
+
+/*
+ * Consume wakeups left on the space semaphore when no producer is
+ * parked, so the next producer to park does not take a stale one.
+ * The caller must hold the write lock on the lock file.
+ */
+static void drain_space(MSGDEQUE* msgdqp) {
+	MSGDEQUE_STATS* statsp;
+
+	statsp = (MSGDEQUE_STATS*)mma_data_pointer(msgdqp->lock);
+	if ((0 == statsp->waiting_producers) && (msgdqp->spacesemp != NULL)) {
+		while (0 == sem_trywait(msgdqp->spacesemp));
+	}
+}
+
+/*
+ * Return the elapsed time between two CLOCK_MONOTONIC readings
+ * in nanoseconds.
+ */
+static unsigned long long elapsed_nsecs(struct timespec* t0, struct timespec* t1) {
+	unsigned long long nsecs;
+
+	nsecs = (unsigned long long)(t1->tv_sec - t0->tv_sec) * 1000000000ULL;
+	nsecs += t1->tv_nsec;
+	nsecs -= t0->tv_nsec;
+	return nsecs;
+}
+
+/*
+ * Make the path of the scheduled delivery timer file from a deque
+ * name. The returned string is allocated from the heap and must be
+ * freed by the caller.
+ */
+static char* make_timer_path(const char* dequename) {
+	char* dequedir;
+	char* buff;
+
+	dequedir = mmdq_dequedir();
+	buff = (char*)calloc(strlen(dequedir) + strlen(dequename) + strlen(TIMERSUFFIX) + 2, sizeof(char));
+	strcpy(buff, dequedir);
+	strcat(buff, "/");
+	strcat(buff, dequename);
+	strcat(buff, TIMERSUFFIX);
+	return buff;
+}
+
+/*
+ * Return 1 if time a is earlier than time b.
+ */
+static int ts_before(const struct timespec* a, const struct timespec* b) {
+	return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+/*
+ * Timer file accessors. See MSGDEQUE_TIMER_HEADER for the layout.
+ */
+static MSGDEQUE_TIMER_ENTRY* timer_heap(MSGDEQUE_TIMER_HEADER* hdrp) {
+	return (MSGDEQUE_TIMER_ENTRY*)(hdrp + 1);
+}
+
+static unsigned int* timer_free_slots(MSGDEQUE_TIMER_HEADER* hdrp) {
+	return (unsigned int*)(timer_heap(hdrp) + hdrp->capacity);
+}
+
+static unsigned char* timer_item(MSGDEQUE_TIMER_HEADER* hdrp, unsigned int slot) {
+	return (unsigned char*)(timer_free_slots(hdrp) + hdrp->capacity) + ((size_t)slot * hdrp->item_size);
+}
+
+static size_t timer_file_size(unsigned int capacity, unsigned int item_size) {
+	return sizeof(MSGDEQUE_TIMER_HEADER) +
+		capacity * (sizeof(MSGDEQUE_TIMER_ENTRY) + sizeof(unsigned int) + item_size);
+}
+
+/*
+ * Empty the timer heap. The caller must hold the write lock on the
+ * lock file (or be the creator).
+ */
+static void timer_reset(MSGDEQUE_TIMER_HEADER* hdrp) {
+	unsigned int* freep;
+	unsigned int i;
+
+	freep = timer_free_slots(hdrp);
+	for (i = 0; i < hdrp->capacity; i++) {
+		freep[i] = hdrp->capacity - i - 1;
+	}
+	hdrp->count = 0;
+}
+
+static int timer_entry_before(MSGDEQUE_TIMER_ENTRY* a, MSGDEQUE_TIMER_ENTRY* b) {
+	if (ts_before(&a->due, &b->due)) {
+		return 1;
+	}
+	if (ts_before(&b->due, &a->due)) {
+		return 0;
+	}
+	return a->seq < b->seq;
+}
+
+/*
+ * Insert a message into the timer heap. Returns 1 if it became the
+ * earliest scheduled message. The caller must hold the write lock and
+ * have checked there is room.
+ */
+static int timer_push(MSGDEQUE_TIMER_HEADER* hdrp, void* itemp, const struct timespec* due) {
+	MSGDEQUE_TIMER_ENTRY* heap;
+	MSGDEQUE_TIMER_ENTRY entry;
+	unsigned int x;
+	unsigned int parent;
+
+	heap = timer_heap(hdrp);
+	entry.due = *due;
+	entry.seq = hdrp->next_seq++;
+	entry.slot = timer_free_slots(hdrp)[hdrp->capacity - hdrp->count - 1];
+	entry.spare = 0;
+	memcpy(timer_item(hdrp, entry.slot), itemp, hdrp->item_size);
+	// Sift up
+	for (x = hdrp->count; x > 0; x = parent) {
+		parent = (x - 1) / 2;
+		if (!timer_entry_before(&entry, &heap[parent])) {
+			break;
+		}
+		heap[x] = heap[parent];
+	}
+	heap[x] = entry;
+	hdrp->count++;
+	return (0 == x);
+}
+
+/*
+ * Remove the earliest message from the timer heap and release its
+ * slot. The caller must hold the write lock and have copied the item.
+ */
+static void timer_pop(MSGDEQUE_TIMER_HEADER* hdrp) {
+	MSGDEQUE_TIMER_ENTRY* heap;
+	MSGDEQUE_TIMER_ENTRY last;
+	unsigned int x;
+	unsigned int child;
+
+	heap = timer_heap(hdrp);
+	hdrp->count--;
+	timer_free_slots(hdrp)[hdrp->capacity - hdrp->count - 1] = heap[0].slot;
+	last = heap[hdrp->count];
+	// Sift down
+	for (x = 0; (child = 2 * x + 1) < hdrp->count; x = child) {
+		if ((child + 1 < hdrp->count) && timer_entry_before(&heap[child + 1], &heap[child])) {
+			child++;
+		}
+		if (!timer_entry_before(&heap[child], &last)) {
+			break;
+		}
+		heap[x] = heap[child];
+	}
+	heap[x] = last;
+}
+
+/*
+ * Move scheduled messages that are due onto the deque, as far as room
+ * allows, and wake one receiver per message moved. If messages remain
+ * scheduled, the earliest due time is stored in nextp and 1 is returned.
+ * The caller must hold the write lock on the lock file.
+ */
+static int promote_due(MSGCELL* msgcellp, struct timespec* nextp) {
+	MSGDEQUE* msgdqp;
+	MSGDEQUE_TIMER_HEADER* hdrp;
+	MSGDEQUE_TIMER_ENTRY* heap;
+	struct timespec now;
+
+	msgdqp = (MSGDEQUE*)msgcellp->datap;
+	if (NULL == msgdqp->timer) {
+		return 0;
+	}
+	hdrp = (MSGDEQUE_TIMER_HEADER*)mma_data_pointer(msgdqp->timer);
+	if (0 == hdrp->count) {
+		return 0;
+	}
+	heap = timer_heap(hdrp);
+	clock_gettime(CLOCK_REALTIME, &now);
+	while ((hdrp->count > 0) && !ts_before(&now, &heap[0].due)) {
+		if (mmdq_abd(msgdqp->deque, timer_item(hdrp, heap[0].slot)) != 0) {
+			// Deque is full. Leave the rest until a receiver makes room.
+			break;
+		}
+		timer_pop(hdrp);
+		sem_post(msgcellp->semp);
+	}
+	if (hdrp->count > 0) {
+		*nextp = heap[0].due;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Block a receiver once on the message cell semaphore. The wait ends
+ * at the earlier of the caller's timeout and the due time of the next
+ * scheduled message (either may be NULL). Returns 0 when the caller
+ * should look at the deque again, non-zero on error or when the
+ * caller's timeout expired (errcode ETIMEDOUT).
+ */
+static int wait_for_data(MSGCELL* msgcellp, const struct timespec* timeout, const struct timespec* duep) {
+	const struct timespec* deadline;
+	int retval = 0;
+
+	deadline = timeout;
+	if ((duep != NULL) && ((NULL == timeout) || ts_before(duep, timeout))) {
+		deadline = duep;
+	}
+	if (NULL == deadline) {
+		if ((sem_wait(msgcellp->semp) != 0) && (errno != EINTR)) {
+			msgcellp->errcode = errno;
+			retval = 1;
+		}
+	} else if (sem_timedwait(msgcellp->semp, deadline) != 0) {
+		if (ETIMEDOUT == errno) {
+			if ((deadline == timeout) && !(*msgcellp->datacheckfuncp)(msgcellp->datap)) {
+				msgcellp->errcode = ETIMEDOUT;
+				retval = 1;
+			}
+		} else if (errno != EINTR) {
+			msgcellp->errcode = errno;
+			retval = 1;
+		}
+	}
+	return retval;
+}
+
 /**
  * @brief Create a message deque structure. This will consist of at msgcell and
  * a memory mapped dequeue. This form sets up a message dequeue that accepts
@@ -109,6 +374,10 @@ static char* make_name(char* buff, size_t buffsize, const char* name) {
  * To send to the dequeue use the msgdeque_send function. The receive
  * from the dequeue call the msgdeque_rec function.
  *
+ * The deque has no timer file, so msgdeque_send_at cannot schedule
+ * messages on it. Use msgdeque_create_flags with MSGDEQUE_FLAG_TIMED
+ * for that.
+ *
  * @param name  name of the dequeue
  * @param permissions  access permissions (see open(2)
  * @param item_size  size of the records accepted by this dequeue.
@@ -116,12 +385,41 @@ static char* make_name(char* buff, size_t buffsize, const char* name) {
  * @return  pointer to the created MSGCELL structure.
  */
 MSGCELL* msgdeque_create(const char *name, uint permissions, ushort item_size, ushort nitems) {
+	return create_deque(name, permissions, item_size, nitems, 0);
+}
+
+/**
+ * @brief Create a fixed length record message deque with MSGDEQUE_FLAG_...
+ * options. As msgdeque_create, except that with MSGDEQUE_FLAG_TIMED a
+ * timer file with room for nitems scheduled messages is created
+ * alongside the deque for use by msgdeque_send_at.
+ *
+ * @param name  name of the dequeue
+ * @param permissions  access permissions (see open(2)
+ * @param item_size  size of the records accepted by this dequeue.
+ * @param nitems  maximum capacity of the dequeue.
+ * @param flags  MSGDEQUE_FLAG_... values
+ * @return  pointer to the created MSGCELL structure.
+ */
+MSGCELL* msgdeque_create_flags(const char *name, uint permissions, ushort item_size, ushort nitems,
+		unsigned int flags) {
+	return create_deque(name, permissions, item_size, nitems, (flags & MSGDEQUE_FLAG_TIMED) != 0);
+}
+
+/*
+ * Common creation code. If timed is non-zero, the scheduled delivery
+ * timer file used by msgdeque_send_at is created too.
+ */
+static MSGCELL* create_deque(const char *name, uint permissions, ushort item_size, ushort nitems, int timed) {
 	MSGCELL* msgcellp;
 	MMA_HANDLE* mmahp;
 	MSGDEQUE* msgdqp;
+	MSGDEQUE_TIMER_HEADER* hdrp;
 	char* dequename;
 	char* dequedir;
 	char* lockfilepath;
+	char* timerpath;
+	char* spacename;
 	char lockfile[1024];
 	int dqnamelen;
 	int lflen;
@@ -137,10 +435,38 @@ MSGCELL* msgdeque_create(const char *name, uint permissions, ushort item_size, u
 	strcat(lockfilepath, lockfile);
 	msgdqp = (MSGDEQUE*)calloc(1, sizeof(MSGDEQUE));
 	msgdqp->deque = mmdq_create(dequename, item_size, nitems);
-	msgdqp->lock = mmapfile_create(lockfile, lockfilepath, 8, MMA_READ_WRITE, MMF_SHARED, permissions);
+	msgdqp->lock = mmapfile_create(lockfile, lockfilepath, sizeof(MSGDEQUE_STATS),
+			MMA_READ_WRITE, MMF_SHARED, permissions);
+	timerpath = make_timer_path(dequename);
+	if (timed) {
+		msgdqp->timer = mmapfile_create(TIMERSUFFIX, timerpath, timer_file_size(nitems, item_size),
+				MMA_READ_WRITE, MMF_SHARED, permissions);
+		if (msgdqp->timer != NULL) {
+			hdrp = (MSGDEQUE_TIMER_HEADER*)mma_data_pointer(msgdqp->timer);
+			memset(hdrp, 0, sizeof(MSGDEQUE_TIMER_HEADER));
+			hdrp->capacity = nitems;
+			hdrp->item_size = item_size;
+			timer_reset(hdrp);
+		}
+	} else {
+		// Don't let attach pick up a timer file left by a previous
+		// deque of the same name.
+		unlink(timerpath);
+	}
+	// The space semaphore starts at 0. Receivers post to it only
+	// when producers are parked on a full deque.
+	spacename = make_space_name(name);
+	msgdqp->spacesemp = sem_open(spacename, (O_RDWR | O_CREAT), permissions, 0);
+	if (SEM_FAILED == msgdqp->spacesemp) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Error creating space semaphore %s [%d / %s]",
+				spacename, errno, strerror(errno));
+		msgdqp->spacesemp = NULL;
+	}
 	msgcellp = msgcell_create(name, permissions, msgdqp, msgdeque_datacheck);
 	free(dequename);
 	free(lockfilepath);
+	free(timerpath);
+	free(spacename);
 	return msgcellp;
 }
 
@@ -158,7 +484,7 @@ MSGCELL* msgdeque_create(const char *name, uint permissions, ushort item_size, u
  * @return  pointer to the created MSGCELL structure.
  */
 MSGCELL* msgdeque_create_byte_stream(const char *name, uint permissions,  ushort byte_capacity) {
-	return msgdeque_create(name, permissions, sizeof(unsigned char), byte_capacity+4);
+	return create_deque(name, permissions, sizeof(unsigned char), byte_capacity+4, 0);
 }
 
 /**
@@ -172,6 +498,8 @@ MSGCELL* msgdeque_attach(const char *name) {
 	MSGCELL* msgcellp;
 	MSGDEQUE* msgdqp;
 	char* lockfilepath;
+	char* timerpath;
+	char* spacename;
 	char lockfile[1024];
 	int lflen;
 
@@ -187,12 +515,104 @@ MSGCELL* msgdeque_attach(const char *name) {
 	strcat(lockfilepath, lockfile);
 	msgdqp->deque = mmdq_open(dequename);
 	msgdqp->lock = mmapfile_open(lockfile, lockfilepath, MMA_READ_WRITE, MMF_SHARED);
+	// Only deques created with MSGDEQUE_FLAG_TIMED have a timer file
+	timerpath = make_timer_path(dequename);
+	if (0 == access(timerpath, F_OK)) {
+		msgdqp->timer = mmapfile_open(TIMERSUFFIX, timerpath, MMA_READ_WRITE, MMF_SHARED);
+	}
+	// Deques created before the space semaphore existed will not have
+	// one, so create it on attach if necessary.
+	spacename = make_space_name(name);
+	msgdqp->spacesemp = sem_open(spacename, (O_RDWR | O_CREAT), 0660, 0);
+	if (SEM_FAILED == msgdqp->spacesemp) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Error opening space semaphore %s [%d / %s]",
+				spacename, errno, strerror(errno));
+		msgdqp->spacesemp = NULL;
+	}
 	msgcellp = msgcell_attach(name, msgdqp, msgdeque_datacheck);
 	free(dequename);
 	free(lockfilepath);
+	free(timerpath);
+	free(spacename);
 	return msgcellp;
 }
 
+/**
+ * @brief Close a message deque. Unmaps the deque and lock files, closes
+ * the semaphores and releases the memory allocated by msgdeque_create
+ * or msgdeque_attach. The message deque files and semaphores are not
+ * removed (see msgdeque_delete).
+ *
+ * @param msgcellp pointer to a MSGCELL structure returned by create or attach functions.
+ * @return 0 on success, non-zero on failure
+ */
+int msgdeque_close(MSGCELL* msgcellp) {
+	MSGDEQUE* msgdqp;
+	int retval;
+
+	msgdqp = (MSGDEQUE*)msgcellp->datap;
+	if (msgdqp->deque != NULL) {
+		mmdq_close(msgdqp->deque);
+	}
+	if (msgdqp->lock != NULL) {
+		mmapfile_close(msgdqp->lock);
+	}
+	if (msgdqp->timer != NULL) {
+		mmapfile_close(msgdqp->timer);
+	}
+	if (msgdqp->spacesemp != NULL) {
+		sem_close(msgdqp->spacesemp);
+	}
+	retval = 0;
+	if (SEM_FAILED != msgcellp->semp) {
+		retval = msgcell_close(msgcellp);
+	}
+	free(msgdqp);
+	free(msgcellp);
+	return retval;
+}
+
+/**
+ * @brief Delete a message deque. Removes the deque, lock and timer
+ * files and unlinks both semaphores, then closes the message deque
+ * as msgdeque_close does. Processes still attached keep their
+ * mappings, but the name can be created afresh.
+ *
+ * @param msgcellp pointer to a MSGCELL structure returned by create or attach functions.
+ * @return 0 on success, non-zero on failure
+ */
+int msgdeque_delete(MSGCELL* msgcellp) {
+	MSGDEQUE* msgdqp;
+	MMA_HANDLE* handles[3];
+	char* spacename;
+	int retval = 0;
+	int i;
+
+	msgdqp = (MSGDEQUE*)msgcellp->datap;
+	handles[0] = msgdqp->deque;
+	handles[1] = msgdqp->lock;
+	handles[2] = msgdqp->timer;
+	for (i = 0; i < 3; i++) {
+		if ((handles[i] != NULL) && unlink(mma_get_disk_file_path(handles[i])) &&
+			(errno != ENOENT)) {
+			msgcellp->errcode = errno;
+			retval = 1;
+		}
+	}
+	if (msgcell_delete(msgcellp) && (errno != ENOENT)) {
+		msgcellp->errcode = errno;
+		retval = 1;
+	}
+	spacename = make_space_name(msgcellp->name);
+	if (sem_unlink(spacename) && (errno != ENOENT)) {
+		msgcellp->errcode = errno;
+		retval = 1;
+	}
+	free(spacename);
+	retval |= msgdeque_close(msgcellp);
+	return retval;
+}
+
 /**
  * @brief Reset a message deque to the empty state and clear
  * the sempahore.
@@ -204,8 +624,18 @@ MSGCELL* msgdeque_attach(const char *name) {
  */
 int msgdeque_reset(MSGCELL* msgcellp) {
 	int retval;
-	// Reset the deque
-	mmdq_reset((MMA_HANDLE*)msgcellp->datap);
+	MSGDEQUE* msgdqp;
+
+	msgdqp = (MSGDEQUE*)msgcellp->datap;
+	// Reset the deque, drop scheduled messages and wake any
+	// parked producers
+	mma_lock_atom_write(msgdqp->lock);
+	mmdq_reset(msgdqp->deque);
+	if (msgdqp->timer != NULL) {
+		timer_reset((MSGDEQUE_TIMER_HEADER*)mma_data_pointer(msgdqp->timer));
+	}
+	signal_space(msgdqp);
+	mma_unlock_atom(msgdqp->lock);
 	// Reset the message cell
 	retval = msgcell_reset(msgcellp);
 	return retval;
@@ -265,6 +695,166 @@ int msgdeque_send(MSGCELL* msgcellp, void* sendp) {
 	return retval;
 }
 
+/**
+ * Send a fixed length record, waiting for space if the deque is full.
+ * Unlike msgdeque_send, a full deque does not cause an immediate failure.
+ * The caller is parked on the message deque's "space available"
+ * semaphore until a receiver removes an item or the timeout expires.
+ *
+ * Time spent parked is accumulated in the message deque statistics
+ * (see msgdeque_stats).
+ *
+ * @param msgcellp  pointer to the message cell
+ * @param sendp  void pointer to the record to be sent
+ * @param timeout  absolute CLOCK_REALTIME deadline as for sem_timedwait(3).
+ * 	If NULL, the call blocks until space is available.
+ * @return  0 on success, non-zero on failure. If the deadline passed
+ * 	before space became available, msgcellp->errcode is ETIMEDOUT and
+ * 	the data pointed to by sendp was not inserted.
+ */
+int msgdeque_send_wait(MSGCELL* msgcellp, void* sendp, const struct timespec* timeout) {
+	MSGDEQUE* msgdqp;
+	MSGDEQUE_STATS* statsp;
+	struct timespec t0;
+	struct timespec t1;
+	int retval = 0;
+	int sent = 0;
+	int waited = 0;
+	int semstat;
+
+	msgdqp = (MSGDEQUE*)msgcellp->datap;
+	statsp = (MSGDEQUE_STATS*)mma_data_pointer(msgdqp->lock);
+
+	while ((!sent) && (0 == retval)) {
+		// Try the insertion and register as a waiter in one locked
+		// operation, so a receiver cannot miss us.
+		mma_lock_atom_write(msgdqp->lock);
+		if (0 == mmdq_abd(msgdqp->deque, sendp)) {
+			sent = 1;
+			drain_space(msgdqp);
+		} else {
+			statsp->waiting_producers++;
+			if (!waited) {
+				statsp->send_waits++;
+			}
+		}
+		mma_unlock_atom(msgdqp->lock);
+		if (sent) {
+			break;
+		}
+		if (NULL == msgdqp->spacesemp) {
+			// No way to be notified ... behave like msgdeque_send
+			mma_lock_atom_write(msgdqp->lock);
+			statsp->waiting_producers--;
+			mma_unlock_atom(msgdqp->lock);
+			msgcellp->errcode = ENOSPC;
+			retval = 1;
+			break;
+		}
+		if (!waited) {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			waited = 1;
+		}
+		if (NULL == timeout) {
+			semstat = sem_wait(msgdqp->spacesemp);
+		} else {
+			semstat = sem_timedwait(msgdqp->spacesemp, timeout);
+		}
+		if ((semstat != 0) && (errno != EINTR)) {
+			msgcellp->errcode = errno;
+			retval = 1;
+		}
+		mma_lock_atom_write(msgdqp->lock);
+		statsp->waiting_producers--;
+		if (retval && (ETIMEDOUT == msgcellp->errcode)) {
+			statsp->send_timeouts++;
+		}
+		mma_unlock_atom(msgdqp->lock);
+	}
+	if (waited) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		mma_lock_atom_write(msgdqp->lock);
+		statsp->blocked_nsecs += elapsed_nsecs(&t0, &t1);
+		mma_unlock_atom(msgdqp->lock);
+	}
+	if (sent) {
+		msgcell_send(msgcellp);
+	}
+	return retval;
+}
+
+/**
+ * @brief Send a fixed length record for delivery at a later time.
+ *
+ * The record is held in the deque's timer file and only becomes
+ * visible to receivers (msgdeque_rec, msgdeque_rec_batch) once
+ * deliver_at has passed. Records due at the same time are delivered
+ * in the order they were sent. Receivers with nothing to do sleep
+ * until the next record is due rather than polling.
+ *
+ * @param msgcellp  pointer to the message cell
+ * @param sendp  void pointer to the record to be sent
+ * @param deliver_at  absolute CLOCK_REALTIME delivery time. A time
+ * 	in the past sends immediately, as msgdeque_send does.
+ * @return  0 on success. Non-zero if the record could not be
+ * 	scheduled, in which case msgcellp->errcode is set: ENOSPC if the
+ * 	timer file is full, EINVAL if the deque has no timer file (it was
+ * 	not created with MSGDEQUE_FLAG_TIMED).
+ */
+int msgdeque_send_at(MSGCELL* msgcellp, void* sendp, const struct timespec* deliver_at) {
+	MSGDEQUE* msgdqp;
+	MSGDEQUE_TIMER_HEADER* hdrp;
+	struct timespec now;
+	int earliest = 0;
+	int retval = 0;
+
+	msgdqp = (MSGDEQUE*)msgcellp->datap;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (!ts_before(&now, deliver_at)) {
+		return msgdeque_send(msgcellp, sendp);
+	}
+	if (NULL == msgdqp->timer) {
+		msgcellp->errcode = EINVAL;
+		return 1;
+	}
+	mma_lock_atom_write(msgdqp->lock);
+	hdrp = (MSGDEQUE_TIMER_HEADER*)mma_data_pointer(msgdqp->timer);
+	if (hdrp->count >= hdrp->capacity) {
+		msgcellp->errcode = ENOSPC;
+		retval = 1;
+	} else {
+		earliest = timer_push(hdrp, sendp, deliver_at);
+	}
+	mma_unlock_atom(msgdqp->lock);
+
+	// A receiver may be sleeping until a later due time. Wake one
+	// so it recalculates its deadline.
+	if (earliest) {
+		sem_post(msgcellp->semp);
+	}
+	return retval;
+}
+
+/**
+ * @brief Number of records scheduled with msgdeque_send_at that
+ * have not yet been delivered to the deque.
+ *
+ * @param msgcellp  pointer to the message cell
+ * @return  Count of scheduled records. 0 if the deque has no timer file.
+ */
+int msgdeque_scheduled(MSGCELL* msgcellp) {
+	MSGDEQUE* msgdqp;
+	int count = 0;
+
+	msgdqp = (MSGDEQUE*)msgcellp->datap;
+	if (msgdqp->timer != NULL) {
+		mma_lock_atom_read(msgdqp->lock);
+		count = ((MSGDEQUE_TIMER_HEADER*)mma_data_pointer(msgdqp->timer))->count;
+		mma_unlock_atom(msgdqp->lock);
+	}
+	return count;
+}
+
 /**
  * Receive a fixed length record. Size was defined when
  * the deque was created (see msgdeque_create). The
@@ -282,6 +872,8 @@ void* msgdeque_rec(MSGCELL* msgcellp) {
 	DQSTATS dqstats;
 	DQSTATS* dqstatsp = NULL;
 	size_t recordlen = 0;
+	struct timespec due;
+	int scheduled = 0;
 
 	deque = ((MSGDEQUE*)msgcellp->datap)->deque;
 	lock = ((MSGDEQUE*)msgcellp->datap)->lock;
@@ -291,6 +883,7 @@ void* msgdeque_rec(MSGCELL* msgcellp) {
 		// current dequeue stats
 
 		mma_lock_atom_write(lock);
+		scheduled = promote_due(msgcellp, &due);
 		dqstatsp = mmdq_stats(deque, &dqstats);
 		if (dqstatsp->dquse != 0) {
 			// We have data
@@ -302,6 +895,8 @@ void* msgdeque_rec(MSGCELL* msgcellp) {
 				free(rec);
 				rec = NULL;
 				ULPPK_LOG(ULPPK_LOG_ERROR, "Error retrieving from message deque: %s", msgcellp->name);
+			} else {
+				signal_space((MSGDEQUE*)msgcellp->datap);
 			}
 		}
 		// Unlock access to the message deque
@@ -309,8 +904,9 @@ void* msgdeque_rec(MSGCELL* msgcellp) {
 
 		// If we still don't have a record
 		if (NULL == rec) {
-			// Wait for a signal on the message cell.
-			retval = msgcell_rec(msgcellp);
+			// Wait for a signal on the message cell, or until the
+			// next scheduled message is due.
+			retval = wait_for_data(msgcellp, NULL, scheduled ? &due : NULL);
 			if (retval) {
 				ULPPK_LOG(ULPPK_LOG_ERROR, "Error receiving on message cell [%d / %s",
 						msgcellp->errcode, strerror(msgcellp->errcode));
@@ -320,6 +916,56 @@ void* msgdeque_rec(MSGCELL* msgcellp) {
 	return rec;
 }
 
+/**
+ * Receive up to maxrecs fixed length records in one locked operation.
+ * Records are copied back to back into the caller's buffer, which must
+ * hold maxrecs items of the size defined when the deque was created
+ * (see msgdeque_create). The function blocks until at least one record
+ * is available or the timeout expires.
+ *
+ * @param msgcellp  pointer to the message cell
+ * @param recs  pointer to a buffer of at least maxrecs records
+ * @param maxrecs  maximum number of records to receive
+ * @param timeout  absolute CLOCK_REALTIME deadline as for sem_timedwait(3).
+ * 	If NULL, the call blocks until a record is available.
+ * @return Number of records received. 0 indicates a timeout or error,
+ * 	in which case msgcellp->errcode is set (ETIMEDOUT on timeout).
+ */
+int msgdeque_rec_batch(MSGCELL* msgcellp, void* recs, int maxrecs, const struct timespec* timeout) {
+	MMA_HANDLE* deque;
+	MMA_HANDLE* lock;
+	DQSTATS dqstats;
+	DQSTATS* dqstatsp = NULL;
+	unsigned char* recp;
+	struct timespec due;
+	int scheduled = 0;
+	int count = 0;
+	int retval = 0;
+
+	deque = ((MSGDEQUE*)msgcellp->datap)->deque;
+	lock = ((MSGDEQUE*)msgcellp->datap)->lock;
+
+	while ((0 == count) && (0 == retval)) {
+		mma_lock_atom_write(lock);
+		scheduled = promote_due(msgcellp, &due);
+		dqstatsp = mmdq_stats(deque, &dqstats);
+		recp = (unsigned char*)recs;
+		while ((count < maxrecs) && (0 == mmdq_rtd(deque, recp))) {
+			count++;
+			recp += dqstatsp->dqitem_size;
+		}
+		if (count > 0) {
+			signal_space((MSGDEQUE*)msgcellp->datap);
+		}
+		mma_unlock_atom(lock);
+
+		if (0 == count) {
+			retval = wait_for_data(msgcellp, timeout, scheduled ? &due : NULL);
+		}
+	}
+	return count;
+}
+
 /**
  * Send to a byte stream deque. .A byte stream dequeue was created by calling
  * msgdeque_create_byte_stream.
@@ -330,13 +976,16 @@ void* msgdeque_rec(MSGCELL* msgcellp) {
  * @param msgcellp  pointer to the message cell
  * @param pdata  pointer to the bytes to be send
  * @param datalen  number of bytes to send
- * @return  0 on success, non-zero on failure.
+ * @return  0 on success, non-zero on failure. If the deque lacks room
+ * 	for the whole message nothing is sent.
  */
 int msgdeque_send_byte_stream(MSGCELL* msgcellp, void* pdata, size_t datalen) {
 	unsigned char lenbuff[4];
 	unsigned char* pbyte;
 	MMA_HANDLE* lock;
 	MMA_HANDLE* deque;
+	DQSTATS dqstats;
+	DQSTATS* dqstatsp = NULL;
 	int i;
 	int retval = 0;
 
@@ -345,6 +994,12 @@ int msgdeque_send_byte_stream(MSGCELL* msgcellp, void* pdata, size_t datalen) {
 	lock = ((MSGDEQUE*)msgcellp->datap)->lock;
 	deque = ((MSGDEQUE*)msgcellp->datap)->deque;
 	mma_lock_atom_write(lock);
+	// Refuse the whole message rather than leave a partial one
+	// in the deque.
+	dqstatsp = mmdq_stats(deque, &dqstats);
+	if ((size_t)(dqstatsp->dqslots - dqstatsp->dquse) < (datalen + sizeof(lenbuff))) {
+		retval = 1;
+	}
 	// Push the 4 bytes of encoded size onto the deque
 	for (i = 0; ((i < sizeof(lenbuff)) && (retval ==0)); i++, pbyte++) {
 		retval = mmdq_abd(deque, pbyte);
@@ -419,6 +1074,7 @@ void* msgdeque_rec_byte_stream(MSGCELL* msgcellp, size_t* bytes_received) {
 						ULPPK_LOG(ULPPK_LOG_ERROR, "Error popping encoded size of byte stream deque %s", msgcellp->name);
 					}
 				}
+				signal_space((MSGDEQUE*)msgcellp->datap);
 			}
 		}
 		mma_unlock_atom(lock);
@@ -435,3 +1091,128 @@ void* msgdeque_rec_byte_stream(MSGCELL* msgcellp, size_t* bytes_received) {
 	}
 	return databuffp;
 }
+
+/**
+ * @brief Create a buffer reference message deque.
+ *
+ * A buffer reference deque carries large messages by reference. The
+ * sender obtains a buffer from an mmpool pool (mmpool_getbuff), writes
+ * the payload in place and sends only the buffer's BPOOL_INDEX with
+ * msgdeque_send_buff. The receiver maps the index back to the buffer
+ * with msgdeque_rec_buff and returns it to the pool with mmpool_putbuff
+ * when done. The payload is never copied through the deque.
+ *
+ * To fan one buffer out to several consumers, the sender takes a
+ * reference per consumer (mmpool_buff_ref) before sending the buffer to
+ * each consumer's deque, then drops its own (mmpool_buff_unref). Each
+ * consumer drops its reference with mmpool_buff_unref instead of
+ * mmpool_putbuff, and the last one returns the buffer to the pool.
+ *
+ * A chain of buffers (mmpool_getchain) is sent by its head buffer and
+ * returned with mmpool_putchain.
+ *
+ * Sender and receiver must both have the pool open (mmpool_open).
+ * Any framing of the payload (e.g. its length) is up to the application.
+ *
+ * @param name  name of the dequeue
+ * @param permissions  access permissions (see open(2)
+ * @param nitems  maximum number of buffer references held by the deque
+ * @return  pointer to the created MSGCELL structure.
+ */
+MSGCELL* msgdeque_create_buffref(const char *name, uint permissions, ushort nitems) {
+	// Buffer references are never scheduled: no timer file
+	return msgdeque_create_flags(name, permissions, sizeof(BPOOL_INDEX), nitems, 0);
+}
+
+/**
+ * @brief Send a pool buffer by reference.
+ *
+ * On success, ownership of the buffer passes to the receiver, who is
+ * responsible for returning it to the pool. On failure the caller still
+ * owns the buffer. While in the deque the buffer has no owner process
+ * (see mmpool_reclaim), so it survives the sender's exit.
+ *
+ * @param msgcellp  pointer to the message cell of a buffer reference deque
+ * @param buff_refp  buffer obtained from mmpool_getbuff
+ * @return  0 on success, non-zero if deque is full.
+ */
+int msgdeque_send_buff(MSGCELL* msgcellp, BPCF_BUFFER_REF* buff_refp) {
+	BPOOL_INDEX bpx;
+	pid_t owner_pid;
+	int status;
+
+	bpx = mmpool_refp2buffx(buff_refp);
+	// Give up ownership first: the receiver may take it before we return
+	owner_pid = buff_refp->owner_pid;
+	mmpool_buff_set_owner(buff_refp, 0);
+	status = msgdeque_send(msgcellp, &bpx);
+	if (status) {
+		mmpool_buff_set_owner(buff_refp, owner_pid);
+	}
+	return status;
+}
+
+/**
+ * @brief Receive a pool buffer by reference.
+ *
+ * Blocks until a buffer reference is available. The returned buffer
+ * belongs to the caller, who must return it with mmpool_putbuff, or
+ * mmpool_buff_unref if the sender fanned it out to several consumers.
+ *
+ * @param msgcellp  pointer to the message cell of a buffer reference deque
+ * @param bphp  handle of the pool the sender allocated from
+ * @return  Pointer to the buffer reference. NULL on error, in which case
+ * 	msgcellp->errcode is set. EINVAL indicates a received index that
+ * 	does not belong to the pool.
+ */
+BPCF_BUFFER_REF* msgdeque_rec_buff(MSGCELL* msgcellp, BPOOL_HANDLE* bphp) {
+	BPOOL_INDEX bpx;
+	BPCF_BUFFER_REF* buff_refp;
+
+	if (msgdeque_rec_batch(msgcellp, &bpx, 1, NULL) != 1) {
+		return NULL;
+	}
+	if (bpx >= mmpool_getstats(bphp)->capacity) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Buffer index %lu out of range for pool %s on message deque %s",
+				(unsigned long)bpx, bphp->pool_name, msgcellp->name);
+		msgcellp->errcode = EINVAL;
+		return NULL;
+	}
+	buff_refp = mmpool_buffx2refp(bphp, bpx);
+	if (buff_refp->bpindex != bpx) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Corrupt buffer %lu in pool %s on message deque %s",
+				(unsigned long)bpx, bphp->pool_name, msgcellp->name);
+		msgcellp->errcode = EINVAL;
+		return NULL;
+	}
+	// Take ownership unless the buffer is shared with other consumers
+	if (1 == buff_refp->refcount) {
+		mmpool_buff_set_owner(buff_refp, getpid());
+	}
+	return buff_refp;
+}
+
+/**
+ * @brief Retrieve message deque statistics.
+ *
+ * The statistics are shared by all processes attached to the
+ * message deque.
+ *
+ * @param msgcellp  pointer to the message cell
+ * @param statsp  Pointer to a MSGDEQUE_STATS structure to receive the
+ * 	statistics. If NULL, memory is allocated from the heap and MUST be
+ * 	freed by the caller.
+ * @return Pointer to the MSGDEQUE_STATS structure.
+ */
+MSGDEQUE_STATS* msgdeque_stats(MSGCELL* msgcellp, MSGDEQUE_STATS* statsp) {
+	MMA_HANDLE* lock;
+
+	if (NULL == statsp) {
+		statsp = (MSGDEQUE_STATS*)malloc(sizeof(MSGDEQUE_STATS));
+	}
+	lock = ((MSGDEQUE*)msgcellp->datap)->lock;
+	mma_lock_atom_read(lock);
+	memcpy(statsp, mma_data_pointer(lock), sizeof(MSGDEQUE_STATS));
+	mma_unlock_atom(lock);
+	return statsp;
+}
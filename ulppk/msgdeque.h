@@ -46,10 +46,14 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 #define MSGDEQUE_H_
 
 #include <sys/types.h>
+#include <time.h>
 
 #include <mmdeque.h>
 #include <mmapfile.h>
 #include <msgcell.h>
+#include <mmpool.h>
+
+#define MSGDEQUE_FLAG_TIMED 0x0001	///< Create the timer file used by msgdeque_send_at
 
 /**
  * @brief Message deque structure definition.
@@ -61,17 +65,73 @@ X-Comment: On Debian systems, the complete text of the GNU General Public
 typedef struct _MSGDEQUE {
 	MMA_HANDLE* deque;			///< Memory mapped atom handle of the memory mapped deque
 	MMA_HANDLE* lock;			///< Memory mapped atom handle of the memory mapped lock file
+	sem_t* spacesemp;			///< "Space available" semaphore posted by receivers
+	MMA_HANDLE* timer;			///< Memory mapped atom handle of the scheduled delivery file (or NULL)
 } MSGDEQUE;
 
+/**
+ * @brief Scheduled delivery timer file header.
+ *
+ * The timer file holds messages sent with msgdeque_send_at that are
+ * not yet due. It is laid out as this header, followed by a binary
+ * min-heap of capacity MSGDEQUE_TIMER_ENTRY structures ordered by due
+ * time, a stack of capacity free slot numbers and capacity item slots
+ * of item_size bytes. It is only accessed while the lock file is write
+ * locked.
+ */
+typedef struct _MSGDEQUE_TIMER_HEADER {
+	unsigned int capacity;			///< Max number of scheduled messages
+	unsigned int count;				///< Number of scheduled messages
+	unsigned int item_size;			///< Size of a message in bytes
+	unsigned int spare;				///< keep alignment nice
+	unsigned long long next_seq;	///< Sequence number of the next scheduled message
+} MSGDEQUE_TIMER_HEADER;
+
+/**
+ * @brief Scheduled delivery heap entry.
+ */
+typedef struct _MSGDEQUE_TIMER_ENTRY {
+	struct timespec due;			///< CLOCK_REALTIME delivery time
+	unsigned long long seq;			///< Keeps messages due at the same time in FIFO order
+	unsigned int slot;				///< Item slot holding the message
+	unsigned int spare;				///< keep alignment nice
+} MSGDEQUE_TIMER_ENTRY;
+
+/**
+ * @brief Message deque statistics.
+ *
+ * This structure is the content of the memory mapped lock file, so
+ * it is shared by all processes attached to the message deque. It is
+ * only modified while the lock file is write locked.
+ */
+typedef struct _MSGDEQUE_STATS {
+	unsigned int waiting_producers;		///< Producers currently parked on a full deque
+	unsigned long send_waits;			///< Number of times a producer blocked on a full deque
+	unsigned long send_timeouts;		///< Number of blocked sends that timed out
+	unsigned long long blocked_nsecs;	///< Total time producers spent blocked (nanoseconds)
+} MSGDEQUE_STATS;
+
 MSGCELL* msgdeque_create(const char*name, uint permissions, ushort item_size, ushort nitems);
+MSGCELL* msgdeque_create_flags(const char*name, uint permissions, ushort item_size, ushort nitems,
+		unsigned int flags);
 MSGCELL* msgdeque_create_byte_stream(const char*name, uint permissions,ushort byte_capacity);
 MSGCELL* msgdeque_attach(const char *name);
+int msgdeque_close(MSGCELL* msgcellp);
+int msgdeque_delete(MSGCELL* msgcellp);
 int msgdeque_datacheck(void* datap);
 int msgdeque_reset(MSGCELL* msgcellp);
-int msgdeque_send(MSGCELL* msgcellp, void* sendp);;
+int msgdeque_send(MSGCELL* msgcellp, void* sendp);
+int msgdeque_send_wait(MSGCELL* msgcellp, void* sendp, const struct timespec* timeout);
+int msgdeque_send_at(MSGCELL* msgcellp, void* sendp, const struct timespec* deliver_at);
+int msgdeque_scheduled(MSGCELL* msgcellp);
 void* msgdeque_rec(MSGCELL* msgcellp);
+int msgdeque_rec_batch(MSGCELL* msgcellp, void* recs, int maxrecs, const struct timespec* timeout);
 int msgdeque_send_byte_stream(MSGCELL* msgcellp, void* pdata, size_t datalen);
 void* msgdeque_rec_byte_stream(MSGCELL* msgcellp, size_t* bytes_received);
+MSGCELL* msgdeque_create_buffref(const char* name, uint permissions, ushort nitems);
+int msgdeque_send_buff(MSGCELL* msgcellp, BPCF_BUFFER_REF* buff_refp);
+BPCF_BUFFER_REF* msgdeque_rec_buff(MSGCELL* msgcellp, BPOOL_HANDLE* bphp);
+MSGDEQUE_STATS* msgdeque_stats(MSGCELL* msgcellp, MSGDEQUE_STATS* statsp);
 
 
 #endif /* MSGDEQUE_H_ */
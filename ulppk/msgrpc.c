@@ -0,0 +1,522 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file msgrpc.c
+ *
+ * @brief Request/Reply (RPC) Facility over Message Deques
+ *
+ * A server creates a single request message deque. Each client creates
+ * its own reply message deque, named after the server and the client's
+ * process ID (<server>-reply-<pid>). Requests and replies are fixed length
+ * items consisting of a MSGRPC_HEADER followed by payload bytes. Both
+ * deques use the same item size, which is fixed by the server.
+ *
+ * Clients tag each request with a correlation ID. Up to "window" requests
+ * may be outstanding at once (pipelining). Replies are matched to
+ * requests by correlation ID, so they may be collected in any order by
+ * msgrpc_wait. A call that times out is abandoned and its late reply, if
+ * any, is discarded.
+ *
+ * The server receives requests in batches (see msgdeque_rec_batch), calls
+ * an application handler for each, and posts the replies to the clients'
+ * reply deques. Reply deques are attached on first use and cached by
+ * client process ID, up to MSGRPC_MAX_ROUTES of them; the oldest is
+ * dropped to make room. A cached reply deque that has since been
+ * deleted (its client closed) is attached afresh, and one that refuses
+ * a reply is dropped, so a reused process ID is looked up again.
+ *
+ * Closing a client deletes its reply deque; closing the server deletes
+ * the request deque.
+ *
+ * Only one client per server per process is supported, since reply
+ * deques are identified by process ID.
+ *
+ * See the msgrpcbench utility for a latency comparison with local TCP.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <msgrpc.h>
+#include <ulppk_log.h>
+
+static char* make_reply_name(char* buff, const char* server_name, pid_t pid) {
+	snprintf(buff, MAX_MSGCELL_NAME, "%s-reply-%d", server_name, (int)pid);
+	return buff;
+}
+
+/*
+ * Return the deque handle of a message deque, NULL if the
+ * message deque could not be created or attached.
+ */
+static MMA_HANDLE* cell_deque(MSGCELL* msgcellp) {
+	if ((NULL == msgcellp) || (NULL == msgcellp->datap)) {
+		return NULL;
+	}
+	return ((MSGDEQUE*)msgcellp->datap)->deque;
+}
+
+/*
+ * Close a cached reply deque and remove its route.
+ */
+static void drop_route(MSGRPC_SERVER* serverp, int x) {
+	msgdeque_close(serverp->routes[x].reply);
+	serverp->nroutes--;
+	memmove(&serverp->routes[x], &serverp->routes[x + 1],
+			(serverp->nroutes - x) * sizeof(MSGRPC_ROUTE));
+}
+
+/*
+ * Return 1 if the file behind a cached reply deque has been deleted,
+ * i.e. its client closed, and perhaps a new one opened under the name.
+ */
+static int route_deleted(MSGCELL* replyp) {
+	struct stat statbuf;
+
+	return (fstat(cell_deque(replyp)->mm_ref.filedes, &statbuf) != 0) || (0 == statbuf.st_nlink);
+}
+
+/*
+ * Find the reply deque for a client process. Attaches the reply
+ * deque and caches it if this is the first request from the client,
+ * or if the cached one has been deleted. Returns the route's index,
+ * -1 if the reply deque could not be attached.
+ */
+static int find_route(MSGRPC_SERVER* serverp, pid_t pid) {
+	char reply_name[MAX_MSGCELL_NAME];
+	MSGCELL* replyp;
+	int i;
+
+	for (i = 0; i < serverp->nroutes; i++) {
+		if (serverp->routes[i].client_pid == pid) {
+			if (!route_deleted(serverp->routes[i].reply)) {
+				return i;
+			}
+			drop_route(serverp, i);
+			break;
+		}
+	}
+	make_reply_name(reply_name, serverp->name, pid);
+	replyp = msgdeque_attach(reply_name);
+	if ((NULL == cell_deque(replyp)) || (SEM_FAILED == replyp->semp)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Unable to attach reply deque %s", reply_name);
+		msgdeque_close(replyp);
+		return -1;
+	}
+	if (MSGRPC_MAX_ROUTES == serverp->nroutes) {
+		drop_route(serverp, 0);
+	}
+	serverp->routes[serverp->nroutes].client_pid = pid;
+	serverp->routes[serverp->nroutes].reply = replyp;
+	return serverp->nroutes++;
+}
+
+/**
+ * @brief Create an RPC server. This creates the request message deque.
+ *
+ * @param name  name of the server (and of its request deque)
+ * @param permissions  access permissions (see open(2))
+ * @param max_payload  maximum request/reply payload size in bytes
+ * @param nitems  capacity of the request deque
+ * @param max_batch  maximum number of requests handled per call
+ * 	to msgrpc_server_dispatch
+ * @return  pointer to a MSGRPC_SERVER structure, NULL on failure.
+ */
+MSGRPC_SERVER* msgrpc_server_create(const char* name, uint permissions, ushort max_payload,
+		ushort nitems, ushort max_batch) {
+	MSGRPC_SERVER* serverp;
+
+	if (max_batch == 0) {
+		max_batch = 1;
+	}
+	serverp = (MSGRPC_SERVER*)calloc(1, sizeof(MSGRPC_SERVER));
+	strncpy(serverp->name, name, sizeof(serverp->name) - 1);
+	serverp->item_size = sizeof(MSGRPC_HEADER) + max_payload;
+	serverp->max_batch = max_batch;
+	// Requests are never scheduled: no timer file
+	serverp->request = msgdeque_create_flags(name, permissions, serverp->item_size, nitems, 0);
+	if ((NULL == cell_deque(serverp->request)) || (serverp->request->errcode != 0)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Unable to create request deque %s", name);
+		msgdeque_close(serverp->request);
+		free(serverp);
+		return NULL;
+	}
+	serverp->batchp = calloc(max_batch, serverp->item_size);
+	serverp->replyp = calloc(1, serverp->item_size);
+	serverp->routes = (MSGRPC_ROUTE*)calloc(MSGRPC_MAX_ROUTES, sizeof(MSGRPC_ROUTE));
+	return serverp;
+}
+
+/**
+ * @brief Receive a batch of requests and dispatch them to a handler.
+ *
+ * Blocks until at least one request is available or the timeout expires.
+ * Then up to max_batch requests are removed from the request deque in one
+ * locked operation, the handler is called for each, and each reply is
+ * posted to the requesting client's reply deque.
+ *
+ * Replies are posted without blocking. A reply that cannot be delivered
+ * (client gone, reply deque full) is counted in serverp->dropped, and
+ * the client's cached reply deque is dropped.
+ *
+ * @param serverp  pointer to the server handle
+ * @param handlerp  request handler
+ * @param ctxp  application context passed to the handler
+ * @param timeout  absolute CLOCK_REALTIME deadline, or NULL to wait forever.
+ * @return number of requests dispatched, 0 on timeout, -1 on error
+ * 	(serverp->errcode is set).
+ */
+int msgrpc_server_dispatch(MSGRPC_SERVER* serverp, MSGRPC_HANDLER* handlerp, void* ctxp,
+		const struct timespec* timeout) {
+	MSGRPC_HEADER* reqhp;
+	MSGRPC_HEADER* replyhp;
+	size_t max_payload;
+	int routex;
+	size_t replylen;
+	int nreqs;
+	int i;
+
+	nreqs = msgdeque_rec_batch(serverp->request, serverp->batchp, serverp->max_batch, timeout);
+	if (0 == nreqs) {
+		serverp->errcode = serverp->request->errcode;
+		return (ETIMEDOUT == serverp->errcode) ? 0 : -1;
+	}
+	max_payload = serverp->item_size - sizeof(MSGRPC_HEADER);
+	replyhp = (MSGRPC_HEADER*)serverp->replyp;
+	for (i = 0; i < nreqs; i++) {
+		reqhp = (MSGRPC_HEADER*)(serverp->batchp + (i * serverp->item_size));
+		memset(replyhp, 0, sizeof(MSGRPC_HEADER));
+		replylen = max_payload;
+		replyhp->status = (*handlerp)(ctxp, (void*)(reqhp + 1), reqhp->datalen,
+				(void*)(replyhp + 1), &replylen);
+		if (replylen > max_payload) {
+			replylen = max_payload;
+		}
+		replyhp->corr_id = reqhp->corr_id;
+		replyhp->client_pid = reqhp->client_pid;
+		replyhp->datalen = (unsigned short)replylen;
+		serverp->dispatched++;
+
+		routex = find_route(serverp, reqhp->client_pid);
+		if ((routex < 0) || msgdeque_send(serverp->routes[routex].reply, replyhp)) {
+			if (routex >= 0) {
+				drop_route(serverp, routex);
+			}
+			serverp->dropped++;
+			ULPPK_LOG(ULPPK_LOG_WARN, "Reply %u to client %d dropped", reqhp->corr_id,
+					(int)reqhp->client_pid);
+		}
+	}
+	return nreqs;
+}
+
+/**
+ * @brief Close an RPC server and any cached client reply deques, and
+ * delete the request deque.
+ *
+ * @param serverp  pointer to the server handle
+ * @return 0 on success, non-zero on failure.
+ */
+int msgrpc_server_close(MSGRPC_SERVER* serverp) {
+	int retval;
+	int i;
+
+	for (i = 0; i < serverp->nroutes; i++) {
+		msgdeque_close(serverp->routes[i].reply);
+	}
+	retval = msgdeque_delete(serverp->request);
+	free(serverp->routes);
+	free(serverp->batchp);
+	free(serverp->replyp);
+	free(serverp);
+	return retval;
+}
+
+/**
+ * @brief Open an RPC client. Attaches the server's request deque and
+ * creates this process's reply deque.
+ *
+ * @param server_name  name of the server
+ * @param window  maximum number of outstanding (pipelined) requests
+ * @return pointer to a MSGRPC_CLIENT structure, NULL on failure.
+ */
+MSGRPC_CLIENT* msgrpc_client_open(const char* server_name, ushort window) {
+	MSGRPC_CLIENT* clientp;
+	DQSTATS dqstats;
+	int i;
+
+	if (window == 0) {
+		window = 1;
+	}
+	clientp = (MSGRPC_CLIENT*)calloc(1, sizeof(MSGRPC_CLIENT));
+	strncpy(clientp->server_name, server_name, sizeof(clientp->server_name) - 1);
+	make_reply_name(clientp->reply_name, server_name, getpid());
+	clientp->request = msgdeque_attach(server_name);
+	if (NULL == cell_deque(clientp->request)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Unable to attach request deque %s", server_name);
+		msgdeque_close(clientp->request);
+		free(clientp);
+		return NULL;
+	}
+	mmdq_stats(cell_deque(clientp->request), &dqstats);
+	clientp->item_size = dqstats.dqitem_size;
+	clientp->window = window;
+	clientp->next_corr_id = 1;
+
+	// Late replies to abandoned calls may still arrive, so allow
+	// some headroom beyond the window.
+	clientp->reply = msgdeque_create_flags(clientp->reply_name, 0660, clientp->item_size,
+			2 * window, 0);
+	if (NULL == cell_deque(clientp->reply)) {
+		ULPPK_LOG(ULPPK_LOG_ERROR, "Unable to create reply deque %s", clientp->reply_name);
+		msgdeque_close(clientp->reply);
+		msgdeque_close(clientp->request);
+		free(clientp);
+		return NULL;
+	}
+	clientp->slots = (MSGRPC_SLOT*)calloc(window, sizeof(MSGRPC_SLOT));
+	for (i = 0; i < window; i++) {
+		clientp->slots[i].itemp = calloc(1, clientp->item_size);
+	}
+	clientp->batchp = calloc(window, clientp->item_size);
+	return clientp;
+}
+
+/**
+ * @brief Maximum request or reply payload size in bytes.
+ *
+ * @param clientp  pointer to the client handle
+ * @return payload capacity of an RPC item.
+ */
+size_t msgrpc_max_payload(MSGRPC_CLIENT* clientp) {
+	return clientp->item_size - sizeof(MSGRPC_HEADER);
+}
+
+static MSGRPC_SLOT* find_slot(MSGRPC_CLIENT* clientp, unsigned int corr_id) {
+	int i;
+
+	for (i = 0; i < clientp->window; i++) {
+		if (clientp->slots[i].corr_id == corr_id) {
+			return &clientp->slots[i];
+		}
+	}
+	return NULL;
+}
+
+static void release_slot(MSGRPC_CLIENT* clientp, MSGRPC_SLOT* slotp) {
+	slotp->corr_id = 0;
+	slotp->replied = 0;
+	clientp->outstanding--;
+}
+
+/*
+ * Receive a batch of replies and file them in their slots. Replies
+ * with no matching outstanding request are discarded.
+ * Returns 0 on success, non-zero on timeout or error.
+ */
+static int receive_replies(MSGRPC_CLIENT* clientp, const struct timespec* timeout) {
+	MSGRPC_HEADER* replyhp;
+	MSGRPC_SLOT* slotp;
+	int nreplies;
+	int i;
+
+	nreplies = msgdeque_rec_batch(clientp->reply, clientp->batchp, clientp->window, timeout);
+	if (0 == nreplies) {
+		clientp->errcode = clientp->reply->errcode;
+		return 1;
+	}
+	for (i = 0; i < nreplies; i++) {
+		replyhp = (MSGRPC_HEADER*)(clientp->batchp + (i * clientp->item_size));
+		slotp = find_slot(clientp, replyhp->corr_id);
+		if ((NULL == slotp) || (slotp->replied)) {
+			ULPPK_LOG(ULPPK_LOG_DEBUG, "Discarding late reply %u", replyhp->corr_id);
+			continue;
+		}
+		memcpy(slotp->itemp, replyhp, clientp->item_size);
+		slotp->replied = 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Submit a request without waiting for the reply.
+ *
+ * If the window of outstanding requests is full, waits for a reply to
+ * arrive before submitting. Collect the reply with msgrpc_wait.
+ *
+ * @param clientp  pointer to the client handle
+ * @param reqp  pointer to the request payload
+ * @param reqlen  size of the request payload in bytes
+ * @param timeout  absolute CLOCK_REALTIME deadline, or NULL to wait forever.
+ * @return correlation ID of the request, 0 on failure (clientp->errcode
+ * 	is set. EBUSY means the window is full of uncollected replies).
+ */
+unsigned int msgrpc_submit(MSGRPC_CLIENT* clientp, void* reqp, size_t reqlen,
+		const struct timespec* timeout) {
+	MSGRPC_HEADER* reqhp;
+	MSGRPC_SLOT* slotp;
+	unsigned int corr_id;
+	int i;
+
+	if (reqlen > msgrpc_max_payload(clientp)) {
+		clientp->errcode = EMSGSIZE;
+		return 0;
+	}
+	while (clientp->outstanding == clientp->window) {
+		for (i = 0; (i < clientp->window) && clientp->slots[i].replied; i++);
+		if (i == clientp->window) {
+			clientp->errcode = EBUSY;
+			return 0;
+		}
+		if (receive_replies(clientp, timeout)) {
+			return 0;
+		}
+	}
+	slotp = find_slot(clientp, 0);
+
+	corr_id = clientp->next_corr_id++;
+	if (0 == clientp->next_corr_id) {
+		clientp->next_corr_id = 1;
+	}
+	// The slot's item buffer is free until the reply arrives, so
+	// build the request there.
+	reqhp = (MSGRPC_HEADER*)slotp->itemp;
+	memset(reqhp, 0, sizeof(MSGRPC_HEADER));
+	reqhp->corr_id = corr_id;
+	reqhp->client_pid = getpid();
+	reqhp->datalen = (unsigned short)reqlen;
+	memcpy(reqhp + 1, reqp, reqlen);
+	if (msgdeque_send_wait(clientp->request, reqhp, timeout)) {
+		clientp->errcode = clientp->request->errcode;
+		return 0;
+	}
+	slotp->corr_id = corr_id;
+	slotp->replied = 0;
+	clientp->outstanding++;
+	return corr_id;
+}
+
+/**
+ * @brief Wait for the reply to a submitted request.
+ *
+ * If the timeout expires the request is abandoned. Its reply, should
+ * it arrive later, is discarded.
+ *
+ * @param clientp  pointer to the client handle
+ * @param corr_id  correlation ID returned by msgrpc_submit
+ * @param replyp  buffer to receive the reply payload. May be NULL.
+ * @param replylenp  on input the size of replyp, on output the number
+ * 	of reply bytes copied. May be NULL if replyp is NULL.
+ * @param timeout  absolute CLOCK_REALTIME deadline, or NULL to wait forever.
+ * @return status returned by the server's handler, or -1 on failure
+ * 	(clientp->errcode is set).
+ */
+int msgrpc_wait(MSGRPC_CLIENT* clientp, unsigned int corr_id, void* replyp, size_t* replylenp,
+		const struct timespec* timeout) {
+	MSGRPC_HEADER* replyhp;
+	MSGRPC_SLOT* slotp;
+	size_t len;
+	int status;
+
+	slotp = (corr_id != 0) ? find_slot(clientp, corr_id) : NULL;
+	if (NULL == slotp) {
+		clientp->errcode = EINVAL;
+		return -1;
+	}
+	while (!slotp->replied) {
+		if (receive_replies(clientp, timeout)) {
+			if (ETIMEDOUT == clientp->errcode) {
+				release_slot(clientp, slotp);
+			}
+			return -1;
+		}
+	}
+	replyhp = (MSGRPC_HEADER*)slotp->itemp;
+	if (replyp != NULL) {
+		len = replyhp->datalen;
+		if (len > *replylenp) {
+			len = *replylenp;
+		}
+		memcpy(replyp, replyhp + 1, len);
+		*replylenp = len;
+	}
+	status = replyhp->status;
+	release_slot(clientp, slotp);
+	return status;
+}
+
+/**
+ * @brief Submit a request and wait for its reply.
+ *
+ * @param clientp  pointer to the client handle
+ * @param reqp  pointer to the request payload
+ * @param reqlen  size of the request payload in bytes
+ * @param replyp  buffer to receive the reply payload. May be NULL.
+ * @param replylenp  on input the size of replyp, on output the number
+ * 	of reply bytes copied. May be NULL if replyp is NULL.
+ * @param timeout  absolute CLOCK_REALTIME deadline covering both the
+ * 	submission and the reply, or NULL to wait forever.
+ * @return status returned by the server's handler, or -1 on failure
+ * 	(clientp->errcode is set).
+ */
+int msgrpc_call(MSGRPC_CLIENT* clientp, void* reqp, size_t reqlen, void* replyp, size_t* replylenp,
+		const struct timespec* timeout) {
+	unsigned int corr_id;
+
+	corr_id = msgrpc_submit(clientp, reqp, reqlen, timeout);
+	if (0 == corr_id) {
+		return -1;
+	}
+	return msgrpc_wait(clientp, corr_id, replyp, replylenp, timeout);
+}
+
+/**
+ * @brief Close an RPC client. Outstanding requests are abandoned and
+ * the client's reply deque (files and semaphores) is deleted.
+ *
+ * @param clientp  pointer to the client handle
+ * @return 0 on success, non-zero on failure.
+ */
+int msgrpc_client_close(MSGRPC_CLIENT* clientp) {
+	int retval;
+	int i;
+
+	retval = msgdeque_close(clientp->request);
+	retval |= msgdeque_delete(clientp->reply);
+	for (i = 0; i < clientp->window; i++) {
+		free(clientp->slots[i].itemp);
+	}
+	free(clientp->slots);
+	free(clientp->batchp);
+	free(clientp);
+	return retval;
+}
@@ -0,0 +1,144 @@
+/*
+ *****************************************************************
+
+<GPL>
+
+Copyright: © 2001-2015 Robert C Garvey
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Lesser General Public License as published by
+ the Free Software Foundation; either version 3 of the License, or
+ (at your option) any later version.
+ .
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ .
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+X-Comment: On Debian systems, the complete text of the GNU General Public
+ License can be found in `/usr/share/common-licenses/GPL-3'.
+
+</GPL>
+*********************************************************************
+*/
+
+/**
+ * @file msgrpc.h
+ * @brief Request/Reply (RPC) Facility over Message Deques
+ *
+ *  Declarations for a request/reply layer built on msgdeque.c and
+ *  msgcell.c. See msgrpc.c for details.
+ */
+
+#ifndef MSGRPC_H_
+#define MSGRPC_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <msgdeque.h>
+
+#define MSGRPC_MAX_NAME 32
+#define MSGRPC_MAX_ROUTES 64		///< Max reply routes cached by a server
+
+/**
+ * @brief Header prefixed to every request and reply item.
+ */
+typedef struct _MSGRPC_HEADER {
+	unsigned int corr_id;		///< Correlation ID assigned by the client (never 0)
+	pid_t client_pid;			///< Client process ID ... identifies the reply deque
+	int status;					///< Handler status (replies only). 0 means success
+	unsigned short datalen;		///< Number of valid payload bytes following the header
+	unsigned short spare;		///< keep alignment nice
+} MSGRPC_HEADER;
+
+/**
+ * @brief Server request handler.
+ *
+ * Called once per request by msgrpc_server_dispatch. The handler writes
+ * up to *replylenp bytes to replyp and sets *replylenp to the number of
+ * reply bytes actually written.
+ *
+ * @return status returned to the client by msgrpc_wait. 0 means success.
+ */
+typedef int MSGRPC_HANDLER(void* ctxp, void* reqp, size_t reqlen, void* replyp, size_t* replylenp);
+
+/**
+ * @brief Client side record of an outstanding request.
+ */
+typedef struct _MSGRPC_SLOT {
+	unsigned int corr_id;		///< Correlation ID of the request. 0 if slot is free
+	int replied;				///< 1 once the reply has been received
+	void* itemp;				///< Reply item (header and payload)
+} MSGRPC_SLOT;
+
+/**
+ * @brief RPC client handle.
+ */
+typedef struct _MSGRPC_CLIENT {
+	char server_name[MSGRPC_MAX_NAME];	///< Name of the server request deque
+	char reply_name[MAX_MSGCELL_NAME];	///< Name of this client's reply deque
+	int errcode;				///< Error code (errno) of the last failure
+	MSGCELL* request;			///< Server request message deque
+	MSGCELL* reply;				///< Client reply message deque
+	ushort item_size;			///< Size of request and reply items (header + payload)
+	ushort window;				///< Max number of outstanding requests
+	ushort outstanding;			///< Number of slots currently in use
+	unsigned int next_corr_id;	///< Next correlation ID to assign
+	MSGRPC_SLOT* slots;			///< Outstanding request table (window entries)
+	void* batchp;				///< Receive buffer (window items)
+} MSGRPC_CLIENT;
+
+/**
+ * @brief Server side cache of reply deques by client process ID.
+ */
+typedef struct _MSGRPC_ROUTE {
+	pid_t client_pid;			///< Client process ID
+	MSGCELL* reply;				///< Attached reply message deque
+} MSGRPC_ROUTE;
+
+/**
+ * @brief RPC server handle.
+ */
+typedef struct _MSGRPC_SERVER {
+	char name[MSGRPC_MAX_NAME];	///< Name of the request deque
+	int errcode;				///< Error code (errno) of the last failure
+	MSGCELL* request;			///< Request message deque
+	ushort item_size;			///< Size of request and reply items (header + payload)
+	ushort max_batch;			///< Max requests dispatched per receive
+	void* batchp;				///< Request receive buffer (max_batch items)
+	void* replyp;				///< Reply item buffer
+	int nroutes;				///< Number of cached reply routes
+	MSGRPC_ROUTE* routes;		///< Cached reply routes (MSGRPC_MAX_ROUTES entries, oldest first)
+	unsigned long dispatched;	///< Count of requests dispatched
+	unsigned long dropped;		///< Count of replies that could not be delivered
+} MSGRPC_SERVER;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+MSGRPC_SERVER* msgrpc_server_create(const char* name, uint permissions, ushort max_payload,
+		ushort nitems, ushort max_batch);
+int msgrpc_server_dispatch(MSGRPC_SERVER* serverp, MSGRPC_HANDLER* handlerp, void* ctxp,
+		const struct timespec* timeout);
+int msgrpc_server_close(MSGRPC_SERVER* serverp);
+
+MSGRPC_CLIENT* msgrpc_client_open(const char* server_name, ushort window);
+size_t msgrpc_max_payload(MSGRPC_CLIENT* clientp);
+unsigned int msgrpc_submit(MSGRPC_CLIENT* clientp, void* reqp, size_t reqlen,
+		const struct timespec* timeout);
+int msgrpc_wait(MSGRPC_CLIENT* clientp, unsigned int corr_id, void* replyp, size_t* replylenp,
+		const struct timespec* timeout);
+int msgrpc_call(MSGRPC_CLIENT* clientp, void* reqp, size_t reqlen, void* replyp, size_t* replylenp,
+		const struct timespec* timeout);
+int msgrpc_client_close(MSGRPC_CLIENT* clientp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MSGRPC_H_ */